@@ -1,6 +1,9 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+
+#define _LARGEFILE64_SOURCE
+
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,6 +12,10 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <time.h>
+#include <sys/time.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_ASM_TYPES_H
 #include <asm/types.h>
@@ -18,7 +25,33 @@
 #include "backup.h"
 #include "macpart.h"
 
-#define BUFSIZE 512 * 256
+/* Output goes through a ring of buffers to a writer thread, so writing */
+/* the backup overlaps reading and compressing it. */
+#define BUFSIZE 512 * 2048
+#define BUFCOUNT 8
+#define BUFALIGN 4096
+
+struct backup_writer
+{
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+#endif
+	unsigned char *bufs[BUFCOUNT];
+	int sizes[BUFCOUNT];
+	int head;				/* Next buffer to fill */
+	int tail;				/* Next buffer to write */
+	int count;				/* Buffers filled and not yet written */
+
+	struct backup_info *info;
+	struct backup_store *store;
+	int fd;
+	int error;				/* Errno of a failed write, or -1 for the store */
+
+	uint64_t fillstall;		/* Microseconds waiting for a free buffer */
+	uint64_t writestall;	/* Microseconds the writer waited for data */
+};
 
 void
 backup_usage (char *progname)
@@ -29,6 +62,16 @@ backup_usage (char *progname)
 	fprintf (stderr, " -h        Display this help message\n");
 	fprintf (stderr, " -o file   Output to file, - for stdout\n");
 	fprintf (stderr, " -1 .. -9  Compress backup, quick (-1) through best (-9)\n");
+	fprintf (stderr, " -j count  Compress using count threads\n");
+	fprintf (stderr, " -z codec  Compress backup with zlib (default), zstd or lz4\n");
+	fprintf (stderr, " -C        Compress in independent chunks and append a seek index\n");
+	fprintf (stderr, " -M file   Write a manifest of the backed up streams to file (needs -C)\n");
+	fprintf (stderr, " -I file   Incremental backup, leaving out streams unchanged since manifest (needs -C)\n");
+	fprintf (stderr, " -R dir    Store deduplicated chunks in dir, with -o naming the recipe\n");
+	fprintf (stderr, " -p        Read streams in disk order rather than fsid order\n");
+	fprintf (stderr, " -H        Record runs of zero sectors as holes\n");
+	fprintf (stderr, " -k size   Save a checkpoint every size GiB, to resume from with -r\n");
+	fprintf (stderr, " -r        Resume an interrupted backup from its checkpoint\n");
 	fprintf (stderr, " -v        Do not include /var in backup\n");
 	fprintf (stderr, " -d        Do not include /db (SQLite) in backup (Premiere and newer)\n");
 	fprintf (stderr, " -s        Shrink MFS in backup (implied for v3 backups without -a flag)\n");
@@ -144,6 +187,201 @@ display_backup_info (struct backup_info *info)
 	}
 }
 
+static uint64_t
+backup_now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/******************************************/
+/* Write one buffer to the backup output. */
+static int
+backup_writer_output (struct backup_writer *wr, unsigned char *buf, int size)
+{
+	if (wr->store)
+	{
+		if (backup_store_write (wr->info, wr->store, buf, size) < 0)
+			return -1;
+	}
+	else if (write (wr->fd, buf, size) != size)
+		return errno? errno: EIO;
+
+	return 0;
+}
+
+#if HAVE_PTHREAD_H
+/*****************************************************/
+/* Writer thread - write filled buffers in order */
+static void *
+backup_writer_thread (void *arg)
+{
+	struct backup_writer *wr = arg;
+
+	pthread_mutex_lock (&wr->lock);
+	for (;;)
+	{
+		int size, err;
+
+		if (!wr->count)
+		{
+			uint64_t start = backup_now ();
+			pthread_cond_wait (&wr->cond, &wr->lock);
+			wr->writestall += backup_now () - start;
+			continue;
+		}
+
+/* A zero size buffer marks the end */
+		size = wr->sizes[wr->tail];
+		if (size == 0)
+			break;
+
+		pthread_mutex_unlock (&wr->lock);
+		err = backup_writer_output (wr, wr->bufs[wr->tail], size);
+		pthread_mutex_lock (&wr->lock);
+
+		if (err)
+		{
+			wr->error = err;
+			pthread_cond_signal (&wr->cond);
+			break;
+		}
+
+		wr->tail = (wr->tail + 1) % BUFCOUNT;
+		wr->count--;
+		pthread_cond_signal (&wr->cond);
+	}
+	pthread_mutex_unlock (&wr->lock);
+
+	return NULL;
+}
+#endif
+
+/*********************************************************/
+/* Allocate the output buffers and start the writer. */
+static int
+backup_writer_start (struct backup_writer *wr)
+{
+	int loop;
+
+	for (loop = 0; loop < BUFCOUNT; loop++)
+	{
+		void *buf;
+
+		if (posix_memalign (&buf, BUFALIGN, BUFSIZE) != 0)
+			return -1;
+		wr->bufs[loop] = buf;
+	}
+
+#if HAVE_PTHREAD_H
+	pthread_mutex_init (&wr->lock, NULL);
+	pthread_cond_init (&wr->cond, NULL);
+	if (pthread_create (&wr->thread, NULL, backup_writer_thread, wr) != 0)
+		return -1;
+#endif
+
+	return 0;
+}
+
+/*****************************************************************/
+/* Get a free buffer to fill, or NULL if the writer has failed. */
+static unsigned char *
+backup_writer_get (struct backup_writer *wr)
+{
+#if HAVE_PTHREAD_H
+	pthread_mutex_lock (&wr->lock);
+	while (!wr->error && wr->count == BUFCOUNT)
+	{
+		uint64_t start = backup_now ();
+		pthread_cond_wait (&wr->cond, &wr->lock);
+		wr->fillstall += backup_now () - start;
+	}
+	pthread_mutex_unlock (&wr->lock);
+#endif
+
+	if (wr->error)
+		return NULL;
+	return wr->bufs[wr->head];
+}
+
+/************************************************************/
+/* Queue the buffer from backup_writer_get to be written. */
+static int
+backup_writer_put (struct backup_writer *wr, int size)
+{
+#if HAVE_PTHREAD_H
+	pthread_mutex_lock (&wr->lock);
+	wr->sizes[wr->head] = size;
+	wr->head = (wr->head + 1) % BUFCOUNT;
+	wr->count++;
+	pthread_cond_signal (&wr->cond);
+	pthread_mutex_unlock (&wr->lock);
+#else
+	if (size > 0)
+	{
+		uint64_t start = backup_now ();
+		wr->error = backup_writer_output (wr, wr->bufs[wr->head], size);
+		wr->fillstall += backup_now () - start;
+	}
+#endif
+
+	return wr->error? -1: 0;
+}
+
+/**********************************************************/
+/* Wait for everything queued so far to be written out. */
+static int
+backup_writer_drain (struct backup_writer *wr)
+{
+#if HAVE_PTHREAD_H
+	pthread_mutex_lock (&wr->lock);
+	while (!wr->error && wr->count > 0)
+		pthread_cond_wait (&wr->cond, &wr->lock);
+	pthread_mutex_unlock (&wr->lock);
+#endif
+
+	return wr->error? -1: 0;
+}
+
+/*******************************************************************/
+/* Flush the remaining buffers and stop the writer.  Returns -1 if */
+/* any write failed. */
+static int
+backup_writer_finish (struct backup_writer *wr)
+{
+	int loop;
+
+#if HAVE_PTHREAD_H
+	if (backup_writer_get (wr))
+		backup_writer_put (wr, 0);
+	pthread_join (wr->thread, NULL);
+	pthread_cond_destroy (&wr->cond);
+	pthread_mutex_destroy (&wr->lock);
+#endif
+
+	for (loop = 0; loop < BUFCOUNT; loop++)
+		free (wr->bufs[loop]);
+
+	return wr->error? -1: 0;
+}
+
+/***********************************************/
+/* Report where the backup pipeline stalled. */
+static void
+backup_report_stalls (struct backup_info *info, struct backup_writer *wr)
+{
+	fprintf (stderr, "Stalls:");
+	if (info->nthreads > 1 && (info->back_flags & BF_COMPRESSED))
+		fprintf (stderr, " reader %" PRIu64 ".%01" PRIu64 "s, compressors %" PRIu64 ".%01" PRIu64 "s,", info->readstall / 1000000, info->readstall / 100000 % 10, info->compstall / 1000000, info->compstall / 100000 % 10);
+#if HAVE_PTHREAD_H
+	fprintf (stderr, " output %" PRIu64 ".%01" PRIu64 "s, writer %" PRIu64 ".%01" PRIu64 "s\n", wr->fillstall / 1000000, wr->fillstall / 100000 % 10, wr->writestall / 1000000, wr->writestall / 100000 % 10);
+#else
+	fprintf (stderr, " writing %" PRIu64 ".%01" PRIu64 "s\n", wr->fillstall / 1000000, wr->fillstall / 100000 % 10);
+#endif
+}
+
 int
 backup_main (int argc, char **argv)
 {
@@ -159,6 +397,16 @@ backup_main (int argc, char **argv)
 	int compressed = 0;
 	int norescheck = 0;
 	unsigned int skipdb = 0;
+	int nthreads = 0;
+	int codec = -1;
+	char *basemanifest = 0;
+	char *manifest = 0;
+	char *storedir = 0;
+	struct backup_store *store = 0;
+	int storelevel = 0;
+	uint64_t checkpoint = 0;
+	int resume = 0;
+	char *ckptname = 0;
 	unsigned starttime = 0;
 
 	enum backup_format selectedformat = bfV3;
@@ -166,9 +414,9 @@ backup_main (int argc, char **argv)
 	tivo_partition_direct ();
 
 #if DEPRECATED
-	while ((loop = getopt (argc, argv, "ho:123456789vsf:L:tTaqEF:idD")) > 0)
+	while ((loop = getopt (argc, argv, "ho:123456789j:z:CI:M:R:pHk:rvsf:L:tTaqEF:idD")) > 0)
 #else
-	while ((loop = getopt (argc, argv, "ho:123456789vstTaqEF:id")) > 0)
+	while ((loop = getopt (argc, argv, "ho:123456789j:z:CI:M:R:pHk:rvstTaqEF:id")) > 0)
 #endif
 	{
 		switch (loop)
@@ -188,6 +436,61 @@ backup_main (int argc, char **argv)
 			bflags |= BF_SETCOMP (loop - '0');
 			compressed = 1;
 			break;
+		case 'j':
+			nthreads = strtoul (optarg, &tmp, 10);
+			if (*tmp || nthreads < 1)
+			{
+				fprintf (stderr, "%s: Positive integer argument expected for -j\n", argv[0]);
+				return 1;
+			}
+			break;
+		case 'z':
+			if (!strcmp (optarg, "zlib"))
+				codec = BC_ZLIB;
+			else if (!strcmp (optarg, "zstd"))
+				codec = BC_ZSTD;
+			else if (!strcmp (optarg, "lz4"))
+				codec = BC_LZ4;
+			else
+			{
+				fprintf (stderr, "%s: Unknown compression codec %s for -z\n", argv[0], optarg);
+				return 1;
+			}
+			if (!backup_codec_available (codec))
+			{
+				fprintf (stderr, "%s: %s compression is not supported by this build\n", argv[0], optarg);
+				return 1;
+			}
+			break;
+		case 'C':
+			bflags |= BF_CHUNKED;
+			break;
+		case 'I':
+			basemanifest = optarg;
+			break;
+		case 'M':
+			manifest = optarg;
+			break;
+		case 'R':
+			storedir = optarg;
+			break;
+		case 'p':
+			bflags |= BF_PHYSORDER;
+			break;
+		case 'H':
+			bflags |= BF_HOLES;
+			break;
+		case 'k':
+			checkpoint = strtoul (optarg, &tmp, 10);
+			if (*tmp || checkpoint < 1)
+			{
+				fprintf (stderr, "%s: Positive integer argument expected for -k\n", argv[0]);
+				return 1;
+			}
+			break;
+		case 'r':
+			resume = 1;
+			break;
 		case 'i':
 			bflags |= BF_BACKUPALL;
 			break;
@@ -288,6 +591,91 @@ backup_main (int argc, char **argv)
 		return 1;
 	}
 
+	if ((bflags & BF_CHUNKED) && selectedformat != bfV3)
+	{
+		fprintf (stderr, "%s: Chunked backups (-C) require the v3 format\n", argv[0]);
+		return 1;
+	}
+
+	if ((bflags & BF_PHYSORDER) && selectedformat != bfV3)
+	{
+		fprintf (stderr, "%s: Disk order backups (-p) require the v3 format\n", argv[0]);
+		return 1;
+	}
+
+/* The container index counts sectors as restored, not as stored */
+	if ((bflags & BF_HOLES) && (bflags & BF_CHUNKED))
+	{
+		fprintf (stderr, "%s: Holes (-H) cannot be combined with chunked backups (-C)\n", argv[0]);
+		return 1;
+	}
+
+	if (checkpoint || resume)
+	{
+		if (storedir || (filename[0] == '-' && filename[1] == '\0'))
+		{
+			fprintf (stderr, "%s: Checkpoints (-k and -r) need an output file, not stdout or a store\n", argv[0]);
+			return 1;
+		}
+
+		ckptname = malloc (strlen (filename) + 6);
+		if (!ckptname)
+		{
+			fprintf (stderr, "%s: Memory exhausted\n", argv[0]);
+			return 1;
+		}
+		sprintf (ckptname, "%s.ckpt", filename);
+	}
+
+	if ((basemanifest || manifest) && selectedformat != bfV3)
+	{
+		fprintf (stderr, "%s: Manifests (-I and -M) require the v3 format\n", argv[0]);
+		return 1;
+	}
+
+/* Restore reads the carried streams out of the base by its chunk index */
+	if ((basemanifest || manifest) && !(bflags & BF_CHUNKED))
+	{
+		fprintf (stderr, "%s: Manifests (-I and -M) require a chunked backup (-C)\n", argv[0]);
+		return 1;
+	}
+
+	if (storedir)
+	{
+		if (codec >= 0 || (bflags & BF_CHUNKED))
+		{
+			fprintf (stderr, "%s: A backup store (-R) cannot be combined with -z or -C\n", argv[0]);
+			return 1;
+		}
+		if (filename[0] == '-' && filename[1] == '\0')
+		{
+			fprintf (stderr, "%s: A backup store (-R) needs a recipe file for -o\n", argv[0]);
+			return 1;
+		}
+
+/* Compressed data does not deduplicate, so the stream is left */
+/* uncompressed and the level applies to each chunk in the store */
+		if (compressed)
+			storelevel = BF_COMPLVL (bflags);
+		bflags &= ~BF_SETCOMP (0xf);
+		compressed = 0;
+	}
+
+/* A chunked backup is always compressed */
+	if ((bflags & BF_CHUNKED) && codec < 0)
+		codec = BC_ZLIB;
+
+/* A codec without a level gets that codec's usual default */
+	if (codec >= 0)
+	{
+		if (!compressed)
+		{
+			bflags |= BF_SETCOMP (codec == BC_ZLIB? 6: codec == BC_ZSTD? 3: 1);
+			compressed = 1;
+		}
+		bflags |= BF_SETCODEC (codec);
+	}
+
 	drive = 0;
 	drive2 = 0;
 	if (optind < argc)
@@ -344,13 +732,32 @@ backup_main (int argc, char **argv)
 	}
 	else
 	{
-		unsigned char buf[BUFSIZE];
+		struct backup_writer wr;
+		unsigned char *buf;
 		uint64_t cursec = 0;
-		int curcount;
+		uint64_t startsec = 0;
+		int curcount = 0;
 		int fd;
 
-		if (filename[0] == '-' && filename[1] == '\0')
+		if (storedir)
+		{
+			store = backup_store_open (info, storedir, filename, storelevel);
+			if (!store)
+			{
+				backup_perror (info, storedir);
+				return 1;
+			}
+			fd = -1;
+		}
+		else if (filename[0] == '-' && filename[1] == '\0')
 			fd = 1;
+/* Resuming keeps what was written, and cuts it back later */
+		else if (resume)
+#if O_LARGEFILE
+			fd = open (filename, O_WRONLY | O_LARGEFILE);
+#else
+			fd = open (filename, O_WRONLY);
+#endif
 		else
 #if O_LARGEFILE
 			fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
@@ -358,7 +765,7 @@ backup_main (int argc, char **argv)
 			fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 #endif
 
-		if (fd < 0)
+		if (fd < 0 && !store)
 		{
 			perror (filename);
 			return 1;
@@ -370,6 +777,18 @@ backup_main (int argc, char **argv)
 			backup_set_resource_check(info);
 		if (skipdb)
 			backup_set_skipdb (info, skipdb);
+		if (nthreads)
+			backup_set_threads (info, nthreads);
+		if (basemanifest && backup_set_base_manifest (info, basemanifest) < 0)
+		{
+			backup_perror (info, basemanifest);
+			return 1;
+		}
+		if (checkpoint && backup_set_checkpoint (info, checkpoint * 1024 * 1024 * 2) < 0)
+		{
+			backup_perror (info, "Backup");
+			return 1;
+		}
 
 		if (quiet < 2)
 			fprintf (stderr, "Scanning source drive.  Please wait a moment.\n");
@@ -389,17 +808,60 @@ backup_main (int argc, char **argv)
 		if (quiet < 2)
 			fprintf (stderr, "Uncompressed backup size: %" PRIu64 " MiB\n", info->nsectors / 2048);
 
+		if (resume)
+		{
+			uint64_t offset;
+
+			if (backup_resume (info, ckptname, &offset) < 0)
+			{
+				backup_perror (info, ckptname);
+				return 1;
+			}
+
+			if (ftruncate64 (fd, (off64_t)offset) < 0 || lseek64 (fd, (off64_t)offset, SEEK_SET) != (off64_t)offset)
+			{
+				perror (filename);
+				return 1;
+			}
+
+			cursec = offset / 512;
+			startsec = info->cursector;
+			if (quiet < 2)
+				fprintf (stderr, "Resuming backup at %" PRId64 " MiB\n", info->cursector / 2048);
+		}
+
+		memset (&wr, 0, sizeof (wr));
+		wr.info = info;
+		wr.store = store;
+		wr.fd = fd;
+		if (backup_writer_start (&wr) < 0)
+		{
+			fprintf (stderr, "Backup failed: Unable to start output\n");
+			return 1;
+		}
+
 		starttime = time(NULL);
 
-		while ((curcount = backup_read (info, buf, BUFSIZE)) > 0)
+		while ((buf = backup_writer_get (&wr)) && (curcount = backup_read (info, buf, BUFSIZE)) > 0)
 		{
 			unsigned int prcnt, compr;
-			if (write (fd, buf, curcount) != curcount)
+			backup_writer_put (&wr, curcount);
+			cursec += curcount / 512;
+
+/* A checkpoint is only good once the output it covers is on disk */
+			if (info->checkpoint_ready)
 			{
-				fprintf (stderr, "Backup failed: %s: %s\n", filename, strerror(errno));
-				return 1;
+				if (backup_writer_drain (&wr) < 0 || fsync (fd) < 0 ||
+					backup_write_checkpoint (info, ckptname) < 0)
+				{
+					if (quiet < 1)
+						fprintf (stderr, "\n");
+					fprintf (stderr, "Warning: Unable to save checkpoint %s\n", ckptname);
+					info->checkpoint_ready = 0;
+					backup_clearerror (info);
+				}
 			}
-			cursec += curcount / 512;
+
 			prcnt = get_percent (info->cursector, info->nsectors);
 			compr = get_percent (info->cursector - cursec, info->cursector);
 			if (quiet < 1)
@@ -413,7 +875,7 @@ backup_main (int argc, char **argv)
 				if (prcnt > 10 && timedelta > 15)
 				{
 					unsigned ETA = timedelta * (10000 - prcnt) / prcnt;
-					fprintf (stderr, " %" PRId64 " MiB/sec (ETA %d:%02d:%02d)", info->cursector / timedelta / 2048, ETA / 3600, ETA / 60 % 60, ETA % 60);
+					fprintf (stderr, " %" PRId64 " MiB/sec (ETA %d:%02d:%02d)", (info->cursector - startsec) / timedelta / 2048, ETA / 3600, ETA / 60 % 60, ETA % 60);
 				}
 			}
 		}
@@ -421,6 +883,15 @@ backup_main (int argc, char **argv)
 		if (quiet < 1)
 			fprintf (stderr, "\n");
 
+		if (backup_writer_finish (&wr) < 0)
+		{
+			if (wr.error < 0)
+				backup_perror (info, storedir);
+			else
+				fprintf (stderr, "Backup failed: %s: %s\n", filename, strerror (wr.error));
+			return 1;
+		}
+
 		if (curcount < 0)
 		{
 			if (backup_has_error (info))
@@ -429,6 +900,9 @@ backup_main (int argc, char **argv)
 				fprintf (stderr, "Backup failed.\n");
 			return 1;
 		}
+
+		if (quiet < 2)
+			backup_report_stalls (info, &wr);
 	}
 
 	if (backup_finish (info) < 0)
@@ -440,6 +914,28 @@ backup_main (int argc, char **argv)
 		return 1;
 	}
 
+/* Nothing left to resume */
+	if (ckptname)
+		unlink (ckptname);
+
+	if (store)
+	{
+		if (backup_store_finish (info, store) < 0)
+		{
+			backup_perror (info, storedir);
+			return 1;
+		}
+		if (quiet < 2)
+			fprintf (stderr, "Stored %u chunks, %u new to the store (%" PRIu64 " MiB added)\n", store->head.nchunks, store->newchunks, store->newbytes / (1024 * 1024));
+		backup_store_close (store);
+	}
+
+	if (manifest && backup_write_manifest (info, manifest) < 0)
+	{
+		backup_perror (info, manifest);
+		return 1;
+	}
+
 	if (info->back_flags & BF_TRUNCATED)
 		fprintf (stderr, "***WARNING***\nBackup was made of an incomplete volume.  While the backup succeeded,\nit is possible there was some required data missing.  Verify your backup.\n");
 	else if (quiet < 2)
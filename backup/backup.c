@@ -818,17 +818,101 @@ backup_state_partitions (struct backup_info *info, void *data, unsigned size, un
 	return bsNextState;
 }
 
+/**************************************************************/
+/* Check a sector for all zeros, a machine word at a time. */
+static int
+backup_sector_is_zero (const unsigned char *sector)
+{
+	int loop;
+
+	if ((size_t)sector & (sizeof (uint64_t) - 1))
+	{
+		for (loop = 0; loop < 512; loop++)
+			if (sector[loop])
+				return 0;
+		return 1;
+	}
+	else
+	{
+		const uint64_t *words = (const uint64_t *)sector;
+		uint64_t acc = 0;
+
+/* No early exit, so the compiler is free to vectorize it */
+		for (loop = 0; loop < 512 / sizeof (*words); loop++)
+			acc |= words[loop];
+		return acc == 0;
+	}
+}
+
+/*************************************************************************/
+/* Replace runs of zero sectors with hole records, copying the rest from */
+/* in to out.  The first sector of the backup is the header, and is always */
+/* left alone.  Data that passes for a hole record gets an escape record */
+/* in front of it, so out needs room for twice count sectors.  Returns the */
+/* number of sectors in out. */
+static int
+backup_encode_holes (unsigned char *in, uint64_t sector, int count, unsigned char *out)
+{
+	int loop = 0, nout = 0;
+
+	while (loop < count)
+	{
+		unsigned char *cur = in + loop * 512;
+		struct backup_hole *hole;
+
+		if (sector + loop > 0 && backup_sector_is_zero (cur))
+		{
+			int run = 1;
+
+			while (loop + run < count && backup_sector_is_zero (cur + run * 512))
+				run++;
+
+			if (run >= BACKUP_HOLE_MIN)
+			{
+				hole = (struct backup_hole *)(out + nout * 512);
+				memset (hole, 0, 512);
+				hole->magic = TBKH_MAGIC;
+				hole->count = run;
+				hole->check = BACKUP_HOLE_CHECK (run, sector + loop);
+				nout++;
+				loop += run;
+				continue;
+			}
+		}
+		else if (sector + loop > 0)
+		{
+			hole = (struct backup_hole *)cur;
+
+/* Data that passes for a hole record gets a record saying it is not one */
+			if (hole->magic == TBKH_MAGIC && hole->check == BACKUP_HOLE_CHECK (hole->count, sector + loop))
+			{
+				hole = (struct backup_hole *)(out + nout * 512);
+				memset (hole, 0, 512);
+				hole->magic = TBKH_MAGIC;
+				hole->count = 0;
+				hole->check = BACKUP_HOLE_CHECK (0, sector + loop);
+				nout++;
+			}
+		}
+
+		memcpy (out + nout * 512, cur, 512);
+		nout++;
+		loop++;
+	}
+
+	return nout;
+}
+
 /*****************************************************************************/
 /* Return the next sectors in the backup.  This is where all the data in the */
 /* backup originates.  If it's backed up, it came from here.  This only */
 /* reads the data from the info structure.  Compression is handled */
 /* elsewhere. */
-static unsigned int
-backup_next_sectors (struct backup_info *info, unsigned char *buf, int sectors)
+static int
+backup_next_raw_sectors (struct backup_info *info, unsigned char *buf, int sectors)
 {
 	enum backup_state_ret ret;
 	unsigned consumed;
-
 	unsigned backup_blocks = 0;
 
 	while (sectors > 0 && info->state < bsMax && info->state >= bsBegin)
@@ -886,6 +970,328 @@ backup_next_sectors (struct backup_info *info, unsigned char *buf, int sectors)
 	return backup_blocks;
 }
 
+/***************************************************************************/
+/* Return the next sectors in the backup with holes taken out.  Escape */
+/* records can make the encoded sectors outnumber the ones read, so what */
+/* doesn't fit is held over and handed back first on the next call. */
+static int
+backup_next_hole_sectors (struct backup_info *info, unsigned char *buf, int sectors)
+{
+	int done = 0;
+	int nread, nout;
+	uint64_t startsector;
+
+	if (info->holeoutlen > info->holeoutpos)
+	{
+		done = info->holeoutlen - info->holeoutpos;
+		if (done > sectors)
+			done = sectors;
+		memcpy (buf, info->holeout + info->holeoutpos * 512, done * 512);
+		info->holeoutpos += done;
+		if (info->holeoutpos < info->holeoutlen)
+			return done;
+	}
+
+	if (done >= sectors)
+		return done;
+
+	if (info->holeoutsize < (unsigned int)(sectors - done) * 2)
+	{
+		unsigned char *tmp = realloc (info->holeout, (size_t)(sectors - done) * 2 * 512);
+		if (!tmp)
+		{
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+		info->holeout = tmp;
+		info->holeoutsize = (sectors - done) * 2;
+	}
+
+	startsector = info->cursector;
+	nread = backup_next_raw_sectors (info, buf + done * 512, sectors - done);
+	if (nread <= 0)
+		return nread < 0? -1: done;
+
+	nout = backup_encode_holes (buf + done * 512, startsector, nread, info->holeout);
+	info->holeoutlen = nout;
+	info->holeoutpos = nout < sectors - done? nout: sectors - done;
+	memcpy (buf + done * 512, info->holeout, info->holeoutpos * 512);
+
+	return done + info->holeoutpos;
+}
+
+/*****************************************************************/
+/* Return the next sectors in the backup, with holes taken out if */
+/* the backup has them. */
+unsigned int
+backup_next_sectors (struct backup_info *info, unsigned char *buf, int sectors)
+{
+	if (info->back_flags & BF_HOLES)
+		return backup_next_hole_sectors (info, buf, sectors);
+
+	return backup_next_raw_sectors (info, buf, sectors);
+}
+
+/***********************************************/
+/* Set up single threaded compression.  zlib is */
+/* used unless the flags ask for another codec. */
+static int
+backup_comp_init (struct backup_info *info)
+{
+	info->comp_buf = calloc (2048, 512);
+	if (!info->comp_buf)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	info->comp = calloc (sizeof (*info->comp), 1);
+	if (!info->comp)
+	{
+		free (info->comp_buf);
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	info->comp->zalloc = Z_NULL;
+	info->comp->zfree = Z_NULL;
+	info->comp->opaque = Z_NULL;
+	info->comp->next_in = Z_NULL;
+	info->comp->avail_in = 0;
+	info->comp->avail_out = 0;
+	if (BF_CODEC (info->back_flags) != BC_ZLIB)
+	{
+		if (backup_codec_init (info, BF_CODEC (info->back_flags), BF_COMPLVL (info->back_flags)) < 0)
+		{
+			free (info->comp_buf);
+			free (info->comp);
+			info->comp = 0;
+			return -1;
+		}
+	}
+	else if (deflateInit (info->comp, BF_COMPLVL (info->back_flags)) != Z_OK)
+	{
+		free (info->comp_buf);
+		free (info->comp);
+		info->err_msg = "Compression init error";
+		return -1;
+	}
+
+	return 0;
+}
+
+/*********************************************************************/
+/* Turn on checkpoints every so many sectors.  Only uncompressed and */
+/* chunked v3 backups can be cut and resumed. */
+int
+backup_set_checkpoint (struct backup_info *info, uint64_t every)
+{
+	if (info->format != bfV3 || ((info->back_flags & BF_COMPRESSED) && !(info->back_flags & BF_CHUNKED)))
+	{
+		info->err_msg = "Checkpoints need an uncompressed or chunked v3 backup";
+		return -1;
+	}
+
+	if (!info->checkpoint)
+	{
+		info->checkpoint = calloc (sizeof (*info->checkpoint), 1);
+		if (!info->checkpoint)
+		{
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+	}
+
+	info->checkpoint->every = every;
+	info->checkpoint_next = info->cursector + every;
+	return 0;
+}
+
+/************************************************************************/
+/* Take a checkpoint if one is due.  Offset is the amount of output up */
+/* to the current position, which must be a clean place to cut it. */
+static void
+backup_checkpoint_take (struct backup_info *info, uint64_t offset)
+{
+	struct backup_checkpoint *cp = info->checkpoint;
+
+/* Sectors held over by the hole encoding are not in the output yet */
+	if (!cp || info->cursector < info->checkpoint_next || info->holeoutpos < info->holeoutlen)
+		return;
+
+	cp->magic = TBKC_MAGIC;
+	cp->flags = info->back_flags;
+	cp->nsectors = info->nsectors;
+	cp->ninodes = info->ninodes;
+	cp->inodecrc = crc32 (0, (unsigned char *)info->inodes, info->ninodes * sizeof (*info->inodes));
+	cp->offset = offset;
+	cp->cursector = info->cursector;
+	cp->state_val1 = info->state_val1;
+	cp->state_val2 = info->state_val2;
+	cp->shared_val1 = info->shared_val1;
+	cp->state = info->state;
+	cp->crc = info->crc;
+	cp->inodeloaded = info->state_ptr1 != NULL;
+	cp->nchunks = info->container? info->container->nchunks: 0;
+	cp->nfsids = info->container? info->container->nfsids: 0;
+
+	info->checkpoint_next = info->cursector + cp->every;
+	info->checkpoint_ready = 1;
+}
+
+/*************************************************************************/
+/* Compress the rest of the backup as a series of independent chunks, each */
+/* a complete zlib, zstd or LZ4 stream of BACKUP_CHUNKSECTORS sectors, then */
+/* write the container index after the last one. */
+static int
+backup_read_chunked (struct backup_info *info, unsigned char *buf, unsigned int size)
+{
+	struct backup_container *ct = info->container;
+	z_stream *strm = info->comp;
+
+/* Everything, index included, has been written */
+	if (!strm)
+		return 0;
+
+	if (!ct)
+	{
+		info->err_msg = "Internal error: Chunked backup without a container";
+		return -1;
+	}
+
+	strm->next_out = buf;
+	strm->avail_out = size;
+
+	while (strm->avail_out > 0)
+	{
+		unsigned char *out = strm->next_out;
+		unsigned int nwrit;
+		int zres;
+
+		if (ct->index)
+		{
+			unsigned int tocopy = ct->indexsize - ct->indexpos;
+
+			if (tocopy > strm->avail_out)
+				tocopy = strm->avail_out;
+			memcpy (strm->next_out, ct->index + ct->indexpos, tocopy);
+			strm->next_out += tocopy;
+			strm->avail_out -= tocopy;
+			ct->indexpos += tocopy;
+			if (ct->indexpos < ct->indexsize)
+				continue;
+
+/* That was the last of it */
+			size -= strm->avail_out;
+			if (info->codec)
+				backup_codec_end (info);
+			else
+				deflateEnd (strm);
+			free (info->comp_buf);
+			free (info->comp);
+			info->comp_buf = 0;
+			info->comp = 0;
+			backup_container_free (info);
+/* The backup is complete, there is nothing left to resume */
+			info->checkpoint_ready = 0;
+			return size;
+		}
+
+		if (strm->avail_in)
+		{
+			zres = info->codec? backup_codec_step (info, Z_NO_FLUSH): deflate (strm, Z_NO_FLUSH);
+		}
+		else if (!ct->finishing)
+		{
+			int nread = 0;
+			int want = BACKUP_CHUNKSECTORS - ct->cur.sectors;
+
+			if (want > 2048)
+				want = 2048;
+			if (want > 0)
+			{
+				nread = backup_next_sectors (info, info->comp_buf, want);
+				if (nread < 0)
+				{
+					return -1;
+				}
+			}
+
+/* Either the chunk is full or the backup is out of data */
+			if (nread == 0)
+			{
+				ct->finishing = 1;
+				continue;
+			}
+
+			ct->cur.sectors += nread;
+			strm->next_in = info->comp_buf;
+			strm->avail_in = (unsigned) (512 * nread);
+			continue;
+		}
+		else if (ct->cur.sectors == 0)
+		{
+/* Out of data, and the last chunk is already done */
+			if (backup_container_index (info) < 0)
+				return -1;
+			continue;
+		}
+		else
+		{
+			zres = info->codec? backup_codec_step (info, Z_FINISH): deflate (strm, Z_FINISH);
+		}
+
+		if (zres != Z_OK && zres != Z_STREAM_END)
+		{
+			if (!info->err_msg)
+				info->err_msg = "Compression error";
+			return -1;
+		}
+
+		nwrit = strm->next_out - out;
+		ct->cur.crc = crc32 (ct->cur.crc, out, nwrit);
+		ct->cur.size += nwrit;
+		ct->offset += nwrit;
+
+		if (zres != Z_STREAM_END)
+			continue;
+
+/* Chunk done, record it and start the next one */
+		if (ct->nchunks >= ct->chunkalloc)
+		{
+			struct backup_index_chunk *tmp;
+
+			tmp = realloc (ct->chunks, sizeof (*ct->chunks) * (ct->chunkalloc + 1024));
+			if (!tmp)
+			{
+				info->err_msg = "Memory exhausted";
+				return -1;
+			}
+			ct->chunks = tmp;
+			ct->chunkalloc += 1024;
+		}
+		ct->chunks[ct->nchunks++] = ct->cur;
+
+		ct->cur.offset = ct->offset;
+		ct->cur.firstsector += ct->cur.sectors;
+		ct->cur.sectors = 0;
+		ct->cur.size = 0;
+		ct->cur.crc = 0;
+		ct->finishing = 0;
+
+		backup_checkpoint_take (info, ct->offset);
+
+		if (info->codec)
+			zres = backup_codec_reset (info);
+		else if ((zres = deflateReset (strm)) != Z_OK)
+			info->err_msg = "Compression error";
+		if (zres != Z_OK)
+			return -1;
+	}
+
+	return size;
+}
+
 /*************************************************************************/
 /* Pass the data to the front-end program.  This handles compression and */
 /* all that fun stuff. */
@@ -911,38 +1317,61 @@ backup_read (struct backup_info *info, unsigned char *buf, unsigned int size)
 				return -1;
 			}
 
-			info->comp_buf = calloc (2048, 512);
-			if (!info->comp_buf)
+			buf += 512;
+			retval = 512;
+			size -= 512;
+
+/* Hand the rest off to worker threads if more than one was asked for */
+			if (BF_CODEC (info->back_flags) != BC_ZLIB || (info->back_flags & BF_CHUNKED))
 			{
-				info->err_msg = "Memory exhausted";
-				return -1;
+				if (backup_comp_init (info) < 0)
+					return -1;
 			}
-
-			info->comp = calloc (sizeof (*info->comp), 1);
-			if (!info->comp)
+			else switch (backup_pcomp_init (info, BF_COMPLVL (info->back_flags)))
 			{
-				free (info->comp_buf);
-				info->err_msg = "Memory exhausted";
+			case 1:
+				break;
+			case 0:
+				if (backup_comp_init (info) < 0)
+					return -1;
+				break;
+			default:
 				return -1;
 			}
+		}
 
-			info->comp->zalloc = Z_NULL;
-			info->comp->zfree = Z_NULL;
-			info->comp->opaque = Z_NULL;
-			info->comp->next_in = Z_NULL;
-			info->comp->avail_in = 0;
-			info->comp->avail_out = 0;
-			if (deflateInit (info->comp, BF_COMPLVL (info->back_flags)) != Z_OK)
-			{
-				free (info->comp_buf);
-				free (info->comp);
-				info->err_msg = "Compression init error";
+		if (info->back_flags & BF_CHUNKED)
+		{
+			int nwrit;
+
+			if (size == 0)
+				return retval;
+
+			nwrit = backup_read_chunked (info, buf, size);
+			if (nwrit < 0)
 				return -1;
+
+			return retval + nwrit;
+		}
+
+		if (info->pcomp)
+		{
+			int nwrit;
+
+			if (size == 0)
+				return retval;
+
+			nwrit = backup_pcomp_read (info, buf, size);
+
+/* Done, either way */
+			if (nwrit <= 0)
+			{
+				backup_pcomp_free (info);
+				if (nwrit < 0)
+					return -1;
 			}
 
-			buf += 512;
-			retval = 512;
-			size -= 512;
+			return retval + nwrit;
 		}
 
 		if (!info->comp)
@@ -956,7 +1385,12 @@ backup_read (struct backup_info *info, unsigned char *buf, unsigned int size)
 		{
 			if (info->comp->avail_in)
 			{
-				if (deflate (info->comp, Z_NO_FLUSH) != Z_OK)
+				if (info->codec)
+				{
+					if (backup_codec_step (info, Z_NO_FLUSH) != Z_OK)
+						return -1;
+				}
+				else if (deflate (info->comp, Z_NO_FLUSH) != Z_OK)
 				{
 					info->err_msg = "Compression error";
 					return -1;
@@ -981,16 +1415,20 @@ backup_read (struct backup_info *info, unsigned char *buf, unsigned int size)
 			}
 			else
 			{
-				int zres = deflate (info->comp, Z_FINISH);
+				int zres = info->codec? backup_codec_step (info, Z_FINISH): deflate (info->comp, Z_FINISH);
 
 				if (zres == Z_STREAM_END)
 				{
 					retval += size - info->comp->avail_out;
-					zres = deflateEnd (info->comp);
+					zres = info->codec? backup_codec_end (info): deflateEnd (info->comp);
 					free (info->comp);
 					info->comp = 0;
 				}
 
+				if (zres == Z_STREAM_ERROR && info->codec)
+				{
+					return -1;
+				}
 				if (zres != Z_OK)
 				{
 					break;
@@ -1004,16 +1442,190 @@ backup_read (struct backup_info *info, unsigned char *buf, unsigned int size)
 	}
 	else
 	{
-		return backup_next_sectors (info, buf, size / 512) * 512;
+		int nread = backup_next_sectors (info, buf, size / 512);
+		if (nread < 0)
+			return -1;
+
+		info->outbytes += nread * 512;
+		backup_checkpoint_take (info, info->outbytes);
+		return nread * 512;
 	}
 
 	return retval;
 }
 
+/**********************************************************************/
+/* Save the latest checkpoint.  The output it covers must already be */
+/* safely written.  The file is replaced in one step, so there is */
+/* always a complete checkpoint, even if the backup dies during this. */
+int
+backup_write_checkpoint (struct backup_info *info, char *filename)
+{
+	struct backup_checkpoint *cp = info->checkpoint;
+	char *tmpname;
+	FILE *file;
+	int ret = 0;
+
+	tmpname = malloc (strlen (filename) + 5);
+	if (!tmpname)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+	sprintf (tmpname, "%s.tmp", filename);
+
+	file = fopen (tmpname, "wb");
+	if (!file)
+	{
+		free (tmpname);
+		info->err_msg = "Unable to create checkpoint";
+		return -1;
+	}
+
+	if (fwrite (cp, sizeof (*cp), 1, file) != 1 ||
+		(cp->nchunks && fwrite (info->container->chunks, sizeof (*info->container->chunks), cp->nchunks, file) != cp->nchunks) ||
+		(cp->nfsids && fwrite (info->container->fsids, sizeof (*info->container->fsids), cp->nfsids, file) != cp->nfsids) ||
+		fflush (file) != 0 ||
+		fsync (fileno (file)) < 0)
+		ret = -1;
+
+	if (fclose (file) != 0)
+		ret = -1;
+
+	if (ret == 0 && rename (tmpname, filename) < 0)
+		ret = -1;
+
+	if (ret < 0)
+	{
+		unlink (tmpname);
+		info->err_msg = "Error writing checkpoint";
+	}
+	else
+		info->checkpoint_ready = 0;
+
+	free (tmpname);
+	return ret;
+}
+
+/************************************************************************/
+/* Pick up an interrupted backup from its last checkpoint.  This is */
+/* called after backup_start, which has rebuilt everything the backup */
+/* is made from; if that came out different, the checkpoint is useless. */
+/* Returns the size the output should be cut back to in offset. */
+int
+backup_resume (struct backup_info *info, char *filename, uint64_t *offset)
+{
+	struct backup_checkpoint cp;
+	FILE *file;
+
+	file = fopen (filename, "rb");
+	if (!file)
+	{
+		info->err_msg = "Unable to open checkpoint";
+		return -1;
+	}
+
+	if (fread (&cp, sizeof (cp), 1, file) != 1 || cp.magic != TBKC_MAGIC)
+	{
+		fclose (file);
+		info->err_msg = "Not a backup checkpoint";
+		return -1;
+	}
+
+	if (cp.flags != info->back_flags || cp.nsectors != info->nsectors ||
+		cp.ninodes != info->ninodes ||
+		cp.inodecrc != crc32 (0, (unsigned char *)info->inodes, info->ninodes * sizeof (*info->inodes)) ||
+		cp.state >= bsMax || cp.cursector <= 0 || cp.cursector > info->nsectors)
+	{
+		fclose (file);
+		info->err_msg = "Checkpoint does not match this backup, check the options and source drive";
+		return -1;
+	}
+
+	if (backup_set_checkpoint (info, cp.every) < 0)
+	{
+		fclose (file);
+		return -1;
+	}
+
+	if (info->container)
+	{
+		struct backup_container *ct = info->container;
+
+		ct->chunks = malloc (sizeof (*ct->chunks) * (cp.nchunks + 1024));
+		ct->fsids = malloc (sizeof (*ct->fsids) * (cp.nfsids + 4096));
+		if (!ct->chunks || !ct->fsids)
+		{
+			fclose (file);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+		ct->chunkalloc = cp.nchunks + 1024;
+		ct->fsidalloc = cp.nfsids + 4096;
+
+		if (fread (ct->chunks, sizeof (*ct->chunks), cp.nchunks, file) != cp.nchunks ||
+			fread (ct->fsids, sizeof (*ct->fsids), cp.nfsids, file) != cp.nfsids)
+		{
+			fclose (file);
+			info->err_msg = "Checkpoint is truncated";
+			return -1;
+		}
+		ct->nchunks = cp.nchunks;
+		ct->nfsids = cp.nfsids;
+
+/* The next chunk starts right where the checkpoint was taken */
+		ct->offset = cp.offset;
+		ct->cur.offset = cp.offset;
+		ct->cur.firstsector = cp.cursector;
+	}
+	fclose (file);
+
+	info->cursector = cp.cursector;
+	info->state = cp.state;
+	info->state_val1 = cp.state_val1;
+	info->state_val2 = cp.state_val2;
+	info->shared_val1 = cp.shared_val1;
+	info->state_ptr1 = NULL;
+	info->crc = cp.crc;
+	info->outbytes = cp.offset;
+	info->checkpoint_next = cp.cursector + cp.every;
+
+/* The inode being backed up was loaded along with its inode sector, */
+/* which is already in the output, so just load it again */
+	if (cp.inodeloaded)
+	{
+		if (cp.state_val1 >= info->ninodes)
+		{
+			info->err_msg = "Checkpoint does not match this backup, check the options and source drive";
+			return -1;
+		}
+		info->state_ptr1 = mfs_read_inode (info->mfs, info->inodes[cp.state_val1]);
+		if (!info->state_ptr1)
+			return -1;
+	}
+
+/* The first sector, which sets up compression, is long gone */
+	if ((info->back_flags & BF_COMPRESSED) && backup_comp_init (info) < 0)
+		return -1;
+
+	*offset = cp.offset;
+	return 0;
+}
+
 int
 backup_finish(struct backup_info *info)
 {
-	if (info->cursector != info->nsectors)
+/* Stop the readers, in case the backup was cut short */
+	backup_prefetch_free (info);
+
+	if (info->holeout)
+	{
+		free (info->holeout);
+		info->holeout = NULL;
+		info->holeoutsize = 0;
+	}
+
+	if (info->cursector != info->nsectors || info->holeoutpos < info->holeoutlen)
 	{
 		info->err_msg = "Backup ended prematurely";
 		return -1;
@@ -30,54 +30,140 @@
 #include "macpart.h"
 #include "backup.h"
 
+/* An inode to back up, and where its data starts on disk */
+struct backup_inode_order
+{
+	unsigned int inode;
+	unsigned int fsid;
+	uint64_t sector;		/* Sort key, 0 for fsid order */
+};
+
 /**************************************************************/
 /* Add an inode to the list, allocating more space if needed. */
-/* Keep the list in order of fsid*/
+/* The list is sorted once the scan is complete. */
 static int
-backup_inode_list_add (unsigned **listinode, unsigned **listfsid, unsigned *allocated, int *total, unsigned inodeval, unsigned fsidval)
+backup_inode_list_add (struct backup_inode_order **list, unsigned *allocated, int total, unsigned inodeval, unsigned fsidval)
 {
-	int insertposmin = 0;
-	int insertposmax = *total;
-
 /* No space, (re)allocate space. */
-	if (*allocated <= *total)
+	if (*allocated <= total)
 	{
-		*allocated += 32;
-		*listfsid = realloc (*listfsid, *allocated * sizeof (*listfsid));
-		*listinode = realloc (*listinode, *allocated * sizeof (*listinode));
-	}
+		struct backup_inode_order *tmp;
+
+		*allocated = *allocated? *allocated * 2: 1024;
+		tmp = realloc (*list, *allocated * sizeof (**list));
 
 /* Allocation error. */
-	if (!*listfsid || !*listinode)
+		if (!tmp)
+			return -1;
+		*list = tmp;
+	}
+
+	(*list)[total].inode = inodeval;
+	(*list)[total].fsid = fsidval;
+	(*list)[total].sector = 0;
+
+	return 0;
+}
+
+/*****************************************************/
+/* Backup order - by disk location, and then by fsid */
+static int
+backup_inode_order_cmp (const void *a, const void *b)
+{
+	const struct backup_inode_order *ia = a, *ib = b;
+
+	if (ia->sector != ib->sector)
+		return ia->sector < ib->sector? -1: 1;
+	if (ia->fsid < ib->fsid)
+		return -1;
+	return ia->fsid > ib->fsid;
+}
+
+/****************************************/
+/* Ordering for manifest entries by fsid */
+static int
+backup_manifest_cmp (const void *a, const void *b)
+{
+	const struct backup_manifest_entry *ea = a, *eb = b;
+
+	if (ea->fsid < eb->fsid)
 		return -1;
+	return ea->fsid > eb->fsid;
+}
 
-/* Search for the location this id fits in the list */
-	while (insertposmin != insertposmax)
+static int
+backup_fsid_cmp (const void *a, const void *b)
+{
+	unsigned int fa = *(const unsigned int *)a, fb = *(const unsigned int *)b;
+
+	if (fa < fb)
+		return -1;
+	return fa > fb;
+}
+
+/*********************************************************************/
+/* Describe a stream inode for the manifest.  The extent list is */
+/* hashed rather than the data, since recordings do not change in */
+/* place, and it costs nothing to read. */
+static void
+backup_manifest_fill (struct backup_info *info, mfs_inode *inode, struct backup_manifest_entry *entry)
+{
+	unsigned int extsize = mfs_is_64bit (info->mfs)? sizeof (inode->datablocks.d64[0]): sizeof (inode->datablocks.d32[0]);
+	unsigned int maxblocks = (512 - offsetof (mfs_inode, datablocks)) / extsize;
+	unsigned int numblocks = intswap32 (inode->numblocks);
+
+	if (numblocks > maxblocks)
+		numblocks = maxblocks;
+
+	entry->fsid = intswap32 (inode->fsid);
+	entry->size = intswap32 (inode->size);
+	entry->lastmodified = intswap32 (inode->lastmodified);
+	entry->exthash = crc32 (0, (unsigned char *)&inode->datablocks, numblocks * extsize);
+
+/* The data backed up can grow without touching any of the above */
+	if (info->back_flags & BF_STREAMTOT)
+		entry->datasize = intswap32 (inode->size);
+	else
+		entry->datasize = intswap32 (inode->blockused);
+	entry->datasize *= intswap32 (inode->blocksize);
+}
+
+/*****************************************************************/
+/* Add a stream to this backup's manifest, or, for an incremental */
+/* backup, to the list the base supplies if it has not changed. */
+/* When copying, every stream is left to the copy to supply. */
+/* Returns 1 if the stream was carried from the base. */
+static int
+backup_manifest_add (struct backup_info *info, mfs_inode *inode)
+{
+	struct backup_manifest_entry entry, *base = NULL;
+
+	backup_manifest_fill (info, inode, &entry);
+
+	if (info->basemanifest)
+		base = bsearch (&entry, info->basemanifest, info->nbasemanifest, sizeof (entry), backup_manifest_cmp);
+
+	if (info->copydirect || (base && !memcmp (base, &entry, sizeof (entry))))
 	{
-		int curpos = (insertposmin + insertposmax) >> 1;
-		int curval = (*listfsid)[curpos];
-		if (curval < fsidval)
-		{
-			insertposmin = curpos + 1;
-		}
-		else
+		if ((info->ncarried & 1023) == 0)
 		{
-			insertposmax = curpos;
+			unsigned int *tmp = realloc (info->carried, sizeof (*info->carried) * (info->ncarried + 1024));
+			if (!tmp)
+				return -1;
+			info->carried = tmp;
 		}
+		info->carried[info->ncarried++] = entry.fsid;
+		return 1;
 	}
 
-/* Move all following entries after the entry */
-	if (insertposmin < *total)
+	if ((info->nmanifest & 1023) == 0)
 	{
-		memmove (*listfsid + insertposmin + 1, *listfsid + insertposmin, (*total - insertposmin) * sizeof (**listfsid));
-		memmove (*listinode + insertposmin + 1, *listinode + insertposmin, (*total - insertposmin) * sizeof (**listinode));
+		struct backup_manifest_entry *tmp = realloc (info->manifest, sizeof (*info->manifest) * (info->nmanifest + 1024));
+		if (!tmp)
+			return -1;
+		info->manifest = tmp;
 	}
-
-	/* Add to the list size and insert the new entry */
-	(*listinode)[insertposmin] = inodeval;
-	(*listfsid)[insertposmin] = fsidval;
-	(*total)++;
-
+	info->manifest[info->nmanifest++] = entry;
 	return 0;
 }
 
@@ -90,7 +176,9 @@ backup_scan_inodes (struct backup_info *info)
 	int ninodes = mfs_inode_count (info->mfs);
 	uint64_t highest = 0;
 	unsigned char inodebuf[512];
-	unsigned *fsids = NULL;
+	struct backup_inode_order *order = NULL;
+	struct backup_fsidorder_entry *streams = NULL;
+	unsigned int nstreams = 0, streamalloc = 0;
 
 	uint64_t appsectors = 0, mediasectors = 0, restoremediasectors = 0;
 	unsigned int mediainodes = 0, appinodes = 0;
@@ -98,6 +186,7 @@ backup_scan_inodes (struct backup_info *info)
 	unsigned allocated = 0;
 
 	info->inodes = NULL;
+	info->ninodes = 0;
 
 /* Get the log type to use for inode updates */
 	if (!info->mfs->inode_log_type)
@@ -116,10 +205,7 @@ backup_scan_inodes (struct backup_info *info)
 
 		if (mfs_has_error (info->mfs))
 		{
-			if (info->inodes)
-				free (info->inodes);
-			info->inodes = 0;
-			return ~0;
+			goto fail;
 		}
 
 /* Don't think this should ever happen. */
@@ -133,17 +219,13 @@ backup_scan_inodes (struct backup_info *info)
 		}
 
 /* Add the inode to the list, even if the data won't be backed up. */
-		if (backup_inode_list_add (&info->inodes, &fsids, &allocated, &info->ninodes, loop, intswap32 (inode->fsid)) < 0)
+		if (backup_inode_list_add (&order, &allocated, info->ninodes, loop, intswap32 (inode->fsid)) < 0)
 		{
 			info->err_msg = "Memory exhausted (Inode scan %d)";
 			info->err_arg1 = (int64_t)(size_t)loop;
-			if (info->inodes)
-				free (info->inodes);
-			if (fsids)
-				free (fsids);
-			info->inodes = NULL;
-			return ~0;
+			goto fail;
 		}
+		info->ninodes++;
 
 /* If it a stream, treat it specially. */
 		if (inode->type == tyStream)
@@ -185,6 +267,54 @@ backup_scan_inodes (struct backup_info *info)
 			if ((info->back_flags & (BF_THRESHTOT | BF_STREAMTOT)) == BF_THRESHTOT)
 				streamsize = intswap32 (inode->blocksize) / 512 * intswap32 (inode->blockused);
 
+/* Unchanged since the base backup, so only the inode itself goes in this one */
+			switch (backup_manifest_add (info, inode))
+			{
+			case 0:
+				break;
+			case 1:
+				info->carriedsectors += streamsize;
+				streamsize = 0;
+				break;
+			default:
+				info->err_msg = "Memory exhausted (Inode scan %d)";
+				info->err_arg1 = (int64_t)(size_t)loop;
+				goto fail;
+			}
+
+/* In physical order, streams with data follow everything else, in order */
+/* of where their data starts, and restore gets the list of streams so it */
+/* can still allocate them in fsid order. */
+			if (info->back_flags & BF_PHYSORDER)
+			{
+				if (streamsize > 0 && inode->numblocks)
+				{
+					if (mfs_is_64bit (info->mfs))
+						order[info->ninodes - 1].sector = sectorswap64 (inode->datablocks.d64[0].sector) + 1;
+					else
+						order[info->ninodes - 1].sector = (uint64_t)intswap32 (inode->datablocks.d32[0].sector) + 1;
+				}
+
+				if (nstreams >= streamalloc)
+				{
+					struct backup_fsidorder_entry *tmp;
+
+					streamalloc = streamalloc? streamalloc * 2: 1024;
+					tmp = realloc (streams, streamalloc * sizeof (*streams));
+					if (!tmp)
+					{
+						info->err_msg = "Memory exhausted (Inode scan %d)";
+						info->err_arg1 = (int64_t)(size_t)loop;
+						goto fail;
+					}
+					streams = tmp;
+				}
+				streams[nstreams].fsid = intswap32 (inode->fsid);
+				streams[nstreams].size = intswap32 (inode->size);
+				streams[nstreams].blocksize = intswap32 (inode->blocksize);
+				nstreams++;
+			}
+
 /* Count the inode's sectors in the total. */
 			mediasectors += streamsize;
 			restoremediasectors += intswap32 (inode->blocksize) / 512 * intswap32 (inode->size);
@@ -235,16 +365,24 @@ backup_scan_inodes (struct backup_info *info)
 			info->err_msg = "Required data at %ld beyond end of the device (%ld)";
 			info->err_arg1 = (int64_t)highest;
 			info->err_arg2 = (int64_t)set_size;
-
-			if (info->inodes)
-				free (info->inodes);
-			if (fsids)
-				free (fsids);
-			info->inodes = NULL;
-			return ~0;
+			goto fail;
 		}
 	}
 
+/* A single sort puts the list in backup order */
+	qsort (order, info->ninodes, sizeof (*order), backup_inode_order_cmp);
+	info->inodes = malloc ((info->ninodes + 1) * sizeof (*info->inodes));
+	if (!info->inodes)
+	{
+		info->err_msg = "Memory exhausted (Inode scan %d)";
+		info->err_arg1 = (int64_t)(size_t)ninodes;
+		goto fail;
+	}
+	for (loop = 0; loop < info->ninodes; loop++)
+		info->inodes[loop] = order[loop].inode;
+	free (order);
+	order = NULL;
+
 	// Record highest block to backup.
 	if ((info->back_flags & BF_SHRINK) && highest > info->shrink_to)
 		info->shrink_to = highest;
@@ -264,9 +402,51 @@ backup_scan_inodes (struct backup_info *info)
 	info->appinodes = appinodes;
 	info->mediainodes = mediainodes;
 
-	if (fsids)
-		free (fsids);
+	if (info->manifest)
+		qsort (info->manifest, info->nmanifest, sizeof (*info->manifest), backup_manifest_cmp);
+
+/* Record the streams left to the base in the header, in pieces that fit */
+/* in an extra info entry */
+	if (info->ncarried > 0)
+	{
+		unsigned int loop3;
+
+		qsort (info->carried, info->ncarried, sizeof (*info->carried), backup_fsid_cmp);
+		for (loop3 = 0; loop3 < info->ncarried; loop3 += 16000)
+		{
+			unsigned int count = info->ncarried - loop3;
+			if (count > 16000)
+				count = 16000;
+			backup_info_add_extra (info, "basefsids", info->carried + loop3, count * sizeof (*info->carried));
+		}
+		info->back_flags |= BF_INCREMENTAL;
+	}
+
+/* The streams were scanned in inode order; restore wants them by fsid */
+	if (streams)
+	{
+		unsigned int loop3;
+
+		qsort (streams, nstreams, sizeof (*streams), backup_fsid_cmp);
+		for (loop3 = 0; loop3 < nstreams; loop3 += 5000)
+		{
+			unsigned int count = nstreams - loop3;
+			if (count > 5000)
+				count = 5000;
+			backup_info_add_extra (info, "fsidorder", streams + loop3, count * sizeof (*streams));
+		}
+		free (streams);
+	}
+
 	return info->ninodes;
+
+fail:
+	if (order)
+		free (order);
+	if (streams)
+		free (streams);
+	info->ninodes = 0;
+	return ~0;
 }
 
 /***************************************************************/
@@ -429,10 +609,210 @@ init_backup_v3 (char *device, char *device2, int flags)
 	{
 		info->back_flags &= ~BF_TRUNCATED;
 	}
+
+/* The first sector is never compressed, so the first chunk follows it */
+	if (info->back_flags & BF_CHUNKED)
+	{
+		info->container = calloc (sizeof (*info->container), 1);
+		if (!info->container)
+		{
+			if (info->mfs)
+				mfs_cleanup (info->mfs);
+			if (info->hda)
+				free (info->hda);
+			free (info);
+			return 0;
+		}
+
+		info->container->offset = 512;
+		info->container->cur.offset = 512;
+		info->container->cur.firstsector = 1;
+	}
  
 	return info;
 }
 
+/*****************************************************/
+/* Note where an inode landed in a chunked backup, so */
+/* it can be found again without reading up to it. */
+static int
+backup_container_add_fsid (struct backup_info *info, unsigned int fsid, uint64_t sector, uint64_t sectors)
+{
+	struct backup_container *ct = info->container;
+	struct backup_index_fsid *entry;
+
+	if (ct->nfsids >= ct->fsidalloc)
+	{
+		struct backup_index_fsid *tmp;
+
+		tmp = realloc (ct->fsids, sizeof (*ct->fsids) * (ct->fsidalloc + 4096));
+		if (!tmp)
+		{
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+		ct->fsids = tmp;
+		ct->fsidalloc += 4096;
+	}
+
+	entry = &ct->fsids[ct->nfsids++];
+	entry->fsid = fsid;
+	entry->chunk = (sector - 1) / BACKUP_CHUNKSECTORS;
+	entry->firstsector = sector;
+	entry->sectors = sectors;
+
+	return 0;
+}
+
+/*************************************************************************/
+/* Build the trailing index of a chunked backup from the chunk and fsid */
+/* tables.  The chunk table must be complete before this is called. */
+int
+backup_container_index (struct backup_info *info)
+{
+	struct backup_container *ct = info->container;
+	struct backup_index_head *head;
+	struct backup_index_tail *tail;
+	unsigned int size;
+
+	size = sizeof (*head) + sizeof (*ct->chunks) * ct->nchunks + sizeof (*ct->fsids) * ct->nfsids;
+
+	ct->index = malloc (size + sizeof (*tail));
+	if (!ct->index)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	head = (struct backup_index_head *)ct->index;
+	head->magic = TBKI_MAGIC;
+	head->nchunks = ct->nchunks;
+	head->nfsids = ct->nfsids;
+	head->chunksectors = BACKUP_CHUNKSECTORS;
+	memcpy (head + 1, ct->chunks, sizeof (*ct->chunks) * ct->nchunks);
+	memcpy ((struct backup_index_chunk *)(head + 1) + ct->nchunks, ct->fsids, sizeof (*ct->fsids) * ct->nfsids);
+
+	tail = (struct backup_index_tail *)(ct->index + size);
+	tail->magic = TBKI_MAGIC;
+	tail->crc = crc32 (0, ct->index, size);
+	tail->size = size;
+
+	ct->indexsize = size + sizeof (*tail);
+	ct->indexpos = 0;
+
+	return 0;
+}
+
+/*********************************/
+/* Release the container tables. */
+void
+backup_container_free (struct backup_info *info)
+{
+	struct backup_container *ct = info->container;
+
+	if (!ct)
+		return;
+
+	if (ct->chunks)
+		free (ct->chunks);
+	if (ct->fsids)
+		free (ct->fsids);
+	if (ct->index)
+		free (ct->index);
+	free (ct);
+	info->container = 0;
+}
+
+/**************************************************************************/
+/* Leave the data of all streams out of the backup, for mfscopy to copy */
+/* from drive to drive itself.  Streams are listed as if the backup were */
+/* incremental, with the source drive as the base. */
+void
+backup_set_copy_direct (struct backup_info *info)
+{
+	info->copydirect = 1;
+}
+
+/*************************************************************************/
+/* Load the manifest of a previous backup to make this one incremental. */
+/* Streams that have not changed since are left out of this backup. */
+int
+backup_set_base_manifest (struct backup_info *info, char *filename)
+{
+	struct backup_manifest_head head;
+	FILE *file;
+
+	file = fopen (filename, "rb");
+	if (!file)
+	{
+		info->err_msg = "Unable to open manifest";
+		return -1;
+	}
+
+	if (fread (&head, sizeof (head), 1, file) != 1 || head.magic != TBKM_MAGIC)
+	{
+		fclose (file);
+		info->err_msg = "Not a backup manifest";
+		return -1;
+	}
+
+	info->basemanifest = malloc (sizeof (*info->basemanifest) * (head.nentries + 1));
+	if (!info->basemanifest)
+	{
+		fclose (file);
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	if (fread (info->basemanifest, sizeof (*info->basemanifest), head.nentries, file) != head.nentries)
+	{
+		fclose (file);
+		free (info->basemanifest);
+		info->basemanifest = NULL;
+		info->err_msg = "Manifest is truncated";
+		return -1;
+	}
+	fclose (file);
+
+	info->nbasemanifest = head.nentries;
+	return 0;
+}
+
+/***************************************************************/
+/* Write the manifest of the streams whose data is in this backup, */
+/* for a later incremental backup to use as its base. */
+int
+backup_write_manifest (struct backup_info *info, char *filename)
+{
+	struct backup_manifest_head head;
+	FILE *file;
+
+	file = fopen (filename, "wb");
+	if (!file)
+	{
+		info->err_msg = "Unable to create manifest";
+		return -1;
+	}
+
+	head.magic = TBKM_MAGIC;
+	head.nentries = info->nmanifest;
+	if (fwrite (&head, sizeof (head), 1, file) != 1 ||
+		fwrite (info->manifest, sizeof (*info->manifest), info->nmanifest, file) != info->nmanifest)
+	{
+		fclose (file);
+		info->err_msg = "Error writing manifest";
+		return -1;
+	}
+
+	if (fclose (file) != 0)
+	{
+		info->err_msg = "Error writing manifest";
+		return -1;
+	}
+
+	return 0;
+}
+
 /***************************************************************************/
 /* State handlers - return val -1 = error, 0 = more data needed, 1 = go to */
 /* next state. */
@@ -666,6 +1046,43 @@ backup_state_volume_header_v3 (struct backup_info *info, void *data, unsigned si
 	return bsNextState;
 }
 
+/**********************************************************************/
+/* Bytes of data backed up after an inode sector.  Data kept in the */
+/* inode itself is part of the inode sector, so it does not count. */
+uint64_t
+backup_inode_datasize_v3 (struct backup_info *info, mfs_inode *inode)
+{
+	uint64_t datasize;
+
+	if (inode->type == tyStream)
+	{
+		unsigned int fsid = intswap32 (inode->fsid);
+
+		if (info->back_flags & BF_STREAMTOT)
+			datasize = intswap32 (inode->size);
+		else
+			datasize = intswap32 (inode->blockused);
+		datasize *= intswap32 (inode->blocksize);
+
+/* The base backup has the data for this one */
+		if (info->ncarried && bsearch (&fsid, info->carried, info->ncarried, sizeof (fsid), backup_fsid_cmp))
+			datasize = 0;
+	}
+	else
+	{
+		if (!(inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2)))
+		{
+			datasize = intswap32 (inode->size);
+		}
+		else
+		{
+			datasize = 0;
+		}
+	}
+
+	return datasize;
+}
+
 /*****************************/
 /* Backup application inodes */
 /* Write inode sector, followed by date for non tyStream inodes. */
@@ -684,9 +1101,14 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 		return bsError;
 	}
 
+/* Read ahead from every source drive at once, if there is more than one */
+	if (!info->prefetch && !info->noprefetch && backup_prefetch_init (info) < 0)
+		return bsError;
+
 	while (info->state_val1 < info->ninodes && size > 0)
 	{
 		uint64_t datasize;
+		uint64_t inodesector = 0;
 
 		if (!info->state_ptr1)
 		{
@@ -695,10 +1117,11 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			uint64_t inode_size;
 
 /* Fetch the next inode */
-			inode = mfs_read_inode (info->mfs, info->inodes[info->state_val1]);
+			inode = backup_prefetch_inode (info, info->state_val1);
 
 			if (!inode)
 			{
+				backup_prefetch_free (info);
 				return bsError;
 			}
 
@@ -731,6 +1154,8 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			tmpinode->inode_flags &= intswap32 (INODE_DATA);
 			tmpinode->numblocks = 0;
 
+			inodesector = info->cursector + *consumed;
+
 			data = (char *)data + 512;
 			--size;
 			++*consumed;
@@ -743,24 +1168,18 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			inode = info->state_ptr1;
 		}
 
-		if (inode->type == tyStream)
-		{
-			if (info->back_flags & BF_STREAMTOT)
-				datasize = intswap32 (inode->size);
-			else
-				datasize = intswap32 (inode->blockused);
-			datasize *= intswap32 (inode->blocksize);
-		}
-		else
+		datasize = backup_inode_datasize_v3 (info, inode);
+
+		if (info->container && inodesector)
 		{
-			if (!(inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2)))
+			if (backup_container_add_fsid (info, intswap32 (inode->fsid), inodesector, 1 + (datasize + 511) / 512) < 0)
 			{
-				datasize = intswap32 (inode->size);
-			}
-			else
-			{
-				datasize = 0;
+				free (inode);
+				info->state_ptr1 = NULL;
+				backup_prefetch_free (info);
+				return bsError;
 			}
+			inodesector = 0;
 		}
 
 		while (info->state_val2 * 512 < datasize)
@@ -772,11 +1191,13 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			if (!tocopy)
 				return bsMoreData;
 
-			if (mfs_read_inode_data_part (info->mfs, inode, data, info->state_val2, (tocopy + 511) / 512) < 0)
+			if (backup_prefetch_read (info, info->state_val1, inode, data, info->state_val2, (tocopy + 511) / 512) < 0)
 			{
 				info->err_msg = "Error reading inode %d";
 				info->err_arg1 = (int64_t)info->state_val1;
 				free (inode);
+				info->state_ptr1 = NULL;
+				backup_prefetch_free (info);
 				return bsError;
 			}
 
@@ -809,6 +1230,7 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 	if (info->state_val1 < info->ninodes)
 		return bsMoreData;
 
+	backup_prefetch_free (info);
 	info->shared_val1 = 0;
 	return bsNextState;
 }
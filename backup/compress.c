@@ -0,0 +1,858 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+#if HAVE_LZ4FRAME_H
+#include <lz4frame.h>
+#endif
+
+#include "mfs.h"
+#include "backup.h"
+
+/* Parallel compression for backup output.  The backup stream is cut into */
+/* blocks which are deflated independently by a pool of worker threads, */
+/* each primed with the tail of the block before it.  The blocks are */
+/* stitched back together with a zlib header and adler32 trailer, so the */
+/* result is a single ordinary zlib stream as far as restore is concerned. */
+/* A separate reader thread keeps the blocks coming from disk, so reading, */
+/* compressing, and whatever the caller does with the output all overlap. */
+
+#if HAVE_PTHREAD_H
+
+/* Uncompressed size of each block handed to a worker */
+#define PCOMP_BLOCKSECTORS 2048
+#define PCOMP_BLOCKSIZE (PCOMP_BLOCKSECTORS * 512)
+/* Size of the deflate window primed from the previous block */
+#define PCOMP_DICTSIZE 32768
+
+enum pcomp_job_state
+{
+	pjFree = 0,
+	pjReady,
+	pjBusy,
+	pjDone
+};
+
+struct pcomp_job
+{
+	enum pcomp_job_state state;
+	uint64_t seq;
+	int last;
+	int error;
+
+	unsigned char *in;
+	unsigned int insize;
+	unsigned char *dict;
+	unsigned int dictsize;
+
+	unsigned char *out;
+	unsigned int outsize;
+	uLong adler;
+};
+
+struct backup_pcomp
+{
+	pthread_mutex_t lock;
+	pthread_cond_t ready;		/* A block was queued, or shutting down */
+	pthread_cond_t done;		/* A block finished compressing */
+	pthread_cond_t freed;		/* A block was emitted and can be reused */
+	int shutdown;
+
+	int level;
+	int nthreads;
+	pthread_t *threads;
+	pthread_t reader;
+	int hasreader;
+	int readerror;				/* The reader hit an error and stopped */
+
+	int njobs;
+	struct pcomp_job *jobs;
+	unsigned int outalloc;
+
+	uint64_t nextin;			/* Sequence of the next block to read */
+	uint64_t nextout;			/* Sequence of the next block to emit */
+	int inputdone;				/* Final (possibly empty) block queued */
+	struct pcomp_job *prev;		/* Last block queued, for the dictionary */
+
+	struct pcomp_job *cur;		/* Block being copied out */
+	unsigned int curoff;
+
+	uint64_t readstall;			/* Reader waiting for a free block */
+	uint64_t compstall;			/* Workers waiting for a block, summed */
+
+	uLong adler;				/* Running adler32 of all emitted blocks */
+	unsigned char pending[4];	/* zlib header or trailer bytes */
+	unsigned int pendoff;
+	unsigned int pendlen;
+	int finished;
+};
+
+/**********************************/
+/* Current time, for stall stats. */
+static uint64_t
+backup_pcomp_now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/******************************************************/
+/* Compress a single block with the worker's stream. */
+static void
+backup_pcomp_job (struct backup_pcomp *pc, z_stream *strm, struct pcomp_job *job)
+{
+	int zres;
+
+	if (deflateReset (strm) != Z_OK)
+	{
+		job->error = 1;
+		return;
+	}
+
+	if (job->dictsize && deflateSetDictionary (strm, job->dict, job->dictsize) != Z_OK)
+	{
+		job->error = 1;
+		return;
+	}
+
+	strm->next_in = job->in;
+	strm->avail_in = job->insize;
+	strm->next_out = job->out;
+	strm->avail_out = pc->outalloc;
+
+/* Non-final blocks end in a sync flush, which leaves the output byte */
+/* aligned so the next block can simply be appended. */
+	zres = deflate (strm, job->last? Z_FINISH: Z_SYNC_FLUSH);
+
+	if ((job->last && zres != Z_STREAM_END) ||
+		(!job->last && (zres != Z_OK || strm->avail_out == 0 || strm->avail_in != 0)))
+	{
+		job->error = 1;
+		return;
+	}
+
+	job->outsize = pc->outalloc - strm->avail_out;
+	job->adler = adler32 (adler32 (0L, Z_NULL, 0), job->in, job->insize);
+}
+
+/*******************************************************/
+/* Worker thread - compress queued blocks, oldest first */
+static void *
+backup_pcomp_worker (void *arg)
+{
+	struct backup_pcomp *pc = arg;
+	z_stream strm;
+	uint64_t compstall = 0;
+	int zok;
+
+	memset (&strm, 0, sizeof (strm));
+	zok = deflateInit2 (&strm, pc->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+	pthread_mutex_lock (&pc->lock);
+	for (;;)
+	{
+		struct pcomp_job *job = NULL;
+		int loop;
+
+		for (loop = 0; loop < pc->njobs; loop++)
+		{
+			if (pc->jobs[loop].state == pjReady && (!job || pc->jobs[loop].seq < job->seq))
+				job = &pc->jobs[loop];
+		}
+
+		if (!job)
+		{
+			uint64_t start;
+
+			if (pc->shutdown)
+				break;
+			start = backup_pcomp_now ();
+			pthread_cond_wait (&pc->ready, &pc->lock);
+			compstall += backup_pcomp_now () - start;
+			continue;
+		}
+
+		job->state = pjBusy;
+		pthread_mutex_unlock (&pc->lock);
+
+		if (zok)
+			backup_pcomp_job (pc, &strm, job);
+		else
+			job->error = 1;
+
+		pthread_mutex_lock (&pc->lock);
+		job->state = pjDone;
+		pthread_cond_broadcast (&pc->done);
+	}
+	pc->compstall += compstall;
+	pthread_mutex_unlock (&pc->lock);
+
+	if (zok)
+		deflateEnd (&strm);
+
+	return NULL;
+}
+
+/*********************************************************************/
+/* Read the next block of the backup into a free job. */
+/* Called without the lock held, the free job belongs to the reader. */
+static int
+backup_pcomp_fill (struct backup_info *info, struct pcomp_job *job)
+{
+	struct backup_pcomp *pc = info->pcomp;
+	int nread;
+
+/* Prime the window with the end of the previous block.  This comes first */
+/* since the previous block may have been emitted and this is its job. */
+	job->dictsize = 0;
+	if (pc->prev)
+	{
+		job->dictsize = pc->prev->insize < PCOMP_DICTSIZE? pc->prev->insize: PCOMP_DICTSIZE;
+		memmove (job->dict, pc->prev->in + pc->prev->insize - job->dictsize, job->dictsize);
+	}
+
+	nread = backup_next_sectors (info, job->in, PCOMP_BLOCKSECTORS);
+	if (nread < 0)
+		return -1;
+
+	job->insize = nread * 512;
+	job->last = nread == 0;
+	job->error = 0;
+	job->outsize = 0;
+
+	return 0;
+}
+
+/**************************************************************/
+/* Reader thread - queue blocks of the backup as jobs free up */
+static void *
+backup_pcomp_reader (void *arg)
+{
+	struct backup_info *info = arg;
+	struct backup_pcomp *pc = info->pcomp;
+
+	pthread_mutex_lock (&pc->lock);
+	while (!pc->shutdown && !pc->inputdone)
+	{
+		struct pcomp_job *job = NULL;
+		int loop;
+
+		for (loop = 0; loop < pc->njobs; loop++)
+		{
+			if (pc->jobs[loop].state == pjFree)
+			{
+				job = &pc->jobs[loop];
+				break;
+			}
+		}
+
+		if (!job)
+		{
+			uint64_t start = backup_pcomp_now ();
+			pthread_cond_wait (&pc->freed, &pc->lock);
+			pc->readstall += backup_pcomp_now () - start;
+			continue;
+		}
+
+		pthread_mutex_unlock (&pc->lock);
+		if (backup_pcomp_fill (info, job) < 0)
+		{
+			pthread_mutex_lock (&pc->lock);
+			pc->readerror = 1;
+			pthread_cond_broadcast (&pc->done);
+			break;
+		}
+		pthread_mutex_lock (&pc->lock);
+
+		job->seq = pc->nextin++;
+		job->state = pjReady;
+		pc->prev = job;
+		if (job->last)
+			pc->inputdone = 1;
+		pthread_cond_signal (&pc->ready);
+	}
+	pthread_mutex_unlock (&pc->lock);
+
+	return NULL;
+}
+
+/*********************************************/
+/* Stop the threads and free it all. */
+void
+backup_pcomp_free (struct backup_info *info)
+{
+	struct backup_pcomp *pc = info->pcomp;
+	int loop;
+
+	if (!pc)
+		return;
+
+	pthread_mutex_lock (&pc->lock);
+	pc->shutdown = 1;
+	pthread_cond_broadcast (&pc->ready);
+	pthread_cond_broadcast (&pc->freed);
+	pthread_mutex_unlock (&pc->lock);
+
+	if (pc->hasreader)
+		pthread_join (pc->reader, NULL);
+	for (loop = 0; loop < pc->nthreads; loop++)
+		pthread_join (pc->threads[loop], NULL);
+
+	info->readstall += pc->readstall;
+	if (pc->nthreads > 0)
+		info->compstall += pc->compstall / pc->nthreads;
+
+	for (loop = 0; loop < pc->njobs; loop++)
+	{
+		free (pc->jobs[loop].in);
+		free (pc->jobs[loop].dict);
+		free (pc->jobs[loop].out);
+	}
+
+	pthread_cond_destroy (&pc->freed);
+	pthread_cond_destroy (&pc->done);
+	pthread_cond_destroy (&pc->ready);
+	pthread_mutex_destroy (&pc->lock);
+	free (pc->jobs);
+	free (pc->threads);
+	free (pc);
+	info->pcomp = NULL;
+}
+
+/***********************************************************************/
+/* Start the parallel compressor.  Returns 1 if it is running, 0 if the */
+/* caller should fall back to single threaded compression, -1 on error. */
+int
+backup_pcomp_init (struct backup_info *info, int level)
+{
+	struct backup_pcomp *pc;
+	int loop;
+	unsigned int flevel;
+
+	if (info->nthreads < 2)
+		return 0;
+
+	pc = calloc (sizeof (*pc), 1);
+	if (!pc)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	pc->level = level;
+	pc->njobs = info->nthreads * 2;
+	pc->outalloc = compressBound (PCOMP_BLOCKSIZE) + 64;
+	pc->jobs = calloc (sizeof (*pc->jobs), pc->njobs);
+	pc->threads = calloc (sizeof (*pc->threads), info->nthreads);
+	if (!pc->jobs || !pc->threads)
+	{
+		free (pc->jobs);
+		free (pc->threads);
+		free (pc);
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	pthread_mutex_init (&pc->lock, NULL);
+	pthread_cond_init (&pc->ready, NULL);
+	pthread_cond_init (&pc->done, NULL);
+	pthread_cond_init (&pc->freed, NULL);
+	info->pcomp = pc;
+
+	for (loop = 0; loop < pc->njobs; loop++)
+	{
+		pc->jobs[loop].in = malloc (PCOMP_BLOCKSIZE);
+		pc->jobs[loop].dict = malloc (PCOMP_DICTSIZE);
+		pc->jobs[loop].out = malloc (pc->outalloc);
+		if (!pc->jobs[loop].in || !pc->jobs[loop].dict || !pc->jobs[loop].out)
+		{
+			backup_pcomp_free (info);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+	}
+
+	for (loop = 0; loop < info->nthreads; loop++)
+	{
+		if (pthread_create (&pc->threads[loop], NULL, backup_pcomp_worker, pc) != 0)
+		{
+			backup_pcomp_free (info);
+			info->err_msg = "Unable to start compression threads";
+			return -1;
+		}
+		pc->nthreads++;
+	}
+
+	if (pthread_create (&pc->reader, NULL, backup_pcomp_reader, info) != 0)
+	{
+		backup_pcomp_free (info);
+		info->err_msg = "Unable to start compression threads";
+		return -1;
+	}
+	pc->hasreader = 1;
+
+/* zlib header, with the level hint matching what deflateInit would write */
+	if (level < 2)
+		flevel = 0;
+	else if (level < 6)
+		flevel = 1;
+	else if (level == 6)
+		flevel = 2;
+	else
+		flevel = 3;
+	pc->pending[0] = 0x78;
+	pc->pending[1] = flevel << 6;
+	pc->pending[1] += (31 - ((pc->pending[0] << 8) + pc->pending[1]) % 31) % 31;
+	pc->pendlen = 2;
+
+	pc->adler = adler32 (0L, Z_NULL, 0);
+
+	return 1;
+}
+
+/************************************************************************/
+/* Produce compressed output.  Returns the number of bytes written, 0 */
+/* once the stream is complete, or -1 on error. */
+int
+backup_pcomp_read (struct backup_info *info, unsigned char *buf, unsigned int size)
+{
+	struct backup_pcomp *pc = info->pcomp;
+	unsigned int written = 0;
+
+	pthread_mutex_lock (&pc->lock);
+	while (written < size)
+	{
+		struct pcomp_job *job = NULL;
+		int loop;
+
+/* Header or trailer bytes */
+		if (pc->pendoff < pc->pendlen)
+		{
+			unsigned int tocopy = pc->pendlen - pc->pendoff;
+			if (tocopy > size - written)
+				tocopy = size - written;
+			memcpy (buf + written, pc->pending + pc->pendoff, tocopy);
+			pc->pendoff += tocopy;
+			written += tocopy;
+			continue;
+		}
+
+		if (pc->finished)
+			break;
+
+/* Copy out the current block */
+		if (pc->cur)
+		{
+			unsigned int tocopy = pc->cur->outsize - pc->curoff;
+			if (tocopy > size - written)
+				tocopy = size - written;
+			memcpy (buf + written, pc->cur->out + pc->curoff, tocopy);
+			pc->curoff += tocopy;
+			written += tocopy;
+
+			if (pc->curoff >= pc->cur->outsize)
+			{
+				pc->adler = adler32_combine (pc->adler, pc->cur->adler, pc->cur->insize);
+				if (pc->cur->last)
+				{
+					pc->pending[0] = pc->adler >> 24;
+					pc->pending[1] = pc->adler >> 16;
+					pc->pending[2] = pc->adler >> 8;
+					pc->pending[3] = pc->adler;
+					pc->pendoff = 0;
+					pc->pendlen = 4;
+					pc->finished = 1;
+				}
+				pc->cur->state = pjFree;
+				pc->cur = NULL;
+				pc->nextout++;
+				pthread_cond_signal (&pc->freed);
+			}
+			continue;
+		}
+
+/* Wait for the next block in sequence */
+		for (loop = 0; loop < pc->njobs; loop++)
+		{
+			if (pc->jobs[loop].state == pjDone && pc->jobs[loop].seq == pc->nextout)
+			{
+				job = &pc->jobs[loop];
+				break;
+			}
+		}
+
+		if (job)
+		{
+			if (job->error)
+			{
+				pthread_mutex_unlock (&pc->lock);
+				info->err_msg = "Compression error";
+				return -1;
+			}
+			pc->cur = job;
+			pc->curoff = 0;
+			continue;
+		}
+
+/* The reader has set the error message */
+		if (pc->readerror)
+		{
+			pthread_mutex_unlock (&pc->lock);
+			return -1;
+		}
+
+		pthread_cond_wait (&pc->done, &pc->lock);
+	}
+	pthread_mutex_unlock (&pc->lock);
+
+	return written;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+int
+backup_pcomp_init (struct backup_info *info, int level)
+{
+	return 0;
+}
+
+int
+backup_pcomp_read (struct backup_info *info, unsigned char *buf, unsigned int size)
+{
+	info->err_msg = "Internal error: Parallel compression not available";
+	return -1;
+}
+
+void
+backup_pcomp_free (struct backup_info *info)
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+void
+backup_set_threads (struct backup_info *info, int nthreads)
+{
+	info->nthreads = nthreads;
+}
+
+/* zstd and LZ4 streams.  These still use info->comp to track the caller's */
+/* buffers, so backup_read drives them exactly the way it drives deflate. */
+
+/* Input handed to LZ4 in one go, which bounds the staging buffer */
+#define LZ4_CHUNKSIZE 65536
+/* zstd long distance matching window, 128MiB, the most a default */
+/* decoder will accept */
+#define ZSTD_LONGWINDOW 27
+
+struct backup_codec
+{
+	int codec;
+#if HAVE_ZSTD_H
+	ZSTD_CCtx *zcs;
+#endif
+#if HAVE_LZ4FRAME_H
+	LZ4F_cctx *lz4;
+	LZ4F_preferences_t prefs;
+	unsigned char *stage;
+	size_t stagesize;
+	size_t stagepos;
+	size_t stagelen;
+	int ended;
+#endif
+};
+
+/*********************************************/
+/* Return true if the codec was compiled in. */
+int
+backup_codec_available (int codec)
+{
+	switch (codec)
+	{
+	case BC_ZLIB:
+		return 1;
+#if HAVE_ZSTD_H
+	case BC_ZSTD:
+		return 1;
+#endif
+#if HAVE_LZ4FRAME_H
+	case BC_LZ4:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/******************************************/
+/* Start a zstd or LZ4 compression stream */
+int
+backup_codec_init (struct backup_info *info, int codec, int level)
+{
+	struct backup_codec *c;
+
+	c = calloc (sizeof (*c), 1);
+	if (!c)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+	c->codec = codec;
+
+	switch (codec)
+	{
+#if HAVE_ZSTD_H
+	case BC_ZSTD:
+		c->zcs = ZSTD_createCCtx ();
+		if (!c->zcs)
+		{
+			free (c);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+
+/* MPEG padding repeats far apart, so let zstd look back a long way */
+		if (ZSTD_isError (ZSTD_CCtx_setParameter (c->zcs, ZSTD_c_compressionLevel, level)) ||
+			ZSTD_isError (ZSTD_CCtx_setParameter (c->zcs, ZSTD_c_enableLongDistanceMatching, 1)) ||
+			ZSTD_isError (ZSTD_CCtx_setParameter (c->zcs, ZSTD_c_windowLog, ZSTD_LONGWINDOW)))
+		{
+			ZSTD_freeCCtx (c->zcs);
+			free (c);
+			info->err_msg = "Compression init error";
+			return -1;
+		}
+
+/* zstd has its own worker threads; a library built without them just */
+/* refuses this, and compresses on this thread instead */
+		if (info->nthreads > 1)
+			ZSTD_CCtx_setParameter (c->zcs, ZSTD_c_nbWorkers, info->nthreads);
+		break;
+#endif
+#if HAVE_LZ4FRAME_H
+	case BC_LZ4:
+	{
+		LZ4F_preferences_t *prefs = &c->prefs;
+
+		prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+/* The low levels all map to the fast compressor, the rest to LZ4HC */
+		prefs->compressionLevel = level < 3? 0: level;
+
+		if (LZ4F_isError (LZ4F_createCompressionContext (&c->lz4, LZ4F_VERSION)))
+		{
+			free (c);
+			info->err_msg = "Compression init error";
+			return -1;
+		}
+
+		c->stagesize = LZ4F_compressBound (LZ4_CHUNKSIZE, prefs);
+		if (c->stagesize < LZ4F_HEADER_SIZE_MAX)
+			c->stagesize = LZ4F_HEADER_SIZE_MAX;
+		c->stage = malloc (c->stagesize);
+		if (!c->stage)
+		{
+			LZ4F_freeCompressionContext (c->lz4);
+			free (c);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+
+		c->stagelen = LZ4F_compressBegin (c->lz4, c->stage, c->stagesize, prefs);
+		if (LZ4F_isError (c->stagelen))
+		{
+			LZ4F_freeCompressionContext (c->lz4);
+			free (c->stage);
+			free (c);
+			info->err_msg = "Compression init error";
+			return -1;
+		}
+		break;
+	}
+#endif
+	default:
+		free (c);
+		info->err_msg = "Compression codec %"PRId64" not supported by this build";
+		info->err_arg1 = codec;
+		return -1;
+	}
+
+	info->codec = c;
+	return 0;
+}
+
+/*************************************************************************/
+/* Compress from info->comp->next_in to info->comp->next_out.  Returns */
+/* Z_OK while there is more to do, Z_STREAM_END once a Z_FINISH flush has */
+/* been fully written, or Z_STREAM_ERROR on failure, just like deflate. */
+int
+backup_codec_step (struct backup_info *info, int flush)
+{
+	struct backup_codec *c = info->codec;
+
+	switch (c->codec)
+	{
+#if HAVE_ZSTD_H
+	case BC_ZSTD:
+	{
+		z_stream *strm = info->comp;
+		ZSTD_inBuffer in;
+		ZSTD_outBuffer out;
+		size_t ret;
+
+		in.src = strm->next_in;
+		in.size = strm->avail_in;
+		in.pos = 0;
+		out.dst = strm->next_out;
+		out.size = strm->avail_out;
+		out.pos = 0;
+
+		ret = ZSTD_compressStream2 (c->zcs, &out, &in, flush == Z_FINISH? ZSTD_e_end: ZSTD_e_continue);
+
+		strm->next_in += in.pos;
+		strm->avail_in -= in.pos;
+		strm->next_out += out.pos;
+		strm->avail_out -= out.pos;
+
+		if (ZSTD_isError (ret))
+		{
+			info->err_msg = "Compression error";
+			return Z_STREAM_ERROR;
+		}
+
+		if (flush == Z_FINISH && ret == 0)
+			return Z_STREAM_END;
+		return Z_OK;
+	}
+#endif
+#if HAVE_LZ4FRAME_H
+	case BC_LZ4:
+	{
+		z_stream *strm = info->comp;
+		size_t len;
+
+/* Anything already compressed goes out first */
+		if (c->stagepos < c->stagelen)
+		{
+			len = c->stagelen - c->stagepos;
+			if (len > strm->avail_out)
+				len = strm->avail_out;
+			memcpy (strm->next_out, c->stage + c->stagepos, len);
+			c->stagepos += len;
+			strm->next_out += len;
+			strm->avail_out -= len;
+			return Z_OK;
+		}
+
+		if (c->ended)
+			return Z_STREAM_END;
+
+		c->stagepos = 0;
+		c->stagelen = 0;
+		if (strm->avail_in > 0)
+		{
+			len = strm->avail_in;
+			if (len > LZ4_CHUNKSIZE)
+				len = LZ4_CHUNKSIZE;
+			c->stagelen = LZ4F_compressUpdate (c->lz4, c->stage, c->stagesize, strm->next_in, len, NULL);
+			strm->next_in += len;
+			strm->avail_in -= len;
+		}
+		else if (flush == Z_FINISH)
+		{
+			c->stagelen = LZ4F_compressEnd (c->lz4, c->stage, c->stagesize, NULL);
+			c->ended = 1;
+		}
+
+		if (LZ4F_isError (c->stagelen))
+		{
+			c->stagelen = 0;
+			info->err_msg = "Compression error";
+			return Z_STREAM_ERROR;
+		}
+		return Z_OK;
+	}
+#endif
+	default:
+		info->err_msg = "Internal error: Unknown compression codec";
+		return Z_STREAM_ERROR;
+	}
+}
+
+/*********************************************************/
+/* Start a new, independent zstd frame or LZ4 frame after */
+/* the last one was finished. */
+int
+backup_codec_reset (struct backup_info *info)
+{
+	struct backup_codec *c = info->codec;
+
+	switch (c->codec)
+	{
+#if HAVE_ZSTD_H
+	case BC_ZSTD:
+		if (ZSTD_isError (ZSTD_CCtx_reset (c->zcs, ZSTD_reset_session_only)))
+			break;
+		return Z_OK;
+#endif
+#if HAVE_LZ4FRAME_H
+	case BC_LZ4:
+		c->stagepos = 0;
+		c->stagelen = LZ4F_compressBegin (c->lz4, c->stage, c->stagesize, &c->prefs);
+		c->ended = 0;
+		if (LZ4F_isError (c->stagelen))
+		{
+			c->stagelen = 0;
+			break;
+		}
+		return Z_OK;
+#endif
+	default:
+		break;
+	}
+
+	info->err_msg = "Compression error";
+	return Z_STREAM_ERROR;
+}
+
+/***************************************/
+/* Release the zstd or LZ4 stream state */
+int
+backup_codec_end (struct backup_info *info)
+{
+	struct backup_codec *c = info->codec;
+
+	if (!c)
+		return Z_OK;
+
+#if HAVE_ZSTD_H
+	if (c->zcs)
+		ZSTD_freeCCtx (c->zcs);
+#endif
+#if HAVE_LZ4FRAME_H
+	if (c->lz4)
+		LZ4F_freeCompressionContext (c->lz4);
+	if (c->stage)
+		free (c->stage);
+#endif
+
+	free (c);
+	info->codec = 0;
+	return Z_OK;
+}
@@ -0,0 +1,396 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#include <fcntl.h>
+#include <zlib.h>
+#include <string.h>
+#include <limits.h>
+#include <inttypes.h>
+
+#include "mfs.h"
+#include "backup.h"
+
+/* Content defined chunking uses a gear hash: each byte shifts the hash and */
+/* adds a per-byte constant, so the top bits depend only on the last 64 */
+/* bytes and a cut point found in one backup is found in any other backup */
+/* with the same data, whatever came before it. */
+static uint64_t gear[256];
+
+/************************************************************/
+/* Fill the gear table.  It must never change between runs, */
+/* or chunks would stop matching those already stored. */
+static void
+backup_store_gear_init (void)
+{
+	uint64_t seed = 0x54695646534d4653ULL;
+	int loop;
+
+	if (gear[0])
+		return;
+
+/* splitmix64 */
+	for (loop = 0; loop < 256; loop++)
+	{
+		uint64_t val;
+
+		seed += 0x9e3779b97f4a7c15ULL;
+		val = seed;
+		val = (val ^ (val >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		val = (val ^ (val >> 27)) * 0x94d049bb133111ebULL;
+		gear[loop] = val ^ (val >> 31);
+	}
+}
+
+/*********************************************/
+/* Build the path of a chunk in the store. */
+static void
+backup_store_path (char *path, char *dir, unsigned char *hash)
+{
+	char *cur;
+	int loop;
+
+	cur = path + sprintf (path, "%s/%02x/", dir, hash[0]);
+	for (loop = 0; loop < 32; loop++)
+		cur += sprintf (cur, "%02x", hash[loop]);
+}
+
+/*******************************************************************/
+/* Flush a directory, so names just renamed into it survive a crash */
+static int
+backup_store_sync_dir (char *path)
+{
+	int fd = open (path, O_RDONLY);
+	int ret;
+
+	if (fd < 0)
+		return -1;
+	ret = fsync (fd);
+	if (close (fd) < 0)
+		ret = -1;
+	return ret;
+}
+
+/****************************************************/
+/* Open a store directory and create a recipe in it */
+struct backup_store *
+backup_store_open (struct backup_info *info, char *dir, char *recipe, int level)
+{
+	struct backup_store *store;
+	char *path;
+	int loop;
+
+	store = calloc (sizeof (*store), 1);
+	if (!store)
+	{
+		info->err_msg = "Memory exhausted";
+		return 0;
+	}
+
+	store->dir = dir;
+	store->level = level;
+	store->compsize = compressBound (BACKUP_STORE_MAXCHUNK);
+	store->buf = malloc (BACKUP_STORE_MAXCHUNK);
+	store->comp = malloc (store->compsize);
+	path = malloc (strlen (dir) + 8);
+	if (!store->buf || !store->comp || !path)
+	{
+		info->err_msg = "Memory exhausted";
+		goto fail;
+	}
+
+/* One subdirectory per leading hash byte keeps directories a sane size */
+	if (mkdir (dir, 0755) < 0 && errno != EEXIST)
+	{
+		info->err_msg = "Unable to create store directory";
+		goto fail;
+	}
+	for (loop = 0; loop < 256; loop++)
+	{
+		sprintf (path, "%s/%02x", dir, loop);
+		if (mkdir (path, 0755) < 0 && errno != EEXIST)
+		{
+			info->err_msg = "Unable to create store directory";
+			goto fail;
+		}
+	}
+	free (path);
+	path = 0;
+
+/* Like the chunks, the recipe only takes its real name once complete */
+	store->recipe = strdup (recipe);
+	store->recipetmp = malloc (strlen (recipe) + 5);
+	if (!store->recipe || !store->recipetmp)
+	{
+		info->err_msg = "Memory exhausted";
+		goto fail;
+	}
+	sprintf (store->recipetmp, "%s.tmp", recipe);
+
+#if O_LARGEFILE
+	store->recipefd = open (store->recipetmp, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+#else
+	store->recipefd = open (store->recipetmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (store->recipefd < 0)
+	{
+		info->err_msg = "Unable to create recipe";
+		goto fail;
+	}
+
+/* The head is rewritten with the real counts when the backup is done */
+	store->head.magic = TBKR_MAGIC;
+	if (write (store->recipefd, &store->head, sizeof (store->head)) != sizeof (store->head))
+	{
+		close (store->recipefd);
+		unlink (store->recipetmp);
+		info->err_msg = "Error writing recipe";
+		goto fail;
+	}
+
+	backup_store_gear_init ();
+
+	return store;
+
+fail:
+	if (path)
+		free (path);
+	if (store->recipe)
+		free (store->recipe);
+	if (store->recipetmp)
+		free (store->recipetmp);
+	if (store->buf)
+		free (store->buf);
+	if (store->comp)
+		free (store->comp);
+	free (store);
+	return 0;
+}
+
+/********************************************************************/
+/* Add the buffered chunk to the recipe, and to the store if it is */
+/* not there yet. */
+static int
+backup_store_chunk (struct backup_info *info, struct backup_store *store)
+{
+	struct backup_recipe_entry entry;
+	struct stat st;
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+
+	memset (&entry, 0, sizeof (entry));
+	compute_sha256 (store->buf, store->bufused, entry.hash);
+	entry.size = store->bufused;
+
+	if (strlen (store->dir) + 68 >= PATH_MAX)
+	{
+		info->err_msg = "Store directory name too long";
+		return -1;
+	}
+	backup_store_path (path, store->dir, entry.hash);
+
+	if (stat (path, &st) < 0)
+	{
+		uLongf compsize = store->compsize;
+		int fd;
+
+		if (compress2 (store->comp, &compsize, store->buf, store->bufused, store->level) != Z_OK)
+		{
+			info->err_msg = "Error compressing chunk";
+			return -1;
+		}
+
+/* Write under a temporary name so a partial chunk is never mistaken for */
+/* a stored one, even if the backup is interrupted.  The data has to be */
+/* on disk before the rename, or a crash can leave the name on an empty */
+/* file. */
+		sprintf (tmp, "%s.%d", path, (int)getpid ());
+		fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+		{
+			info->err_msg = "Unable to create chunk in store";
+			return -1;
+		}
+		if (write (fd, store->comp, compsize) != (int)compsize || fsync (fd) < 0)
+		{
+			close (fd);
+			unlink (tmp);
+			info->err_msg = "Error writing chunk to store";
+			return -1;
+		}
+		if (close (fd) < 0)
+		{
+			unlink (tmp);
+			info->err_msg = "Error writing chunk to store";
+			return -1;
+		}
+		if (rename (tmp, path) < 0)
+		{
+			unlink (tmp);
+			info->err_msg = "Error writing chunk to store";
+			return -1;
+		}
+
+		store->dirty[entry.hash[0] >> 3] |= 1 << (entry.hash[0] & 7);
+		store->newchunks++;
+		store->newbytes += compsize;
+	}
+
+	if (write (store->recipefd, &entry, sizeof (entry)) != sizeof (entry))
+	{
+		info->err_msg = "Error writing recipe";
+		return -1;
+	}
+
+	store->head.nchunks++;
+	store->head.size += store->bufused;
+	store->bufused = 0;
+	store->hash = 0;
+
+	return 0;
+}
+
+/*******************************************************/
+/* Cut backup data into chunks and store them. */
+int
+backup_store_write (struct backup_info *info, struct backup_store *store, unsigned char *buf, unsigned int size)
+{
+	while (size > 0)
+	{
+		uint64_t hash = store->hash;
+		unsigned int count = size;
+		unsigned int loop;
+		int cut = 0;
+
+		if (count > BACKUP_STORE_MAXCHUNK - store->bufused)
+			count = BACKUP_STORE_MAXCHUNK - store->bufused;
+
+		for (loop = 0; loop < count; loop++)
+		{
+			hash = (hash << 1) + gear[buf[loop]];
+			if (!(hash & BACKUP_STORE_CUTMASK) && store->bufused + loop + 1 >= BACKUP_STORE_MINCHUNK)
+			{
+				loop++;
+				cut = 1;
+				break;
+			}
+		}
+
+		memcpy (store->buf + store->bufused, buf, loop);
+		store->bufused += loop;
+		store->hash = hash;
+		buf += loop;
+		size -= loop;
+
+		if ((cut || store->bufused == BACKUP_STORE_MAXCHUNK) && backup_store_chunk (info, store) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**********************************************************************/
+/* Store the last chunk and complete the recipe.  The directories new */
+/* chunks were renamed into are flushed before the recipe is renamed */
+/* into place, so a recipe that survives a crash has all its chunks. */
+int
+backup_store_finish (struct backup_info *info, struct backup_store *store)
+{
+	char path[PATH_MAX];
+	char *slash;
+	int ret = 0;
+	int loop;
+
+	if (store->bufused > 0 && backup_store_chunk (info, store) < 0)
+		ret = -1;
+
+	for (loop = 0; ret == 0 && loop < 256; loop++)
+	{
+		if (!(store->dirty[loop >> 3] & (1 << (loop & 7))))
+			continue;
+
+		sprintf (path, "%s/%02x", store->dir, loop);
+		if (backup_store_sync_dir (path) < 0)
+		{
+			info->err_msg = "Error writing chunk to store";
+			ret = -1;
+		}
+	}
+
+	if (ret == 0 &&
+		(lseek (store->recipefd, 0, SEEK_SET) != 0 ||
+		 write (store->recipefd, &store->head, sizeof (store->head)) != sizeof (store->head) ||
+		 fsync (store->recipefd) < 0))
+	{
+		info->err_msg = "Error writing recipe";
+		ret = -1;
+	}
+
+	if (close (store->recipefd) < 0 && ret == 0)
+	{
+		info->err_msg = "Error writing recipe";
+		ret = -1;
+	}
+	store->recipefd = -1;
+
+	if (ret == 0 && rename (store->recipetmp, store->recipe) < 0)
+	{
+		info->err_msg = "Error writing recipe";
+		ret = -1;
+	}
+
+	if (ret < 0)
+	{
+		unlink (store->recipetmp);
+		return ret;
+	}
+
+/* And the directory holding the recipe */
+	if (strlen (store->recipe) >= PATH_MAX)
+	{
+		info->err_msg = "Recipe name too long";
+		return -1;
+	}
+	strcpy (path, store->recipe);
+	slash = strrchr (path, '/');
+	if (!slash)
+		strcpy (path, ".");
+	else if (slash == path)
+		path[1] = '\0';
+	else
+		*slash = '\0';
+
+	if (backup_store_sync_dir (path) < 0)
+	{
+		info->err_msg = "Error writing recipe";
+		return -1;
+	}
+
+	return 0;
+}
+
+/*************************/
+/* Free a store handle. */
+void
+backup_store_close (struct backup_store *store)
+{
+	if (store->recipefd >= 0)
+	{
+		close (store->recipefd);
+		unlink (store->recipetmp);
+	}
+	free (store->recipe);
+	free (store->recipetmp);
+	free (store->buf);
+	free (store->comp);
+	free (store);
+}
@@ -0,0 +1,545 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "mfs.h"
+#include "macpart.h"
+#include "backup.h"
+
+/* Inode data read ahead for v3 backups.  The data of the upcoming inodes */
+/* is cut into slots, each inside a single extent, and every slot is read */
+/* by the worker thread for the drive it is on.  With an A and B drive */
+/* both are kept streaming, instead of one waiting while the other reads. */
+/* The state machine takes the slots back in order, and anything it asks */
+/* for that was not planned starts the plan over from there. */
+
+#if HAVE_PTHREAD_H
+
+#define PREFETCH_SLOTS 32
+/* Most sectors in a slot, 512KiB */
+#define PREFETCH_SECTORS 1024
+/* Most inodes loaded ahead of the state machine */
+#define PREFETCH_INODES 256
+#define PREFETCH_MAXDEVS 8
+
+enum prefetch_slot_state
+{
+	psFree = 0,
+	psQueued,
+	psBusy,
+	psDone
+};
+
+struct prefetch_slot
+{
+	enum prefetch_slot_state state;
+	int error;
+	int dev;				/* Worker to read it */
+
+	unsigned int index;		/* Inode index in info->inodes */
+	uint64_t start;			/* First sector of the inode data */
+	unsigned int count;
+	unsigned char inode[512];	/* Copy of the inode, for the extents */
+	unsigned char *data;
+};
+
+struct prefetch_worker
+{
+	struct backup_prefetch *pf;
+	int dev;
+};
+
+struct backup_prefetch
+{
+	pthread_mutex_t lock;
+	pthread_cond_t queued;		/* A slot was queued, or shutting down */
+	pthread_cond_t done;		/* A slot was read */
+	int shutdown;
+
+	struct mfs_handle *mfs;
+	int ndevs;
+	void *devkeys[PREFETCH_MAXDEVS];
+	struct prefetch_worker workers[PREFETCH_MAXDEVS];
+	pthread_t threads[PREFETCH_MAXDEVS];
+	int nthreads;
+
+	struct prefetch_slot slots[PREFETCH_SLOTS];
+	unsigned int head;			/* Oldest slot, next to be used */
+	unsigned int used;			/* Slots in use from head on */
+
+	unsigned int planindex;		/* Next inode to plan slots for */
+	uint64_t planstart;			/* Next sector of its data */
+	uint64_t plansize;			/* Sectors of data it has */
+	int planloaded;				/* planindex is loaded, and plansize set */
+
+	mfs_inode *inodes[PREFETCH_INODES];	/* Inodes loaded ahead, by index */
+	unsigned int inodeindex[PREFETCH_INODES];
+	unsigned int lowindex;		/* Oldest inode still wanted */
+};
+
+/****************************************************************/
+/* Partitions on the same drive share a partition table, while */
+/* anything else is taken to be its own drive. */
+static void *
+backup_prefetch_devkey (tpFILE *file)
+{
+	if (file->tptype == pDIRECT || file->tptype == pDIRECTFILE)
+		return file->extra.direct.pt;
+	return file;
+}
+
+/***************************************/
+/* Find the worker for an MFS sector. */
+static int
+backup_prefetch_dev (struct backup_prefetch *pf, uint64_t sector)
+{
+	struct volume_info *vol = mfsvol_get_volume (pf->mfs->vols, sector);
+	void *key;
+	int loop;
+
+	if (!vol)
+		return 0;
+
+	key = backup_prefetch_devkey (vol->file);
+	for (loop = 0; loop < pf->ndevs; loop++)
+		if (pf->devkeys[loop] == key)
+			return loop;
+
+	return 0;
+}
+
+/**********************************************************************/
+/* Find where inode data starts on disk, and how much of it follows */
+/* contiguously.  Returns 0 if the data is past the last extent. */
+static uint64_t
+backup_prefetch_extent (struct backup_prefetch *pf, mfs_inode *inode, uint64_t start, uint64_t *sector)
+{
+	int loop;
+
+	for (loop = 0; loop < intswap32 (inode->numblocks); loop++)
+	{
+		uint64_t blkstart;
+		uint64_t blkcount;
+
+		if (mfs_is_64bit (pf->mfs))
+		{
+			blkstart = sectorswap64 (inode->datablocks.d64[loop].sector);
+			blkcount = intswap32 (inode->datablocks.d64[loop].count);
+		}
+		else
+		{
+			blkstart = intswap32 (inode->datablocks.d32[loop].sector);
+			blkcount = intswap32 (inode->datablocks.d32[loop].count);
+		}
+
+		if (start < blkcount)
+		{
+			*sector = blkstart + start;
+			return blkcount - start;
+		}
+		start -= blkcount;
+	}
+
+	return 0;
+}
+
+/****************************************/
+/* Worker thread - read slots for one drive */
+static void *
+backup_prefetch_worker (void *arg)
+{
+	struct prefetch_worker *worker = arg;
+	struct backup_prefetch *pf = worker->pf;
+
+	pthread_mutex_lock (&pf->lock);
+	for (;;)
+	{
+		struct prefetch_slot *slot = NULL;
+		unsigned int loop;
+		int nread;
+
+/* Oldest first, so the state machine waits as little as possible */
+		for (loop = 0; loop < pf->used; loop++)
+		{
+			struct prefetch_slot *cur = &pf->slots[(pf->head + loop) % PREFETCH_SLOTS];
+
+			if (cur->state == psQueued && cur->dev == worker->dev)
+			{
+				slot = cur;
+				break;
+			}
+		}
+
+		if (!slot)
+		{
+			if (pf->shutdown)
+				break;
+			pthread_cond_wait (&pf->queued, &pf->lock);
+			continue;
+		}
+
+		slot->state = psBusy;
+		pthread_mutex_unlock (&pf->lock);
+
+		nread = mfs_read_inode_data_part (pf->mfs, (mfs_inode *)slot->inode, slot->data, slot->start, slot->count);
+
+/* Same as reading directly, a short read is not an error, but at least */
+/* it does not leave stale data behind */
+		if (nread >= 0 && nread < slot->count * 512)
+			memset (slot->data + nread, 0, slot->count * 512 - nread);
+
+		pthread_mutex_lock (&pf->lock);
+		slot->error = nread < 0;
+		slot->state = psDone;
+		pthread_cond_broadcast (&pf->done);
+	}
+	pthread_mutex_unlock (&pf->lock);
+
+	return NULL;
+}
+
+/*******************************************************************/
+/* Queue reads until the slots are all in use, or the planning gets */
+/* too far ahead of the state machine. */
+static void
+backup_prefetch_plan (struct backup_info *info, struct backup_prefetch *pf)
+{
+	while (pf->used < PREFETCH_SLOTS && pf->planindex < info->ninodes && pf->planindex < pf->lowindex + PREFETCH_INODES)
+	{
+		unsigned int cache = pf->planindex % PREFETCH_INODES;
+		struct prefetch_slot *slot;
+		mfs_inode *inode;
+		uint64_t count, sector = 0;
+
+		if (!pf->inodes[cache] || pf->inodeindex[cache] != pf->planindex)
+		{
+			if (pf->inodes[cache])
+				free (pf->inodes[cache]);
+			pf->inodes[cache] = mfs_read_inode (info->mfs, info->inodes[pf->planindex]);
+			pf->inodeindex[cache] = pf->planindex;
+
+/* Leave it for the state machine to run into and report */
+			if (!pf->inodes[cache])
+				return;
+		}
+		inode = pf->inodes[cache];
+
+		if (!pf->planloaded)
+		{
+			pf->plansize = (backup_inode_datasize_v3 (info, inode) + 511) / 512;
+			pf->planloaded = 1;
+		}
+
+		if (pf->planstart >= pf->plansize)
+		{
+			pf->planindex++;
+			pf->planstart = 0;
+			pf->planloaded = 0;
+			continue;
+		}
+
+		count = backup_prefetch_extent (pf, inode, pf->planstart, &sector);
+		if (count == 0 || count > pf->plansize - pf->planstart)
+			count = pf->plansize - pf->planstart;
+		if (count > PREFETCH_SECTORS)
+			count = PREFETCH_SECTORS;
+
+		pthread_mutex_lock (&pf->lock);
+		slot = &pf->slots[(pf->head + pf->used) % PREFETCH_SLOTS];
+		slot->dev = sector? backup_prefetch_dev (pf, sector): 0;
+		slot->index = pf->planindex;
+		slot->start = pf->planstart;
+		slot->count = count;
+		slot->error = 0;
+		memcpy (slot->inode, inode, sizeof (slot->inode));
+		slot->state = psQueued;
+		pf->used++;
+		pthread_cond_broadcast (&pf->queued);
+		pthread_mutex_unlock (&pf->lock);
+
+		pf->planstart += count;
+	}
+}
+
+/******************************************************************/
+/* Drop everything planned, and plan again from the given place. */
+/* The lock must be held. */
+static void
+backup_prefetch_restart (struct backup_prefetch *pf, unsigned int index, uint64_t start)
+{
+	unsigned int loop;
+
+	for (;;)
+	{
+		int busy = 0;
+
+		for (loop = 0; loop < pf->used; loop++)
+			if (pf->slots[(pf->head + loop) % PREFETCH_SLOTS].state == psBusy)
+				busy = 1;
+		if (!busy)
+			break;
+		pthread_cond_wait (&pf->done, &pf->lock);
+	}
+
+	for (loop = 0; loop < PREFETCH_SLOTS; loop++)
+		pf->slots[loop].state = psFree;
+	pf->head = 0;
+	pf->used = 0;
+
+	pf->planindex = index;
+	pf->planstart = start;
+	pf->planloaded = 0;
+	pf->lowindex = index;
+}
+
+/*******************************************************************/
+/* Start the readers, one for each drive the MFS volumes are on. */
+/* With only one drive there is nothing to overlap, so the data is */
+/* read as it is needed, as before.  The same goes when reads seek the */
+/* descriptors the readers would share. */
+int
+backup_prefetch_init (struct backup_info *info)
+{
+	struct backup_prefetch *pf;
+	struct volume_info *vol;
+	int loop;
+
+	info->noprefetch = 1;
+
+	if (!tivo_partition_parallel_read ())
+		return 0;
+
+	pf = calloc (sizeof (*pf), 1);
+	if (!pf)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+	pf->mfs = info->mfs;
+
+	for (vol = info->mfs->vols->volumes; vol; vol = vol->next)
+	{
+		void *key = backup_prefetch_devkey (vol->file);
+
+		for (loop = 0; loop < pf->ndevs; loop++)
+			if (pf->devkeys[loop] == key)
+				break;
+		if (loop == pf->ndevs && pf->ndevs < PREFETCH_MAXDEVS)
+			pf->devkeys[pf->ndevs++] = key;
+	}
+
+	if (pf->ndevs < 2)
+	{
+		free (pf);
+		return 0;
+	}
+
+	for (loop = 0; loop < PREFETCH_SLOTS; loop++)
+	{
+		pf->slots[loop].data = malloc (PREFETCH_SECTORS * 512);
+		if (!pf->slots[loop].data)
+		{
+			while (loop-- > 0)
+				free (pf->slots[loop].data);
+			free (pf);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+	}
+
+	pthread_mutex_init (&pf->lock, NULL);
+	pthread_cond_init (&pf->queued, NULL);
+	pthread_cond_init (&pf->done, NULL);
+	info->prefetch = pf;
+
+	for (loop = 0; loop < pf->ndevs; loop++)
+	{
+		pf->workers[loop].pf = pf;
+		pf->workers[loop].dev = loop;
+		if (pthread_create (&pf->threads[loop], NULL, backup_prefetch_worker, &pf->workers[loop]) != 0)
+		{
+			backup_prefetch_free (info);
+			info->err_msg = "Unable to start reader threads";
+			return -1;
+		}
+		pf->nthreads++;
+	}
+
+	return 0;
+}
+
+/****************************************************************/
+/* Get an inode for the state machine, which must free it.  The */
+/* state machine asks for them in order, so this is a good time */
+/* to drop the ones it is done with. */
+mfs_inode *
+backup_prefetch_inode (struct backup_info *info, unsigned int index)
+{
+	struct backup_prefetch *pf = info->prefetch;
+	unsigned int cache = index % PREFETCH_INODES;
+	mfs_inode *inode;
+
+	if (!pf)
+		return mfs_read_inode (info->mfs, info->inodes[index]);
+
+	pf->lowindex = index;
+
+	if (!pf->inodes[cache] || pf->inodeindex[cache] != index)
+		return mfs_read_inode (info->mfs, info->inodes[index]);
+
+	inode = malloc (512);
+	if (!inode)
+	{
+		info->err_msg = "Memory exhausted";
+		return NULL;
+	}
+	memcpy (inode, pf->inodes[cache], 512);
+
+/* That may have made room for more */
+	backup_prefetch_plan (info, pf);
+
+	return inode;
+}
+
+/*****************************************************************/
+/* Get inode data for the state machine, from the slots if it */
+/* was read ahead.  Returns the number of bytes, or -1 on error. */
+int
+backup_prefetch_read (struct backup_info *info, unsigned int index, mfs_inode *inode, unsigned char *data, uint64_t start, unsigned int count)
+{
+	struct backup_prefetch *pf = info->prefetch;
+	int total = 0;
+
+	if (!pf)
+		return mfs_read_inode_data_part (info->mfs, inode, data, start, count);
+
+	while (count > 0)
+	{
+		struct prefetch_slot *slot;
+		unsigned int offset, tocopy;
+
+		pthread_mutex_lock (&pf->lock);
+		slot = &pf->slots[pf->head];
+
+		if (!pf->used || slot->index != index || start < slot->start || start >= slot->start + slot->count)
+		{
+			backup_prefetch_restart (pf, index, start);
+			pthread_mutex_unlock (&pf->lock);
+			backup_prefetch_plan (info, pf);
+			pthread_mutex_lock (&pf->lock);
+
+/* Nothing could be planned, so read it here */
+			if (!pf->used)
+			{
+				pthread_mutex_unlock (&pf->lock);
+				return mfs_read_inode_data_part (info->mfs, inode, data, start, count);
+			}
+			slot = &pf->slots[pf->head];
+		}
+
+		while (slot->state != psDone)
+			pthread_cond_wait (&pf->done, &pf->lock);
+
+		if (slot->error)
+		{
+			pthread_mutex_unlock (&pf->lock);
+			return -1;
+		}
+
+		offset = start - slot->start;
+		tocopy = slot->count - offset;
+		if (tocopy > count)
+			tocopy = count;
+		memcpy (data, slot->data + offset * 512, tocopy * 512);
+
+		if (offset + tocopy == slot->count)
+		{
+			slot->state = psFree;
+			pf->head = (pf->head + 1) % PREFETCH_SLOTS;
+			pf->used--;
+		}
+		pthread_mutex_unlock (&pf->lock);
+
+		backup_prefetch_plan (info, pf);
+
+		data += tocopy * 512;
+		start += tocopy;
+		count -= tocopy;
+		total += tocopy * 512;
+	}
+
+	return total;
+}
+
+/*****************************************/
+/* Stop the readers and free the slots. */
+void
+backup_prefetch_free (struct backup_info *info)
+{
+	struct backup_prefetch *pf = info->prefetch;
+	int loop;
+
+	if (!pf)
+		return;
+
+	pthread_mutex_lock (&pf->lock);
+	pf->shutdown = 1;
+	pthread_cond_broadcast (&pf->queued);
+	pthread_mutex_unlock (&pf->lock);
+
+	for (loop = 0; loop < pf->nthreads; loop++)
+		pthread_join (pf->threads[loop], NULL);
+
+	for (loop = 0; loop < PREFETCH_SLOTS; loop++)
+		free (pf->slots[loop].data);
+	for (loop = 0; loop < PREFETCH_INODES; loop++)
+		if (pf->inodes[loop])
+			free (pf->inodes[loop]);
+
+	pthread_cond_destroy (&pf->done);
+	pthread_cond_destroy (&pf->queued);
+	pthread_mutex_destroy (&pf->lock);
+	free (pf);
+	info->prefetch = 0;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+int
+backup_prefetch_init (struct backup_info *info)
+{
+	info->noprefetch = 1;
+	return 0;
+}
+
+mfs_inode *
+backup_prefetch_inode (struct backup_info *info, unsigned int index)
+{
+	return mfs_read_inode (info->mfs, info->inodes[index]);
+}
+
+int
+backup_prefetch_read (struct backup_info *info, unsigned int index, mfs_inode *inode, unsigned char *data, uint64_t start, unsigned int count)
+{
+	return mfs_read_inode_data_part (info->mfs, inode, data, start, count);
+}
+
+void
+backup_prefetch_free (struct backup_info *info)
+{
+}
+
+#endif
@@ -195,6 +195,12 @@ struct backup_info
 /* Compression */
 	struct z_stream_s *comp;
 	unsigned char *comp_buf;
+	struct backup_pcomp *pcomp;	/* Parallel compressor, when in use */
+	int nthreads;				/* Compression threads, 0 or 1 for none (restore: 0 for automatic) */
+	uint64_t readstall;			/* Microseconds the reader waited on compressors */
+	uint64_t compstall;			/* Microseconds each compressor waited on the reader */
+	void *codec;				/* zstd or LZ4 stream state, when in use */
+	struct backup_container *container;	/* Chunk and fsid index for BF_CHUNKED */
 
 	struct mfs_handle *mfs;
 
@@ -219,11 +225,45 @@ struct backup_info
 	unsigned int minalloc;
 
 	void *extrainfodata;
+
+	struct restore_base *base;	/* Base backup of an incremental restore */
+	struct restore_copy *copy;	/* Source drive streams are copied from by mfscopy */
+	struct restore_prealloc *prealloc;	/* Streams allocated ahead for BF_PHYSORDER */
+	unsigned int nprealloc;
+
+	unsigned char *holebuf;	/* Zero sectors fed to the state machine for holes */
+	unsigned int holeleft;	/* Sectors of the current hole still to restore */
+	int holeliteral;		/* Next sector is data, even if it looks like a hole */
+
+	struct backup_index_head *index;	/* Container index of the backup being restored */
+	struct restore_pdecomp *pdecomp;	/* Decompression threads, when in use */
 #else
 	unsigned int thresh;
 	unsigned int skipdb;
 	char *hda;
 	unsigned int shrink_to;
+
+	struct backup_manifest_entry *manifest;	/* Streams with data in this backup */
+	unsigned int nmanifest;
+	struct backup_manifest_entry *basemanifest;	/* Streams in the incremental base */
+	unsigned int nbasemanifest;
+	unsigned int *carried;	/* Sorted fsids left for the base to supply */
+	unsigned int ncarried;
+	uint64_t carriedsectors;	/* Stream sectors left for the base to supply */
+	int copydirect;			/* Leave all stream data for mfscopy to copy */
+
+	struct backup_prefetch *prefetch;	/* Inode data readers, when in use */
+	int noprefetch;			/* Read inode data as it is needed */
+
+	struct backup_checkpoint *checkpoint;	/* Latest checkpoint taken */
+	int checkpoint_ready;	/* The checkpoint has not been saved yet */
+	uint64_t checkpoint_next;	/* Sector to take the next checkpoint at */
+	uint64_t outbytes;		/* Bytes of uncompressed backup handed out */
+
+	unsigned char *holeout;	/* Backup with holes taken out, not yet handed back */
+	unsigned int holeoutsize;	/* Sectors holeout has room for */
+	unsigned int holeoutpos;	/* First sector of holeout not handed back */
+	unsigned int holeoutlen;	/* Sectors in holeout */
 #endif
 };
 
@@ -284,6 +324,208 @@ struct backup_head_v3
 #define TB3_MAGIC (('T' << 24) + ('B' << 16) + ('K' << 8) + ('3' << 0))
 #define TB3_ENDIAN (('T' << 0) + ('B' << 8) + ('K' << 16) + ('3' << 24))
 
+/* Seekable container index, written uncompressed after the last chunk of */
+/* a BF_CHUNKED backup.  The index is a backup_index_head, the chunk table, */
+/* the fsid table, and finally a backup_index_tail as the last bytes of the */
+/* file, so readers can find it from the end. */
+#define TBKI_MAGIC (('T' << 24) + ('B' << 16) + ('K' << 8) + ('I' << 0))
+#define TBKI_ENDIAN (('T' << 0) + ('B' << 8) + ('K' << 16) + ('I' << 24))
+
+/* Uncompressed size of each independently compressed chunk */
+#define BACKUP_CHUNKSECTORS 32768
+
+struct backup_index_head
+{
+	unsigned int magic;		/* TBKI */
+	unsigned int nchunks;	/* Number of chunk entries */
+	unsigned int nfsids;	/* Number of fsid entries */
+	unsigned int chunksectors;	/* Uncompressed sectors per chunk */
+};
+
+struct backup_index_chunk
+{
+	uint64_t offset;		/* Byte offset of the chunk in the backup file */
+	uint64_t firstsector;	/* First uncompressed sector in the chunk */
+	unsigned int size;		/* Compressed size in bytes */
+	unsigned int sectors;	/* Uncompressed size in sectors */
+	unsigned int crc;		/* crc32 of the compressed bytes */
+	unsigned int reserved;
+};
+
+struct backup_index_fsid
+{
+	unsigned int fsid;
+	unsigned int chunk;		/* Chunk holding the inode sector */
+	uint64_t firstsector;	/* Uncompressed sector of the inode */
+	uint64_t sectors;		/* Inode sector plus inode data */
+};
+
+struct backup_index_tail
+{
+	unsigned int magic;		/* TBKI */
+	unsigned int crc;		/* crc32 of the index before the tail */
+	uint64_t size;			/* Size of the index before the tail */
+};
+
+/* Manifest of the streams whose data is in a backup, used as the base for */
+/* a later incremental backup.  Entries are sorted by fsid. */
+#define TBKM_MAGIC (('T' << 24) + ('B' << 16) + ('K' << 8) + ('M' << 0))
+
+struct backup_manifest_head
+{
+	unsigned int magic;		/* TBKM */
+	unsigned int nentries;
+};
+
+struct backup_manifest_entry
+{
+	unsigned int fsid;
+	unsigned int size;
+	unsigned int lastmodified;
+	unsigned int exthash;	/* crc32 of the inode's extent list */
+	uint64_t datasize;		/* Bytes of stream data backed up */
+};
+
+/* Hole record.  In a BF_HOLES backup, a run of zero sectors after the */
+/* header is replaced by a single sector starting with this and otherwise */
+/* zero.  The check ties a record to its uncompressed sector number, so */
+/* data is unlikely to look like one; data that does follows a record */
+/* with a count of 0, and is taken as it is. */
+#define TBKH_MAGIC (('T' << 24) + ('B' << 16) + ('K' << 8) + ('H' << 0))
+#define BACKUP_HOLE_CHECK(count, sector) (TBKH_MAGIC ^ 0x5a3ca5c3 ^ ((count) * 0x9e3779b1) ^ (unsigned int)(sector) ^ (unsigned int)((uint64_t)(sector) >> 32))
+
+/* Shortest run of zero sectors worth a hole record */
+#define BACKUP_HOLE_MIN 2
+
+struct backup_hole
+{
+	unsigned int magic;		/* TBKH */
+	unsigned int count;		/* Zero sectors, or 0 if the next sector is data */
+	unsigned int check;		/* BACKUP_HOLE_CHECK (count, sector) */
+	unsigned int reserved;
+};
+
+/* Checkpoint of a backup in progress, so it can be resumed after an */
+/* interruption.  Checkpoints are only taken where the output can be cut */
+/* and picked up again: anywhere in an uncompressed backup, and between */
+/* chunks of a chunked one.  The container chunk and fsid tables up to */
+/* that point follow the checkpoint in the file. */
+#define TBKC_MAGIC (('T' << 24) + ('B' << 16) + ('K' << 8) + ('C' << 0))
+
+struct backup_checkpoint
+{
+	unsigned int magic;		/* TBKC */
+	unsigned int flags;		/* Backup flags, which must match on resume */
+	uint64_t nsectors;		/* Uncompressed backup size, which must match too */
+	unsigned int ninodes;
+	unsigned int inodecrc;	/* crc32 of the inode list */
+	uint64_t every;			/* Sectors between checkpoints */
+	uint64_t offset;		/* Bytes of output covered by the checkpoint */
+
+	int64_t cursector;
+	uint64_t state_val1;
+	uint64_t state_val2;
+	uint64_t shared_val1;
+	unsigned int state;
+	unsigned int crc;
+	unsigned int inodeloaded;	/* state_ptr1 held the inode at state_val1 */
+	unsigned int nchunks;	/* Container chunk entries that follow */
+	unsigned int nfsids;	/* Container fsid entries that follow */
+	unsigned int reserved;
+};
+
+/* Stream allocation for a BF_PHYSORDER backup.  The "fsidorder" extra */
+/* info entries list the streams by fsid, so restore can allocate them */
+/* in that order even though they are in the backup by disk location. */
+struct backup_fsidorder_entry
+{
+	unsigned int fsid;
+	unsigned int size;
+	unsigned int blocksize;
+};
+
+/* Base backup for restoring an incremental backup */
+struct restore_base
+{
+	int fd;
+	int flags;				/* Backup flags of the base */
+	unsigned char *index;	/* Container index of the base */
+	struct backup_index_head *head;
+	struct backup_index_chunk *chunks;
+	struct backup_index_fsid *fsids;
+
+	unsigned int *carried;	/* Sorted fsids the delta takes from the base */
+	unsigned int ncarried;
+
+	unsigned char *comp;	/* Compressed chunk read from the base */
+	unsigned int compsize;
+	unsigned char *chunk;	/* Decompressed chunk */
+	int curchunk;
+};
+
+/* Container state while a chunked backup is being written */
+struct backup_container
+{
+	struct backup_index_chunk *chunks;
+	unsigned int nchunks;
+	unsigned int chunkalloc;
+	struct backup_index_fsid *fsids;
+	unsigned int nfsids;
+	unsigned int fsidalloc;
+
+	struct backup_index_chunk cur;	/* Chunk being compressed */
+	uint64_t offset;		/* Bytes of backup written so far */
+	int finishing;			/* Flushing the current chunk */
+
+	unsigned char *index;	/* Index being written out */
+	unsigned int indexsize;
+	unsigned int indexpos;
+};
+
+/* Deduplicating backup store.  The uncompressed backup stream is cut into */
+/* content defined chunks, each kept once in the store directory as */
+/* <dir>/xx/<sha256>, and a recipe file lists the chunks of one backup. */
+#define TBKR_MAGIC (('T' << 24) + ('B' << 16) + ('K' << 8) + ('R' << 0))
+
+#define BACKUP_STORE_MINCHUNK	(16 * 1024)
+#define BACKUP_STORE_MAXCHUNK	(256 * 1024)
+#define BACKUP_STORE_CUTMASK	0xffff000000000000ULL	/* About 64KiB past the minimum */
+
+struct backup_recipe_head
+{
+	unsigned int magic;		/* TBKR */
+	unsigned int nchunks;
+	uint64_t size;			/* Total bytes of backup stream */
+};
+
+struct backup_recipe_entry
+{
+	unsigned char hash[32];	/* SHA-256 of the uncompressed chunk */
+	unsigned int size;		/* Uncompressed size of the chunk */
+};
+
+struct backup_store
+{
+	char *dir;
+	int recipefd;
+	char *recipe;			/* Recipe name, and the name it is written under */
+	char *recipetmp;
+	unsigned char dirty[32];	/* Bitmap of subdirectories given new chunks */
+	int level;				/* zlib level for new chunks */
+	struct backup_recipe_head head;
+
+	unsigned char *buf;		/* Chunk being cut or reassembled */
+	unsigned int bufused;
+	unsigned int bufpos;
+	uint64_t hash;			/* Rolling gear hash */
+
+	unsigned char *comp;	/* Chunk as stored */
+	unsigned int compsize;
+
+	unsigned int newchunks;	/* Chunks new to the store, or read on restore */
+	uint64_t newbytes;
+};
+
 // Backup Flags (No longer shared with Restore Flags, so all 32-bits are available for use)
 #define BF_COMPRESSED	0x00000001	/* Backup is compressed. */
 //#define BF_MFSONLY	0x00000002	/* Backup is MFS only. - Usurped for mfs endianness because BF_MFSONLY was not implemented*/
@@ -301,6 +543,17 @@ struct backup_head_v3
 #define BF_COMPLVL(f)	(((f) >> 12) & 0xf)                   /* Bits 13 thru 16 */
 #define BF_SETCOMP(l)	((((l) & 0xf) << 12) | BF_COMPRESSED) /* Bits 13 thru 16 */
 #define BF_PARTLSB 0x00010000 /* (EXTENDED FLAG) The TiVo Partition is also LSB on the Roamio */
+#define BF_CODEC(f)	(((f) >> 17) & 0x3)	/* (EXTENDED FLAG) Compression codec, bits 18 and 19 */
+#define BF_SETCODEC(c)	(((c) & 0x3) << 17)
+#define BF_CHUNKED	0x00080000	/* (EXTENDED FLAG) Compressed in independent chunks with a trailing index */
+#define BF_INCREMENTAL	0x00100000	/* (EXTENDED FLAG) Streams listed in "basefsids" extra info are in the base backup */
+#define BF_PHYSORDER	0x00200000	/* (EXTENDED FLAG) Streams in disk order, listed by fsid in "fsidorder" extra info */
+#define BF_HOLES	0x00400000	/* (EXTENDED FLAG) Runs of zero sectors are replaced with hole records */
+
+/* Compression codecs */
+#define BC_ZLIB		0
+#define BC_ZSTD		1
+#define BC_LZ4		2
 
 // Restore Flags (No longer shared with Backup Flags, so all 32-bits are available for use)
 #define RF_INITIALIZED	0x00010000	/* Restore initialized. */
@@ -318,10 +571,37 @@ int is_resource(unsigned int fsid);
 int backup_set_resource_check(struct backup_info *info);
 void backup_set_thresh (struct backup_info *info, unsigned int thresh);
 void backup_set_skipdb (struct backup_info *info, unsigned int skipdb);
+void backup_set_threads (struct backup_info *info, int nthreads);
+int backup_set_base_manifest (struct backup_info *info, char *filename);
+int backup_write_manifest (struct backup_info *info, char *filename);
+void backup_set_copy_direct (struct backup_info *info);
+int backup_set_checkpoint (struct backup_info *info, uint64_t every);
+int backup_write_checkpoint (struct backup_info *info, char *filename);
+int backup_resume (struct backup_info *info, char *filename, uint64_t *offset);
 void backup_check_truncated_volume (struct backup_info *info);
 
 int backup_start (struct backup_info *info);
 int backup_read (struct backup_info *info, unsigned char *buf, unsigned int size);
+unsigned int backup_next_sectors (struct backup_info *info, unsigned char *buf, int sectors);
+int backup_pcomp_init (struct backup_info *info, int level);
+int backup_pcomp_read (struct backup_info *info, unsigned char *buf, unsigned int size);
+void backup_pcomp_free (struct backup_info *info);
+int backup_prefetch_init (struct backup_info *info);
+mfs_inode *backup_prefetch_inode (struct backup_info *info, unsigned int index);
+int backup_prefetch_read (struct backup_info *info, unsigned int index, mfs_inode *inode, unsigned char *data, uint64_t start, unsigned int count);
+void backup_prefetch_free (struct backup_info *info);
+uint64_t backup_inode_datasize_v3 (struct backup_info *info, mfs_inode *inode);
+int backup_codec_available (int codec);
+int backup_codec_init (struct backup_info *info, int codec, int level);
+int backup_codec_step (struct backup_info *info, int flush);
+int backup_codec_reset (struct backup_info *info);
+int backup_codec_end (struct backup_info *info);
+int backup_container_index (struct backup_info *info);
+void backup_container_free (struct backup_info *info);
+struct backup_store *backup_store_open (struct backup_info *info, char *dir, char *recipe, int level);
+int backup_store_write (struct backup_info *info, struct backup_store *store, unsigned char *buf, unsigned int size);
+int backup_store_finish (struct backup_info *info, struct backup_store *store);
+void backup_store_close (struct backup_store *store);
 int backup_finish (struct backup_info *info);
 void backup_perror (struct backup_info *info, char *str);
 int backup_strerror (struct backup_info *info, char *str);
@@ -329,6 +609,7 @@ int backup_has_error (struct backup_info *info);
 void backup_clearerror (struct backup_info *info);
 int add_partitions_to_backup_info (struct backup_info *info, char *device);
 int add_mfs_partitions_to_backup_info (struct backup_info *info);
+void backup_info_add_extra (struct backup_info *info, char *type, void *data, int datalength);
 
 struct backup_info *init_restore (unsigned int flags);
 void restore_set_varsize (struct backup_info *info, int size);
@@ -341,6 +622,33 @@ void restore_set_maxmedia (struct backup_info *info, int64_t maxmedia);
 void restore_set_bswap (struct backup_info *info, int bswap);
 
 unsigned int restore_write (struct backup_info *info, unsigned char *buf, unsigned int size);
+int restore_next_records (struct backup_info *info, unsigned char *buf, int sectors);
+int restore_codec_init (struct backup_info *info, int codec);
+int restore_codec_step (struct backup_info *info);
+void restore_codec_end (struct backup_info *info);
+int restore_codec_chunk (int codec, unsigned char *in, unsigned int insize, unsigned char *out, unsigned int outsize);
+void restore_set_threads (struct backup_info *info, int nthreads);
+int restore_set_index (struct backup_info *info, int fd);
+void *restore_load_index (struct backup_info *info, int fd);
+int restore_pdecomp_init (struct backup_info *info);
+int restore_pdecomp_write (struct backup_info *info, unsigned char *buf, unsigned int size);
+int restore_pdecomp_finish (struct backup_info *info);
+void restore_pdecomp_free (struct backup_info *info);
+int restore_set_base (struct backup_info *info, char *filename);
+void restore_base_free (struct backup_info *info);
+struct restore_base *restore_base_open (struct backup_info *info, char *filename);
+void restore_base_close (struct restore_base *base);
+struct backup_index_fsid *restore_base_find (struct restore_base *base, unsigned int fsid);
+int restore_base_load_chunk (struct backup_info *info, struct restore_base *base, unsigned int chunk);
+int restore_extract (struct backup_info *info, struct restore_base *backup, char *what, char *dir);
+int restore_base_inode_data (struct backup_info *info, mfs_inode *inode, uint64_t datasize);
+int restore_set_copy_source (struct backup_info *info, struct mfs_handle *mfs);
+uint64_t restore_copy_sectors (struct backup_info *info);
+int restore_copy_inode_data (struct backup_info *info, mfs_inode *inode, uint64_t datasize);
+void restore_copy_free (struct backup_info *info);
+struct backup_store *restore_store_open (struct backup_info *info, char *dir, char *recipe);
+int restore_store_read (struct backup_info *info, struct backup_store *store, unsigned char *buf, unsigned int size);
+void restore_store_close (struct backup_store *store);
 int restore_trydev (struct backup_info *info, char *dev1, char *dev2, int64_t carveA, int64_t carveB);
 int restore_start (struct backup_info *info);
 int restore_finish(struct backup_info *info);
@@ -0,0 +1,20 @@
+#ifndef JSONL_H
+#define JSONL_H
+
+#include <stdio.h>
+#include <inttypes.h>
+
+/* JSON Lines output.  Each record is one object on one line, written out */
+/* field by field as it is built, so nothing is held in memory.  Every */
+/* record starts with its "type" field. */
+void jsonl_begin (FILE *fp, const char *type);
+void jsonl_string (FILE *fp, const char *key, const char *val);
+void jsonl_int (FILE *fp, const char *key, int64_t val);
+void jsonl_uint (FILE *fp, const char *key, uint64_t val);
+void jsonl_bool (FILE *fp, const char *key, int val);
+void jsonl_end (FILE *fp);
+
+/* Quote a string into a buffer, with the same return as snprintf */
+int jsonl_quote (char *buf, size_t size, const char *val);
+
+#endif /*JSONL_H */
@@ -105,14 +105,43 @@ typedef enum log_trans_types_e
 }
 log_trans_types;
 
-struct log_entry_list
+/* A single decoded log entry.  Only as much of entry as the log entry */
+/* length calls for is actually stored. */
+struct log_entry_rec
 {
-	struct log_entry_list *next;
 	unsigned int logstamp;
+	unsigned int recsize;		/* Bytes used in the arena, including padding */
 	log_entry_all entry;
 };
 
+/* Decoded log entries, in log order.  The records and the pointer array */
+/* are all carved out of a single arena allocation, so freeing the arena */
+/* frees the whole list. */
+struct log_entry_list
+{
+	struct log_entry_rec **entries;
+	unsigned int nentries;
+	unsigned char *arena;
+	size_t arenasize;
+	size_t arenaused;
+};
+
+/* The whole transaction log area, read and CRC checked in one pass. */
+/* Slot n holds the logstamp congruent to n modulo nsectors.  Cached on */
+/* the mfs handle and kept current by mfs_log_write. */
+struct log_index
+{
+	unsigned char *data;		/* nsectors * 512 bytes of log */
+	unsigned char *valid;		/* Non-zero for slots with a good CRC and stamp */
+	unsigned int nsectors;
+	unsigned int oldest;		/* Oldest logstamp still readable */
+	unsigned int newest;		/* Newest logstamp written */
+	int empty;					/* No readable log sectors at all */
+};
+
 unsigned int mfs_log_last_sync (struct mfs_handle *mfshnd);
+struct log_index *mfs_log_index (struct mfs_handle *mfshnd);
+void mfs_log_index_free (struct mfs_handle *mfshnd);
 int mfs_log_read (struct mfs_handle *mfshnd, void *buf, unsigned int logstamp);
 int mfs_log_write (struct mfs_handle *mfshnd, void *buf);
 
@@ -121,6 +150,9 @@ int mfs_log_inode_update (struct mfs_handle *mfshnd, mfs_inode *inode);
 int mfs_log_commit (struct mfs_handle *mfshnd);
 int mfs_log_fssync (struct mfs_handle *mfshnd);
 
+int mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int end, struct log_entry_list *list);
+void mfs_log_free_list (struct log_entry_list *list);
+
 uint64_t mfs_log_stamp_to_sector (struct mfs_handle *mfshnd, unsigned int logstamp);
 
 
@@ -147,8 +147,26 @@ int tivo_partition_table_write (const char *device);
 uint64_t tivo_partition_largest_free (const char *device);
 
 /* From readwrite.c */
+int tivo_partition_parallel_read (void);
 int tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count);
 int tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count);
+int tivo_partition_copy (tpFILE * from, uint64_t fromsector, tpFILE * to, uint64_t tosector, int count);
+int tivo_partition_copy_out (tpFILE * from, uint64_t fromsector, int count, int fd);
+int tivo_partition_writebehind (size_t size);
+int tivo_partition_flush ();
+int tivo_partition_flush_table (struct tivo_partition_table *pt);
+
+/* Writes from the zero buffer are known to be zeros, and need not be */
+/* written out in full */
+enum tivo_zero_mode
+{
+	tzWrite = 0,	/* Write the zeros like any other data */
+	tzDiscard,		/* Punch a hole in files, or zero out devices */
+	tzSkip			/* The target is already zeroed */
+};
+extern unsigned char *tivo_partition_zeros;
+extern unsigned int tivo_partition_nzeros;
+extern enum tivo_zero_mode tivo_partition_zeromode;
 int tivo_partition_rename (const char *device, int partition, const char *name);
 
 /* Some quick routines, mainly intended for internal macpart use. */
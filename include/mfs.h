@@ -136,6 +136,7 @@ struct mfs_handle
 	struct zone_map_head zones[ztMax];
 	struct zone_map *loaded_zones;
 	struct log_hdr_s *current_log;
+	struct log_index *log_index;
 
 	int inode_log_type;
 	int is_64;
@@ -173,6 +174,8 @@ void mfs_clearerror (struct mfs_handle *mfshnd);
 
 #define mfs_read_data(mfshnd,buf,sector,count) mfsvol_read_data ((mfshnd)->vols, buf, sector, count)
 #define mfs_write_data(mfshnd,buf,sector,count) mfsvol_write_data ((mfshnd)->vols, buf, sector, count)
+#define mfs_copy_data(from,fromsector,to,tosector,count) mfsvol_copy_data ((from)->vols, fromsector, (to)->vols, tosector, count)
+#define mfs_copy_out(mfshnd,sector,count,fd) mfsvol_copy_out ((mfshnd)->vols, sector, count, fd)
 #define mfs_volume_size(mfshnd,sector) mfsvol_volume_size ((mfshnd)->vols, sector)
 #define mfs_volume_set_size(mfshnd) mfsvol_volume_set_size ((mfshnd)->vols)
 #define mfs_enable_memwrite(mfshnd) mfsvol_enable_memwrite ((mfshnd)->vols)
@@ -140,6 +140,7 @@ unsigned int compute_crc (unsigned char *data, unsigned int size, unsigned int c
 unsigned int mfs_compute_crc (unsigned char *data, unsigned int size, unsigned int off);
 unsigned int mfs_check_crc (unsigned char *data, unsigned int size, unsigned int off);
 void mfs_update_crc (unsigned char *data, unsigned int size, unsigned int off);
+void compute_sha256 (const unsigned char *data, unsigned int size, unsigned char *digest);
 
 #define MFS_check_crc(data, size, crc) (mfs_check_crc ((unsigned char *)(data), (size), (unsigned int *)&(crc) - (unsigned int *)(data)))
 #define MFS_update_crc(data, size, crc) (mfs_update_crc ((unsigned char *)(data), (size), (unsigned int *)&(crc) - (unsigned int *)(data)))
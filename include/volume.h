@@ -60,6 +60,8 @@ uint64_t mfsvol_volume_size (struct volume_handle *hnd, uint64_t sector);
 uint64_t mfsvol_volume_set_size (struct volume_handle *hnd);
 int mfsvol_read_data (struct volume_handle *hnd, void *buf, uint64_t sector, uint32_t count);
 int mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, uint32_t count);
+int mfsvol_copy_data (struct volume_handle *from, uint64_t fromsector, struct volume_handle *to, uint64_t tosector, uint32_t count);
+int mfsvol_copy_out (struct volume_handle *hnd, uint64_t sector, uint32_t count, int fd);
 void mfsvol_enable_memwrite (struct volume_handle *hnd);
 void mfsvol_discard_memwrite (struct volume_handle *hnd);
 void mfsvol_cleanup (struct volume_handle *hnd);
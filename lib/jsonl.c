@@ -0,0 +1,120 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "jsonl.h"
+
+/* Escape one character of a string, returning the length written to out */
+static int
+jsonl_escape (unsigned char c, char *out)
+{
+	switch (c)
+	{
+	case '"':
+	case '\\':
+		out[0] = '\\';
+		out[1] = c;
+		return 2;
+	case '\n':
+		memcpy (out, "\\n", 2);
+		return 2;
+	case '\r':
+		memcpy (out, "\\r", 2);
+		return 2;
+	case '\t':
+		memcpy (out, "\\t", 2);
+		return 2;
+	}
+
+	/* Other control characters have no short form.  TiVo strings are not */
+	/* guaranteed to be UTF-8, so high bytes are written as Latin-1 code */
+	/* points to keep the output valid. */
+	if (c < 0x20 || c >= 0x7f)
+		return sprintf (out, "\\u%04x", c);
+
+	out[0] = c;
+	return 1;
+}
+
+static void
+jsonl_key (FILE *fp, const char *key)
+{
+	fprintf (fp, ",\"%s\":", key);
+}
+
+void
+jsonl_begin (FILE *fp, const char *type)
+{
+	fprintf (fp, "{\"type\":\"%s\"", type);
+}
+
+void
+jsonl_string (FILE *fp, const char *key, const char *val)
+{
+	char esc[8];
+
+	jsonl_key (fp, key);
+	putc ('"', fp);
+	while (*val)
+		fwrite (esc, 1, jsonl_escape (*val++, esc), fp);
+	putc ('"', fp);
+}
+
+void
+jsonl_int (FILE *fp, const char *key, int64_t val)
+{
+	jsonl_key (fp, key);
+	fprintf (fp, "%" PRId64, val);
+}
+
+void
+jsonl_uint (FILE *fp, const char *key, uint64_t val)
+{
+	jsonl_key (fp, key);
+	fprintf (fp, "%" PRIu64, val);
+}
+
+void
+jsonl_bool (FILE *fp, const char *key, int val)
+{
+	jsonl_key (fp, key);
+	fputs (val? "true": "false", fp);
+}
+
+void
+jsonl_end (FILE *fp)
+{
+	fputs ("}\n", fp);
+}
+
+int
+jsonl_quote (char *buf, size_t size, const char *val)
+{
+	char esc[8];
+	size_t len = 0;
+
+	if (size)
+		buf[len] = '"';
+	len++;
+
+	while (*val)
+	{
+		int count = jsonl_escape (*val++, esc);
+
+		if (len + count < size)
+			memcpy (buf + len, esc, count);
+		len += count;
+	}
+
+	if (len < size)
+		buf[len] = '"';
+	len++;
+
+	if (size)
+		buf[len < size? len: size - 1] = 0;
+
+	return len;
+}
@@ -63,11 +63,185 @@ mfs_log_stamp_to_sector (struct mfs_handle *mfshnd, unsigned int logstamp)
 	}
 }
 
+/************************************************************************/
+/* Free the cached log index, if any. */
+void
+mfs_log_index_free (struct mfs_handle *mfshnd)
+{
+	if (mfshnd->log_index)
+	{
+		free (mfshnd->log_index->data);
+		free (mfshnd->log_index->valid);
+		free (mfshnd->log_index);
+		mfshnd->log_index = NULL;
+	}
+}
+
+/* Is the slot distance slots after (or before) the anchor slot holding */
+/* the logstamp the same distance from the anchor logstamp? */
+static int
+mfs_log_index_in_sequence (struct log_index *idx, unsigned int anchor, unsigned int distance, int forward)
+{
+	unsigned int slot;
+	log_hdr *hdr;
+
+	if (forward)
+		slot = (anchor + distance) % idx->nsectors;
+	else
+		slot = (anchor + idx->nsectors - distance) % idx->nsectors;
+
+	if (!idx->valid[slot])
+		return 0;
+
+	hdr = (log_hdr *)(idx->data + slot * 512);
+	if (forward)
+		return intswap32 (hdr->logstamp) == intswap32 (((log_hdr *)(idx->data + anchor * 512))->logstamp) + distance;
+	return intswap32 (hdr->logstamp) == intswap32 (((log_hdr *)(idx->data + anchor * 512))->logstamp) - distance;
+}
+
+/* Binary search for the last slot still in sequence with the anchor. */
+/* Past the newest entry the slots hold the previous lap around the log */
+/* so the sequence test is true up to some distance and false after. */
+/* A corrupt or torn sector breaks that, so the slots either side of the */
+/* answer are checked, and if they do not fit the log is walked one */
+/* slot at a time instead. */
+static unsigned int
+mfs_log_index_search (struct log_index *idx, unsigned int anchor, int forward)
+{
+	unsigned int lo = 0;
+	unsigned int hi = idx->nsectors - 1;
+
+	while (lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo + 1) / 2;
+
+		if (mfs_log_index_in_sequence (idx, anchor, mid, forward))
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	if ((lo < 2 || mfs_log_index_in_sequence (idx, anchor, lo - 1, forward)) &&
+		(lo + 1 >= idx->nsectors || !mfs_log_index_in_sequence (idx, anchor, lo + 1, forward)))
+		return lo;
+
+	for (lo = 0; lo + 1 < idx->nsectors && mfs_log_index_in_sequence (idx, anchor, lo + 1, forward); lo++)
+		;
+
+	return lo;
+}
+
+/************************************************************************/
+/* Read the entire log area in one go, validate every sector and locate */
+/* the oldest and newest logstamps.  The result is cached on the handle. */
+struct log_index *
+mfs_log_index (struct mfs_handle *mfshnd)
+{
+	struct log_index *idx;
+	unsigned int lastsync = mfs_log_last_sync (mfshnd);
+	unsigned int anchor;
+	unsigned int slot;
+	unsigned int found = 0;
+
+	if (mfshnd->log_index)
+		return mfshnd->log_index;
+
+	idx = calloc (sizeof (*idx), 1);
+	if (!idx)
+	{
+		mfshnd->err_msg = "Out of memory loading transaction log";
+		return NULL;
+	}
+
+	idx->nsectors = mfs_log_nentries (mfshnd);
+	idx->data = malloc (idx->nsectors * 512);
+	idx->valid = calloc (idx->nsectors, 1);
+	if (!idx->nsectors || !idx->data || !idx->valid)
+	{
+		mfshnd->err_msg = "Out of memory loading transaction log";
+		free (idx->data);
+		free (idx->valid);
+		free (idx);
+		return NULL;
+	}
+
+	if (mfsvol_read_data (mfshnd->vols, idx->data, mfs_log_stamp_to_sector (mfshnd, 0), idx->nsectors) != idx->nsectors * 512)
+	{
+		mfshnd->err_msg = "Error reading transaction log";
+		free (idx->data);
+		free (idx->valid);
+		free (idx);
+		return NULL;
+	}
+
+	/* Validate every sector up front */
+	for (slot = 0; slot < idx->nsectors; slot++)
+	{
+		log_hdr *hdr = (log_hdr *)(idx->data + slot * 512);
+
+		if (intswap32 (hdr->logstamp) % idx->nsectors == slot && MFS_check_crc (hdr, 512, hdr->crc))
+		{
+			idx->valid[slot] = 1;
+			found++;
+		}
+	}
+
+	if (!found)
+	{
+		idx->empty = 1;
+		idx->oldest = lastsync;
+		idx->newest = lastsync;
+		mfshnd->log_index = idx;
+		return idx;
+	}
+
+	/* Search outward from the last sync if it is still in the log, */
+	/* otherwise from the first readable sector */
+	anchor = lastsync % idx->nsectors;
+	if (!idx->valid[anchor] || intswap32 (((log_hdr *)(idx->data + anchor * 512))->logstamp) != lastsync)
+	{
+		for (anchor = 0; !idx->valid[anchor]; anchor++)
+			;
+	}
+
+	idx->newest = intswap32 (((log_hdr *)(idx->data + anchor * 512))->logstamp) + mfs_log_index_search (idx, anchor, 1);
+	idx->oldest = intswap32 (((log_hdr *)(idx->data + anchor * 512))->logstamp) - mfs_log_index_search (idx, anchor, 0);
+	if (idx->newest - idx->oldest >= idx->nsectors)
+	{
+		idx->oldest = idx->newest - idx->nsectors + 1;
+	}
+
+	mfshnd->log_index = idx;
+	return idx;
+}
+
 int
 mfs_log_read (struct mfs_handle *mfshnd, void *buf, unsigned int logstamp)
 {
 	log_hdr *tmp = buf;
 
+	if (mfshnd->log_index)
+	{
+		/* Served from the cached copy, already CRC checked */
+		unsigned int slot = logstamp % mfshnd->log_index->nsectors;
+
+		memcpy (buf, mfshnd->log_index->data + slot * 512, 512);
+
+		if (logstamp != intswap32 (tmp->logstamp))
+		{
+			return 0;
+		}
+
+		if (!mfshnd->log_index->valid[slot])
+		{
+			mfshnd->err_msg = "MFS transaction logstamp %ud has invalid checksum";
+			mfshnd->err_arg1 = logstamp;
+			return 0;
+		}
+
+		return 512;
+	}
+
 	if (mfsvol_read_data (mfshnd->vols, buf, mfs_log_stamp_to_sector (mfshnd, logstamp), 1) != 512)
 	{
 		return -1;
@@ -101,6 +275,29 @@ mfs_log_write (struct mfs_handle *mfshnd, void *buf)
 		return -1;
 	}
 
+	/* Keep the cached log in step */
+	if (mfshnd->log_index)
+	{
+		struct log_index *idx = mfshnd->log_index;
+		unsigned int slot = logstamp % idx->nsectors;
+
+		memcpy (idx->data + slot * 512, buf, 512);
+		idx->valid[slot] = 1;
+		if (idx->empty || (int)(logstamp - idx->newest) > 0)
+		{
+			idx->newest = logstamp;
+		}
+		if (idx->empty)
+		{
+			idx->oldest = logstamp;
+			idx->empty = 0;
+		}
+		else if (idx->newest - idx->oldest >= idx->nsectors)
+		{
+			idx->oldest = idx->newest - idx->nsectors + 1;
+		}
+	}
+
 	return 512;
 }
 
@@ -472,14 +669,17 @@ mfs_log_sync_inode (struct mfs_handle *mfshnd, log_inode_update *entry)
 /************************************************************************/
 /* Take a list of transactions and commit them */
 static int
-mfs_log_commit_list (struct mfs_handle *mfshnd, struct log_entry_list *list, unsigned int logstamp)
+mfs_log_commit_list (struct mfs_handle *mfshnd, struct log_entry_rec **entries, unsigned int nentries, unsigned int logstamp)
 {
-	struct log_entry_list *cur;
-	struct log_entry_list *last = NULL;
+	struct log_entry_rec *cur;
+	struct log_entry_rec *last = NULL;
+	unsigned int loop;
 
 	/* Commit each log entry in turn */
-	for (cur = list; cur; cur = cur->next)
+	for (loop = 0; loop < nentries; loop++)
 	{
+		cur = entries[loop];
+
 		switch (intswap32 (cur->entry.log.transtype))
 		{
 			case ltUnknownType6:
@@ -546,11 +746,15 @@ mfs_log_commit_list (struct mfs_handle *mfshnd, struct log_entry_list *list, uns
 static int
 mfs_log_fssync_list (struct mfs_handle *mfshnd, struct log_entry_list *list)
 {
-	struct log_entry_list *cur;
+	struct log_entry_rec *cur;
+	unsigned int loop;
+	unsigned int first;
 
 	/* Scan the list to make sure every entry is valid and understood */
-	for (cur = list; cur; cur = cur->next)
+	for (loop = 0; loop < list->nentries; loop++)
 	{
+		cur = list->entries[loop];
+
 		if (cur->entry.log.length < sizeof (log_entry) + 2)
 		{
 			if (mfsLSB == 1)
@@ -592,17 +796,16 @@ mfs_log_fssync_list (struct mfs_handle *mfshnd, struct log_entry_list *list)
 		}
 	}
 
-	for (cur = list; cur; cur = cur->next)
+	/* Commit each run of entries ending in a commit entry */
+	first = 0;
+	for (loop = 0; loop < list->nentries; loop++)
 	{
+		cur = list->entries[loop];
+
 		if (cur->entry.log.transtype == intswap32 (ltCommit))
 		{
-			int ret;
-			struct log_entry_list *next = cur->next;
-			cur->next = NULL;
-
-			ret = mfs_log_commit_list (mfshnd, list, cur->logstamp);
-			cur->next = next;
-			list = next;
+			int ret = mfs_log_commit_list (mfshnd, list->entries + first, loop + 1 - first, cur->logstamp);
+			first = loop + 1;
 
 			if (ret <= 0)
 			{
@@ -614,18 +817,111 @@ mfs_log_fssync_list (struct mfs_handle *mfshnd, struct log_entry_list *list)
 	return 1;
 }
 
+/************************************************************************/
+/* Free a list loaded by mfs_log_load_list. */
+void
+mfs_log_free_list (struct log_entry_list *list)
+{
+	if (list->arena)
+	{
+		free (list->arena);
+	}
+
+	memset (list, 0, sizeof (*list));
+}
+
+/************************************************************************/
+/* Carve space for a new log entry of size bytes out of the list arena. */
+/* The record is appended after the last one, so the arena can be walked */
+/* by recsize later to build the entry index. */
+static struct log_entry_rec *
+mfs_log_list_alloc (struct mfs_handle *mfshnd, struct log_entry_list *list, unsigned int size, unsigned int logstamp)
+{
+	struct log_entry_rec *rec;
+	size_t recsize = (offsetof (struct log_entry_rec, entry) + size + 7) & ~(size_t)7;
+
+	if (list->arenaused + recsize > list->arenasize)
+	{
+		size_t newsize = list->arenasize? list->arenasize * 2: 65536;
+		unsigned char *newarena;
+
+		while (newsize < list->arenaused + recsize)
+		{
+			newsize *= 2;
+		}
+
+		newarena = realloc (list->arena, newsize);
+		if (!newarena)
+		{
+			mfshnd->err_msg = "Out of memory loading transaction log";
+			return NULL;
+		}
+
+		list->arena = newarena;
+		list->arenasize = newsize;
+	}
+
+	rec = (struct log_entry_rec *)(list->arena + list->arenaused);
+	memset (rec, 0, recsize);
+	rec->logstamp = logstamp;
+	rec->recsize = recsize;
+	list->arenaused += recsize;
+
+	return rec;
+}
+
+/************************************************************************/
+/* Build the entry pointer array at the end of the arena.  Done once all */
+/* entries are loaded, since growing the arena may move it. */
+static int
+mfs_log_list_index (struct mfs_handle *mfshnd, struct log_entry_list *list)
+{
+	size_t indexsize = list->nentries * sizeof (*list->entries);
+	size_t offset;
+	unsigned int loop;
+
+	if (!list->nentries)
+	{
+		mfs_log_free_list (list);
+		return 1;
+	}
+
+	if (list->arenaused + indexsize > list->arenasize)
+	{
+		unsigned char *newarena = realloc (list->arena, list->arenaused + indexsize);
+		if (!newarena)
+		{
+			mfshnd->err_msg = "Out of memory loading transaction log";
+			mfs_log_free_list (list);
+			return 0;
+		}
+
+		list->arena = newarena;
+		list->arenasize = list->arenaused + indexsize;
+	}
+
+	list->entries = (struct log_entry_rec **)(list->arena + list->arenaused);
+
+	for (offset = 0, loop = 0; loop < list->nentries; loop++)
+	{
+		list->entries[loop] = (struct log_entry_rec *)(list->arena + offset);
+		offset += list->entries[loop]->recsize;
+	}
+
+	return 1;
+}
+
 /************************************************************************/
 /* Load a list of transactions. */
 /* If the start is passed in as ~0, it is assumed to be the last successful sync */
 /* If the end is passed as ~0, it is assumed to be the last log written */
 int
-mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int end, struct log_entry_list **list)
+mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int end, struct log_entry_list *list)
 {
-	struct log_entry_list *cur, **tail, **synctail;
+	struct log_entry_rec *cur;
 	unsigned char buf[512];
 	log_hdr *curlog = (log_hdr *)buf;
 	unsigned int partremaining, partread;
-	unsigned int lastsynclog = ~0;
 
 	if (!~start)
 	{
@@ -635,9 +931,7 @@ mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int e
 	/* No need to update end, ~0 is bigger than anything else, and it stops */
 	/* on a non read anyway */
 	
-	*list = NULL;
-	synctail = list;
-	tail = list;
+	memset (list, 0, sizeof (*list));
 
 	cur = NULL;
 	partremaining = 0;
@@ -653,17 +947,12 @@ mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int e
 			/* If it started with a partial, read it that way */
 			if (curlog->first)
 			{
-				if (*list)
+				if (list->nentries)
 				{
 					/* Not the first entry and we missed something - that's bad */
 					mfshnd->err_msg = "Error reading from log entry %d";
 					mfshnd->err_arg1 = (size_t)start;
-					while (*list)
-					{
-						cur = *list;
-						*list = (*list)->next;
-						free (cur);
-					}
+					mfs_log_free_list (list);
 					return 0;
 				}
 
@@ -680,8 +969,12 @@ mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int e
 			if (partremaining > 2)
 			{
 				/* Only allocate if there is going to be actual data */
-				cur = calloc (partremaining + offsetof (struct log_entry_list, entry), 1);
-				cur->logstamp = start;
+				cur = mfs_log_list_alloc (mfshnd, list, partremaining, start);
+				if (!cur)
+				{
+					mfs_log_free_list (list);
+					return 0;
+				}
 			}
 		}
 		else if (partremaining < intswap32 (curlog->first) || curlog->first == 0)
@@ -689,12 +982,7 @@ mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int e
 			/* Existing entry that doesn't look like it's properly continued */
 			mfshnd->err_msg = "Error reading from log entry %d";
 			mfshnd->err_arg1 = (size_t)start;
-			while (*list)
-			{
-				cur = *list;
-				*list = (*list)->next;
-				free (cur);
-			}
+			mfs_log_free_list (list);
 			return 0;
 		}
 
@@ -725,15 +1013,7 @@ mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int e
 
 			if (cur)
 			{
-				*tail = cur;
-				tail = &cur->next;
-
-				if (cur->entry.log.transtype == intswap32 (ltCommit))
-				{
-					/* Mark the new end of what is to be committed */
-					synctail = &cur->next;
-					lastsynclog = start;
-				}
+				list->nentries++;
 			}
 
 			cur = NULL;
@@ -745,21 +1025,25 @@ mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int e
 				if (partremaining > 2)
 				{
 					/* Only allocate if there is going to be actual data */
-					cur = calloc (partremaining + offsetof (struct log_entry_list, entry), 1);
-					cur->logstamp = start;
+					cur = mfs_log_list_alloc (mfshnd, list, partremaining, start);
+					if (!cur)
+					{
+						mfs_log_free_list (list);
+						return 0;
+					}
 				}
 			}
 		}
 	}
 
 	/* All valid entries are read in */
-	/* Clear out any partial read */
+	/* Clear out any partial read, it is always the last record in the arena */
 	if (cur)
 	{
-		free (cur);
+		list->arenaused -= cur->recsize;
 	}
 
-	return 1;
+	return mfs_log_list_index (mfshnd, list);
 }
 
 /************************************************************************/
@@ -767,32 +1051,27 @@ mfs_log_load_list (struct mfs_handle *mfshnd, unsigned int start, unsigned int e
 static int
 mfs_log_find_inode_log_type (struct mfs_handle *mfshnd, unsigned int logstamp)
 {
-	struct log_entry_list *list;
+	struct log_entry_list list;
+	unsigned int loop;
 
 	/* Search the previous 32 entries, ignoring if they have been committed or not */
 	if (mfs_log_load_list (mfshnd, logstamp < 32? 0: logstamp - 32, logstamp, &list) != 1)
 		return 0;
 
-	while (list)
+	for (loop = 0; loop < list.nentries && !mfshnd->inode_log_type; loop++)
 	{
-		struct log_entry_list *cur = list;
-		list = cur->next;
-
-		if (!mfshnd->inode_log_type)
+		switch (intswap32 (list.entries[loop]->entry.log.transtype))
 		{
-			switch (intswap32 (cur->entry.log.transtype))
-			{
-			case ltInodeUpdate:
-				mfshnd->inode_log_type = ltInodeUpdate;
-				break;
-			case ltInodeUpdate2:
-				mfshnd->inode_log_type = ltInodeUpdate2;
-				break;
-			}
+		case ltInodeUpdate:
+			mfshnd->inode_log_type = ltInodeUpdate;
+			break;
+		case ltInodeUpdate2:
+			mfshnd->inode_log_type = ltInodeUpdate2;
+			break;
 		}
-
-		free (cur);
 	}
+
+	mfs_log_free_list (&list);
 	return 1;
 }
 
@@ -810,23 +1089,35 @@ mfs_log_fssync (struct mfs_handle *mfshnd)
 	/* If this is the first time, replay the log first */
 	if (!mfshnd->current_log)
 	{
-		struct log_entry_list *list;
+		struct log_entry_list list;
+		struct log_index *idx;
 		unsigned int startlogstamp = mfs_log_last_sync (mfshnd);
+		unsigned int endlogstamp = ~0;
+
+		/* Pull the whole log in at once, so the replay and the search */
+		/* for the inode log type below don't go to disk per sector */
+		idx = mfs_log_index (mfshnd);
+		if (idx)
+		{
+			if (idx->empty || (int)(idx->newest - startlogstamp) <= 0)
+				endlogstamp = startlogstamp;
+			else
+				endlogstamp = idx->newest;
+		}
+		else
+		{
+			mfs_clearerror (mfshnd);
+		}
 
-		if (mfs_log_load_list (mfshnd, startlogstamp + 1, ~0, &list) != 1)
+		if (mfs_log_load_list (mfshnd, startlogstamp + 1, endlogstamp, &list) != 1)
 			return 0;
 
-		if (list)
+		if (list.nentries)
 		{
-			int ret = mfs_log_fssync_list (mfshnd, list);
+			int ret = mfs_log_fssync_list (mfshnd, &list);
 
 			/* Free the list */
-			while (list)
-			{
-				struct log_entry_list *cur = list;
-				list = cur->next;
-				free (cur);
-			}
+			mfs_log_free_list (&list);
 
 			if (ret <= 0)
 			{
@@ -908,7 +1199,8 @@ mfs_log_commit (struct mfs_handle *mfshnd)
 {
 	uint32_t endlog;
 	log_entry entry;
-	struct log_entry_list *list;
+	struct log_entry_list list;
+	int ret;
 
 	/* Start with a clean structure */
 	memset (&entry, 0, sizeof (entry));
@@ -936,7 +1228,9 @@ mfs_log_commit (struct mfs_handle *mfshnd)
 	if (mfs_log_load_list (mfshnd, mfshnd->lastlogcommit + 1, endlog, &list) <= 0)
 		return 0;
 
-	if (mfs_log_commit_list (mfshnd, list, endlog) <= 0)
+	ret = mfs_log_commit_list (mfshnd, list.entries, list.nentries, endlog);
+	mfs_log_free_list (&list);
+	if (ret <= 0)
 		return 0;
 
 	/* Perform a periodic fssync */
@@ -415,6 +415,10 @@ tivo_partition_rrpart (const char *device)
 			}
 		}
 
+/* Buffered writes need the descriptor, and must not outlive the table */
+		if (tivo_partition_flush_table (tofree) < 0)
+			return -1;
+
 		*table = tofree->next;
 
 		for (loop = 0; loop < tofree->count; loop++)
@@ -1102,7 +1106,9 @@ tivo_partition_table_write (const char *device)
 			return -1;
 	}
 	table->vol_flags &= ~VOL_DIRTY;
-	return 0;
+
+/* Other tools and the kernel read the map straight from the drive */
+	return tivo_partition_flush ();
 }
 
 /********************************************************************/
@@ -1431,6 +1437,7 @@ tivo_partition_close (tpFILE * file)
 /* shared file leave it for the unwritten cleanup code. */
 	if (file->fd >= 0 && file->tptype != pDIRECT && file->tptype != pDIRECTFILE)
 	{
+		tivo_partition_flush ();
 		close (file->fd);
 		file->fd = -1;
 	}
@@ -1596,7 +1603,9 @@ tivo_partition_write_bootsector (const char *device, void *buf)
 	file.extra.direct.pt = table;
 	file.extra.direct.part = &part;
 
-	return (tivo_partition_write (&file, buf, 0, 1));
+	if (tivo_partition_write (&file, buf, 0, 1) != 512)
+		return -1;
+	return tivo_partition_flush () < 0? -1: 512;
 }
 
 /*******************************************************************/
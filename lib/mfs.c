@@ -22,6 +22,7 @@
 #endif
 
 #include "mfs.h"
+#include "log.h"
 
 char* tivo_devnames[] = { "/dev/hda", "/dev/hdb" };
 
@@ -374,6 +375,7 @@ mfs_cleanup (struct mfs_handle *mfshnd)
 		mfsvol_cleanup (mfshnd->vols);
 	if (mfshnd->current_log)
 		free (mfshnd->current_log);
+	mfs_log_index_free (mfshnd);
 	free (mfshnd);
 }
 
@@ -387,6 +389,12 @@ mfs_reinit (struct mfs_handle *mfshnd, int flags)
 
 	mfs_cleanup_zone_maps (mfshnd);
 
+/* The log state belongs to the old volume header, drop it so the log is */
+/* rescanned against the new one. */
+	if (mfshnd->current_log)
+		free (mfshnd->current_log);
+	mfs_log_index_free (mfshnd);
+
 	mfs_init_internal (mfshnd, vols->hda, vols->hdb, flags);
 
 	mfsvol_cleanup (vols);
@@ -3,6 +3,7 @@
 #endif
 
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -14,10 +15,14 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <inttypes.h>
+#include <limits.h>
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
 #include <sys/param.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 #ifdef HAVE_LINUX_FS_H
 #include <linux/fs.h>
 #endif
@@ -83,6 +88,356 @@ data_swab (void *data, int size)
 	}
 }
 
+/* Write behind.  With a budget set, writes are copied into a buffer and */
+/* only written out when it fills or on tivo_partition_flush, a device at a */
+/* time in ascending sector order with runs of adjacent writes merged into */
+/* one.  Scattered writes, such as MFS media interleaved with inodes and */
+/* the log, then reach the drive as long sequential runs.  Reads are */
+/* patched from the buffer so everything still sees what was written.  The */
+/* buffer is not locked, so only a single threaded writer may turn it on. */
+struct tivo_wb_extent
+{
+	uint64_t sector;		/* Absolute sector on the device */
+	unsigned int count;
+	unsigned char *data;	/* Already byte swapped for the device */
+};
+
+struct tivo_wb_dev
+{
+	struct tivo_partition_table *pt;	/* Table for partitions, or NULL */
+	int fd;
+	struct tivo_wb_extent *extents;	/* Sorted by sector, never overlapping */
+	unsigned int nextents;
+	unsigned int nalloc;
+};
+
+#define TIVO_WB_MAXDEVS 8
+/* Most extents merged into a single write */
+#define TIVO_WB_MAXIOV 256
+
+static struct tivo_wb_dev tivo_wb_devs[TIVO_WB_MAXDEVS];
+static int tivo_wb_ndevs = 0;
+static unsigned char *tivo_wb_buf = NULL;
+static size_t tivo_wb_size = 0;
+static size_t tivo_wb_used = 0;
+
+/***************************************************************/
+/* Find the write behind state for the device a file is on. */
+static struct tivo_wb_dev *
+tivo_wb_find (tpFILE * file)
+{
+	struct tivo_partition_table *pt = NULL;
+	int loop;
+
+	if (file->tptype == pDIRECT || file->tptype == pDIRECTFILE)
+		pt = file->extra.direct.pt;
+
+	for (loop = 0; loop < tivo_wb_ndevs; loop++)
+	{
+		if (pt? tivo_wb_devs[loop].pt == pt: (!tivo_wb_devs[loop].pt && tivo_wb_devs[loop].fd == _tivo_partition_fd (file)))
+			return &tivo_wb_devs[loop];
+	}
+
+	return NULL;
+}
+
+/******************************************************************/
+/* Find the first extent that ends after a sector.  Returns the */
+/* number of extents if there are none. */
+static unsigned int
+tivo_wb_search (struct tivo_wb_dev *dev, uint64_t sector)
+{
+	unsigned int low = 0, high = dev->nextents;
+
+	while (low < high)
+	{
+		unsigned int mid = (low + high) / 2;
+
+		if (dev->extents[mid].sector + dev->extents[mid].count <= sector)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/**************************************************************/
+/* Write out all the buffered writes for a device, in order. */
+static int
+tivo_wb_flush_dev (struct tivo_wb_dev *dev)
+{
+#ifdef USE__LLSEEK
+	loff_t result;
+#endif
+	unsigned int loop = 0;
+
+	while (loop < dev->nextents)
+	{
+		struct tivo_wb_extent *ext = &dev->extents[loop];
+		unsigned int run = 1;
+		size_t size = (size_t)ext->count * 512;
+		ssize_t retval;
+
+		while (loop + run < dev->nextents && run < TIVO_WB_MAXIOV &&
+			ext[run - 1].sector + ext[run - 1].count == ext[run].sector)
+		{
+			size += (size_t)ext[run].count * 512;
+			run++;
+		}
+
+#ifdef USE__LLSEEK
+		if (_llseek (dev->fd, ext->sector >> 23, ext->sector << 9, &result, SEEK_SET) < 0)
+#elif HAVE_LSEEK64
+		if (lseek64 (dev->fd, (off64_t)ext->sector << 9, SEEK_SET) != (off64_t)ext->sector << 9)
+#else
+		if (lseek (dev->fd, (off_t)ext->sector << 9, SEEK_SET) != (off_t)ext->sector << 9)
+#endif
+		{
+			return -1;
+		}
+
+#ifdef HAVE_SYS_UIO_H
+		{
+			struct iovec iov[TIVO_WB_MAXIOV];
+			unsigned int loop2;
+
+			for (loop2 = 0; loop2 < run; loop2++)
+			{
+				iov[loop2].iov_base = ext[loop2].data;
+				iov[loop2].iov_len = (size_t)ext[loop2].count * 512;
+			}
+			retval = writev (dev->fd, iov, run);
+		}
+#else
+		run = 1;
+		size = (size_t)ext->count * 512;
+		retval = write (dev->fd, ext->data, size);
+#endif
+		if (retval != (ssize_t)size)
+		{
+			if (retval >= 0)
+				errno = EIO;
+			return -1;
+		}
+
+		loop += run;
+	}
+
+	dev->nextents = 0;
+	return 0;
+}
+
+/******************************************************************/
+/* Write out everything buffered.  Returns 0, or -1 with errno set */
+/* if any of it could not be written, in which case it is dropped. */
+int
+tivo_partition_flush ()
+{
+	int ret = 0;
+	int loop;
+
+	for (loop = 0; loop < tivo_wb_ndevs; loop++)
+	{
+		if (tivo_wb_flush_dev (&tivo_wb_devs[loop]) < 0)
+		{
+			tivo_wb_devs[loop].nextents = 0;
+			ret = -1;
+		}
+	}
+
+	tivo_wb_used = 0;
+	return ret;
+}
+
+/*********************************************************************/
+/* Write out and forget the buffered writes for a partition table */
+/* about to be released, so a later table at the same address does not */
+/* pick up its stale descriptor.  Returns 0, or -1 with errno set if */
+/* any of it could not be written, in which case it is dropped. */
+int
+tivo_partition_flush_table (struct tivo_partition_table *pt)
+{
+	int ret = 0;
+	int loop = 0;
+
+	while (loop < tivo_wb_ndevs)
+	{
+		struct tivo_wb_dev tmp = tivo_wb_devs[loop];
+
+		if (tmp.pt != pt)
+		{
+			loop++;
+			continue;
+		}
+
+		if (tivo_wb_flush_dev (&tmp) < 0)
+			ret = -1;
+
+/* Swap with the last one, keeping the extent array with its slot */
+		tivo_wb_ndevs--;
+		tivo_wb_devs[loop] = tivo_wb_devs[tivo_wb_ndevs];
+		tivo_wb_devs[tivo_wb_ndevs] = tmp;
+		tivo_wb_devs[tivo_wb_ndevs].pt = NULL;
+		tivo_wb_devs[tivo_wb_ndevs].fd = -1;
+		tivo_wb_devs[tivo_wb_ndevs].nextents = 0;
+	}
+
+	if (tivo_wb_ndevs == 0)
+		tivo_wb_used = 0;
+
+	return ret;
+}
+
+/************************************************************************/
+/* Set the memory for write behind, in bytes, or 0 to write straight */
+/* through.  Anything already buffered is written out first.  Returns 0, */
+/* or -1 with errno set. */
+int
+tivo_partition_writebehind (size_t size)
+{
+	int ret = tivo_partition_flush ();
+
+	if (tivo_wb_buf)
+		free (tivo_wb_buf);
+	tivo_wb_buf = NULL;
+	tivo_wb_size = 0;
+
+	if (size > 0)
+	{
+		tivo_wb_buf = malloc (size);
+		if (!tivo_wb_buf)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		tivo_wb_size = size;
+	}
+
+	return ret;
+}
+
+/*********************************************************************/
+/* Make sure nothing buffered overlaps some sectors about to be */
+/* changed some other way, by writing the device out if anything does. */
+static int
+tivo_wb_claim (struct tivo_wb_dev *dev, uint64_t sector, int count)
+{
+	unsigned int loop = tivo_wb_search (dev, sector);
+
+	if (loop < dev->nextents && dev->extents[loop].sector < sector + count)
+		return tivo_wb_flush_dev (dev);
+
+	return 0;
+}
+
+/*************************************************/
+/* Buffer a write.  Returns the bytes written. */
+static int
+tivo_wb_write (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	struct tivo_wb_dev *dev = tivo_wb_find (file);
+	struct tivo_wb_extent *ext;
+	size_t size = (size_t)count * 512;
+	unsigned int loop;
+
+	if (!dev)
+	{
+		if (tivo_wb_ndevs >= TIVO_WB_MAXDEVS)
+		{
+			if (tivo_partition_flush () < 0)
+				return -1;
+			tivo_wb_ndevs = 0;
+		}
+		dev = &tivo_wb_devs[tivo_wb_ndevs++];
+		dev->pt = (file->tptype == pDIRECT || file->tptype == pDIRECTFILE)? file->extra.direct.pt: NULL;
+		dev->fd = _tivo_partition_fd (file);
+		dev->nextents = 0;
+	}
+
+	if (tivo_wb_used + size > tivo_wb_size && tivo_partition_flush () < 0)
+		return -1;
+
+/* Rewriting buffered sectors is rare enough to just write them out */
+	if (tivo_wb_claim (dev, sector, count) < 0)
+		return -1;
+
+	loop = tivo_wb_search (dev, sector);
+
+	memcpy (tivo_wb_buf + tivo_wb_used, buf, size);
+	if (_tivo_partition_swab (file))
+		data_swab (tivo_wb_buf + tivo_wb_used, size);
+
+/* Sequential writes grow the extent before them */
+	if (loop > 0)
+	{
+		ext = &dev->extents[loop - 1];
+		if (ext->sector + ext->count == sector && ext->data + (size_t)ext->count * 512 == tivo_wb_buf + tivo_wb_used)
+		{
+			ext->count += count;
+			tivo_wb_used += size;
+			return size;
+		}
+	}
+
+	if (dev->nextents >= dev->nalloc)
+	{
+		struct tivo_wb_extent *tmp = realloc (dev->extents, sizeof (*tmp) * (dev->nalloc + 1024));
+		if (!tmp)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		dev->extents = tmp;
+		dev->nalloc += 1024;
+	}
+
+	ext = &dev->extents[loop];
+	memmove (ext + 1, ext, sizeof (*ext) * (dev->nextents - loop));
+	ext->sector = sector;
+	ext->count = count;
+	ext->data = tivo_wb_buf + tivo_wb_used;
+	dev->nextents++;
+	tivo_wb_used += size;
+
+	return size;
+}
+
+/*********************************************************************/
+/* Copy anything buffered over sectors just read from the device. */
+static void
+tivo_wb_patch (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	struct tivo_wb_dev *dev = tivo_wb_find (file);
+	unsigned int loop;
+
+	if (!dev)
+		return;
+
+	for (loop = tivo_wb_search (dev, sector); loop < dev->nextents && dev->extents[loop].sector < sector + count; loop++)
+	{
+		struct tivo_wb_extent *ext = &dev->extents[loop];
+		uint64_t start = ext->sector > sector? ext->sector: sector;
+		uint64_t end = ext->sector + ext->count < sector + count? ext->sector + ext->count: sector + count;
+
+		memcpy ((unsigned char *)buf + (start - sector) * 512, ext->data + (start - ext->sector) * 512, (end - start) * 512);
+	}
+}
+
+/***************************************************************************/
+/* Whether partitions can be read from several threads at once.  Without */
+/* pread64, reads seek the descriptor first, and two threads sharing it */
+/* would move each other's offset. */
+int
+tivo_partition_parallel_read (void)
+{
+#if HAVE_PREAD64 && !defined (USE__LLSEEK)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
 /*****************************************************************************/
 /* Read data from the MFS volume set.  It must be in whole sectors, and must */
 /* not cross a volume boundry. */
@@ -134,7 +489,12 @@ tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count)
 	}
 #endif
 
-/* A file, or not TiVo, use llseek and read. */
+/* A file, or not TiVo.  pread leaves the file offset alone, so partitions */
+/* sharing a descriptor can be read from more than one thread. */
+#if HAVE_PREAD64 && !defined (USE__LLSEEK)
+	retval = pread64 (_tivo_partition_fd (file), buf, count * 512, (off64_t)sector << 9);
+#else
+/* Otherwise use llseek and read. */
 #ifdef USE__LLSEEK
 	if (_llseek (_tivo_partition_fd (file), sector >> 23, sector << 9, &result, SEEK_SET) < 0)
 #elif HAVE_LSEEK64
@@ -147,6 +507,10 @@ tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count)
 	}
 
 	retval = read (_tivo_partition_fd (file), buf, count * 512);
+#endif
+
+	if (tivo_wb_ndevs > 0 && retval == count * 512)
+		tivo_wb_patch (file, buf, sector, count);
 	
 	/* rescue begin by terativo(http://mfslive.org/forums/viewtopic.php?f=4&t=955)*/
 	if (retval < 0 && errno == EIO)
@@ -194,6 +558,51 @@ tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count)
 	return retval;
 }
 
+unsigned char *tivo_partition_zeros = NULL;
+unsigned int tivo_partition_nzeros = 0;
+enum tivo_zero_mode tivo_partition_zeromode = tzWrite;
+
+/****************************************************************************/
+/* Zero sectors without writing them, by punching a hole in a file or */
+/* asking a device to zero them itself.  Returns -1 if neither works, and */
+/* the zeros need to be written after all. */
+static int
+tivo_partition_discard (tpFILE * file, uint64_t sector, int count)
+{
+	if (_tivo_partition_isdevice (file))
+	{
+#ifdef BLKZEROOUT
+		uint64_t range[2];
+
+		range[0] = sector << 9;
+		range[1] = (uint64_t)count << 9;
+		if (ioctl (_tivo_partition_fd (file), BLKZEROOUT, range) == 0)
+			return 0;
+#endif
+	}
+	else
+	{
+#if HAVE_FALLOCATE && defined (FALLOC_FL_PUNCH_HOLE)
+		struct stat st;
+		off_t end = (off_t)(sector + count) << 9;
+
+/* Leave anything off_t can not reach to a plain write */
+		if (sizeof (off_t) < 8 && sector + count > (UINT64_C(1) << (31 - 9)))
+			return -1;
+
+/* A hole punched past the end would not grow the file to cover it */
+		if (fstat (_tivo_partition_fd (file), &st) < 0 ||
+			(st.st_size < end && ftruncate (_tivo_partition_fd (file), end) < 0))
+			return -1;
+
+		if (fallocate (_tivo_partition_fd (file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)sector << 9, (off_t)count << 9) == 0)
+			return 0;
+#endif
+	}
+
+	return -1;
+}
+
 /****************************************************************************/
 /* Write data to the MFS volume set.  It must be in whole sectors, and must */
 /* not cross a volume boundry. */
@@ -247,6 +656,32 @@ tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count)
 	}
 #endif
 
+/* Zeros may not need writing at all */
+	if (tivo_partition_zeromode != tzWrite &&
+		(unsigned char *)buf >= tivo_partition_zeros &&
+		(unsigned char *)buf + count * 512 <= tivo_partition_zeros + tivo_partition_nzeros * 512)
+	{
+		struct tivo_wb_dev *dev = tivo_wb_ndevs > 0? tivo_wb_find (file): NULL;
+
+		if (dev && tivo_partition_zeromode == tzDiscard && tivo_wb_claim (dev, sector, count) < 0)
+			return -1;
+		if (tivo_partition_zeromode == tzSkip || tivo_partition_discard (file, sector, count) == 0)
+			return count * 512;
+	}
+
+	if (tivo_wb_buf)
+	{
+		struct tivo_wb_dev *dev;
+
+		if ((size_t)count * 512 <= tivo_wb_size)
+			return tivo_wb_write (file, buf, sector, count);
+
+/* Too big to buffer, but it must still land after older writes */
+		dev = tivo_wb_find (file);
+		if (dev && tivo_wb_claim (dev, sector, count) < 0)
+			return -1;
+	}
+
 /* A file, or not TiVo, use llseek and write. */
 #ifdef USE__LLSEEK
 	if (_llseek (_tivo_partition_fd (file), sector >> 23, sector << 9, &result, SEEK_SET) < 0)
@@ -271,3 +706,178 @@ tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count)
 	}
 	return retval;
 }
+
+/****************************************************************************/
+/* Copy sectors from one partition to another without passing them */
+/* through memory.  Only files with the same byte order can be copied this */
+/* way; anything else returns -1 with errno set, and the caller copies the */
+/* data with reads and writes instead. */
+int
+tivo_partition_copy (tpFILE * from, uint64_t fromsector, tpFILE * to, uint64_t tosector, int count)
+{
+#if HAVE_COPY_FILE_RANGE
+	loff_t fromoff, tooff;
+	size_t left;
+
+	if (fromsector + count > tivo_partition_size (from) || tosector + count > tivo_partition_size (to))
+	{
+		errno = EIO;
+		return -1;
+	}
+
+/* Buffered writes would land on top of the copy later */
+	if (_tivo_partition_isdevice (from) || _tivo_partition_isdevice (to) ||
+		_tivo_partition_swab (from) != _tivo_partition_swab (to) || tivo_wb_buf)
+	{
+		errno = EXDEV;
+		return -1;
+	}
+
+	fromoff = (loff_t)(fromsector + tivo_partition_offset (from)) << 9;
+	tooff = (loff_t)(tosector + tivo_partition_offset (to)) << 9;
+
+	for (left = (size_t)count * 512; left > 0; )
+	{
+		ssize_t ncopied = copy_file_range (_tivo_partition_fd (from), &fromoff, _tivo_partition_fd (to), &tooff, left, 0);
+		if (ncopied <= 0)
+		{
+			if (ncopied == 0)
+				errno = EIO;
+			return -1;
+		}
+		left -= ncopied;
+	}
+
+	return count * 512;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/****************************************************************************/
+/* Copy sectors from a partition out to a file descriptor, at its current */
+/* offset, without passing them through memory.  Plain files are copied */
+/* with copy_file_range, and anything else is spliced through a pipe. */
+/* Returns -1 with errno set to ENOSYS, EXDEV, EINVAL or EOPNOTSUPP if it */
+/* can't be done this way and nothing was written, so the caller can read */
+/* and write the data instead.  Any later failure is EIO. */
+int
+tivo_partition_copy_out (tpFILE * from, uint64_t fromsector, int count, int fd)
+{
+#if HAVE_COPY_FILE_RANGE || HAVE_SPLICE
+	loff_t fromoff;
+	size_t left = (size_t)count * 512;
+
+/* The byte count has to fit the return */
+	if (count < 0 || count > INT_MAX / 512)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fromsector + count > tivo_partition_size (from))
+	{
+		errno = EIO;
+		return -1;
+	}
+
+#ifdef TIVO
+/* Devices are read with readsectors */
+	if (_tivo_partition_isdevice (from))
+	{
+		errno = EXDEV;
+		return -1;
+	}
+#endif
+
+/* Swapped data has to come through memory to be put right */
+	if (_tivo_partition_swab (from))
+	{
+		errno = EXDEV;
+		return -1;
+	}
+
+	fromoff = (loff_t)(fromsector + tivo_partition_offset (from)) << 9;
+
+#if HAVE_COPY_FILE_RANGE
+	if (!_tivo_partition_isdevice (from))
+	{
+		while (left > 0)
+		{
+			ssize_t ncopied = copy_file_range (_tivo_partition_fd (from), &fromoff, fd, NULL, left, 0);
+			if (ncopied <= 0)
+			{
+				if (ncopied < 0 && left == (size_t)count * 512 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+					break;
+				if (ncopied == 0 || left != (size_t)count * 512)
+					errno = EIO;
+				return -1;
+			}
+			left -= ncopied;
+		}
+
+		if (!left)
+			return count * 512;
+	}
+#endif
+
+#if HAVE_SPLICE
+	{
+		int pipefd[2];
+		size_t written = 0;
+		int ret = count * 512;
+
+		if (pipe (pipefd) < 0)
+			return -1;
+#ifdef F_SETPIPE_SZ
+/* Bigger pieces, if the pipe can be made to hold them */
+		fcntl (pipefd[1], F_SETPIPE_SZ, 1024 * 1024);
+#endif
+
+		while (left > 0 && ret > 0)
+		{
+			ssize_t nin = splice (_tivo_partition_fd (from), &fromoff, pipefd[1], NULL, left, SPLICE_F_MOVE);
+
+			if (nin <= 0)
+			{
+				if (nin == 0)
+					errno = EIO;
+				ret = -1;
+				break;
+			}
+
+			left -= nin;
+			while (nin > 0)
+			{
+				ssize_t nout = splice (pipefd[0], NULL, fd, NULL, nin, SPLICE_F_MOVE);
+
+				if (nout <= 0)
+				{
+					if (nout == 0)
+						errno = EIO;
+					ret = -1;
+					break;
+				}
+				nin -= nout;
+				written += nout;
+			}
+		}
+
+/* Once anything is out there is no going back to reads and writes */
+		if (ret < 0 && (written || (errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)))
+			errno = EIO;
+
+		close (pipefd[0]);
+		close (pipefd[1]);
+		return ret;
+	}
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
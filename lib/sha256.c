@@ -0,0 +1,106 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "mfs.h"
+
+/* FIPS 180-4 SHA-256, used to name chunks in the deduplicating backup store */
+static const unsigned int sha256tab[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block (unsigned int *state, const unsigned char *block)
+{
+	unsigned int w[64];
+	unsigned int a, b, c, d, e, f, g, h;
+	int loop;
+
+	for (loop = 0; loop < 16; loop++)
+		w[loop] = (block[loop * 4] << 24) | (block[loop * 4 + 1] << 16) | (block[loop * 4 + 2] << 8) | block[loop * 4 + 3];
+	for (; loop < 64; loop++)
+	{
+		unsigned int s0 = ROR32 (w[loop - 15], 7) ^ ROR32 (w[loop - 15], 18) ^ (w[loop - 15] >> 3);
+		unsigned int s1 = ROR32 (w[loop - 2], 17) ^ ROR32 (w[loop - 2], 19) ^ (w[loop - 2] >> 10);
+		w[loop] = w[loop - 16] + s0 + w[loop - 7] + s1;
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (loop = 0; loop < 64; loop++)
+	{
+		unsigned int t1 = h + (ROR32 (e, 6) ^ ROR32 (e, 11) ^ ROR32 (e, 25)) + ((e & f) ^ (~e & g)) + sha256tab[loop] + w[loop];
+		unsigned int t2 = (ROR32 (a, 2) ^ ROR32 (a, 13) ^ ROR32 (a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void
+compute_sha256 (const unsigned char *data, unsigned int size, unsigned char *digest)
+{
+	unsigned int state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	unsigned char tail[128];
+	uint64_t bits = (uint64_t)size * 8;
+	unsigned int left, tailsize;
+	int loop;
+
+	for (left = size; left >= 64; left -= 64, data += 64)
+		sha256_block (state, data);
+
+/* Pad with a 1 bit, zeros, and the message length in bits */
+	memcpy (tail, data, left);
+	tail[left] = 0x80;
+	tailsize = left < 56? 64: 128;
+	memset (tail + left + 1, 0, tailsize - left - 1);
+	for (loop = 0; loop < 8; loop++)
+		tail[tailsize - 1 - loop] = bits >> (loop * 8);
+
+	sha256_block (state, tail);
+	if (tailsize == 128)
+		sha256_block (state, tail + 64);
+
+	for (loop = 0; loop < 8; loop++)
+	{
+		digest[loop * 4] = state[loop] >> 24;
+		digest[loop * 4 + 1] = state[loop] >> 16;
+		digest[loop * 4 + 2] = state[loop] >> 8;
+		digest[loop * 4 + 3] = state[loop];
+	}
+}
@@ -543,6 +543,91 @@ mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, uint32
 	return tivo_partition_write (vol->file, buf, sector, count);
 }
 
+/****************************************************************************/
+/* Copy data from one MFS volume set to another without reading it into */
+/* memory, where the files underneath allow it.  It must be in whole */
+/* sectors, and must not cross a volume boundry on either side.  Returns */
+/* -1 with errno set if it can't be done this way. */
+int
+mfsvol_copy_data (struct volume_handle *from, uint64_t fromsector, struct volume_handle *to, uint64_t tosector, uint32_t count)
+{
+	struct volume_info *fromvol, *tovol;
+
+	fromvol = mfsvol_get_volume (from, fromsector);
+	tovol = mfsvol_get_volume (to, tosector);
+
+/* If no volumes claim this sector, it's an IO error. */
+	if (!fromvol || !tovol)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+/* Make the sector numbers relative to the volumes. */
+	fromsector -= fromvol->start;
+	tosector -= tovol->start;
+
+	if (fromsector + count > fromvol->sectors || tosector + count > tovol->sectors)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	if (tovol->vol_flags & VOL_RDONLY)
+	{
+		errno = EPERM;
+		return -1;
+	}
+
+/* Changes kept in memory would be missed on either side */
+	if (to->write_mode != vwNormal || mfsvol_locate_mem_data_for_read (fromvol, fromsector, count))
+	{
+		errno = EXDEV;
+		return -1;
+	}
+
+	return tivo_partition_copy (fromvol->file, fromsector, tovol->file, tosector, count);
+}
+
+/****************************************************************************/
+/* Copy data from the MFS volume set out to a file descriptor without */
+/* reading it into memory, where the files underneath allow it.  It must */
+/* be in whole sectors, and must not cross a volume boundry.  Returns -1 */
+/* with errno set if it can't be done this way.  EAGAIN means only this */
+/* range has changes held in memory, and other ranges may still work. */
+int
+mfsvol_copy_out (struct volume_handle *hnd, uint64_t sector, uint32_t count, int fd)
+{
+	struct volume_info *vol;
+
+	vol = mfsvol_get_volume (hnd, sector);
+
+/* If no volumes claim this sector, it's an IO error. */
+	if (!vol)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+/* Make the sector number relative to this volume. */
+	sector -= vol->start;
+
+	if (sector + count > vol->sectors)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+/* Changes kept in memory would be missed */
+	if (mfsvol_locate_mem_data_for_read (vol, sector, count))
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return tivo_partition_copy_out (vol->file, sector, count, fd);
+}
+
 /******************************************************************************/
 /* Set local mem write mode for making temp changes in memory. */
 void
@@ -12,10 +12,15 @@
 #include <stdint.h>
 #endif
 #include <inttypes.h>
+#include <stdarg.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "mfs.h"
 #include "macpart.h"
 #include "log.h"
+#include "jsonl.h"
 
 #include "mfsck.h"
 
@@ -27,12 +32,107 @@ mfsck_usage (char *progname)
 	fprintf (stderr, "Options:\n");
 	fprintf (stderr, " -h        Display this help message\n");
 	fprintf (stderr, " -r        Revalidate TiVo partitions on Adrive [Bdrive]\n");
+	fprintf (stderr, " -j n      Scan inodes with n threads (Default: one per CPU)\n");
+	fprintf (stderr, " -f        Fast check of only what the log touched since the last sync\n");
+	fprintf (stderr, " -J        Report as JSON Lines instead of text\n");
 //#if DEBUG
 	fprintf (stderr, " -m [1-5]  Set volume header magic to OK, FS_CHK, LOG_CHK, DB_CHK, or CLEAN\n");
 	fprintf (stderr, " -e [1-3]  Set vol_hdr.v64.off0c to 0x00000010, TiVo, or Dish\n");
 //#endif
 }
 
+/* Set by -J, every report is then a JSON Lines record on stdout */
+static int scan_json = 0;
+
+/* Print a message, or with -J a record of the given type holding the */
+/* message, and id under key if there is a key. */
+void
+scan_message (const char *type, const char *key, int64_t id, const char *fmt, ...)
+{
+	va_list ap;
+	char msg[1024];
+	char *start = msg;
+	int len;
+
+	va_start (ap, fmt);
+	if (!scan_json)
+	{
+		vprintf (fmt, ap);
+		va_end (ap);
+		return;
+	}
+	vsnprintf (msg, sizeof (msg), fmt, ap);
+	va_end (ap);
+
+	/* The line breaks are only there for the text form */
+	while (*start == '\n')
+		start++;
+	len = strlen (start);
+	while (len > 0 && start[len - 1] == '\n')
+		start[--len] = 0;
+
+	jsonl_begin (stdout, type);
+	if (key)
+		jsonl_int (stdout, key, id);
+	jsonl_string (stdout, "message", start);
+	jsonl_end (stdout);
+}
+
+/* Announce the next step of the check */
+void
+scan_phase (const char *phase, const char *text)
+{
+	if (scan_json)
+	{
+		jsonl_begin (stdout, "phase");
+		jsonl_string (stdout, "phase", phase);
+		jsonl_end (stdout);
+	}
+	else
+		fputs (text, stdout);
+}
+
+/* Ints compared at once in the middle of a range */
+#define SCAN_BLOCKINTS 8
+
+/* Number of the lowest set bit.  The value must not be 0. */
+static inline int
+scan_ctz (uint32_t val)
+{
+#if HAVE_BUILTIN_CTZ
+	return __builtin_ctz (val);
+#else
+	int bit = 0;
+
+	if (!(val & 0xffff))
+	{
+		val >>= 16;
+		bit += 16;
+	}
+	if (!(val & 0xff))
+	{
+		val >>= 8;
+		bit += 8;
+	}
+	if (!(val & 0xf))
+	{
+		val >>= 4;
+		bit += 4;
+	}
+	if (!(val & 0x3))
+	{
+		val >>= 2;
+		bit += 2;
+	}
+	if (!(val & 0x1))
+	{
+		bit += 1;
+	}
+
+	return bit;
+#endif
+}
+
 int
 scan_bit_range (zone_bitmap *map, int startbit, int endbit, int desiredval)
 {
@@ -67,8 +167,25 @@ scan_bit_range (zone_bitmap *map, int startbit, int endbit, int desiredval)
 		return 0;
 	}
 
-	/* Check all the ints inbetween */
-	while (++startint < endint)
+	/* Check all the ints inbetween, a block at a time with no branch per */
+	/* int so the compiler can vectorize it */
+	startint++;
+	while (startint + SCAN_BLOCKINTS <= endint)
+	{
+		unsigned int diff = 0;
+		int loop;
+
+		for (loop = 0; loop < SCAN_BLOCKINTS; loop++)
+		{
+			diff |= map->bits[startint + loop] ^ desiredbits;
+		}
+		if (diff)
+		{
+			return 0;
+		}
+		startint += SCAN_BLOCKINTS;
+	}
+	for (; startint < endint; startint++)
 	{
 		if (map->bits[startint] != desiredbits)
 		{
@@ -115,9 +232,9 @@ set_bit_range (zone_bitmap *map, int startbit, int endbit)
 	map->bits[startint] |= startbits;
 
 	/* Set all the ints inbetween */
-	while (++startint < endint)
+	if (endint > startint + 1)
 	{
-		map->bits[startint] = ~0;
+		memset (&map->bits[startint + 1], 0xff, (endint - startint - 1) * sizeof (*map->bits));
 	}
 
 	/* Set the bits in the last int */
@@ -152,10 +269,10 @@ clear_bit_range (zone_bitmap *map, int startbit, int endbit)
 	/* Set the bits in the first int */
 	map->bits[startint] &= ~startbits;
 
-	/* Set all the ints inbetween */
-	while (++startint < endint)
+	/* Clear all the ints inbetween */
+	if (endint > startint + 1)
 	{
-		map->bits[startint] = 0;
+		memset (&map->bits[startint + 1], 0, (endint - startint - 1) * sizeof (*map->bits));
 	}
 
 	/* Set the bits in the last int */
@@ -244,23 +361,23 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 		/* Check the current zone against the previous zone's pointer */
 		if (sector != nextsector)
 		{
-			printf ("Zone %d sector (%" PRId64 ") mismatch to zone %d nextsector (%" PRId64 ")\n", zoneno, sector, zoneno-1, nextsector);
+			scan_message ("zone", "zone", zoneno, "Zone %d sector (%" PRId64 ") mismatch to zone %d nextsector (%" PRId64 ")\n", zoneno, sector, zoneno-1, nextsector);
 		}
 		if (sbackup != nextsbackup)
 		{
-			printf ("Zone %d alternate sector (%" PRId64 ") mismatch to zone %d next alternate sector (%" PRId64 ")\n", zoneno, sbackup, zoneno-1, nextsbackup);
+			scan_message ("zone", "zone", zoneno, "Zone %d alternate sector (%" PRId64 ") mismatch to zone %d next alternate sector (%" PRId64 ")\n", zoneno, sbackup, zoneno-1, nextsbackup);
 		}
 		if (length != nextlength)
 		{
-			printf ("Zone %d length (%d) mismatch to zone %d next length (%d)\n", zoneno, length, zoneno-1, nextlength);
+			scan_message ("zone", "zone", zoneno, "Zone %d length (%d) mismatch to zone %d next length (%d)\n", zoneno, length, zoneno-1, nextlength);
 		}
 		if (size != nextsize)
 		{
-			printf ("Zone %d size (%" PRId64 ") mismatch to zone %d next size (%" PRId64 ")\n", zoneno, size, zoneno-1, nextsize);
+			scan_message ("zone", "zone", zoneno, "Zone %d size (%" PRId64 ") mismatch to zone %d next size (%" PRId64 ")\n", zoneno, size, zoneno-1, nextsize);
 		}
 		if (blocksize != nextblocksize)
 		{
-			printf ("Zone %d block size (%d) mismatch to zone %d next block size (%d)\n", zoneno, blocksize, zoneno-1, nextblocksize);
+			scan_message ("zone", "zone", zoneno, "Zone %d block size (%d) mismatch to zone %d next block size (%d)\n", zoneno, blocksize, zoneno-1, nextblocksize);
 		}
 
 		if (mfs_is_64bit (mfs))
@@ -283,19 +400,19 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 		/* Check a few values for sanity */
 		if (first > last)
 		{
-			printf ("Zone %d start sector > end sector (%" PRId64 " > %" PRId64 ")\n", zoneno, first, last);
+			scan_message ("zone", "zone", zoneno, "Zone %d start sector > end sector (%" PRId64 " > %" PRId64 ")\n", zoneno, first, last);
 		}
 		if (size != last - first + 1)
 		{
-			printf ("Zone %d size (%" PRId64 ") mismatches difference between start and end sectors (%" PRId64 "-%" PRId64 ")\n", zoneno, size, first, last);
+			scan_message ("zone", "zone", zoneno, "Zone %d size (%" PRId64 ") mismatches difference between start and end sectors (%" PRId64 "-%" PRId64 ")\n", zoneno, size, first, last);
 		}
 		if (last >= vol_set_size)
 		{
-			printf ("Zone %d end sector (%" PRId64 ") past end of MFS volume (%" PRId64 ")\n", zoneno, last, vol_set_size);
+			scan_message ("zone", "zone", zoneno, "Zone %d end sector (%" PRId64 ") past end of MFS volume (%" PRId64 ")\n", zoneno, last, vol_set_size);
 		}
 		if (size % blocksize)
 		{
-			printf ("Zone %d size is not divisible by blocksize (%" PRId64 " / %d remainder = %d)\n", zoneno, size, blocksize, (int) (size % blocksize));
+			scan_message ("zone", "zone", zoneno, "Zone %d size is not divisible by blocksize (%" PRId64 " / %d remainder = %d)\n", zoneno, size, blocksize, (int) (size % blocksize));
 		}
 
 		/* Make sure this zone doesn't overlap with any others */
@@ -303,7 +420,7 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 		{
 			if (first <= (*bitmaploop)->last && last >= (*bitmaploop)->first)
 			{
-				printf ("Zone %d (%" PRId64 "-%" PRId64 ") overlaps with zone %d (%" PRId64 "-%" PRId64 ")\n", zoneno, first, last, loop, (*bitmaploop)->first, (*bitmaploop)->last);
+				scan_message ("zone", "zone", zoneno, "Zone %d (%" PRId64 "-%" PRId64 ") overlaps with zone %d (%" PRId64 "-%" PRId64 ")\n", zoneno, first, last, loop, (*bitmaploop)->first, (*bitmaploop)->last);
 			}
 		}
 
@@ -330,7 +447,7 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 			if ((size_t)ints >= (size_t)curzone + length * 512 ||
 				(size_t)ints + intswap32 (bitmaphdr->nints) * 4 >= (size_t)curzone + length * 512)
 			{
-				printf ("Zone %d bitmap %d is beyond end of the zone map\n", zoneno, loop);
+				scan_message ("zone", "zone", zoneno, "Zone %d bitmap %d is beyond end of the zone map\n", zoneno, loop);
 				continue;
 			}
 
@@ -342,12 +459,12 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 			/* Sanity check the values in the bitmap header */
 			if ((nbits + 31) / 32 != nints)
 			{
-				printf ("Zone %d bitmap %d number of ints (%d) does not match number of bits (%d bits / %d ints)\n", zoneno, loop, nints, nbits, (nbits + 31) / 32);
+				scan_message ("zone", "zone", zoneno, "Zone %d bitmap %d number of ints (%d) does not match number of bits (%d bits / %d ints)\n", zoneno, loop, nints, nbits, (nbits + 31) / 32);
 			}
 
 			if (nbits < size)
 			{
-				printf ("Zone %d bitmap %d has fewer bits (%d) than needed (%" PRId64 ")\n", zoneno, loop, nbits, size);
+				scan_message ("zone", "zone", zoneno, "Zone %d bitmap %d has fewer bits (%d) than needed (%" PRId64 ")\n", zoneno, loop, nbits, size);
 			}
 
 			/* Scan for set bits on a coarse level */
@@ -373,7 +490,7 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 
 						if ((curbit & 1) && lastbit == curbit - 1)
 						{
-							printf ("Zone %d bitmap %d bits %d-%d (%" PRId64 "-%" PRId64 ") has blocks that could be combined\n", zoneno, loop, bitno - 1, bitno, (bitno - 1) * blocksize + (*bitmaploop)->first, (bitno + 1) * blocksize - 1 + (*bitmaploop)->first);
+							scan_message ("zone", "zone", zoneno, "Zone %d bitmap %d bits %d-%d (%" PRId64 "-%" PRId64 ") has blocks that could be combined\n", zoneno, loop, bitno - 1, bitno, (bitno - 1) * blocksize + (*bitmaploop)->first, (bitno + 1) * blocksize - 1 + (*bitmaploop)->first);
 						}
 						lastbit = curbit;
 
@@ -383,14 +500,14 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 						/* Make sure it is within the bitmap */
 						if (bitno >= size)
 						{
-							printf ("Zone %d bitmap %d has free space beyond the zone - bit %d (%" PRId64 "-%" PRId64 ")\n", zoneno, loop, bitno, bitno * blocksize + (*bitmaploop)->first, (bitno + 1) * blocksize - 1 + (*bitmaploop)->first);
+							scan_message ("zone", "zone", zoneno, "Zone %d bitmap %d has free space beyond the zone - bit %d (%" PRId64 "-%" PRId64 ")\n", zoneno, loop, bitno, bitno * blocksize + (*bitmaploop)->first, (bitno + 1) * blocksize - 1 + (*bitmaploop)->first);
 							continue;
 						}
 
 						/* Make sure the bit wasn't already set */
 						if (!scan_bit_range (*bitmaploop, bitno << loop, ((bitno + 1) << loop) - 1, 0))
 						{
-							printf ("Zone %d bitmap %d bit %d (%" PRId64 "-%" PRId64 ") overlaps with previous bitmap\n", zoneno, loop, bitno, bitno * blocksize + (*bitmaploop)->first, (bitno + 1) * blocksize - 1 + (*bitmaploop)->first);
+							scan_message ("zone", "zone", zoneno, "Zone %d bitmap %d bit %d (%" PRId64 "-%" PRId64 ") overlaps with previous bitmap\n", zoneno, loop, bitno, bitno * blocksize + (*bitmaploop)->first, (bitno + 1) * blocksize - 1 + (*bitmaploop)->first);
 						}
 
 						/* Track this bitmap's bit */
@@ -402,7 +519,7 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 
 			if (foundbits != setbits)
 			{
-				printf ("Zone %d bitmap %d bits marked available (%d) mismatch against bitmap header (%d)\n", zoneno, loop, foundbits, setbits);
+				scan_message ("zone", "zone", zoneno, "Zone %d bitmap %d bits marked available (%d) mismatch against bitmap header (%d)\n", zoneno, loop, foundbits, setbits);
 			}
 
 			foundfree += foundbits * blocksize;
@@ -411,31 +528,73 @@ scan_zone_maps (struct mfs_handle *mfs, zone_bitmap **ckbitmaps)
 
 		if (free != foundfree)
 		{
-			printf ("Zone %d free space (%d) does not match header (%d)\n", zoneno, foundfree, free);
+			scan_message ("zone", "zone", zoneno, "Zone %d free space (%d) does not match header (%d)\n", zoneno, foundfree, free);
 		}
 		totalfree += foundfree;
 	}
 
-	printf ("Total: %" PRId64 " free sectors in %d chunks across %d zone maps\n", totalfree, totalbits, zoneno + 1);
+	if (scan_json)
+	{
+		jsonl_begin (stdout, "zone_summary");
+		jsonl_uint (stdout, "free_sectors", totalfree);
+		jsonl_int (stdout, "free_chunks", totalbits);
+		jsonl_int (stdout, "zones", zoneno + 1);
+		jsonl_end (stdout);
+	}
+	else
+		printf ("Total: %" PRId64 " free sectors in %d chunks across %d zone maps\n", totalfree, totalbits, zoneno + 1);
 }
 
 void
 set_fsid_range (zone_bitmap *bitmap, int startbit, int endbit, unsigned int fsid)
 {
+	uint32_t *fsids;
+	uint32_t *end;
+
 	if (!bitmap->fsids)
 	{
 		bitmap->fsids = calloc (4, (bitmap->last + 1 - bitmap->first) / bitmap->blocksize);
 	}
 
-	while (startbit <= endbit)
+	fsids = bitmap->fsids + startbit;
+	end = bitmap->fsids + endbit;
+	while (fsids <= end)
 	{
-		bitmap->fsids[startbit] = fsid;
-		startbit++;
+		*fsids++ = fsid;
 	}
 }
 
+/* Report the blocks of an inode from startbit up to bitno that another */
+/* fsid holds, or that are free.  The text has always given the block at */
+/* bitno, just past the range; the record gives where the range starts. */
 void
-scan_inode_overlap (zone_bitmap *bitmap, unsigned int curinode, mfs_inode *inode, int bitno, int bitcount)
+scan_overlap_report (zone_bitmap *bitmap, unsigned int curinode, unsigned int fsid, int startbit, int bitno, int otherfsid)
+{
+	int size = (bitno - startbit) * bitmap->blocksize;
+
+	if (scan_json)
+	{
+		jsonl_begin (stdout, otherfsid > 0? "overlap": "marked_free");
+		jsonl_int (stdout, "inode", curinode);
+		jsonl_uint (stdout, "fsid", fsid);
+		jsonl_uint (stdout, "sector", (uint64_t)startbit * bitmap->blocksize + bitmap->first);
+		jsonl_int (stdout, "sectors", size);
+		if (otherfsid > 0)
+			jsonl_int (stdout, "other_fsid", otherfsid);
+		jsonl_end (stdout);
+	}
+	else if (otherfsid > 0)
+	{
+		printf ("Inode %d fsid %d data block %" PRId64 " size %d overlaps with fsid %d\n", curinode, fsid, bitno * bitmap->blocksize + bitmap->first, size, otherfsid);
+	}
+	else
+	{
+		printf ("Inode %d fsid %d data block %" PRId64 " size %d marked free in zone map\n", curinode, fsid, bitno * bitmap->blocksize + bitmap->first, size);
+	}
+}
+
+void
+scan_inode_overlap (zone_bitmap *bitmap, unsigned int curinode, unsigned int fsid, int bitno, int bitcount)
 {
 	int rangestart = -1;
 	int rangefsid = 0;
@@ -452,14 +611,7 @@ scan_inode_overlap (zone_bitmap *bitmap, unsigned int curinode, mfs_inode *inode
 
 		if (((newfsid != rangefsid && (rangefsid != 0 || rangestart >= 0))) || (rangestart >= 0 && isclear))
 		{
-			if (rangefsid > 0)
-			{
-				printf ("Inode %d fsid %d data block %" PRId64 " size %d overlaps with fsid %d\n", curinode, intswap32 (inode->fsid), bitno * bitmap->blocksize + bitmap->first, (bitno - rangestart) * bitmap->blocksize, rangefsid);
-			}
-			else
-			{
-				printf ("Inode %d fsid %d data block %" PRId64 " size %d marked free in zone map\n", curinode, intswap32 (inode->fsid), bitno * bitmap->blocksize + bitmap->first, (bitno - rangestart) * bitmap->blocksize);
-			}
+			scan_overlap_report (bitmap, curinode, fsid, rangestart, bitno, rangefsid);
 			if (isclear)
 			{
 				rangestart = -1;
@@ -486,283 +638,793 @@ scan_inode_overlap (zone_bitmap *bitmap, unsigned int curinode, mfs_inode *inode
 		}
 	}
 
-	if (rangefsid > 0)
+	scan_overlap_report (bitmap, curinode, fsid, rangestart, bitno, rangefsid);
+}
+
+/* Inodes are scanned by several workers, each taking its own range of */
+/* inodes.  A worker keeps its messages in a buffer, and the blocks its */
+/* inodes claim in maps of its own.  Afterwards the workers are merged in */
+/* inode order: if a worker's claims don't overlap anything claimed */
+/* before it, its maps are ORed in a word at a time.  Otherwise its claims */
+/* are replayed one at a time, so the overlaps are reported where the */
+/* serial scan would have reported them. */
+
+/* Most threads scanning inodes */
+#define SCAN_MAXTHREADS 16
+/* Threads used when no count is given */
+#define SCAN_MAXAUTO 8
+
+enum scan_record_type
+{
+	srClaim,
+	srReadError
+};
+
+/* Something to do at a point in a worker's messages */
+struct scan_record
+{
+	size_t textpos;				/* Messages before this record */
+	enum scan_record_type type;
+	unsigned int inode;
+	unsigned int fsid;
+	int map;
+	int bitno;
+	int bitcount;
+};
+
+/* Range of inodes from first up to last that need to be chained */
+struct scan_chain
+{
+	int first;
+	int last;
+};
+
+struct scan_worker
+{
+	struct mfs_handle *mfs;
+	zone_bitmap *bitmaps;		/* Shared, only read while scanning */
+	int first;
+	int last;
+	int maxinode;
+	int maxblocks;
+	unsigned char *chained_inodes;
+
+	zone_bitmap *claims;		/* Own copy of each zone map */
+	int nmaps;
+	int selfoverlap;			/* Two of this worker's claims overlap */
+	int nomem;
+
+	char *text;
+	size_t textlen;
+	size_t textalloc;
+	struct scan_record *records;
+	unsigned int nrecords;
+	unsigned int recordalloc;
+	struct scan_chain *chains;
+	unsigned int nchains;
+	unsigned int chainalloc;
+
+	int nchained;
+	int chainlength;
+	int maxchainlength;
+	int allocinode;
+#if HAVE_PTHREAD_H
+	pthread_t thread;
+#endif
+};
+
+void
+scan_vprintf (struct scan_worker *w, const char *fmt, va_list ap)
+{
+	va_list aq;
+	char *tmp;
+	int len;
+
+	for (;;)
+	{
+		va_copy (aq, ap);
+		len = vsnprintf (w->text + w->textlen, w->textalloc - w->textlen, fmt, aq);
+		va_end (aq);
+
+		if (len < 0)
+			return;
+		if (w->textlen + len < w->textalloc)
+			break;
+
+		tmp = realloc (w->text, w->textalloc * 2 + len + 1);
+		if (!tmp)
+		{
+			w->nomem = 1;
+			return;
+		}
+		w->text = tmp;
+		w->textalloc = w->textalloc * 2 + len + 1;
+	}
+
+	w->textlen += len;
+}
+
+void
+scan_printf (struct scan_worker *w, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start (ap, fmt);
+	scan_vprintf (w, fmt, ap);
+	va_end (ap);
+}
+
+/* Report a problem with an inode into the worker's buffer, as text or */
+/* as an "inode" record.  An fsid of 0 is left out of the record. */
+void
+scan_inode_report (struct scan_worker *w, int curinode, unsigned int fsid, const char *fmt, ...)
+{
+	va_list ap;
+	char msg[512];
+	char quoted[sizeof (msg) * 6 + 3];
+	int len;
+
+	va_start (ap, fmt);
+	if (!scan_json)
 	{
-		printf ("Inode %d fsid %d data block %" PRId64 " size %d overlaps with fsid %d\n", curinode, intswap32 (inode->fsid), bitno * bitmap->blocksize + bitmap->first, (bitno - rangestart) * bitmap->blocksize, rangefsid);
+		scan_vprintf (w, fmt, ap);
+		va_end (ap);
+		return;
 	}
+	vsnprintf (msg, sizeof (msg), fmt, ap);
+	va_end (ap);
+
+	len = strlen (msg);
+	if (len > 0 && msg[len - 1] == '\n')
+		msg[len - 1] = 0;
+	jsonl_quote (quoted, sizeof (quoted), msg);
+
+	if (fsid)
+		scan_printf (w, "{\"type\":\"inode\",\"inode\":%d,\"fsid\":%u,\"message\":%s}\n", curinode, fsid, quoted);
 	else
+		scan_printf (w, "{\"type\":\"inode\",\"inode\":%d,\"message\":%s}\n", curinode, quoted);
+}
+
+void
+scan_record_add (struct scan_worker *w, enum scan_record_type type, unsigned int inode, unsigned int fsid, int map, int bitno, int bitcount)
+{
+	struct scan_record *rec;
+
+	if (w->nrecords >= w->recordalloc)
 	{
-		printf ("Inode %d fsid %d data block %" PRId64 " size %d marked free in zone map\n", curinode, intswap32 (inode->fsid), bitno * bitmap->blocksize + bitmap->first, (bitno - rangestart) * bitmap->blocksize);
+		unsigned int newalloc = w->recordalloc? w->recordalloc * 2: 1024;
+		struct scan_record *tmp = realloc (w->records, newalloc * sizeof (*tmp));
+		if (!tmp)
+		{
+			w->nomem = 1;
+			return;
+		}
+		w->records = tmp;
+		w->recordalloc = newalloc;
 	}
+
+	rec = &w->records[w->nrecords++];
+	rec->textpos = w->textlen;
+	rec->type = type;
+	rec->inode = inode;
+	rec->fsid = fsid;
+	rec->map = map;
+	rec->bitno = bitno;
+	rec->bitcount = bitcount;
 }
 
 void
-scan_inodes (struct mfs_handle *mfs, zone_bitmap *bitmaps)
+scan_chain_add (struct scan_worker *w, int first, int last)
 {
-	int curinode = 0;
-	int maxinode = mfs_inode_count (mfs);
-	int loop;
+	if (w->nchains >= w->chainalloc)
+	{
+		unsigned int newalloc = w->chainalloc? w->chainalloc * 2: 256;
+		struct scan_chain *tmp = realloc (w->chains, newalloc * sizeof (*tmp));
+		if (!tmp)
+		{
+			w->nomem = 1;
+			return;
+		}
+		w->chains = tmp;
+		w->chainalloc = newalloc;
+	}
 
-	int nchained = 0;
-	int chainlength = 0;
-	int maxchainlength = 0;
-	int extrachained = 0;
-	int needchained = 0;
-	int allocinode = 0;
+	w->chains[w->nchains].first = first;
+	w->chains[w->nchains].last = last;
+	w->nchains++;
+}
+
+int
+scan_claim (struct scan_worker *w, int map, int bitno, int bitcount)
+{
+	zone_bitmap *claims = &w->claims[map];
 
-	int maxblocks = 0;
+	if (!claims->bits)
+	{
+		int nbits = (claims->last + 1 - claims->first) / claims->blocksize;
+
+		claims->bits = calloc ((nbits + 31) / 32, 4);
+		if (!claims->bits)
+		{
+			w->nomem = 1;
+			return -1;
+		}
+	}
+
+	if (!scan_bit_range (claims, bitno, bitno + bitcount - 1, 0))
+	{
+		w->selfoverlap = 1;
+	}
+	set_bit_range (claims, bitno, bitno + bitcount - 1);
+
+	return 0;
+}
+
+void
+scan_inode_check (struct scan_worker *w, int curinode)
+{
+	struct mfs_handle *mfs = w->mfs;
+	int maxinode = w->maxinode;
+	int maxblocks = w->maxblocks;
+	int loop;
 
 	mfs_inode *inode;
 
-	// Bit 1 = chain needed, bit 2 = chain set
-	unsigned char *chained_inodes = calloc (1, maxinode);
+	inode = mfs_read_inode (mfs, curinode);
 
-	if (mfs_is_64bit (mfs))
+	if (!inode)
 	{
-		maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d64[0]);
+		/* The error is kept in the shared handle, so it is looked up later */
+		scan_record_add (w, srReadError, curinode, 0, 0, 0, 0);
+		return;
 	}
-	else
+
+	switch (intswap32 (inode->sig))
+	{
+	case MFS32_INODE_SIG:
+		if (mfs_is_64bit (mfs))
+		{
+			scan_inode_report (w, curinode, 0, "Inode %d claims to be 32 bit in 64 bit volume\n", curinode);
+		}
+		break;
+	case MFS64_INODE_SIG:
+		if (!mfs_is_64bit (mfs))
+		{
+			scan_inode_report (w, curinode, 0, "Inode %d claims to be 64 bit in 32 bit volume\n", curinode);
+		}
+		break;
+	default:
+		scan_inode_report (w, curinode, 0, "Inode %d unknown signature %08x\n", curinode, intswap32 (inode->sig));
+		break;
+	}
+
+	/* Mark if this inode is chained */
+	if (inode->inode_flags & intswap32 (INODE_CHAINED))
 	{
-		maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d32[0]);
+		w->chained_inodes[curinode] |= 2;
 	}
 
-	for (curinode = 0; curinode < maxinode; curinode++)
+	if (inode->fsid)
 	{
-		inode = mfs_read_inode (mfs, curinode);
+		int curchainlength = 0;
+		int expectedzonetype;
 
-		if (!inode)
+		w->allocinode++;
+
+		/* Mark if this fsid needs any inodes before it chained */
+		/* The marks can land in another worker's range, so they are */
+		/* only noted here and set once all the workers are done */
+		loop = intswap32 (inode->fsid) * MFS_FSID_HASH % maxinode;
+		curchainlength = (curinode + maxinode - loop) % maxinode;
+
+		/* Track statistics on chained inodes */
+		if (curchainlength > 0)
 		{
-			if (mfs_has_error (mfs))
-			{
-				char msg[1024];
-				mfs_strerror (mfs, msg);
-				printf ("Error reading inode %d: %s\n", curinode, msg);
-				mfs_clearerror (mfs);
-			}
-			else
-			{
-				printf ("Error reading inode %d: Unknown\n", curinode);
-			}
-			continue;
+			scan_chain_add (w, loop, curinode);
+			w->nchained++;
+			w->chainlength += curchainlength;
+			if (curchainlength > w->maxchainlength)
+				w->maxchainlength = curchainlength;
+		}
+
+		if (intswap32 (inode->inode) != curinode)
+		{
+			scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d inode number mismatch with data %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->inode));
+		}
+
+		if (!inode->refcount)
+		{
+			scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d has zero reference count\n", curinode, intswap32 (inode->fsid));
 		}
 
-		switch (intswap32 (inode->sig))
+		switch (inode->type)
 		{
-		case MFS32_INODE_SIG:
-			if (mfs_is_64bit (mfs))
+		case tyStream:
+			if (inode->blocksize != inode->unk3)
 			{
-				printf ("Inode %d claims to be 32 bit in 64 bit volume\n", curinode);
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d stream total block blocksize %d mismatch used block blocksize %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->unk3), intswap32 (inode->blocksize));
 			}
-			break;
-		case MFS64_INODE_SIG:
-			if (!mfs_is_64bit (mfs))
+			if (intswap32 (inode->size) < intswap32 (inode->blockused))
+			{
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d stream total block count %d less than used block count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), intswap32 (inode->blockused));
+			}
+			expectedzonetype = ztMedia;
+			if (inode->zone != 1)
 			{
-				printf ("Inode %d claims to be 64 bit in 32 bit volume\n", curinode);
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d marked for data type %d (Expect 1)\n", curinode, intswap32 (inode->fsid), inode->zone);
 			}
 			break;
 		default:
-			printf ("Inode %d unknown signature %08x\n", curinode, intswap32 (inode->sig));
+			scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d unknown type %d\n", curinode, intswap32 (inode->fsid), inode->type);
+			/* Intentionally fall through */
+		case tyFile:
+		case tyDir:
+		case tyDb:
+			if (inode->blocksize || inode->blockused || inode->unk3)
+			{
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d non-stream inode defines stream block sizes\n", curinode, intswap32 (inode->fsid));
+			}
+			expectedzonetype = ztApplication;
+			if (inode->zone != 2)
+			{
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d marked for data type %d (Expect 2)\n", curinode, intswap32 (inode->fsid), inode->zone);
+			}
 			break;
 		}
 
-		/* Mark if this inode is chained */
-		if (inode->inode_flags & intswap32 (INODE_CHAINED))
+		if (inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2))
 		{
-			chained_inodes[curinode] |= 2;
-		}
-
-		if (inode->fsid)
-		{
-			int curchainlength = 0;
-			int expectedzonetype;
-
-			allocinode++;
-
-			/* Mark if this fsid needs any inodes before it chained */
-			loop = intswap32 (inode->fsid) * MFS_FSID_HASH % maxinode;
-			while (loop != curinode)
+			if (inode->numblocks)
 			{
-				chained_inodes[loop] |= 1;
-				curchainlength++;
-				loop = (loop + 1) % maxinode;
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d has data in inode block and non-zero extent count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks));
 			}
 
-			/* Track statistics on chained inodes */
-			if (curchainlength > 0)
+			if (intswap32 (inode->size) + sizeof (*inode) > 512)
 			{
-				nchained++;
-				chainlength += curchainlength;
-				if (curchainlength > maxchainlength)
-					maxchainlength = curchainlength;
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d has data in inode block but size %d greather than max allowed %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), (int) (512 - sizeof (*inode)));
 			}
 
-			if (intswap32 (inode->inode) != curinode)
+			if (inode->type == tyStream)
 			{
-				printf ("Inode %d fsid %d inode number mismatch with data %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->inode));
+				scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d has data in inode block with tyStream data type\n", curinode, intswap32 (inode->fsid));
 			}
+		}
+		else if (intswap32 (inode->numblocks) > maxblocks)
+		{
+			scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d has more extents (%d) than max (%d)\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks), maxblocks);
+		}
+		else
+		{
+			uint64_t totalsize=0;
 
-			if (!inode->refcount)
+			for (loop = 0; loop < intswap32 (inode->numblocks); loop++)
 			{
-				printf ("Inode %d fsid %d has zero reference count\n", curinode, intswap32 (inode->fsid));
-			}
+				uint64_t sector;
+				uint32_t count;
+				int bitno;
+				int bitcount;
 
-			switch (inode->type)
-			{
-			case tyStream:
-				if (inode->blocksize != inode->unk3)
-				{
-					printf ("Inode %d fsid %d stream total block blocksize %d mismatch used block blocksize %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->unk3), intswap32 (inode->blocksize));
-				}
-				if (intswap32 (inode->size) < intswap32 (inode->blockused))
+				if (mfs_is_64bit (mfs))
 				{
-					printf ("Inode %d fsid %d stream total block count %d less than used block count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), intswap32 (inode->blockused));
+					sector = sectorswap64 (inode->datablocks.d64[loop].sector);
+					count = intswap32 (inode->datablocks.d64[loop].count);
 				}
-				expectedzonetype = ztMedia;
-				if (inode->zone != 1)
+				else
 				{
-					printf ("Inode %d fsid %d marked for data type %d (Expect 1)\n", curinode, intswap32 (inode->fsid), inode->zone);
+					sector = intswap32 (inode->datablocks.d32[loop].sector);
+					count = intswap32 (inode->datablocks.d32[loop].count);
 				}
-				break;
-			default:
-				printf ("Inode %d fsid %d unknown type %d\n", curinode, intswap32 (inode->fsid), inode->type);
-				/* Intentionally fall through */
-			case tyFile:
-			case tyDir:
-			case tyDb:
-				if (inode->blocksize || inode->blockused || inode->unk3)
+
+				totalsize += count;
+
+				zone_bitmap *bitmapforblock = w->bitmaps;
+				int map = 0;
+				while (bitmapforblock->first > sector || bitmapforblock->last < sector)
 				{
-					printf ("Inode %d fsid %d non-stream inode defines stream block sizes\n", curinode, intswap32 (inode->fsid));
+					bitmapforblock = bitmapforblock->next;
+					map++;
 				}
-				expectedzonetype = ztApplication;
-				if (inode->zone != 2)
+
+				if (!bitmapforblock)
 				{
-					printf ("Inode %d fsid %d marked for data type %d (Expect 2)\n", curinode, intswap32 (inode->fsid), inode->zone);
+					scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d extent %d (Sector %" PRId64 " size %d) not within any zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
+					continue;
 				}
-				break;
-			}
 
-			if (inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2))
-			{
-				if (inode->numblocks)
+				if (expectedzonetype != bitmapforblock->type)
 				{
-					printf ("Inode %d fsid %d has data in inode block and non-zero extent count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks));
+					scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d expected zone type %d but extent %d is in type %d\n", curinode, intswap32 (inode->fsid), expectedzonetype, loop, bitmapforblock->type);
 				}
 
-				if (intswap32 (inode->size) + sizeof (*inode) > 512)
+				if ((sector - bitmapforblock->first) % bitmapforblock->blocksize)
 				{
-					printf ("Inode %d fsid %d has data in inode block but size %d greather than max allowed %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), (int) (512 - sizeof (*inode)));
+					scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d extent %d (Sector %" PRId64 " size %d) not aligned inside zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
+					continue;
 				}
 
-				if (inode->type == tyStream)
+				if (count % bitmapforblock->blocksize)
 				{
-					printf ("Inode %d fsid %d has data in inode block with tyStream data type\n", curinode, intswap32 (inode->fsid));
+					scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d extent %d (Sector %" PRId64 " size %d) size not a multiple of zone block size\n", curinode, intswap32 (inode->fsid), loop, sector, count);
+					continue;
 				}
+
+				/* Claim the range in this worker's own maps.  Whether it */
+				/* was marked already is checked against the other */
+				/* workers and the zone maps when the claims are merged */
+				bitno = (sector - bitmapforblock->first) / bitmapforblock->blocksize;
+				bitcount = count / bitmapforblock->blocksize;
+				if (scan_claim (w, map, bitno, bitcount) < 0)
+					break;
+				scan_record_add (w, srClaim, curinode, intswap32 (inode->fsid), map, bitno, bitcount);
 			}
-			else if (intswap32 (inode->numblocks) > maxblocks)
+
+			if (inode->type == tyStream)
 			{
-				printf ("Inode %d fsid %d has more extents (%d) than max (%d)\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks), maxblocks);
+				if (totalsize*512 < intswap32 (inode->size) * intswap32 (inode->unk3))
+				{
+					scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d allocated size (%" PRId64 ") less than data size (%" PRId64 ")\n", curinode, intswap32 (inode->fsid), totalsize*512, (uint64_t)intswap32 (inode->size) * (uint64_t)intswap32 (inode->unk3));
+				}
 			}
 			else
 			{
-				uint64_t totalsize=0;
-
-				for (loop = 0; loop < intswap32 (inode->numblocks); loop++)
+				if (totalsize*512 < intswap32 (inode->size))
 				{
-					uint64_t sector;
-					uint32_t count;
-					int bitno;
-					int bitcount;
+					scan_inode_report (w, curinode, intswap32 (inode->fsid), "Inode %d fsid %d allocated size (%" PRId64 ") less than data%s size (%" PRId64 ")\n", curinode, intswap32 (inode->fsid), totalsize*512, intswap32 (inode->numblocks) ? "" : " (in inode)", (uint64_t)intswap32 (inode->size));
+				}
+			}
+		}
+	}
+	else
+	{
+		if (inode->refcount)
+		{
+			scan_inode_report (w, curinode, 0, "Inode %d has %d references and no fsid\n", curinode, intswap32 (inode->refcount));
+		}
 
-					if (mfs_is_64bit (mfs))
-					{
-						sector = sectorswap64 (inode->datablocks.d64[loop].sector);
-						count = intswap32 (inode->datablocks.d64[loop].count);
-					}
-					else
-					{
-						sector = intswap32 (inode->datablocks.d32[loop].sector);
-						count = intswap32 (inode->datablocks.d32[loop].count);
-					}
+		if (inode->numblocks)
+		{
+			scan_inode_report (w, curinode, 0, "Inode %d free but has datablocks allocated to it\n", curinode);
+		}
+	}
 
-					totalsize += count;
+	free (inode);
+}
 
-					zone_bitmap *bitmapforblock = bitmaps;
-					while (bitmapforblock->first > sector || bitmapforblock->last < sector)
-						bitmapforblock = bitmapforblock->next;
+void
+scan_inode_range (struct scan_worker *w)
+{
+	int curinode;
 
-					if (!bitmapforblock)
-					{
-						printf ("Inode %d fsid %d extent %d (Sector %" PRId64 " size %d) not within any zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
-						continue;
-					}
+	for (curinode = w->first; curinode < w->last && !w->nomem; curinode++)
+	{
+		scan_inode_check (w, curinode);
+	}
+}
 
-					if (expectedzonetype != bitmapforblock->type)
-					{
-						printf ("Inode %d fsid %d expected zone type %d but extent %d is in type %d\n", curinode, intswap32 (inode->fsid), expectedzonetype, loop, bitmapforblock->type);
-					}
+#if HAVE_PTHREAD_H
+void *
+scan_inode_thread (void *arg)
+{
+	scan_inode_range (arg);
+	return NULL;
+}
+#endif
 
-					if ((sector - bitmapforblock->first) % bitmapforblock->blocksize)
-					{
-						printf ("Inode %d fsid %d extent %d (Sector %" PRId64 " size %d) not aligned inside zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
-						continue;
-					}
+/* Does anything this worker claimed overlap what is claimed already? */
+int
+scan_claims_overlap (struct scan_worker *w, zone_bitmap *bitmaps)
+{
+	int map;
 
-					if (count % bitmapforblock->blocksize)
-					{
-						printf ("Inode %d fsid %d extent %d (Sector %" PRId64 " size %d) size not a multiple of zone block size\n", curinode, intswap32 (inode->fsid), loop, sector, count);
-						continue;
-					}
+	if (w->selfoverlap)
+		return 1;
 
-					/* Make sure the range isn't marked already */
-					bitno = (sector - bitmapforblock->first) / bitmapforblock->blocksize;
-					bitcount = count / bitmapforblock->blocksize;
-					if (!scan_bit_range (bitmapforblock, bitno, bitno + bitcount - 1, 0))
-					{
-						scan_inode_overlap (bitmapforblock, curinode, inode, bitno, bitcount);
-					}
-					set_bit_range (bitmapforblock, bitno, bitno + bitcount - 1);
-					set_fsid_range (bitmapforblock, bitno, bitno + bitcount - 1, intswap32 (inode->fsid));
-				}
+	for (map = 0; map < w->nmaps; map++, bitmaps = bitmaps->next)
+	{
+		int nints = ((bitmaps->last + 1 - bitmaps->first) / bitmaps->blocksize + 31) / 32;
+		int loop;
 
-				if (inode->type == tyStream)
-				{
-					if (totalsize*512 < intswap32 (inode->size) * intswap32 (inode->unk3))
-					{
-						printf ("Inode %d fsid %d allocated size (%" PRId64 ") less than data size (%" PRId64 ")\n", curinode, intswap32 (inode->fsid), totalsize*512, (uint64_t)intswap32 (inode->size) * (uint64_t)intswap32 (inode->unk3));
-					}
-				}
-				else
-				{
-					if (totalsize*512 < intswap32 (inode->size))
-					{
-						printf ("Inode %d fsid %d allocated size (%" PRId64 ") less than data%s size (%" PRId64 ")\n", curinode, intswap32 (inode->fsid), totalsize*512, intswap32 (inode->numblocks) ? "" : " (in inode)", (uint64_t)intswap32 (inode->size));
-					}
-				}
+		if (!w->claims[map].bits)
+			continue;
+
+		for (loop = 0; loop < nints; loop++)
+		{
+			if (bitmaps->bits[loop] & w->claims[map].bits[loop])
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+void
+scan_merge_worker (struct scan_worker *w, zone_bitmap **maps)
+{
+	int replay = scan_claims_overlap (w, maps[0]);
+	size_t textpos = 0;
+	unsigned int loop;
+	int map;
+
+	for (loop = 0; loop < w->nrecords; loop++)
+	{
+		struct scan_record *rec = &w->records[loop];
+		zone_bitmap *bitmap = maps[rec->map];
+
+		fwrite (w->text + textpos, 1, rec->textpos - textpos, stdout);
+		textpos = rec->textpos;
+
+		if (rec->type == srReadError)
+		{
+			/* Read it again here to find out why it failed */
+			mfs_inode *inode;
+
+			mfs_clearerror (w->mfs);
+			inode = mfs_read_inode (w->mfs, rec->inode);
+			if (!inode && mfs_has_error (w->mfs))
+			{
+				char msg[1024];
+				mfs_strerror (w->mfs, msg);
+				scan_message ("inode_error", "inode", rec->inode, "Error reading inode %d: %s\n", rec->inode, msg);
+				mfs_clearerror (w->mfs);
 			}
+			else
+			{
+				scan_message ("inode_error", "inode", rec->inode, "Error reading inode %d: Unknown\n", rec->inode);
+			}
+			if (inode)
+				free (inode);
+			continue;
 		}
-		else
+
+		/* Make sure the range isn't marked already */
+		if (replay)
 		{
-			if (inode->refcount)
+			if (!scan_bit_range (bitmap, rec->bitno, rec->bitno + rec->bitcount - 1, 0))
 			{
-				printf ("Inode %d has %d references and no fsid\n", curinode, intswap32 (inode->refcount));
+				scan_inode_overlap (bitmap, rec->inode, rec->fsid, rec->bitno, rec->bitcount);
 			}
+			set_bit_range (bitmap, rec->bitno, rec->bitno + rec->bitcount - 1);
+		}
+		set_fsid_range (bitmap, rec->bitno, rec->bitno + rec->bitcount - 1, rec->fsid);
+	}
 
-			if (inode->numblocks)
+	fwrite (w->text + textpos, 1, w->textlen - textpos, stdout);
+
+	if (w->nomem)
+	{
+		scan_message ("error", NULL, 0, "Out of memory scanning inodes %d to %d\n", w->first, w->last - 1);
+	}
+
+	/* Nothing overlapped, so the claims go in a word at a time */
+	for (map = 0; !replay && map < w->nmaps; map++)
+	{
+		int nints = ((maps[map]->last + 1 - maps[map]->first) / maps[map]->blocksize + 31) / 32;
+		int word;
+
+		if (!w->claims[map].bits)
+			continue;
+
+		for (word = 0; word < nints; word++)
+		{
+			maps[map]->bits[word] |= w->claims[map].bits[word];
+		}
+	}
+}
+
+/* List the zone maps in order, so they can be found by number */
+zone_bitmap **
+scan_map_list (zone_bitmap *bitmaps, int *nmaps)
+{
+	zone_bitmap **maps;
+	zone_bitmap *bitmap;
+
+	*nmaps = 0;
+	for (bitmap = bitmaps; bitmap; bitmap = bitmap->next)
+		(*nmaps)++;
+
+	maps = calloc (*nmaps + 1, sizeof (*maps));
+	if (!maps)
+		return NULL;
+
+	*nmaps = 0;
+	for (bitmap = bitmaps; bitmap; bitmap = bitmap->next)
+		maps[(*nmaps)++] = bitmap;
+
+	return maps;
+}
+
+int
+scan_worker_init (struct scan_worker *w, struct mfs_handle *mfs, zone_bitmap **maps, int nmaps, unsigned char *chained_inodes)
+{
+	mfs_inode *inode;
+	int map;
+
+	w->mfs = mfs;
+	w->bitmaps = maps[0];
+	w->maxinode = mfs_inode_count (mfs);
+	if (mfs_is_64bit (mfs))
+	{
+		w->maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d64[0]);
+	}
+	else
+	{
+		w->maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d32[0]);
+	}
+	w->chained_inodes = chained_inodes;
+	w->nmaps = nmaps;
+	w->claims = calloc (nmaps + 1, sizeof (*w->claims));
+	w->textalloc = 4096;
+	w->text = malloc (w->textalloc);
+	if (!w->claims || !w->text)
+	{
+		w->nomem = 1;
+		return -1;
+	}
+
+	for (map = 0; map < nmaps; map++)
+	{
+		w->claims[map].first = maps[map]->first;
+		w->claims[map].last = maps[map]->last;
+		w->claims[map].blocksize = maps[map]->blocksize;
+		w->claims[map].type = maps[map]->type;
+	}
+
+	return 0;
+}
+
+void
+scan_worker_free (struct scan_worker *w)
+{
+	int map;
+
+	for (map = 0; w->claims && map < w->nmaps; map++)
+	{
+		if (w->claims[map].bits)
+			free (w->claims[map].bits);
+	}
+	if (w->claims)
+		free (w->claims);
+	if (w->text)
+		free (w->text);
+	if (w->records)
+		free (w->records);
+	if (w->chains)
+		free (w->chains);
+}
+
+void
+scan_inodes (struct mfs_handle *mfs, zone_bitmap *bitmaps, int nthreads)
+{
+	int curinode = 0;
+	int maxinode = mfs_inode_count (mfs);
+	int loop;
+
+	int nchained = 0;
+	int chainlength = 0;
+	int maxchainlength = 0;
+	int extrachained = 0;
+	int needchained = 0;
+	int allocinode = 0;
+
+	struct scan_worker *workers;
+	zone_bitmap **maps;
+	int nmaps = 0;
+	int started;
+
+	// Bit 1 = chain needed, bit 2 = chain set
+	unsigned char *chained_inodes = calloc (1, maxinode);
+
+#if HAVE_PTHREAD_H
+	if (nthreads < 1)
+	{
+#ifdef _SC_NPROCESSORS_ONLN
+		nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+		if (nthreads > SCAN_MAXAUTO)
+			nthreads = SCAN_MAXAUTO;
+	}
+	if (nthreads > SCAN_MAXTHREADS)
+		nthreads = SCAN_MAXTHREADS;
+#else
+	nthreads = 1;
+#endif
+	/* The workers share the partition descriptors, so reads must not seek */
+	if (!tivo_partition_parallel_read ())
+		nthreads = 1;
+	if (nthreads < 1)
+		nthreads = 1;
+	/* Don't bother splitting up tiny volumes */
+	if (nthreads > maxinode / 1024)
+		nthreads = maxinode / 1024 > 0? maxinode / 1024: 1;
+
+	maps = scan_map_list (bitmaps, &nmaps);
+	workers = calloc (nthreads, sizeof (*workers));
+	if (!chained_inodes || !maps || !workers)
+	{
+		scan_message ("error", NULL, 0, "Out of memory scanning inodes\n");
+		if (chained_inodes)
+			free (chained_inodes);
+		if (maps)
+			free (maps);
+		if (workers)
+			free (workers);
+		return;
+	}
+
+	for (loop = 0; loop < nthreads; loop++)
+	{
+		workers[loop].first = (int64_t)maxinode * loop / nthreads;
+		workers[loop].last = (int64_t)maxinode * (loop + 1) / nthreads;
+		scan_worker_init (&workers[loop], mfs, maps, nmaps, chained_inodes);
+	}
+
+	/* The first range is scanned on this thread */
+	started = 1;
+#if HAVE_PTHREAD_H
+	for (; started < nthreads; started++)
+	{
+		if (workers[started].nomem)
+			continue;
+		if (pthread_create (&workers[started].thread, NULL, scan_inode_thread, &workers[started]) != 0)
+			break;
+	}
+#endif
+	if (!workers[0].nomem)
+		scan_inode_range (&workers[0]);
+
+	/* Anything that couldn't get a thread is scanned here too */
+	for (loop = started; loop < nthreads; loop++)
+	{
+		if (!workers[loop].nomem)
+			scan_inode_range (&workers[loop]);
+	}
+
+#if HAVE_PTHREAD_H
+	/* The chain marks can land in any range, so wait for all of them */
+	for (loop = 1; loop < started; loop++)
+	{
+		if (!workers[loop].nomem)
+			pthread_join (workers[loop].thread, NULL);
+	}
+#endif
+
+	for (loop = 0; loop < nthreads; loop++)
+	{
+		struct scan_worker *w = &workers[loop];
+		unsigned int chain;
+
+		if (w->text)
+			scan_merge_worker (w, maps);
+		else
+			scan_message ("error", NULL, 0, "Out of memory scanning inodes %d to %d\n", w->first, w->last - 1);
+
+		for (chain = 0; chain < w->nchains; chain++)
+		{
+			for (curinode = w->chains[chain].first; curinode != w->chains[chain].last; curinode = (curinode + 1) % maxinode)
 			{
-				printf ("Inode %d free but has datablocks allocated to it\n", curinode);
+				chained_inodes[curinode] |= 1;
 			}
 		}
 
-		free (inode);
+		nchained += w->nchained;
+		chainlength += w->chainlength;
+		if (w->maxchainlength > maxchainlength)
+			maxchainlength = w->maxchainlength;
+		allocinode += w->allocinode;
+
+		scan_worker_free (w);
 	}
 
+	free (workers);
+	free (maps);
+
 	for (curinode = 0; curinode < maxinode; curinode++)
 	{
 		/* Bit 1 = chain needed, bit 2 = chain set */
 		switch (chained_inodes[curinode])
 		{
 			case 1:
-				printf ("Inode %d requires chained flag, but not set\n", curinode);
+				scan_message ("inode", "inode", curinode, "Inode %d requires chained flag, but not set\n", curinode);
 				needchained++;
 				break;
 			case 2:
@@ -771,66 +1433,436 @@ scan_inodes (struct mfs_handle *mfs, zone_bitmap *bitmaps)
 		}
 	}
 
-	printf ("%d/%d inodes used\n", allocinode, maxinode);
-	if (nchained)
+	if (scan_json)
 	{
-		printf ("%d fsids in chained inodes, %d max inode chain length, %d average length\n", nchained, maxchainlength, (chainlength + nchained / 2) / nchained);
+		jsonl_begin (stdout, "inode_summary");
+		jsonl_int (stdout, "used", allocinode);
+		jsonl_int (stdout, "total", maxinode);
+		jsonl_int (stdout, "chained_fsids", nchained);
+		jsonl_int (stdout, "max_chain_length", maxchainlength);
+		jsonl_int (stdout, "average_chain_length", nchained? (chainlength + nchained / 2) / nchained: 0);
+		jsonl_int (stdout, "extra_chained", extrachained);
+		jsonl_int (stdout, "need_chained", needchained);
+		jsonl_end (stdout);
 	}
-	if (extrachained || needchained)
+	else
 	{
-		printf ("%d inodes unnecessarily chained, %d not chained need to be\n", extrachained, needchained);
+		printf ("%d/%d inodes used\n", allocinode, maxinode);
+		if (nchained)
+		{
+			printf ("%d fsids in chained inodes, %d max inode chain length, %d average length\n", nchained, maxchainlength, (chainlength + nchained / 2) / nchained);
+		}
+		if (extrachained || needchained)
+		{
+			printf ("%d inodes unnecessarily chained, %d not chained need to be\n", extrachained, needchained);
+		}
 	}
 
 	free (chained_inodes);
 }
 
+void
+scan_unclaimed_report (zone_bitmap *bitmap, int startbit, int bitcount)
+{
+	uint64_t sector = (uint64_t)startbit * bitmap->blocksize + bitmap->first;
+	uint64_t size = (uint64_t)bitcount * bitmap->blocksize;
+
+	if (scan_json)
+	{
+		jsonl_begin (stdout, "unclaimed");
+		jsonl_int (stdout, "zone_type", bitmap->type);
+		jsonl_uint (stdout, "sector", sector);
+		jsonl_uint (stdout, "sectors", size);
+		jsonl_end (stdout);
+	}
+	else
+		printf ("Block type %d at %" PRId64 " for %" PRId64 " sectors unclaimed by zone maps or inodes\n", bitmap->type, sector, size);
+}
+
+void
+scan_unclaimed_range (zone_bitmap *bitmap, int startbit, int endbit)
+{
+	int startint = startbit / 32;
+	int endint = endbit / 32;
+	int loop;
+
+	int startunclaimed = -1;
+
+	for (loop = startint; loop <= endint; loop++)
+	{
+		uint32_t word = bitmap->bits[loop];
+		int bit = 0;
+
+		/* Bits outside the range count as claimed, so a run stops there */
+		if (loop == startint)
+		{
+			word |= (1U << (startbit & 31)) - 1;
+		}
+		if (loop == endint && (endbit & 31) != 31)
+		{
+			word |= ~((1U << ((endbit & 31) + 1)) - 1);
+		}
+
+		/* Hop from one end of a run to the next, rather than a bit at a time */
+		while (bit < 32)
+		{
+			if (startunclaimed < 0)
+			{
+				uint32_t clear = ~word >> bit;
+
+				if (!clear)
+					break;
+				bit += scan_ctz (clear);
+				startunclaimed = bit + loop * 32;
+			}
+			else
+			{
+				uint32_t set = word >> bit;
+
+				if (!set)
+					break;
+				bit += scan_ctz (set);
+				scan_unclaimed_report (bitmap, startunclaimed, bit + loop * 32 - startunclaimed);
+				startunclaimed = -1;
+			}
+		}
+	}
+
+	if (startunclaimed >= 0)
+	{
+		scan_unclaimed_report (bitmap, startunclaimed, endbit + 1 - startunclaimed);
+	}
+}
+
 void
 scan_unclaimed_blocks (struct mfs_handle *mfs, zone_bitmap *bitmap)
 {
 	while (bitmap)
 	{
 		int nbits = (bitmap->last + 1 - bitmap->first) / bitmap->blocksize;
-		int nints = (nbits + 31) / 32;
-		int loop;
 
-		int startunclaimed = -1;
+		if (nbits > 0)
+		{
+			scan_unclaimed_range (bitmap, 0, nbits - 1);
+		}
 
-		for (loop = 0; loop < nints; loop++)
+		bitmap = bitmap->next;
+	}
+}
+
+/* Fast check.  Everything the transaction log touched since the last */
+/* sync is collected before the log is replayed: the fsids of inode */
+/* updates, and the fsids and sectors of zone map updates.  Only those */
+/* inodes are checked, and only the bitmap words under those sectors are */
+/* checked for unclaimed blocks.  Overlaps with inodes the log didn't */
+/* touch can't be seen this way; a full check still finds those. */
+struct scan_touched_range
+{
+	uint64_t sector;
+	uint64_t size;
+};
+
+struct scan_touched
+{
+	unsigned int nentries;
+	unsigned int *fsids;
+	unsigned int nfsids;
+	unsigned int fsidalloc;
+	struct scan_touched_range *ranges;
+	unsigned int nranges;
+	unsigned int rangealloc;
+};
+
+int
+scan_touched_fsid (struct scan_touched *touched, unsigned int fsid)
+{
+	if (!fsid)
+		return 0;
+
+	if (touched->nfsids >= touched->fsidalloc)
+	{
+		unsigned int newalloc = touched->fsidalloc? touched->fsidalloc * 2: 256;
+		unsigned int *tmp = realloc (touched->fsids, newalloc * sizeof (*tmp));
+		if (!tmp)
+			return -1;
+		touched->fsids = tmp;
+		touched->fsidalloc = newalloc;
+	}
+
+	touched->fsids[touched->nfsids++] = fsid;
+	return 0;
+}
+
+int
+scan_touched_range (struct scan_touched *touched, uint64_t sector, uint64_t size)
+{
+	if (!size)
+		return 0;
+
+	if (touched->nranges >= touched->rangealloc)
+	{
+		unsigned int newalloc = touched->rangealloc? touched->rangealloc * 2: 256;
+		struct scan_touched_range *tmp = realloc (touched->ranges, newalloc * sizeof (*tmp));
+		if (!tmp)
+			return -1;
+		touched->ranges = tmp;
+		touched->rangealloc = newalloc;
+	}
+
+	touched->ranges[touched->nranges].sector = sector;
+	touched->ranges[touched->nranges].size = size;
+	touched->nranges++;
+	return 0;
+}
+
+int
+scan_compare_fsid (const void *a, const void *b)
+{
+	unsigned int fa = *(const unsigned int *)a;
+	unsigned int fb = *(const unsigned int *)b;
+
+	return fa < fb? -1: fa > fb;
+}
+
+int
+scan_compare_range (const void *a, const void *b)
+{
+	const struct scan_touched_range *ra = a;
+	const struct scan_touched_range *rb = b;
+
+	return ra->sector < rb->sector? -1: ra->sector > rb->sector;
+}
+
+void
+scan_touched_free (struct scan_touched *touched)
+{
+	if (touched->fsids)
+		free (touched->fsids);
+	if (touched->ranges)
+		free (touched->ranges);
+	memset (touched, 0, sizeof (*touched));
+}
+
+/* Collect what the log touched since the last sync.  This has to be done */
+/* before the log is replayed, since the replay moves the sync point. */
+int
+scan_log_touched (struct mfs_handle *mfs, struct scan_touched *touched)
+{
+	struct log_entry_list list;
+	struct log_index *idx;
+	unsigned int start = mfs_log_last_sync (mfs);
+	unsigned int end = ~0;
+	unsigned int loop;
+	int ret = 0;
+
+	memset (touched, 0, sizeof (*touched));
+
+	/* Same range the replay loads */
+	idx = mfs_log_index (mfs);
+	if (idx)
+	{
+		if (idx->empty || (int)(idx->newest - start) <= 0)
+			end = start;
+		else
+			end = idx->newest;
+	}
+	else
+	{
+		mfs_clearerror (mfs);
+	}
+
+	if (mfs_log_load_list (mfs, start + 1, end, &list) != 1)
+		return -1;
+
+	touched->nentries = list.nentries;
+
+	for (loop = 0; loop < list.nentries && ret == 0; loop++)
+	{
+		log_entry_all *entry = &list.entries[loop]->entry;
+
+		/* Short entries are ignored by the replay as well */
+		if (entry->log.length < sizeof (log_entry) + 2)
+			continue;
+
+		switch (intswap32 (entry->log.transtype))
+		{
+		case ltMapUpdate:
+			ret = scan_touched_fsid (touched, intswap32 (entry->log.fsid));
+			if (ret == 0)
+				ret = scan_touched_range (touched, intswap32 (entry->zonemap_32.sector), intswap32 (entry->zonemap_32.size));
+			break;
+		case ltMapUpdate64:
+			ret = scan_touched_fsid (touched, intswap32 (entry->log.fsid));
+			if (ret == 0)
+				ret = scan_touched_range (touched, intswap64 (entry->zonemap_64.sector), intswap64 (entry->zonemap_64.size));
+			break;
+		case ltInodeUpdate:
+		case ltInodeUpdate2:
+			ret = scan_touched_fsid (touched, intswap32 (entry->inode.fsid));
+			break;
+		}
+	}
+
+	mfs_log_free_list (&list);
+	if (ret < 0)
+	{
+		scan_touched_free (touched);
+		return -1;
+	}
+
+	/* The same fsid is usually updated several times */
+	if (touched->nfsids)
+	{
+		unsigned int out = 1;
+
+		qsort (touched->fsids, touched->nfsids, sizeof (*touched->fsids), scan_compare_fsid);
+		for (loop = 1; loop < touched->nfsids; loop++)
+		{
+			if (touched->fsids[loop] != touched->fsids[out - 1])
+				touched->fsids[out++] = touched->fsids[loop];
+		}
+		touched->nfsids = out;
+	}
+
+	/* And overlapping ranges are merged so nothing is reported twice */
+	if (touched->nranges)
+	{
+		unsigned int out = 1;
+
+		qsort (touched->ranges, touched->nranges, sizeof (*touched->ranges), scan_compare_range);
+		for (loop = 1; loop < touched->nranges; loop++)
 		{
-			if (bitmap->bits[loop] != ~0)
+			struct scan_touched_range *prev = &touched->ranges[out - 1];
+
+			if (touched->ranges[loop].sector <= prev->sector + prev->size)
 			{
-				int loop2;
-				for (loop2 = 0; loop2 < 32 && loop2 + loop * 32 < nbits; loop2++)
-				{
-					if (!(bitmap->bits[loop] & (1 << loop2)))
-					{
-						if (startunclaimed < 0)
-						{
-							startunclaimed = loop2 + loop * 32;
-						}
-					}
-					else if (startunclaimed >= 0)
-					{
-						printf ("Block type %d at %" PRId64 " for %" PRId64 " sectors unclaimed by zone maps or inodes\n", bitmap->type, (uint64_t)startunclaimed * bitmap->blocksize + bitmap->first, (uint64_t)(loop2 + loop * 32 - startunclaimed) * bitmap->blocksize);
-						startunclaimed = -1;
-					}
-				}
+				if (touched->ranges[loop].sector + touched->ranges[loop].size > prev->sector + prev->size)
+					prev->size = touched->ranges[loop].sector + touched->ranges[loop].size - prev->sector;
 			}
-			else if (startunclaimed >= 0)
+			else
 			{
-				printf ("Block type %d at %" PRId64 " for %" PRId64 " sectors unclaimed by zone maps or inodes\n", bitmap->type, (uint64_t)startunclaimed * bitmap->blocksize + bitmap->first, (uint64_t)(loop * 32 - startunclaimed) * bitmap->blocksize);
-				startunclaimed = -1;
+				touched->ranges[out++] = touched->ranges[loop];
 			}
 		}
+		touched->nranges = out;
+	}
+
+	return 0;
+}
+
+/* Find the inode holding an fsid, the same way the hash chain is followed */
+/* when looking it up.  Returns -1 if it isn't there. */
+int
+scan_find_fsid (struct mfs_handle *mfs, unsigned int fsid, int maxinode)
+{
+	int start = fsid * MFS_FSID_HASH % maxinode;
+	int curinode = start;
+
+	do
+	{
+		mfs_inode *inode = mfs_read_inode (mfs, curinode);
+		int found;
+		int chained;
+
+		/* Let the inode check report the error */
+		if (!inode)
+			return curinode;
+
+		found = intswap32 (inode->fsid) == fsid;
+		chained = inode->inode_flags & intswap32 (INODE_CHAINED);
+		free (inode);
+
+		if (found)
+			return curinode;
+		if (!chained)
+			return -1;
+
+		curinode = (curinode + 1) % maxinode;
+	}
+	while (curinode != start);
+
+	return -1;
+}
+
+void
+scan_touched_check (struct mfs_handle *mfs, zone_bitmap *bitmaps, struct scan_touched *touched)
+{
+	struct scan_worker w;
+	zone_bitmap **maps;
+	unsigned char *chained_inodes;
+	int maxinode = mfs_inode_count (mfs);
+	int nmaps;
+	int gone = 0;
+	unsigned int loop;
+
+	memset (&w, 0, sizeof (w));
+	maps = scan_map_list (bitmaps, &nmaps);
+	chained_inodes = calloc (1, maxinode);
+	if (!maps || !chained_inodes || scan_worker_init (&w, mfs, maps, nmaps, chained_inodes) < 0)
+	{
+		scan_message ("error", NULL, 0, "Out of memory checking inodes\n");
+		scan_worker_free (&w);
+		if (maps)
+			free (maps);
+		if (chained_inodes)
+			free (chained_inodes);
+		return;
+	}
 
-		if (startunclaimed >= 0)
+	for (loop = 0; loop < touched->nfsids && !w.nomem; loop++)
+	{
+		int curinode = scan_find_fsid (mfs, touched->fsids[loop], maxinode);
+
+		/* Deleted since, its blocks are covered by the zone ranges */
+		if (curinode < 0)
 		{
-			printf ("Block type %d at %" PRId64 " for %" PRId64 " sectors unclaimed by zone maps or inodes\n", bitmap->type, (uint64_t)startunclaimed * bitmap->blocksize + bitmap->first, (uint64_t)(nbits - startunclaimed) * bitmap->blocksize);
-			startunclaimed = -1;
+			gone++;
+			continue;
 		}
 
-		bitmap = bitmap->next;
+		scan_inode_check (&w, curinode);
+	}
+
+	scan_merge_worker (&w, maps);
+	scan_worker_free (&w);
+
+	if (scan_json)
+	{
+		jsonl_begin (stdout, "touched_summary");
+		jsonl_int (stdout, "checked", touched->nfsids - gone);
+		jsonl_int (stdout, "gone", gone);
+		jsonl_end (stdout);
 	}
+	else
+		printf ("%d fsids checked, %d no longer in use\n", touched->nfsids - gone, gone);
+
+	scan_phase ("touched_unclaimed", "Checking touched blocks for unclaimed space...\n");
+	for (loop = 0; loop < touched->nranges; loop++)
+	{
+		uint64_t sector = touched->ranges[loop].sector;
+		uint64_t last = sector + touched->ranges[loop].size - 1;
+		zone_bitmap *bitmap;
+
+		for (bitmap = bitmaps; bitmap; bitmap = bitmap->next)
+		{
+			if (bitmap->first <= sector && bitmap->last >= sector)
+				break;
+		}
+
+		if (!bitmap)
+		{
+			scan_message ("log", NULL, 0, "Log zone update at %" PRId64 " for %" PRId64 " sectors not within any zone\n", sector, touched->ranges[loop].size);
+			continue;
+		}
+
+		if (last > bitmap->last)
+			last = bitmap->last;
+
+		scan_unclaimed_range (bitmap, (sector - bitmap->first) / bitmap->blocksize, (last - bitmap->first) / bitmap->blocksize);
+	}
+
+	free (maps);
+	free (chained_inodes);
 }
 
 int
@@ -843,13 +1875,16 @@ mfsck_main (int argc, char **argv)
 	int inconsistent = 0;
 	int esata = 0;
 	int doreval = 0;
+	int nthreads = 0;
+	int fastcheck = 0;
+	struct scan_touched touched;
 
 	tivo_partition_direct ();
 
 //#if DEBUG
-	while ((opt = getopt (argc, argv, "hm:e:r")) > 0)
+	while ((opt = getopt (argc, argv, "hm:e:rj:fJ")) > 0)
 //#else
-//	while ((opt = getopt (argc, argv, "hr")) > 0)
+//	while ((opt = getopt (argc, argv, "hrj:fJ")) > 0)
 //#endif
 	{
 		switch (opt)
@@ -885,6 +1920,25 @@ mfsck_main (int argc, char **argv)
 		case 'r':
 			doreval = 1;
 			break;
+		case 'f':
+			fastcheck = 1;
+			break;
+		case 'J':
+			scan_json = 1;
+			break;
+		case 'j':
+			nthreads = strtoul (optarg, &tmp, 10);
+			if (tmp && *tmp)
+			{
+				fprintf (stderr, "%s: Integer argument expected for -j.\n", argv[0]);
+				return 1;
+			}
+			if (nthreads < 1)
+			{
+				fprintf (stderr, "%s: The value for -j must be at least 1.\n", argv[0]);
+				return 1;
+			}
+			break;
 		default:
 			mfsck_usage (argv[0]);
 			return 1;
@@ -1016,7 +2070,41 @@ mfsck_main (int argc, char **argv)
 	}
 //#endif
 
-	printf ("\nChecking zone maps...\n");
+	if (fastcheck)
+	{
+		uint32_t magic = intswap32 (mfsLSB? mfs->vol_hdr.v32.magicLSB: mfs->vol_hdr.v32.magicMSB) & ~MFS_MAGIC_64BIT;
+
+		/* The volume header magic is the clean state marker.  Anything */
+		/* else means the volume itself knows it needs a full check. */
+		if (magic != MFS_MAGIC_OK)
+		{
+			scan_message ("fast_check", NULL, 0, "\nVolume is not marked consistent (0x%08x), doing a full check\n", magic);
+			fastcheck = 0;
+		}
+		else if (scan_log_touched (mfs, &touched) < 0)
+		{
+			if (mfs_has_error (mfs))
+			{
+				char msg[1024];
+				mfs_strerror (mfs, msg);
+				scan_message ("fast_check", NULL, 0, "\nUnable to read the transaction log (%s), doing a full check\n", msg);
+				mfs_clearerror (mfs);
+			}
+			else
+			{
+				scan_message ("fast_check", NULL, 0, "\nUnable to read the transaction log, doing a full check\n");
+			}
+			fastcheck = 0;
+		}
+		else if (touched.nentries == 0)
+		{
+			scan_message ("fast_check", NULL, 0, "\nVolume is marked consistent and nothing was logged since the last sync\n");
+			scan_phase ("done", "Done!\n");
+			return 0;
+		}
+	}
+
+	scan_phase ("zone_maps", "\nChecking zone maps...\n");
 	scan_zone_maps (mfs, &usedblocks);
 
 	while (usedblocks)
@@ -1030,19 +2118,38 @@ mfsck_main (int argc, char **argv)
 		free (tmp);
 	}
 
-	printf ("Replaying transaction log...\n");
+	scan_phase ("log_replay", "Replaying transaction log...\n");
 	mfs_enable_memwrite (mfs);
 	mfs_log_fssync (mfs);
 
-	printf ("Re-scanning zone maps...\n");
+	scan_phase ("zone_maps_replayed", "Re-scanning zone maps...\n");
 	scan_zone_maps (mfs, &usedblocks);
 
-	printf ("Scanning inodes...\n");
-	scan_inodes (mfs, usedblocks);
+	if (fastcheck)
+	{
+		if (scan_json)
+		{
+			jsonl_begin (stdout, "phase");
+			jsonl_string (stdout, "phase", "touched");
+			jsonl_int (stdout, "fsids", touched.nfsids);
+			jsonl_int (stdout, "ranges", touched.nranges);
+			jsonl_int (stdout, "entries", touched.nentries);
+			jsonl_end (stdout);
+		}
+		else
+			printf ("Checking %d fsids and %d zone ranges touched by %d log entries...\n", touched.nfsids, touched.nranges, touched.nentries);
+		scan_touched_check (mfs, usedblocks, &touched);
+		scan_touched_free (&touched);
+	}
+	else
+	{
+		scan_phase ("inodes", "Scanning inodes...\n");
+		scan_inodes (mfs, usedblocks, nthreads);
 
-	printf ("Checking for unclaimed blocks...\n");
-	scan_unclaimed_blocks (mfs, usedblocks);
+		scan_phase ("unclaimed", "Checking for unclaimed blocks...\n");
+		scan_unclaimed_blocks (mfs, usedblocks);
+	}
 
-	printf ("Done!\n");
+	scan_phase ("done", "Done!\n");
 	return 0;
 }
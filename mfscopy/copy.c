@@ -14,6 +14,10 @@
 #include <asm/types.h>
 #endif
 #include <sys/param.h>
+#include <sys/time.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "mfs.h"
 #include "backup.h"
@@ -21,11 +25,33 @@
 
 #define BUFSIZE 512 * 256
 
+/* Most target drive sets copied to at once */
+#define COPY_MAXTARGETS 8
+/* Buffers the source may read ahead of the slowest target */
+#define COPY_RINGSLOTS 16
+
+struct copy_ring;
+
+struct copy_target
+{
+	char drive_a[PATH_MAX];
+	char drive_b[PATH_MAX];
+	char *name;				/* For error messages */
+	struct backup_info *info;
+
+	struct copy_ring *ring;
+	unsigned int consumed;	/* Buffers written to this target */
+	int failed;
+#if HAVE_PTHREAD_H
+	pthread_t thread;
+#endif
+};
+
 void
 copy_usage (char *progname)
 {
 	fprintf (stderr, "%s %s\n", PACKAGE, VERSION);
-	fprintf (stderr, "Usage: %s [options] SourceA[:SourceB] DestA[:DestB]\n", progname);
+	fprintf (stderr, "Usage: %s [options] SourceA[:SourceB] DestA[:DestB] [DestA[:DestB]...]\n", progname);
 	fprintf (stderr, "General options:\n");
 	fprintf (stderr, " -h        Display this help message\n");
 	fprintf (stderr, " -q        Do not display progress\n");
@@ -64,6 +90,7 @@ copy_usage (char *progname)
 	fprintf (stderr, " -z        Zero out partitions not copied\n");
 #endif
 	fprintf (stderr, " -R        Just copy raw blocks (v1) instead of rebuilding data structures (v3)\n");
+	fprintf (stderr, " -n        Pass stream data through the backup format instead of copying it directly\n");
 	fprintf (stderr, " -w 32/64  Write MFS structures as 32 or 64 bit\n");
 	fprintf (stderr, " -c size   Carve (leave free) in blocks on drive A\n");
 	fprintf (stderr, " -C size   Carve (leave free) in blocks on Drive B\n");
@@ -105,13 +132,537 @@ get_drives (char *drives, char *adrive, char *bdrive)
 	//fprintf (stderr, "Drives: %s and %s\n", adrive, bdrive);
 }
 
+/***********************************/
+/* Show how far along the copy is. */
+static void
+copy_progress (uint64_t done, uint64_t total, unsigned starttime)
+{
+	unsigned int prcnt = get_percent (done, total);
+	unsigned timedelta = time(NULL) - starttime;
+
+	fprintf (stderr, "\rCopying %" PRId64 " of %" PRId64 " MiB (%d.%02d%%)", done / 2048, total / 2048, prcnt / 100, prcnt % 100);
+
+	if (prcnt > 100 && timedelta > 15)
+	{
+		unsigned ETA = timedelta * (10000 - prcnt) / prcnt;
+		fprintf (stderr, " %" PRId64 " MiB/sec (ETA %d:%02d:%02d)", done / timedelta / 2048, ETA / 3600, ETA / 60 % 60, ETA % 60);
+	}
+}
+
+/* Buffers read from the source once, and written to every target.  A */
+/* buffer is only reused once all the targets have written it. */
+struct copy_ring
+{
+	unsigned char *buf[COPY_RINGSLOTS];
+	int len[COPY_RINGSLOTS];
+	unsigned int produced;	/* Buffers read from the source */
+	int eof;
+	int stop;				/* Reading the source failed */
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+};
+
+#if HAVE_PTHREAD_H
+/*********************************************************/
+/* Write every buffer read from the source to one target. */
+static void *
+copy_target_thread (void *arg)
+{
+	struct copy_target *t = arg;
+	struct copy_ring *ring = t->ring;
+
+	for (;;)
+	{
+		unsigned int slot;
+		int len;
+
+		pthread_mutex_lock (&ring->lock);
+		while (t->consumed == ring->produced && !ring->eof && !ring->stop)
+			pthread_cond_wait (&ring->cond, &ring->lock);
+		if (ring->stop || t->consumed == ring->produced)
+		{
+			pthread_mutex_unlock (&ring->lock);
+			break;
+		}
+		slot = t->consumed % COPY_RINGSLOTS;
+		len = ring->len[slot];
+		pthread_mutex_unlock (&ring->lock);
+
+/* A failed target drops out, and the others carry on without it */
+		if (restore_write (t->info, ring->buf[slot], len) != len)
+		{
+			pthread_mutex_lock (&ring->lock);
+			t->failed = 1;
+			pthread_cond_broadcast (&ring->cond);
+			pthread_mutex_unlock (&ring->lock);
+			break;
+		}
+
+		pthread_mutex_lock (&ring->lock);
+		t->consumed++;
+		pthread_cond_broadcast (&ring->cond);
+		pthread_mutex_unlock (&ring->lock);
+	}
+
+	return NULL;
+}
+#endif
+
+/*************************************************************************/
+/* Copy the rest of the source to several targets at once.  The source */
+/* is read once into a ring of buffers, and each target writes them on */
+/* its own thread, so the copy runs at the pace of the slowest drive. */
+static int
+copy_fanout (struct backup_info *info_b, struct copy_target *targets, int ntargets, int quiet, unsigned starttime, uint64_t totsectors)
+{
+	struct copy_ring *ring;
+	int loop, working, ret = 0;
+#if HAVE_PTHREAD_H
+	int nthreads;
+#endif
+
+	ring = calloc (sizeof (*ring), 1);
+	if (!ring)
+	{
+		fprintf (stderr, "Copy: Memory exhausted\n");
+		return -1;
+	}
+	for (loop = 0; loop < COPY_RINGSLOTS; loop++)
+	{
+		ring->buf[loop] = malloc (BUFSIZE);
+		if (!ring->buf[loop])
+		{
+			while (loop-- > 0)
+				free (ring->buf[loop]);
+			free (ring);
+			fprintf (stderr, "Copy: Memory exhausted\n");
+			return -1;
+		}
+	}
+	for (loop = 0; loop < ntargets; loop++)
+	{
+		targets[loop].ring = ring;
+		targets[loop].consumed = 0;
+		targets[loop].failed = 0;
+	}
+
+#if HAVE_PTHREAD_H
+	pthread_mutex_init (&ring->lock, NULL);
+	pthread_cond_init (&ring->cond, NULL);
+
+	for (nthreads = 0; nthreads < ntargets; nthreads++)
+		if (pthread_create (&targets[nthreads].thread, NULL, copy_target_thread, &targets[nthreads]) != 0)
+			break;
+
+	if (nthreads == ntargets)
+	{
+		for (;;)
+		{
+			unsigned int slot, oldest;
+			int nread;
+
+/* Wait for the slowest target still working to free up a buffer */
+			pthread_mutex_lock (&ring->lock);
+			for (;;)
+			{
+				oldest = ring->produced;
+				working = 0;
+				for (loop = 0; loop < ntargets; loop++)
+				{
+					if (targets[loop].failed)
+						continue;
+					working++;
+					if (targets[loop].consumed < oldest)
+						oldest = targets[loop].consumed;
+				}
+				if (!working || ring->produced - oldest < COPY_RINGSLOTS)
+					break;
+				pthread_cond_wait (&ring->cond, &ring->lock);
+			}
+			slot = ring->produced % COPY_RINGSLOTS;
+			pthread_mutex_unlock (&ring->lock);
+			if (!working)
+				break;
+
+			nread = backup_read (info_b, ring->buf[slot], BUFSIZE);
+
+			pthread_mutex_lock (&ring->lock);
+			if (nread > 0)
+			{
+				ring->len[slot] = nread;
+				ring->produced++;
+			}
+			else
+			{
+				ring->eof = 1;
+				if (nread < 0)
+					ring->stop = 1;
+			}
+			pthread_cond_broadcast (&ring->cond);
+			pthread_mutex_unlock (&ring->lock);
+
+			if (nread <= 0)
+				break;
+
+/* Progress is shown for the source, as every target sees the same data */
+			if (quiet < 1)
+				copy_progress (info_b->cursector, totsectors, starttime);
+		}
+	}
+	else
+	{
+		pthread_mutex_lock (&ring->lock);
+		ring->stop = 1;
+		pthread_mutex_unlock (&ring->lock);
+		fprintf (stderr, "Copy: Unable to start target threads\n");
+		ret = -1;
+	}
+
+	pthread_mutex_lock (&ring->lock);
+	ring->eof = 1;
+	pthread_cond_broadcast (&ring->cond);
+	pthread_mutex_unlock (&ring->lock);
+	for (loop = 0; loop < nthreads; loop++)
+		pthread_join (targets[loop].thread, NULL);
+
+	pthread_mutex_destroy (&ring->lock);
+	pthread_cond_destroy (&ring->cond);
+#else
+/* Without threads, the targets take turns with each buffer */
+	for (;;)
+	{
+		int nread = backup_read (info_b, ring->buf[0], BUFSIZE);
+
+		if (nread <= 0)
+			break;
+
+		working = 0;
+
+		for (loop = 0; loop < ntargets; loop++)
+		{
+			if (targets[loop].failed)
+				continue;
+			if (restore_write (targets[loop].info, ring->buf[0], nread) != nread)
+				targets[loop].failed = 1;
+			else
+				working++;
+		}
+		if (!working)
+			break;
+
+		if (quiet < 1)
+			copy_progress (info_b->cursector, totsectors, starttime);
+	}
+#endif
+
+	if (quiet < 1)
+		fprintf (stderr, "\n");
+
+	for (loop = 0; loop < COPY_RINGSLOTS; loop++)
+		free (ring->buf[loop]);
+	free (ring);
+
+	if (backup_has_error (info_b))
+	{
+		backup_perror (info_b, "Copy source");
+		ret = -1;
+	}
+
+/* The copy goes on as long as one target is still good */
+	working = 0;
+	for (loop = 0; loop < ntargets; loop++)
+	{
+		if (targets[loop].failed || restore_has_error (targets[loop].info))
+		{
+			if (restore_has_error (targets[loop].info))
+				restore_perror (targets[loop].info, targets[loop].name);
+			else
+				fprintf (stderr, "%s failed.\n", targets[loop].name);
+			targets[loop].failed = 1;
+		}
+		else
+			working++;
+	}
+
+	return working? ret: -1;
+}
+
+/* A single target gets a ring of its own with no locks on the buffer */
+/* path.  The reader thread only ever moves head and the writer only */
+/* ever moves tail.  A side that runs out of buffers or data sleeps on */
+/* the condition, and the other side only takes the lock to wake it if */
+/* it said it was sleeping. */
+struct copy_spsc
+{
+	unsigned char *buf[COPY_RINGSLOTS];
+	int len[COPY_RINGSLOTS];
+	uint64_t usec[COPY_RINGSLOTS];	/* Time taken reading each buffer */
+	unsigned int head;		/* Buffers read from the source */
+	unsigned int tail;		/* Buffers written to the target */
+	int done;				/* The reader is finished */
+	int stop;				/* The writer failed */
+	int readwait;
+	int writewait;
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	struct backup_info *info_b;
+};
+
+#if HAVE_PTHREAD_H && HAVE_ATOMIC_BUILTINS
+/**********************************/
+/* Current time, for copy stats. */
+static uint64_t
+copy_now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**************************************************************************/
+/* Sleep until the ring has room (for the reader) or data (for the */
+/* writer).  The sleeping flag is set before the final check, so a wakeup */
+/* from the other side can't fall between the check and the wait. */
+static void
+copy_spsc_wait (struct copy_spsc *ring, int *waiting, int writer)
+{
+	pthread_mutex_lock (&ring->lock);
+	__atomic_store_n (waiting, 1, __ATOMIC_SEQ_CST);
+	for (;;)
+	{
+		unsigned int head = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST);
+		unsigned int tail = __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST);
+
+		if (writer && (head != tail || __atomic_load_n (&ring->done, __ATOMIC_SEQ_CST)))
+			break;
+		if (!writer && (head - tail < COPY_RINGSLOTS || __atomic_load_n (&ring->stop, __ATOMIC_SEQ_CST)))
+			break;
+		pthread_cond_wait (&ring->cond, &ring->lock);
+	}
+	__atomic_store_n (waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock (&ring->lock);
+}
+
+/*******************************************************/
+/* Wake the other side of the ring, if it is sleeping. */
+static void
+copy_spsc_wake (struct copy_spsc *ring, int *waiting)
+{
+	if (__atomic_load_n (waiting, __ATOMIC_SEQ_CST))
+	{
+		pthread_mutex_lock (&ring->lock);
+		pthread_cond_broadcast (&ring->cond);
+		pthread_mutex_unlock (&ring->lock);
+	}
+}
+
+/************************************************/
+/* Read the source into the ring until it ends. */
+static void *
+copy_spsc_reader (void *arg)
+{
+	struct copy_spsc *ring = arg;
+	unsigned int head = ring->head;
+
+	for (;;)
+	{
+		unsigned int slot = head % COPY_RINGSLOTS;
+		uint64_t start;
+		int nread;
+
+		if (head - __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST) >= COPY_RINGSLOTS)
+			copy_spsc_wait (ring, &ring->readwait, 0);
+		if (__atomic_load_n (&ring->stop, __ATOMIC_SEQ_CST))
+			break;
+
+		start = copy_now ();
+		nread = backup_read (ring->info_b, ring->buf[slot], BUFSIZE);
+		if (nread <= 0)
+			break;
+
+		ring->len[slot] = nread;
+		ring->usec[slot] = copy_now () - start;
+		__atomic_store_n (&ring->head, ++head, __ATOMIC_SEQ_CST);
+		copy_spsc_wake (ring, &ring->writewait);
+	}
+
+	__atomic_store_n (&ring->done, 1, __ATOMIC_SEQ_CST);
+	copy_spsc_wake (ring, &ring->writewait);
+	return NULL;
+}
+
+/*****************************************************************/
+/* Show how fast each side of the copy is going, and how full the */
+/* ring between them is on average. */
+static void
+copy_spsc_stats (uint64_t readbytes, uint64_t readusec, uint64_t writebytes, uint64_t writeusec, uint64_t fill, uint64_t samples)
+{
+	if (!readusec || !writeusec || !samples)
+		return;
+
+	fprintf (stderr, " [read %" PRId64 " MiB/s, write %" PRId64 " MiB/s, ring %" PRId64 ".%" PRId64 "/%d]", readbytes * 1000000 / readusec / 1048576, writebytes * 1000000 / writeusec / 1048576, fill / samples, fill * 10 / samples % 10, COPY_RINGSLOTS);
+}
+#endif
+
+/**************************************************************************/
+/* Copy the rest of the source to a single target.  The source is read */
+/* on a thread of its own, so the source and target drives are both kept */
+/* busy instead of taking turns. */
+static int
+copy_single (struct backup_info *info_b, struct backup_info *info_r, unsigned char *buf, int quiet, unsigned starttime, uint64_t totsectors)
+{
+	int curcount, failed = 0;
+#if HAVE_PTHREAD_H && HAVE_ATOMIC_BUILTINS
+	struct copy_spsc *ring;
+	pthread_t reader;
+	int loop;
+
+/* The reader shares the source descriptors with the direct stream copy, */
+/* which is only safe if reads don't seek them */
+	ring = tivo_partition_parallel_read ()? calloc (sizeof (*ring), 1): 0;
+	for (loop = 0; ring && loop < COPY_RINGSLOTS; loop++)
+	{
+		ring->buf[loop] = malloc (BUFSIZE);
+		if (!ring->buf[loop])
+		{
+			while (loop-- > 0)
+				free (ring->buf[loop]);
+			free (ring);
+			ring = 0;
+		}
+	}
+
+	if (ring)
+	{
+		ring->info_b = info_b;
+		pthread_mutex_init (&ring->lock, NULL);
+		pthread_cond_init (&ring->cond, NULL);
+
+		if (pthread_create (&reader, NULL, copy_spsc_reader, ring) == 0)
+		{
+			uint64_t readbytes = 0, readusec = 0, writebytes = 0, writeusec = 0;
+			uint64_t fill = 0, samples = 0;
+			unsigned int tail = 0;
+
+			for (;;)
+			{
+				unsigned int slot = tail % COPY_RINGSLOTS;
+				unsigned int head;
+				uint64_t start;
+
+				head = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST);
+				if (head == tail)
+				{
+					copy_spsc_wait (ring, &ring->writewait, 1);
+					head = __atomic_load_n (&ring->head, __ATOMIC_SEQ_CST);
+					if (head == tail)
+						break;
+				}
+
+				fill += head - tail;
+				samples++;
+				readbytes += ring->len[slot];
+				readusec += ring->usec[slot];
+
+				start = copy_now ();
+				curcount = restore_write (info_r, ring->buf[slot], ring->len[slot]);
+				writeusec += copy_now () - start;
+				if (curcount != ring->len[slot])
+				{
+					failed = 1;
+					__atomic_store_n (&ring->stop, 1, __ATOMIC_SEQ_CST);
+					copy_spsc_wake (ring, &ring->readwait);
+					break;
+				}
+				writebytes += curcount;
+
+				__atomic_store_n (&ring->tail, ++tail, __ATOMIC_SEQ_CST);
+				copy_spsc_wake (ring, &ring->readwait);
+
+				if (quiet < 1)
+				{
+					copy_progress (info_r->cursector + restore_copy_sectors (info_r), totsectors, starttime);
+					copy_spsc_stats (readbytes, readusec, writebytes, writeusec, fill, samples);
+				}
+			}
+
+			pthread_join (reader, NULL);
+		}
+		else
+		{
+			for (loop = 0; loop < COPY_RINGSLOTS; loop++)
+				free (ring->buf[loop]);
+			pthread_mutex_destroy (&ring->lock);
+			pthread_cond_destroy (&ring->cond);
+			free (ring);
+			ring = 0;
+		}
+	}
+
+	if (ring)
+	{
+		for (loop = 0; loop < COPY_RINGSLOTS; loop++)
+			free (ring->buf[loop]);
+		pthread_mutex_destroy (&ring->lock);
+		pthread_cond_destroy (&ring->cond);
+		free (ring);
+	}
+	else
+#endif
+	{
+/* Without a reader thread, the two sides take turns */
+		while ((curcount = backup_read (info_b, buf, BUFSIZE)) > 0)
+		{
+			if (restore_write (info_r, buf, curcount) != curcount)
+			{
+				failed = 1;
+				break;
+			}
+			if (quiet < 1)
+				copy_progress (info_r->cursector + restore_copy_sectors (info_r), totsectors, starttime);
+		}
+	}
+
+	if (quiet < 1)
+		fprintf (stderr, "\n");
+
+	if (failed)
+	{
+		if (restore_has_error (info_r))
+			restore_perror (info_r, "Copy source");
+		else
+			fprintf (stderr, "Copy source failed.\n");
+		return -1;
+	}
+
+	if (backup_has_error (info_b))
+	{
+		backup_perror (info_b, "Copy source");
+		return -1;
+	}
+
+	if (restore_has_error (info_r))
+	{
+		restore_perror (info_r, "Copy target");
+		return -1;
+	}
+
+	return 0;
+}
+
 int
 copy_main (int argc, char **argv)
 {
 	char source_a[PATH_MAX], source_b[PATH_MAX];
-	char dest_a[PATH_MAX], dest_b[PATH_MAX];
+	static struct copy_target targets[COPY_MAXTARGETS];
+	int ntargets = 0, failed = 0, loop;
 	char *tmp;
-	struct backup_info *info_b, *info_r;
+	struct backup_info *info_b;
 	int opt, threshopt = 0;
 	unsigned int thresh = 0;
 	unsigned int varsize = 0, dbsize = 0, swapsize = 0;
@@ -120,6 +671,7 @@ copy_main (int argc, char **argv)
 	int bswap = 0;
 	int restorebits = 0;
 	int rawcopy = 0;
+	int nodirect = 0;
 	int64_t carveA = 0;
 	int64_t carveB = 0;
 	int norescheck = 0;
@@ -132,9 +684,9 @@ copy_main (int argc, char **argv)
 	tivo_partition_direct ();
 
 #if DEPRECATED
-	while ((opt = getopt (argc, argv, "hqf:L:tTasPxr:v:S:lbBzEw:RiDkc:C:d:m:M:")) > 0)
+	while ((opt = getopt (argc, argv, "hqf:L:tTasPxr:v:S:lbBzEw:RniDkc:C:d:m:M:")) > 0)
 #else
-	while ((opt = getopt (argc, argv, "hqtTasxr:v:S:lbBEw:Rikc:C:d:m:M:")) > 0)
+	while ((opt = getopt (argc, argv, "hqtTasxr:v:S:lbBEw:Rnikc:C:d:m:M:")) > 0)
 #endif
 	{
 		switch (opt)
@@ -291,6 +843,9 @@ copy_main (int argc, char **argv)
 			}
 			rawcopy = 1;
 			break;
+		case 'n':
+			nodirect = 1;
+			break;
 		case 'i':
 			bflags |= BF_BACKUPALL;
 			break;
@@ -344,30 +899,35 @@ copy_main (int argc, char **argv)
 	// Split out the drive names
 	source_a[0] = 0;
 	source_b[0] = 0;
-	dest_a[0] = 0;
-	dest_b[0] = 0;
 
-	if (argc - optind < 4)
+	if (argc - optind == 4 && !strchr (argv[optind + 2], ':') && !strchr (argv[optind + 3], ':'))
+	{
+// Special case for convenience - 2 source and 2 target named
+		strcpy (source_a, argv[optind++]);
+		strcpy (source_b, argv[optind++]);
+		strcpy (targets[0].drive_a, argv[optind++]);
+		strcpy (targets[0].drive_b, argv[optind++]);
+		ntargets = 1;
+	}
+	else
 	{
 		if (optind < argc)
 		{
 			get_drives (argv[optind++], source_a, source_b);
 		}
-		if (optind < argc)
+/* Every drive set after the source is another target */
+		while (optind < argc && ntargets < COPY_MAXTARGETS)
 		{
-			get_drives (argv[optind++], dest_a, dest_b);
+			targets[ntargets].drive_a[0] = 0;
+			targets[ntargets].drive_b[0] = 0;
+			get_drives (argv[optind++], targets[ntargets].drive_a, targets[ntargets].drive_b);
+			if (!*targets[ntargets].drive_a)
+				break;
+			ntargets++;
 		}
 	}
-	else
-	{
-// Special case for convenience - 2 source and 2 target named
-		strcpy (source_a, argv[optind++]);
-		strcpy (source_b, argv[optind++]);
-		strcpy (dest_a, argv[optind++]);
-		strcpy (dest_b, argv[optind++]);
-	}
 
-	if (optind < argc || !*source_a || !*dest_a)
+	if (optind < argc || !*source_a || ntargets == 0)
 	{
 		copy_usage (argv[0]);
 		return 1;
@@ -411,14 +971,22 @@ copy_main (int argc, char **argv)
 		return 1;
 	}
 
-	info_r = init_restore (rflags);
-	if (info_r && restore_has_error (info_r))
+	for (loop = 0; loop < ntargets; loop++)
 	{
-		restore_perror (info_r, "Copy target");
-		return 1;
+		struct copy_target *t = &targets[loop];
+
+		t->name = ntargets > 1? t->drive_a: "Copy target";
+		t->info = init_restore (rflags);
+		if (t->info && restore_has_error (t->info))
+		{
+			restore_perror (t->info, t->name);
+			return 1;
+		}
+		if (!t->info)
+			break;
 	}
 
-	if (!info_b || !info_r)
+	if (!info_b || loop < ntargets)
 	{
 		fprintf (stderr, "%s: Copy failed to start.  Make sure you specified the right\ndevices, and that the drives are not locked.\n", argv[0]);
 		return 1;
@@ -428,6 +996,7 @@ copy_main (int argc, char **argv)
 		unsigned char buf[BUFSIZE];
 		int curcount = 0;
 		int nread, nwrit;
+		uint64_t totsectors;
 
 		if (threshopt)
 			backup_set_thresh (info_b, thresh);
@@ -436,22 +1005,40 @@ copy_main (int argc, char **argv)
 		if (skipdb)
 			backup_set_skipdb (info_b, skipdb);
 
-		if (varsize)
-			restore_set_varsize (info_r, varsize);
-		if (dbsize)
-			restore_set_dbsize (info_r, dbsize);
-		if (swapsize)
-			restore_set_swapsize (info_r, swapsize * 1024 * 2);
-		if (bswap)
-			restore_set_bswap (info_r, bswap);
-		if (restorebits)
-			restore_set_mfs_type (info_r, restorebits);
-		if (minalloc)
-			restore_set_minalloc (info_r, minalloc);
-		if (maxdisk)
-			restore_set_maxdisk (info_r, maxdisk);
-		if (maxmedia)
-			restore_set_maxmedia (info_r, maxmedia);
+/* Streams go straight from drive to drive, not through the backup format. */
+/* With more than one target that would read them once per target, so */
+/* they go through the backup format to be read once for all of them. */
+		if (!rawcopy && !nodirect && ntargets == 1)
+		{
+			backup_set_copy_direct (info_b);
+			if (restore_set_copy_source (targets[0].info, info_b->mfs) < 0)
+			{
+				restore_perror (targets[0].info, targets[0].name);
+				return 1;
+			}
+		}
+
+		for (loop = 0; loop < ntargets; loop++)
+		{
+			struct backup_info *info_r = targets[loop].info;
+
+			if (varsize)
+				restore_set_varsize (info_r, varsize);
+			if (dbsize)
+				restore_set_dbsize (info_r, dbsize);
+			if (swapsize)
+				restore_set_swapsize (info_r, swapsize * 1024 * 2);
+			if (bswap)
+				restore_set_bswap (info_r, bswap);
+			if (restorebits)
+				restore_set_mfs_type (info_r, restorebits);
+			if (minalloc)
+				restore_set_minalloc (info_r, minalloc);
+			if (maxdisk)
+				restore_set_maxdisk (info_r, maxdisk);
+			if (maxmedia)
+				restore_set_maxmedia (info_r, maxmedia);
+		}
 
 		if (quiet < 2)
 			fprintf (stderr, "Scanning source drive.  Please wait a moment.\n");
@@ -483,93 +1070,65 @@ copy_main (int argc, char **argv)
 
 		nread = curcount;
 
-		nwrit = restore_write (info_r, buf, nread);
-		if (nwrit < 0)
+/* Each target is laid out and started on its own before the copy begins */
+		for (loop = 0; loop < ntargets; loop++)
 		{
-			if (restore_has_error (info_r))
-				restore_perror (info_r, "Copy target");
-			else
-				fprintf (stderr, "Copy target failed.\n");
-			return 1;
-		}
-
-		if (swapsize > 128 && !(info_r->back_flags & BF_NOBSWAP))
-			fprintf (stderr, "    ***WARNING***\nUsing version 1 swap signature to get >128MiB swap size, but the backup looks\nlike a series 1.  Stock SERIES 1 TiVo kernels do not support the version 1\nswap signature.  If you are using a stock SERIES 1 TiVo kernel, 128MiB is the\nlargest usable swap size.\n");
-		if (restorebits == 64 && !(info_r->back_flags & BF_64))
-			fprintf (stderr, "    ***WARNING***\nConverting MFS structure to 64 bit if very experimental, and will only work on\nSeries 3 based TiVo platforms or later, such as the TiVo HD.\n");
+			struct copy_target *t = &targets[loop];
 
-		if (restore_trydev (info_r, dest_a, dest_b, carveA, carveB) < 0)
-		{
-			if (restore_has_error (info_r))
-				restore_perror (info_r, "Copy target");
-			else
-				fprintf (stderr, "Copy target failed.\n");
-			return 1;
-		}
-
-		if (restore_start (info_r) < 0)
-		{
-			if (restore_has_error (info_r))
-				restore_perror (info_r, "Copy target");
-			else
-				fprintf (stderr, "Copy target failed.\n");
-			return 1;
-		}
-
-		if (restore_write (info_r, buf + nwrit, nread - nwrit) != nread - nwrit)
-		{
-			if (restore_has_error (info_r))
-				restore_perror (info_r, "Copy target");
-			else
-				fprintf (stderr, "Copy target failed.\n");
-			return 1;
-		}
+			nwrit = restore_write (t->info, buf, nread);
+			if (nwrit < 0)
+			{
+				if (restore_has_error (t->info))
+					restore_perror (t->info, t->name);
+				else
+					fprintf (stderr, "%s failed.\n", t->name);
+				return 1;
+			}
 
-		starttime = time (NULL);
+			if (loop == 0 && swapsize > 128 && !(t->info->back_flags & BF_NOBSWAP))
+				fprintf (stderr, "    ***WARNING***\nUsing version 1 swap signature to get >128MiB swap size, but the backup looks\nlike a series 1.  Stock SERIES 1 TiVo kernels do not support the version 1\nswap signature.  If you are using a stock SERIES 1 TiVo kernel, 128MiB is the\nlargest usable swap size.\n");
+			if (loop == 0 && restorebits == 64 && !(t->info->back_flags & BF_64))
+				fprintf (stderr, "    ***WARNING***\nConverting MFS structure to 64 bit if very experimental, and will only work on\nSeries 3 based TiVo platforms or later, such as the TiVo HD.\n");
 
-		fprintf (stderr, "Starting copy\nSize: %" PRId64 " MiB\n", info_r->nsectors / 2048);
-		while ((curcount = backup_read (info_b, buf, BUFSIZE)) > 0)
-		{
-			unsigned int prcnt;
-			if (restore_write (info_r, buf, curcount) != curcount)
+			if (restore_trydev (t->info, t->drive_a, t->drive_b, carveA, carveB) < 0)
 			{
-				if (quiet < 1)
-					fprintf (stderr, "\n");
-				if (restore_has_error (info_r))
-					restore_perror (info_r, "Copy source");
+				if (restore_has_error (t->info))
+					restore_perror (t->info, t->name);
 				else
-					fprintf (stderr, "Copy source failed.\n");
+					fprintf (stderr, "%s failed.\n", t->name);
 				return 1;
 			}
-			prcnt = get_percent (info_r->cursector, info_r->nsectors);
-			if (quiet < 1)
-			{
-				unsigned timedelta = time(NULL) - starttime;
 
-				fprintf (stderr, "\rCopying %" PRId64 " of %" PRId64 " MiB (%d.%02d%%)", info_r->cursector / 2048, info_r->nsectors / 2048, prcnt / 100, prcnt % 100);
+			if (restore_start (t->info) < 0)
+			{
+				if (restore_has_error (t->info))
+					restore_perror (t->info, t->name);
+				else
+					fprintf (stderr, "%s failed.\n", t->name);
+				return 1;
+			}
 
-				if (prcnt > 100 && timedelta > 15)
-				{
-					unsigned ETA = timedelta * (10000 - prcnt) / prcnt;
-					fprintf (stderr, " %" PRId64 " MiB/sec (ETA %d:%02d:%02d)", info_r->cursector / timedelta / 2048, ETA / 3600, ETA / 60 % 60, ETA % 60);
-				}
+			if (restore_write (t->info, buf + nwrit, nread - nwrit) != nread - nwrit)
+			{
+				if (restore_has_error (t->info))
+					restore_perror (t->info, t->name);
+				else
+					fprintf (stderr, "%s failed.\n", t->name);
+				return 1;
 			}
 		}
 
-		if (quiet < 1)
-			fprintf (stderr, "\n");
+		starttime = time (NULL);
 
-		if (backup_has_error (info_b))
+		totsectors = targets[0].info->nsectors + info_b->carriedsectors;
+		fprintf (stderr, "Starting copy\nSize: %" PRId64 " MiB\n", totsectors / 2048);
+		if (ntargets > 1)
 		{
-			backup_perror (info_b, "Copy source");
-			return 1;
+			if (copy_fanout (info_b, targets, ntargets, quiet, starttime, totsectors) < 0)
+				return 1;
 		}
-
-		if (restore_has_error (info_r))
-		{
-			restore_perror (info_r, "Copy target");
+		else if (copy_single (info_b, targets[0].info, buf, quiet, starttime, totsectors) < 0)
 			return 1;
-		}
 	}
 
 	if (backup_finish (info_b) < 0)
@@ -587,14 +1146,37 @@ copy_main (int argc, char **argv)
 	}
 
 	if (quiet < 2)
-		fprintf (stderr, "Cleaning up target.  Please wait a moment.\n");
+		fprintf (stderr, "Cleaning up target%s.  Please wait a moment.\n", ntargets > 1? "s": "");
 
-	if (restore_finish (info_r) < 0)
+	for (loop = 0; loop < ntargets; loop++)
 	{
-		if (restore_has_error (info_r))
-			restore_perror (info_r, "Copy target");
-		else
-			fprintf (stderr, "Copy target failed.\n");
+		struct copy_target *t = &targets[loop];
+
+/* Targets that failed during the copy were already reported */
+		if (t->failed)
+		{
+			failed = 1;
+			continue;
+		}
+
+		if (restore_finish (t->info) < 0)
+		{
+			if (restore_has_error (t->info))
+				restore_perror (t->info, t->name);
+			else
+				fprintf (stderr, "%s failed.\n", t->name);
+			if (ntargets == 1)
+				return 1;
+			t->failed = 1;
+			failed = 1;
+		}
+	}
+
+	if (failed && ntargets > 1)
+	{
+		for (loop = 0; loop < ntargets; loop++)
+			if (targets[loop].failed)
+				fprintf (stderr, "%s was not copied.\n", targets[loop].name);
 		return 1;
 	}
 
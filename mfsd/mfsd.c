@@ -32,7 +32,7 @@ usage ()
 	fprintf (stderr, " -f FSID  Dump a single FSID\n");
 	fprintf (stderr, " -F        Dump ALL FSIDs\n");
 	fprintf (stderr, " -i indoe  Dump a single inode\n");
-	fprintf (stderr, " -l log    Dump a single transaction log\n");
+	fprintf (stderr, " -l log    Dump a single transaction log, or \"last\" for the newest\n");
 	fprintf (stderr, " -s sector Read from sector, or from offset into file\n");
 	fprintf (stderr, " -c count  Read count sectors, where applicable\n");
 	fprintf (stderr, "    -C    Perform consistency checkpoint before displaying data\n");
@@ -927,6 +927,8 @@ mfsd_main (int argc, char **argv)
 	unsigned int inode = 0xdeadbeef;
 	unsigned int bufsize = 0;
 	unsigned int logstamp = 0xdeadbeef;
+	int lastlog = 0;
+	struct log_index *logidx = NULL;
 	int dofssync = 0;
 	int doall = 0;
 	unsigned int zonemap = 0xdeadbeef;
@@ -961,7 +963,10 @@ mfsd_main (int argc, char **argv)
 				usage ();
 				return 2;
 			}
-			logstamp = strtoul (optarg, 0, 0);
+			if (!strcmp (optarg, "last"))
+				lastlog = 1;
+			else
+				logstamp = strtoul (optarg, 0, 0);
 			break;
 		case 'c':
 			count = strtoul (optarg, 0, 0);
@@ -1025,9 +1030,9 @@ mfsd_main (int argc, char **argv)
 		}
 	}
 
-	if ( (sector == 0xdeadbeef && !fsid && inode == 0xdeadbeef && logstamp == 0xdeadbeef && zonemap == 0xdeadbeef) || 
+	if ( (sector == 0xdeadbeef && !fsid && inode == 0xdeadbeef && logstamp == 0xdeadbeef && !lastlog && zonemap == 0xdeadbeef) || 
 				optind == argc || argc > optind + 2 || 
-	     (logstamp != 0xdeadbeef && (fsid || inode != 0xdeadbeef || sector != 0xdeadbeef)))
+	     ((logstamp != 0xdeadbeef || lastlog) && (fsid || inode != 0xdeadbeef || sector != 0xdeadbeef)))
 	{
 		usage ();
 		return 4;
@@ -1050,6 +1055,27 @@ mfsd_main (int argc, char **argv)
 		}
 	}
 
+	if (logstamp != 0xdeadbeef || lastlog)
+	{
+		/* Read and index the whole log at once rather than sector by sector */
+		logidx = mfs_log_index (mfs);
+		if (!logidx)
+		{
+			mfs_perror (mfs, "Read log");
+			return 1;
+		}
+
+		if (lastlog)
+		{
+			if (logidx->empty)
+			{
+				fprintf (stderr, "Log entry not found\n");
+				return 1;
+			}
+			logstamp = logidx->newest;
+		}
+	}
+
 	if (fsid && doall)
 	{
 		int curinode = 0;
@@ -1206,7 +1232,10 @@ mfsd_main (int argc, char **argv)
 			{
 				if (bufsize == 0)
 				{
-					fprintf (stderr, "Log entry not found\n");
+					if (logidx->empty)
+						fprintf (stderr, "Log entry not found\n");
+					else
+						fprintf (stderr, "Log entry not found, log holds %u-%u\n", logidx->oldest, logidx->newest);
 					return 1;
 				}
 
@@ -0,0 +1,562 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include "macpart.h"
+#include "mfs.h"
+#include "log.h"
+
+/* Pull the data of fsids out of the MFS volume set into files.  Each */
+/* extent is copied straight from the partition to the output where the */
+/* kernel allows it, and read and written in large pieces where it */
+/* doesn't.  Objects are grouped by the drive most of their data is on, */
+/* and each drive gets a worker of its own, so two drives are read at */
+/* once. */
+
+/* Largest piece read or written at once, 1MiB */
+#define EXTRACT_SECTORS 2048
+/* Drives in a volume set */
+#define EXTRACT_MAXDRIVES 2
+
+struct extract_item
+{
+	char *what;
+	uint32_t fsid;
+	mfs_inode *inode;
+	uint64_t size;
+	int drive;
+	char path[PATH_MAX];
+	int native;				/* Data was copied without reading it */
+
+	char *err_msg;
+	int err_errno;
+};
+
+struct extract_worker
+{
+	struct mfs_handle *mfs;
+	struct extract_item *items;
+	int nitems;
+	int drive;
+	unsigned char *buf;
+	int native;				/* Keep trying to copy in the kernel */
+#if HAVE_PTHREAD_H
+	pthread_t thread;
+#endif
+};
+
+static char *progname;
+
+void
+mfsextract_usage ()
+{
+	fprintf (stderr, "%s %s\n", PACKAGE, VERSION);
+	fprintf (stderr, "Usage: %s [options] Adrive [Bdrive]\n", progname);
+	fprintf (stderr, "Options:\n");
+	fprintf (stderr, " -h        Display this help message\n");
+	fprintf (stderr, " -f what   Extract an fsid or MFS path, may be given more than once\n");
+	fprintf (stderr, " -l file   Extract each fsid or MFS path listed in file, - for stdin\n");
+	fprintf (stderr, " -o dir    Write files named by fsid into dir (Default: .)\n");
+	fprintf (stderr, " -O file   Write a single object to file, - for stdout\n");
+}
+
+/* Get the sectors of an extent of an inode's data. */
+static void
+extract_get_extent (struct mfs_handle *mfs, mfs_inode *inode, unsigned int n, uint64_t *sector, uint64_t *count)
+{
+	if (mfs_is_64bit (mfs))
+	{
+		*sector = sectorswap64 (inode->datablocks.d64[n].sector);
+		*count = intswap32 (inode->datablocks.d64[n].count);
+	}
+	else
+	{
+		*sector = intswap32 (inode->datablocks.d32[n].sector);
+		*count = intswap32 (inode->datablocks.d32[n].count);
+	}
+}
+
+/* Bytes of data in an inode.  Streams are as long as their used blocks. */
+static uint64_t
+extract_inode_size (mfs_inode *inode)
+{
+	if (inode->type == tyStream)
+		return (uint64_t)intswap32 (inode->blockused) * intswap32 (inode->blocksize);
+
+	return intswap32 (inode->size);
+}
+
+/* Work out which drive holds most of an inode's data.  Drives are told */
+/* apart by the device name of their partitions. */
+static int
+extract_find_drive (struct mfs_handle *mfs, mfs_inode *inode, const char **drives, int *ndrives)
+{
+	uint64_t sectors[EXTRACT_MAXDRIVES] = {0};
+	unsigned int loop;
+	int best = 0;
+	int drive;
+
+	for (loop = 0; loop < intswap32 (inode->numblocks); loop++)
+	{
+		uint64_t sector, count;
+		struct volume_info *vol;
+		const char *name;
+
+		extract_get_extent (mfs, inode, loop, &sector, &count);
+		vol = mfsvol_get_volume (mfs->vols, sector);
+		if (!vol)
+			continue;
+
+		name = tivo_partition_device_name (vol->file);
+		if (!name)
+			name = "";
+
+		for (drive = 0; drive < *ndrives; drive++)
+		{
+			if (!strcmp (drives[drive], name))
+				break;
+		}
+		if (drive == *ndrives)
+		{
+			if (*ndrives >= EXTRACT_MAXDRIVES)
+				continue;
+			drives[(*ndrives)++] = name;
+		}
+
+		sectors[drive] += count;
+	}
+
+	for (drive = 1; drive < *ndrives; drive++)
+	{
+		if (sectors[drive] > sectors[best])
+			best = drive;
+	}
+
+	return best;
+}
+
+/* Write all of a buffer, returning -1 on error. */
+static int
+extract_write (int fd, unsigned char *buf, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t nwrit = write (fd, buf, size);
+		if (nwrit <= 0)
+			return -1;
+		buf += nwrit;
+		size -= nwrit;
+	}
+
+	return 0;
+}
+
+/* Copy the data of one item out to fd. */
+static int
+extract_copy (struct extract_worker *w, struct extract_item *item, int fd)
+{
+	mfs_inode *inode = item->inode;
+	uint64_t left = item->size;
+	unsigned int loop;
+	int direct = 0, buffered = 0;
+
+	/* Small files live in the inode itself */
+	if (inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2))
+	{
+		if (left > 512 - 0x3c)
+		{
+			item->err_msg = "Inode is corrupt";
+			return -1;
+		}
+		if (extract_write (fd, (unsigned char *)inode + 0x3c, left) < 0)
+		{
+			item->err_msg = "Error writing";
+			item->err_errno = errno;
+			return -1;
+		}
+		return 0;
+	}
+
+	for (loop = 0; left > 0 && loop < intswap32 (inode->numblocks); loop++)
+	{
+		uint64_t sector, count, whole;
+
+		extract_get_extent (w->mfs, inode, loop, &sector, &count);
+		if (count > (left + 511) / 512)
+			count = (left + 511) / 512;
+
+		/* Whole sectors go straight out, if the kernel can manage it */
+		whole = count;
+		if (whole * 512 > left)
+			whole = left / 512;
+
+		while (w->native && whole > 0)
+		{
+			unsigned int tocopy = whole > EXTRACT_SECTORS? EXTRACT_SECTORS: whole;
+
+			if (mfs_copy_out (w->mfs, sector, tocopy, fd) == (int)tocopy * 512)
+			{
+				sector += tocopy;
+				count -= tocopy;
+				whole -= tocopy;
+				left -= tocopy * 512;
+				direct = 1;
+			}
+			else if (errno == EAGAIN)
+			{
+				/* Changes held in memory for the log only rule out this extent */
+				break;
+			}
+			else if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+			{
+				/* Swapped partitions and TiVo devices won't ever manage it */
+				w->native = 0;
+			}
+			else
+			{
+				item->err_msg = "Error copying";
+				item->err_errno = errno;
+				return -1;
+			}
+		}
+
+		while (count > 0)
+		{
+			unsigned int toread = count > EXTRACT_SECTORS? EXTRACT_SECTORS: count;
+			uint64_t towrite = (uint64_t)toread * 512;
+
+			if (mfs_read_data (w->mfs, w->buf, sector, toread) != (int)toread * 512)
+			{
+				item->err_msg = "Error reading";
+				item->err_errno = errno;
+				return -1;
+			}
+
+			if (towrite > left)
+				towrite = left;
+			if (extract_write (fd, w->buf, towrite) < 0)
+			{
+				item->err_msg = "Error writing";
+				item->err_errno = errno;
+				return -1;
+			}
+
+			sector += toread;
+			count -= toread;
+			left -= towrite;
+			buffered = 1;
+		}
+	}
+
+	if (left > 0)
+	{
+		item->err_msg = "Extents do not cover the data";
+		return -1;
+	}
+
+	item->native = direct && !buffered;
+	return 0;
+}
+
+static void *
+extract_worker_thread (void *arg)
+{
+	struct extract_worker *w = arg;
+	int loop;
+
+	for (loop = 0; loop < w->nitems; loop++)
+	{
+		struct extract_item *item = &w->items[loop];
+		int fd;
+
+		if (item->err_msg || item->drive != w->drive)
+			continue;
+
+		if (!strcmp (item->path, "-"))
+			fd = STDOUT_FILENO;
+		else
+		{
+#if O_LARGEFILE
+			fd = open (item->path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+#else
+			fd = open (item->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+		}
+		if (fd < 0)
+		{
+			item->err_msg = "Unable to create output file";
+			item->err_errno = errno;
+			continue;
+		}
+
+		if (extract_copy (w, item, fd) < 0)
+		{
+			if (fd != STDOUT_FILENO)
+			{
+				close (fd);
+				unlink (item->path);
+			}
+			continue;
+		}
+
+		if (fd != STDOUT_FILENO && close (fd) < 0)
+		{
+			item->err_msg = "Error writing";
+			item->err_errno = errno;
+			unlink (item->path);
+		}
+	}
+
+	return NULL;
+}
+
+/* Add an fsid or path to the list. */
+static int
+extract_add (struct extract_item **items, int *nitems, int *itemalloc, char *what)
+{
+	if (*nitems >= *itemalloc)
+	{
+		int newalloc = *itemalloc? *itemalloc * 2: 16;
+		struct extract_item *tmp = realloc (*items, newalloc * sizeof (*tmp));
+		if (!tmp)
+			return -1;
+		*items = tmp;
+		*itemalloc = newalloc;
+	}
+
+	memset (&(*items)[*nitems], 0, sizeof (**items));
+	(*items)[*nitems].what = what;
+	(*nitems)++;
+	return 0;
+}
+
+/* Add each line of a file to the list. */
+static int
+extract_add_list (struct extract_item **items, int *nitems, int *itemalloc, char *listfile)
+{
+	FILE *fp = strcmp (listfile, "-")? fopen (listfile, "r"): stdin;
+	char line[1024];
+
+	if (!fp)
+	{
+		perror (listfile);
+		return -1;
+	}
+
+	while (fgets (line, sizeof (line), fp))
+	{
+		char *what;
+
+		line[strcspn (line, "\r\n")] = 0;
+		if (!line[0])
+			continue;
+
+		what = strdup (line);
+		if (!what || extract_add (items, nitems, itemalloc, what) < 0)
+		{
+			fprintf (stderr, "%s: Out of memory\n", progname);
+			if (fp != stdin)
+				fclose (fp);
+			return -1;
+		}
+	}
+
+	if (fp != stdin)
+		fclose (fp);
+	return 0;
+}
+
+int
+mfsextract_main (int argc, char **argv)
+{
+	int opt;
+	struct mfs_handle *mfs;
+	struct extract_item *items = NULL;
+	int nitems = 0, itemalloc = 0;
+	char *outdir = ".";
+	char *outfile = NULL;
+	const char *drives[EXTRACT_MAXDRIVES];
+	int ndrives = 0;
+	struct extract_worker workers[EXTRACT_MAXDRIVES];
+	int loop;
+	int failed = 0;
+
+	progname = argv[0];
+
+	tivo_partition_direct ();
+
+	while ((opt = getopt (argc, argv, "hf:l:o:O:")) > 0)
+	{
+		switch (opt)
+		{
+		case 'f':
+			if (extract_add (&items, &nitems, &itemalloc, optarg) < 0)
+			{
+				fprintf (stderr, "%s: Out of memory\n", progname);
+				return 1;
+			}
+			break;
+		case 'l':
+			if (extract_add_list (&items, &nitems, &itemalloc, optarg) < 0)
+				return 1;
+			break;
+		case 'o':
+			outdir = optarg;
+			break;
+		case 'O':
+			outfile = optarg;
+			break;
+		default:
+			mfsextract_usage ();
+			return 1;
+		}
+	}
+
+	if (optind == argc || argc > optind + 2 || nitems == 0)
+	{
+		mfsextract_usage ();
+		return 1;
+	}
+
+	if (outfile && nitems > 1)
+	{
+		fprintf (stderr, "%s: -O can only be used with a single object\n", progname);
+		return 1;
+	}
+
+	mfs = mfs_init (argv[optind], optind + 1 < argc? argv[optind + 1] : NULL, (O_RDONLY | MFS_ERROROK));
+	if (!mfs)
+	{
+		fprintf (stderr, "Could not open MFS volume set.\n");
+		return 1;
+	}
+
+	if (mfs_has_error (mfs))
+	{
+		mfs_perror (mfs, argv[0]);
+		return 1;
+	}
+
+	/* Extract what the TiVo would see, with the log replayed in memory */
+	mfs_enable_memwrite (mfs);
+	mfs_log_fssync (mfs);
+	mfs_clearerror (mfs);
+
+	/* Everything that touches the mfs handle is done up front, so the */
+	/* workers only ever read data */
+	for (loop = 0; loop < nitems; loop++)
+	{
+		struct extract_item *item = &items[loop];
+
+		item->fsid = mfs_resolve (mfs, item->what);
+		mfs_clearerror (mfs);
+		if (!item->fsid)
+		{
+			item->err_msg = "No such fsid or path";
+			continue;
+		}
+
+		item->inode = mfs_read_inode_by_fsid (mfs, item->fsid);
+		mfs_clearerror (mfs);
+		if (!item->inode)
+		{
+			item->err_msg = "Unable to read inode";
+			continue;
+		}
+
+		if (item->inode->type == tyDir)
+		{
+			item->err_msg = "Is a directory";
+			continue;
+		}
+
+		item->size = extract_inode_size (item->inode);
+		item->drive = extract_find_drive (mfs, item->inode, drives, &ndrives);
+
+		if (outfile)
+			snprintf (item->path, sizeof (item->path), "%s", outfile);
+		else if (snprintf (item->path, sizeof (item->path), "%s/%u", outdir, item->fsid) >= (int)sizeof (item->path))
+			item->err_msg = "Output directory name too long";
+	}
+
+	if (ndrives == 0)
+		ndrives = 1;
+
+	memset (workers, 0, sizeof (workers));
+	for (loop = 0; loop < ndrives; loop++)
+	{
+		workers[loop].mfs = mfs;
+		workers[loop].items = items;
+		workers[loop].nitems = nitems;
+		workers[loop].drive = loop;
+		workers[loop].native = 1;
+		workers[loop].buf = malloc (EXTRACT_SECTORS * 512);
+		if (!workers[loop].buf)
+		{
+			fprintf (stderr, "%s: Out of memory\n", progname);
+			return 1;
+		}
+	}
+
+#if HAVE_PTHREAD_H
+	/* The first drive is done on this thread, while the others run.  An */
+	/* item can have data on more than one drive, so the workers only run */
+	/* together when reads do not move a shared file offset. */
+	for (loop = 1; loop < ndrives && tivo_partition_parallel_read (); loop++)
+	{
+		if (pthread_create (&workers[loop].thread, NULL, extract_worker_thread, &workers[loop]) != 0)
+			break;
+	}
+	extract_worker_thread (&workers[0]);
+	{
+		int started = loop;
+
+		for (loop = 1; loop < started; loop++)
+			pthread_join (workers[loop].thread, NULL);
+		for (loop = started; loop < ndrives; loop++)
+			extract_worker_thread (&workers[loop]);
+	}
+#else
+	for (loop = 0; loop < ndrives; loop++)
+		extract_worker_thread (&workers[loop]);
+#endif
+
+	for (loop = 0; loop < nitems; loop++)
+	{
+		struct extract_item *item = &items[loop];
+
+		if (item->err_msg)
+		{
+			if (item->err_errno)
+				fprintf (stderr, "%s: %s: %s\n", item->what, item->err_msg, strerror (item->err_errno));
+			else
+				fprintf (stderr, "%s: %s\n", item->what, item->err_msg);
+			failed++;
+		}
+		else if (!outfile || strcmp (outfile, "-"))
+		{
+			fprintf (stderr, "Extracted fsid %u (%" PRIu64 " bytes%s) to %s\n", item->fsid, item->size, item->native? ", direct": "", item->path);
+		}
+
+		if (item->inode)
+			free (item->inode);
+	}
+
+	for (loop = 0; loop < ndrives; loop++)
+		free (workers[loop].buf);
+	free (items);
+
+	return failed? 1: 0;
+}
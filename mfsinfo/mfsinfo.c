@@ -10,6 +10,10 @@
 #include <unistd.h>
 #include "mfs.h"
 #include "macpart.h"
+#include "jsonl.h"
+
+/* Set by -J, everything is then written as JSON Lines records */
+static int info_json = 0;
 
 void
 mfsinfo_usage (char *progname)
@@ -18,6 +22,7 @@ mfsinfo_usage (char *progname)
 	fprintf (stderr, "Usage: %s [options] Adrive [Bdrive]\n", progname);
 	fprintf (stderr, "Options:\n");
 	fprintf (stderr, " -d        Display extra partition detail\n");
+	fprintf (stderr, " -J        Report as JSON Lines instead of text\n");
 	fprintf (stderr, " -h        Display this help message\n");
 }
 
@@ -50,14 +55,18 @@ partition_info (struct mfs_handle *mfs, char *drives[])
 		list += offset;
 	}
 
-	fprintf (stdout, "The MFS volume set contains %d partitions\n", count);
+	if (!info_json)
+	{
+		fprintf (stdout, "The MFS volume set contains %d partitions\n", count);
+		fprintf (stdout, "   Partition       Sectors         Size\n");
+	}
 	offset = 0;
-	fprintf (stdout, "   Partition       Sectors         Size\n");
 	for (loop = 0; loop < count; loop++)
 	{
 		int d;
 		int p;
 		uint64_t size;
+		char device[256];
 
 		p = namelens[loop] - 1;
 
@@ -73,20 +82,42 @@ partition_info (struct mfs_handle *mfs, char *drives[])
 
 			if (d == 0 || d == 1)
 #if TARGET_OS_MAC
-				fprintf (stdout, "  %ss%d  ", drives[d], p);
+				snprintf (device, sizeof (device), "%ss%d", drives[d], p);
 #else
-				fprintf (stdout, "  %s%d  ", drives[d], p);
+				snprintf (device, sizeof (device), "%s%d", drives[d], p);
 #endif
 			else
-				fprintf (stdout, "  %.*s  ", namelens[loop], names[loop]);
+				snprintf (device, sizeof (device), "%.*s", namelens[loop], names[loop]);
 		}
 		else
-			fprintf (stdout, "  %.*s  ", namelens[loop], names[loop]);
+			snprintf (device, sizeof (device), "%.*s", namelens[loop], names[loop]);
 
 		size = mfs_volume_size (mfs, offset);
-		fprintf (stdout, "%12" PRIu64 " %12" PRIu64 " MiB\n", size, size / (1024 * 2));
+		if (info_json)
+		{
+			char name[256];
+
+			snprintf (name, sizeof (name), "%.*s", namelens[loop], names[loop]);
+			jsonl_begin (stdout, "partition");
+			jsonl_int (stdout, "index", loop);
+			jsonl_string (stdout, "name", name);
+			jsonl_string (stdout, "device", device);
+			jsonl_uint (stdout, "sectors", size);
+			jsonl_end (stdout);
+		}
+		else
+			fprintf (stdout, "  %s  %12" PRIu64 " %12" PRIu64 " MiB\n", device, size, size / (1024 * 2));
 		offset += size;
 	}
+	if (info_json)
+	{
+		jsonl_begin (stdout, "volume_set");
+		jsonl_int (stdout, "partitions", count);
+		jsonl_uint (stdout, "sectors", offset);
+		jsonl_uint (stdout, "inodes", mfs_inode_count (mfs));
+		jsonl_end (stdout);
+		return count;
+	}
 	fprintf (stdout, "Total MFS sectors: %" PRIu64 "\n", offset);
 	fprintf (stdout, "Total MFS volume size: %" PRIu64 " MiB\n", offset / (1024 * 2));
 	fprintf (stdout, "Total Inodes: %d\n",mfs_inode_count(mfs) ); 
@@ -101,6 +132,20 @@ int display_partition_map (char *drive)
 
   	struct tivo_partition_table *table;
   	table = (struct tivo_partition_table*) tivo_read_partition_table (drive, O_RDONLY);
+	if (info_json)
+	{
+		for (i=0; i<table->count; i++)
+		{
+			jsonl_begin (stdout, "partition_map");
+			jsonl_string (stdout, "drive", drive);
+			jsonl_int (stdout, "index", i+1);
+			jsonl_string (stdout, "name", table->partitions[i].name);
+			jsonl_uint (stdout, "start", table->partitions[i].start);
+			jsonl_uint (stdout, "sectors", table->partitions[i].sectors);
+			jsonl_end (stdout);
+		}
+		return 0;
+	}
 	fprintf (stdout, "\n---------------------------------------------------------------------\n");
 	fprintf (stdout, "partition table for %s\n", drive);
 	fprintf (stdout, "---------------------------------------------------------------------\n");
@@ -117,6 +162,90 @@ int display_partition_map (char *drive)
 	return 0;
 }
 
+void
+volume_header_json (struct mfs_handle *mfs)
+{
+	jsonl_begin (stdout, "volume");
+	if (mfs->is_64)
+	{
+		jsonl_int (stdout, "bits", 64);
+		jsonl_uint (stdout, "state", mfsLSB ? intswap32 (mfs->vol_hdr.v64.magicMSB) : intswap32 (mfs->vol_hdr.v64.magicLSB));
+		jsonl_uint (stdout, "magic", mfsLSB ? intswap32 (mfs->vol_hdr.v64.magicLSB) : intswap32 (mfs->vol_hdr.v64.magicMSB));
+		jsonl_string (stdout, "devlist", mfs->vol_hdr.v64.partitionlist);
+		jsonl_uint (stdout, "zonemap_ptr", intswap64 (mfs->vol_hdr.v64.zonemap.sector));
+		jsonl_uint (stdout, "total_secs", intswap64 (mfs->vol_hdr.v64.total_sectors));
+		jsonl_uint (stdout, "next_fsid", intswap32 (mfs->vol_hdr.v64.next_fsid));
+	}
+	else
+	{
+		jsonl_int (stdout, "bits", 32);
+		jsonl_uint (stdout, "state", mfsLSB ? intswap32 (mfs->vol_hdr.v32.magicMSB) : intswap32 (mfs->vol_hdr.v32.magicLSB));
+		jsonl_uint (stdout, "magic", mfsLSB ? intswap32 (mfs->vol_hdr.v32.magicLSB) : intswap32 (mfs->vol_hdr.v32.magicMSB));
+		jsonl_string (stdout, "devlist", mfs->vol_hdr.v32.partitionlist);
+		jsonl_uint (stdout, "zonemap_ptr", intswap32 (mfs->vol_hdr.v32.zonemap.sector));
+		jsonl_uint (stdout, "total_secs", intswap32 (mfs->vol_hdr.v32.total_sectors));
+		jsonl_uint (stdout, "next_fsid", intswap32 (mfs->vol_hdr.v32.next_fsid));
+	}
+	jsonl_end (stdout);
+}
+
+/* One record per zone map, with the same fields for 32 and 64 bit maps */
+void
+zone_maps_json (struct mfs_handle *mfs)
+{
+	struct zone_map *cur;
+	int loop = 0;
+
+	for (cur = mfs->loaded_zones; cur; cur = cur->next_loaded, loop++)
+	{
+		jsonl_begin (stdout, "zone");
+		jsonl_int (stdout, "zone", loop);
+		if (mfs->is_64)
+		{
+			jsonl_uint (stdout, "zone_type", intswap32 (cur->map->z64.type));
+			jsonl_uint (stdout, "logstamp", intswap32 (cur->map->z64.logstamp));
+			jsonl_uint (stdout, "checksum", intswap32 (cur->map->z64.checksum));
+			jsonl_uint (stdout, "first", intswap64 (cur->map->z64.first));
+			jsonl_uint (stdout, "last", intswap64 (cur->map->z64.last));
+			jsonl_uint (stdout, "sector", intswap64 (cur->map->z64.sector));
+			jsonl_uint (stdout, "sbackup", intswap64 (cur->map->z64.sbackup));
+			jsonl_uint (stdout, "length", intswap32 (cur->map->z64.length));
+			jsonl_uint (stdout, "size", intswap64 (cur->map->z64.size));
+			jsonl_uint (stdout, "min", intswap32 (cur->map->z64.min));
+			jsonl_uint (stdout, "free", intswap64 (cur->map->z64.free));
+			jsonl_uint (stdout, "zero", intswap32 (cur->map->z64.zero));
+			jsonl_uint (stdout, "num", intswap32 (cur->map->z64.num));
+			jsonl_uint (stdout, "next_sector", intswap64 (cur->map->z64.next_sector));
+			jsonl_uint (stdout, "next_sbackup", cur->map->z64.next_sbackup == 0xaaaaaaaaaaaaaaaa ? 0 : intswap64 (cur->map->z64.next_sbackup));
+			jsonl_uint (stdout, "next_length", intswap32 (cur->map->z64.next_length));
+			jsonl_uint (stdout, "next_size", intswap64 (cur->map->z64.next_size));
+			jsonl_uint (stdout, "next_min", intswap32 (cur->map->z64.next_min));
+		}
+		else
+		{
+			jsonl_uint (stdout, "zone_type", intswap32 (cur->map->z32.type));
+			jsonl_uint (stdout, "logstamp", intswap32 (cur->map->z32.logstamp));
+			jsonl_uint (stdout, "checksum", intswap32 (cur->map->z32.checksum));
+			jsonl_uint (stdout, "first", intswap32 (cur->map->z32.first));
+			jsonl_uint (stdout, "last", intswap32 (cur->map->z32.last));
+			jsonl_uint (stdout, "sector", intswap32 (cur->map->z32.sector));
+			jsonl_uint (stdout, "sbackup", intswap32 (cur->map->z32.sbackup));
+			jsonl_uint (stdout, "length", intswap32 (cur->map->z32.length));
+			jsonl_uint (stdout, "size", intswap32 (cur->map->z32.size));
+			jsonl_uint (stdout, "min", intswap32 (cur->map->z32.min));
+			jsonl_uint (stdout, "free", intswap32 (cur->map->z32.free));
+			jsonl_uint (stdout, "zero", intswap32 (cur->map->z32.zero));
+			jsonl_uint (stdout, "num", intswap32 (cur->map->z32.num));
+			jsonl_uint (stdout, "next_sector", intswap32 (cur->map->z32.next.sector));
+			jsonl_uint (stdout, "next_sbackup", cur->map->z32.next.sbackup == 0xaaaaaaaa ? 0 : intswap32 (cur->map->z32.next.sbackup));
+			jsonl_uint (stdout, "next_length", intswap32 (cur->map->z32.next.length));
+			jsonl_uint (stdout, "next_size", intswap32 (cur->map->z32.next.size));
+			jsonl_uint (stdout, "next_min", intswap32 (cur->map->z32.next.min));
+		}
+		jsonl_end (stdout);
+	}
+}
+
 int
 mfsinfo_main (int argc, char **argv)
 {
@@ -129,7 +258,7 @@ mfsinfo_main (int argc, char **argv)
 
 	tivo_partition_direct ();
 
-	while ((opt = getopt (argc, argv, "hd")) > 0)
+	while ((opt = getopt (argc, argv, "hdJ")) > 0)
 	{
 		switch (opt)
 		{
@@ -139,12 +268,18 @@ mfsinfo_main (int argc, char **argv)
 		case 'd':
 			partition_detail = 1;
 			break;
+		case 'J':
+			info_json = 1;
+			break;
+		default:
+			mfsinfo_usage (argv[0]);
+			return 1;
 		}
 	}
 	
-	while (partition_detail + ndrives + 1 < argc && ndrives < 3)
+	while (optind + ndrives < argc && ndrives < 3)
 	{
-		drives[ndrives] = argv[partition_detail + ndrives + 1];
+		drives[ndrives] = argv[optind + ndrives];
 		ndrives++;
 	}
 
@@ -166,6 +301,24 @@ mfsinfo_main (int argc, char **argv)
 		return 1;
 	}
 
+	if (info_json)
+	{
+		volume_header_json (mfs);
+		nparts = partition_info (mfs, drives);
+		zone_maps_json (mfs);
+		if (partition_detail != 0)
+		{
+			display_partition_map (drives[0]);
+			if (ndrives > 1)
+				display_partition_map (drives[1]);
+		}
+		jsonl_begin (stdout, "estimate");
+		jsonl_int (stdout, "standalone_hours", mfs_sa_hours_estimate (mfs));
+		jsonl_int (stdout, "expansions_left", (12 - nparts) / 2);
+		jsonl_end (stdout);
+		return 0;
+	}
+
 	fprintf(stdout,"---------------------------------------------------------------------\n");
 	if (mfs->is_64)
 	{
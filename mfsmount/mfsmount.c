@@ -0,0 +1,553 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+/* FUSE insists on a 64 bit off_t, which nothing in the MFS headers uses */
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fuse.h>
+
+#include "mfs.h"
+#include "macpart.h"
+#include "log.h"
+
+/* Read-only FUSE mount of an MFS volume set.  Paths are resolved through */
+/* a cache of sorted directory listings, and inodes are kept in a small */
+/* cache by fsid, so a lookup doesn't go back to the drive every time. */
+/* Each open file remembers which extent it last read from and reads */
+/* ahead up to a megabyte at a time, so streaming a recording turns into */
+/* large sequential reads.  FUSE is run single threaded, so none of this */
+/* needs locking. */
+
+/* Directories kept in the cache */
+#define MOUNT_DIRCACHE 64
+/* Slots in the inode cache */
+#define MOUNT_INODECACHE 1024
+/* Sectors read ahead at once, 1MiB */
+#define MOUNT_READAHEAD 2048
+
+struct mount_dir
+{
+	uint32_t fsid;
+	mfs_dirent *ents;			/* Sorted by name */
+	uint32_t count;
+	struct mount_dir *next;
+};
+
+struct mount_inode
+{
+	uint32_t fsid;
+	mfs_inode *inode;
+};
+
+struct mount_file
+{
+	mfs_inode *inode;
+	uint64_t size;				/* Bytes of data */
+
+	/* Extent the last read came from */
+	unsigned int extent;
+	uint64_t extentstart;		/* Sector in the file it starts at */
+
+	unsigned char *buf;
+	uint64_t bufstart;			/* Byte in the file the buffer starts at */
+	unsigned int buflen;
+};
+
+static struct mfs_handle *mfs;
+static struct mount_dir *mount_dirs;
+static int mount_ndirs;
+static struct mount_inode mount_inodes[MOUNT_INODECACHE];
+
+void
+mfsmount_usage (char *progname)
+{
+	fprintf (stderr, "%s %s\n", PACKAGE, VERSION);
+	fprintf (stderr, "Usage: %s [options] Adrive [Bdrive] mountpoint\n", progname);
+	fprintf (stderr, "Options:\n");
+	fprintf (stderr, " -h        Display this help message\n");
+	fprintf (stderr, " -f        Stay in the foreground\n");
+	fprintf (stderr, " -d        Display FUSE debugging messages\n");
+	fprintf (stderr, " -o opts   Pass mount options on to FUSE\n");
+}
+
+/* Get an inode from the cache, reading it in if it isn't there.  The */
+/* inode belongs to the cache. */
+static mfs_inode *
+mount_get_inode (uint32_t fsid)
+{
+	struct mount_inode *slot = &mount_inodes[fsid % MOUNT_INODECACHE];
+
+	if (slot->inode && slot->fsid == fsid)
+		return slot->inode;
+
+	if (slot->inode)
+		free (slot->inode);
+	slot->inode = mfs_read_inode_by_fsid (mfs, fsid);
+	slot->fsid = fsid;
+	if (!slot->inode)
+		mfs_clearerror (mfs);
+
+	return slot->inode;
+}
+
+/* Bytes of data in an inode.  Streams are as long as their used blocks. */
+static uint64_t
+mount_inode_size (mfs_inode *inode)
+{
+	if (inode->type == tyStream)
+		return (uint64_t)intswap32 (inode->blockused) * intswap32 (inode->blocksize);
+
+	return intswap32 (inode->size);
+}
+
+static int
+mount_compare_dirent (const void *a, const void *b)
+{
+	return strcmp (((const mfs_dirent *)a)->name, ((const mfs_dirent *)b)->name);
+}
+
+/* Get a directory listing from the cache, most recently used first. */
+static struct mount_dir *
+mount_get_dir (uint32_t fsid)
+{
+	struct mount_dir **prev;
+	struct mount_dir *dir;
+
+	for (prev = &mount_dirs; *prev; prev = &(*prev)->next)
+	{
+		if ((*prev)->fsid == fsid)
+		{
+			dir = *prev;
+			*prev = dir->next;
+			dir->next = mount_dirs;
+			mount_dirs = dir;
+			return dir;
+		}
+	}
+
+	dir = calloc (1, sizeof (*dir));
+	if (!dir)
+		return NULL;
+
+	/* An empty directory comes back as nothing at all */
+	dir->fsid = fsid;
+	dir->ents = mfs_dir (mfs, fsid, &dir->count);
+	mfs_clearerror (mfs);
+	if (!dir->ents)
+		dir->count = 0;
+	else if (dir->count > 1)
+		qsort (dir->ents, dir->count, sizeof (*dir->ents), mount_compare_dirent);
+
+	dir->next = mount_dirs;
+	mount_dirs = dir;
+
+	/* Drop the least recently used one if there are too many */
+	if (++mount_ndirs > MOUNT_DIRCACHE)
+	{
+		for (prev = &mount_dirs; (*prev)->next; prev = &(*prev)->next)
+			;
+		if ((*prev)->ents)
+			mfs_dir_free ((*prev)->ents);
+		free (*prev);
+		*prev = NULL;
+		mount_ndirs--;
+	}
+
+	return dir;
+}
+
+/* Turn a path into an fsid and type.  Returns -ENOENT or -ENOTDIR if */
+/* the path doesn't lead anywhere. */
+static int
+mount_resolve (const char *path, uint32_t *fsid, fsid_type *type)
+{
+	char name[256];
+
+	*fsid = 1;
+	*type = tyDir;
+
+	while (*path)
+	{
+		struct mount_dir *dir;
+		mfs_dirent key;
+		mfs_dirent *ent;
+		size_t len;
+
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+
+		len = strcspn (path, "/");
+		if (len >= sizeof (name))
+			return -ENAMETOOLONG;
+		memcpy (name, path, len);
+		name[len] = 0;
+		path += len;
+
+		if (*type != tyDir)
+			return -ENOTDIR;
+
+		dir = mount_get_dir (*fsid);
+		if (!dir)
+			return -ENOMEM;
+
+		key.name = name;
+		ent = bsearch (&key, dir->ents, dir->count, sizeof (*dir->ents), mount_compare_dirent);
+		if (!ent)
+			return -ENOENT;
+
+		*fsid = ent->fsid;
+		*type = ent->type;
+	}
+
+	return 0;
+}
+
+static int
+mount_getattr (const char *path, struct stat *st)
+{
+	uint32_t fsid;
+	fsid_type type;
+	mfs_inode *inode;
+	int ret;
+
+	ret = mount_resolve (path, &fsid, &type);
+	if (ret < 0)
+		return ret;
+
+	inode = mount_get_inode (fsid);
+	if (!inode)
+		return -EIO;
+
+	memset (st, 0, sizeof (*st));
+	st->st_ino = fsid;
+	st->st_nlink = type == tyDir? 2: 1;
+	st->st_mode = type == tyDir? S_IFDIR | 0555: S_IFREG | 0444;
+	st->st_size = mount_inode_size (inode);
+	st->st_blocks = (st->st_size + 511) / 512;
+	st->st_mtime = st->st_ctime = st->st_atime = intswap32 (inode->lastmodified);
+
+	return 0;
+}
+
+static int
+mount_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+	uint32_t fsid;
+	fsid_type type;
+	struct mount_dir *dir;
+	uint32_t loop;
+	int ret;
+
+	ret = mount_resolve (path, &fsid, &type);
+	if (ret < 0)
+		return ret;
+	if (type != tyDir)
+		return -ENOTDIR;
+
+	dir = mount_get_dir (fsid);
+	if (!dir)
+		return -ENOMEM;
+
+	filler (buf, ".", NULL, 0);
+	filler (buf, "..", NULL, 0);
+
+	/* The type is all ls needs, so the inodes aren't read here */
+	for (loop = 0; loop < dir->count; loop++)
+	{
+		struct stat st;
+
+		memset (&st, 0, sizeof (st));
+		st.st_ino = dir->ents[loop].fsid;
+		st.st_mode = dir->ents[loop].type == tyDir? S_IFDIR: S_IFREG;
+		if (filler (buf, dir->ents[loop].name, &st, 0))
+			break;
+	}
+
+	return 0;
+}
+
+static int
+mount_open (const char *path, struct fuse_file_info *fi)
+{
+	uint32_t fsid;
+	fsid_type type;
+	mfs_inode *inode;
+	struct mount_file *file;
+	int ret;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+
+	ret = mount_resolve (path, &fsid, &type);
+	if (ret < 0)
+		return ret;
+	if (type == tyDir)
+		return -EISDIR;
+
+	inode = mount_get_inode (fsid);
+	if (!inode)
+		return -EIO;
+
+	file = calloc (1, sizeof (*file));
+	if (!file)
+		return -ENOMEM;
+
+	/* Keep a copy, the cache may let go of it while the file is open */
+	file->inode = malloc (512);
+	file->buf = malloc (MOUNT_READAHEAD * 512);
+	if (!file->inode || !file->buf)
+	{
+		if (file->inode)
+			free (file->inode);
+		if (file->buf)
+			free (file->buf);
+		free (file);
+		return -ENOMEM;
+	}
+	memcpy (file->inode, inode, 512);
+	file->size = mount_inode_size (inode);
+
+	fi->fh = (uintptr_t)file;
+	/* Nothing changes underneath a read-only mount */
+	fi->keep_cache = 1;
+
+	return 0;
+}
+
+/* Get the sectors of an extent of an inode's data. */
+static void
+mount_get_extent (mfs_inode *inode, unsigned int n, uint64_t *sector, uint64_t *count)
+{
+	if (mfs_is_64bit (mfs))
+	{
+		*sector = sectorswap64 (inode->datablocks.d64[n].sector);
+		*count = intswap32 (inode->datablocks.d64[n].count);
+	}
+	else
+	{
+		*sector = intswap32 (inode->datablocks.d32[n].sector);
+		*count = intswap32 (inode->datablocks.d32[n].count);
+	}
+}
+
+/* Fill the read ahead buffer starting at the sector holding offset.  It */
+/* carries on across extents until the buffer is full.  The extent of the */
+/* last read is remembered, so reading straight through a file never */
+/* walks the extent list from the start. */
+static int
+mount_fill (struct mount_file *file, uint64_t offset)
+{
+	mfs_inode *inode = file->inode;
+	unsigned int numblocks = intswap32 (inode->numblocks);
+	uint64_t want = offset / 512;
+	uint64_t end = (file->size + 511) / 512;
+	unsigned int filled = 0;
+
+	if (want < file->extentstart)
+	{
+		file->extent = 0;
+		file->extentstart = 0;
+	}
+
+	file->bufstart = want * 512;
+	file->buflen = 0;
+
+	while (filled < MOUNT_READAHEAD && want < end && file->extent < numblocks)
+	{
+		uint64_t sector, count;
+		unsigned int toread;
+
+		mount_get_extent (inode, file->extent, &sector, &count);
+		if (want >= file->extentstart + count)
+		{
+			file->extentstart += count;
+			file->extent++;
+			continue;
+		}
+
+		toread = MOUNT_READAHEAD - filled;
+		if (toread > file->extentstart + count - want)
+			toread = file->extentstart + count - want;
+		if (toread > end - want)
+			toread = end - want;
+
+		if (mfs_read_data (mfs, file->buf + filled * 512, sector + want - file->extentstart, toread) != (int)toread * 512)
+		{
+			mfs_clearerror (mfs);
+			return filled? 0: -EIO;
+		}
+
+		filled += toread;
+		want += toread;
+		file->buflen = filled * 512;
+	}
+
+	return 0;
+}
+
+static int
+mount_read (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct mount_file *file = (struct mount_file *)(uintptr_t)fi->fh;
+	mfs_inode *inode = file->inode;
+	size_t done = 0;
+
+	if ((uint64_t)offset >= file->size)
+		return 0;
+	if (size > file->size - offset)
+		size = file->size - offset;
+
+	/* Small files live in the inode itself */
+	if (inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2))
+	{
+		if (offset + size > 512 - 0x3c)
+			return -EIO;
+		memcpy (buf, (unsigned char *)inode + 0x3c + offset, size);
+		return size;
+	}
+
+	while (done < size)
+	{
+		uint64_t pos = offset + done;
+		size_t count;
+		int ret;
+
+		if (pos < file->bufstart || pos >= file->bufstart + file->buflen)
+		{
+			ret = mount_fill (file, pos);
+			if (ret < 0)
+				return done? (int)done: ret;
+			if (!file->buflen)
+				break;
+		}
+
+		count = file->bufstart + file->buflen - pos;
+		if (count > size - done)
+			count = size - done;
+		memcpy (buf + done, file->buf + (pos - file->bufstart), count);
+		done += count;
+	}
+
+	return done;
+}
+
+static int
+mount_release (const char *path, struct fuse_file_info *fi)
+{
+	struct mount_file *file = (struct mount_file *)(uintptr_t)fi->fh;
+
+	free (file->inode);
+	free (file->buf);
+	free (file);
+	return 0;
+}
+
+static void *
+mount_init (struct fuse_conn_info *conn)
+{
+	conn->max_readahead = MOUNT_READAHEAD * 512;
+	return NULL;
+}
+
+static struct fuse_operations mount_ops =
+{
+	.getattr = mount_getattr,
+	.readdir = mount_readdir,
+	.open = mount_open,
+	.read = mount_read,
+	.release = mount_release,
+	.init = mount_init,
+};
+
+int
+mfsmount_main (int argc, char **argv)
+{
+	int opt;
+	int foreground = 0;
+	int debug = 0;
+	char *options = NULL;
+	char *hda, *hdb = NULL, *mountpoint;
+	char *fuseargv[10];
+	int fuseargc = 0;
+
+	tivo_partition_direct ();
+
+	while ((opt = getopt (argc, argv, "hfdo:")) > 0)
+	{
+		switch (opt)
+		{
+		case 'f':
+			foreground = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'o':
+			options = optarg;
+			break;
+		default:
+			mfsmount_usage (argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind < 2 || argc - optind > 3)
+	{
+		mfsmount_usage (argv[0]);
+		return 1;
+	}
+
+	hda = argv[optind];
+	if (argc - optind == 3)
+		hdb = argv[optind + 1];
+	mountpoint = argv[argc - 1];
+
+	mfs = mfs_init (hda, hdb, (O_RDONLY | MFS_ERROROK));
+	if (!mfs)
+	{
+		fprintf (stderr, "Could not open MFS volume set.\n");
+		return 1;
+	}
+
+	if (mfs_has_error (mfs))
+	{
+		mfs_perror (mfs, argv[0]);
+		return 1;
+	}
+
+	/* Show what the TiVo would see, with the log replayed in memory */
+	mfs_enable_memwrite (mfs);
+	mfs_log_fssync (mfs);
+	mfs_clearerror (mfs);
+
+	fuseargv[fuseargc++] = argv[0];
+	fuseargv[fuseargc++] = mountpoint;
+	fuseargv[fuseargc++] = "-s";
+	fuseargv[fuseargc++] = "-o";
+	fuseargv[fuseargc++] = "ro,fsname=mfs,subtype=mfs";
+	if (options)
+	{
+		fuseargv[fuseargc++] = "-o";
+		fuseargv[fuseargc++] = options;
+	}
+	if (foreground)
+		fuseargv[fuseargc++] = "-f";
+	if (debug)
+		fuseargv[fuseargc++] = "-d";
+	fuseargv[fuseargc] = NULL;
+
+	return fuse_main (fuseargc, fuseargv, &mount_ops, NULL);
+}
@@ -38,6 +38,12 @@ extern int mfsinfo_main (int, char **);
 #if BUILD_MFSCK
 extern int mfsck_main (int, char **);
 #endif
+#if BUILD_EXTRACT
+extern int mfsextract_main (int, char **);
+#endif
+#if BUILD_MOUNT
+extern int mfsmount_main (int, char **);
+#endif
 
 struct {
 	char *name;
@@ -70,6 +76,12 @@ struct {
 #endif
 #if BUILD_MFSINFO
 	{"info", mfsinfo_main, "Display information about MFS volume."},
+#endif
+#if BUILD_EXTRACT
+	{"extract", mfsextract_main, "Copy streams and files out of the MFS volume."},
+#endif
+#if BUILD_MOUNT
+	{"mount", mfsmount_main, "Mount MFS volume read-only through FUSE."},
 #endif
 	{0, 0, 0}
 };
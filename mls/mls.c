@@ -8,6 +8,9 @@
 #include <string.h>
 #include <time.h>
 #include <inttypes.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "macpart.h"
 #include "mfs.h"
 
@@ -28,17 +31,226 @@ mls_usage ()
 	fprintf (stderr, " -R        recurse\n");
 }
 
-static void dir_list(int fsid, int recurse)
+/* Recursive listings are read breadth first by a few worker threads, */
+/* while the main thread prints each directory in the usual depth first */
+/* order as soon as it has been read.  Each directory's inodes are read */
+/* in the order they sit on disk rather than in name order. */
+
+/* Threads reading directories for -R */
+#define MLS_THREADS 4
+
+struct mls_stat
+{
+	uint32_t slot;			/* Where the inode should be on disk */
+	uint32_t index;			/* Which entry it belongs to */
+	int valid;
+	time_t modtime;
+	uint64_t size;
+};
+
+struct mls_node
 {
+	int fsid;
 	mfs_dirent *dir;
-	uint32_t count, i;
-	dir = mfs_dir(mfs, fsid, &count);
-	if (fsid == 0)
+	uint32_t count;
+	struct mls_stat *stats;	/* By entry, with -l */
+	struct mls_node **children;	/* One per entry, set for directories */
+	int done;
+	struct mls_node *next;	/* Read queue */
+};
+
+static struct
+{
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	struct mls_node *head;
+	struct mls_node *tail;
+	int pending;			/* Directories queued or being read */
+	int nthreads;
+} walk;
+
+static struct mls_node *
+mls_node_new (int fsid)
+{
+	struct mls_node *node = calloc (1, sizeof (*node));
+
+	if (!node)
+	{
+		fprintf (stderr, "Out of memory!\n");
+		exit (1);
+	}
+	node->fsid = fsid;
+	return node;
+}
+
+static int
+mls_stat_cmp (const void *a, const void *b)
+{
+	const struct mls_stat *sa = a, *sb = b;
+
+	if (sa->slot != sb->slot)
+		return sa->slot < sb->slot? -1: 1;
+	return sa->index < sb->index? -1: sa->index > sb->index;
+}
+
+/* Read the inodes of all entries of a directory, in the order of their */
+/* inode slots so the reads move across the disk in one direction. */
+static void
+mls_read_stats (struct mls_node *node)
+{
+	struct mls_stat *order;
+	uint32_t inodes = mfs_inode_count (mfs);
+	uint32_t i;
+
+	node->stats = calloc (node->count? node->count: 1, sizeof (*node->stats));
+	order = calloc (node->count? node->count: 1, sizeof (*order));
+	if (!node->stats || !order)
+	{
+		fprintf (stderr, "Out of memory!\n");
+		exit (1);
+	}
+
+	for (i = 0; i < node->count; i++)
+	{
+		order[i].slot = (node->dir[i].fsid * MFS_FSID_HASH) & (inodes - 1);
+		order[i].index = i;
+	}
+	qsort (order, node->count, sizeof (*order), mls_stat_cmp);
+
+	for (i = 0; i < node->count; i++)
+	{
+		struct mls_stat *st = &node->stats[order[i].index];
+		mfs_inode *inode = mfs_read_inode_by_fsid (mfs, node->dir[order[i].index].fsid);
+
+		if (!inode)
+			continue;
+
+		st->valid = 1;
+		st->modtime = intswap32 (inode->lastmodified);
+		if (intswap32 (inode->unk3) == 0x20000)
+			st->size = intswap32 (inode->size) * intswap32 (inode->unk3);
+		else
+			st->size = intswap32 (inode->size);
+		free (inode);
+	}
+
+	free (order);
+}
+
+/* Read a directory and everything needed to print it, and queue up its */
+/* subdirectories when recursing. */
+static void
+mls_read_node (struct mls_node *node, int recurse)
+{
+	uint32_t i;
+	int nchildren = 0;
+
+	if (node->fsid)
+		node->dir = mfs_dir (mfs, node->fsid, &node->count);
+
+	if (node->dir && long_list)
+		mls_read_stats (node);
+
+	if (node->dir && recurse)
+	{
+		node->children = calloc (node->count? node->count: 1, sizeof (*node->children));
+		if (!node->children)
+		{
+			fprintf (stderr, "Out of memory!\n");
+			exit (1);
+		}
+		for (i = 0; i < node->count; i++)
+		{
+			if (node->dir[i].type == tyDir)
+			{
+				node->children[i] = mls_node_new (node->dir[i].fsid);
+				nchildren++;
+			}
+		}
+	}
+
+#if HAVE_PTHREAD_H
+	if (walk.nthreads)
+	{
+		pthread_mutex_lock (&walk.lock);
+		for (i = 0; nchildren && i < node->count; i++)
 		{
+			struct mls_node *child = node->children[i];
+
+			if (!child)
+				continue;
+			if (walk.tail)
+				walk.tail->next = child;
+			else
+				walk.head = child;
+			walk.tail = child;
+		}
+		walk.pending += nchildren - 1;
+		node->done = 1;
+		pthread_cond_broadcast (&walk.cond);
+		pthread_mutex_unlock (&walk.lock);
+		return;
+	}
+#endif
+
+	node->done = 1;
+}
+
+#if HAVE_PTHREAD_H
+static void *
+mls_read_thread (void *arg)
+{
+	while (1)
+	{
+		struct mls_node *node;
+
+		pthread_mutex_lock (&walk.lock);
+		while (!walk.head && walk.pending > 0)
+			pthread_cond_wait (&walk.cond, &walk.lock);
+		node = walk.head;
+		if (node)
+		{
+			walk.head = node->next;
+			if (!walk.head)
+				walk.tail = NULL;
+		}
+		pthread_mutex_unlock (&walk.lock);
+
+		if (!node)
+			break;
+
+		mls_read_node (node, 1);
+	}
+
+	return NULL;
+}
+#endif
+
+static void
+mls_print_node (struct mls_node *node, int recurse)
+{
+	uint32_t i;
+
+#if HAVE_PTHREAD_H
+	if (walk.nthreads)
+	{
+		pthread_mutex_lock (&walk.lock);
+		while (!node->done)
+			pthread_cond_wait (&walk.cond, &walk.lock);
+		pthread_mutex_unlock (&walk.lock);
+	}
+#endif
+	if (!node->done)
+		mls_read_node (node, recurse);
+
+	if (node->fsid == 0)
+	{
 		fprintf (stderr, "No such file or directory!\n");
 		exit (1);
-		}
-	if (!dir)
+	}
+	if (!node->dir)
 	{
 		fprintf (stderr, "No such directory!\n");
 		exit (1);
@@ -50,51 +262,81 @@ static void dir_list(int fsid, int recurse)
 	} else {
 		printf("      FsId   Type     Name\n");
 		printf("      ----   ----     ----\n");
-}
-	for (i=0;i<count;i++) {
-	char date[17] = "xx/xx/xx xx:xx";
-	time_t modtime;
+	}
+	for (i = 0; i < node->count; i++) {
+		mfs_dirent *ent = &node->dir[i];
+
 		if (long_list) {
-			mfs_inode *inode;
+			char date[17] = "xx/xx/xx xx:xx";
 			uint64_t size = 0;
-			inode = mfs_read_inode_by_fsid (mfs, dir[i].fsid); 
-			if (inode)
-	{
-				modtime = intswap32 (inode->lastmodified);
-		strftime (date, 16, "%D %R", localtime (&modtime));
-				if (intswap32 (inode->unk3) == 0x20000) 
-					size = intswap32 (inode->size) * intswap32 (inode->unk3);
-	else
-					size = intswap32 (inode->size);
-	}
+
+			if (node->stats[i].valid)
+			{
+				strftime (date, 16, "%D %R", localtime (&node->stats[i].modtime));
+				size = node->stats[i].size;
+			}
 			printf("%9d %-8s %14s%10" SCNd64 " %s\n",
-						dir[i].fsid, 
-						mfs_type_string(dir[i].type),
+						ent->fsid,
+						mfs_type_string(ent->type),
 						date,
 						size,
-						dir[i].name);
-			if (inode)
-				free (inode);
+						ent->name);
 		} else {
-			printf("   %7d   %-8s %s\n", 
-						dir[i].fsid, 
-						mfs_type_string(dir[i].type),
-						dir[i].name);
-}
+			printf("   %7d   %-8s %s\n",
+						ent->fsid,
+						mfs_type_string(ent->type),
+						ent->name);
+		}
 	}
 
 	if (recurse) {
-		for (i=0;i<count;i++) {
-			if (dir[i].type == tyDir) {
-				printf("\n%s[%d]:\n", 
-							dir[i].name, dir[i].fsid);
-				dir_list(dir[i].fsid, 1);
-	}
-		}
+		for (i = 0; i < node->count; i++) {
+			if (node->children[i]) {
+				printf("\n%s[%d]:\n",
+							node->dir[i].name, node->dir[i].fsid);
+				mls_print_node (node->children[i], 1);
+			}
 		}
+	}
 
-	if (dir) mfs_dir_free(dir);
+	mfs_dir_free (node->dir);
+	free (node->stats);
+	free (node->children);
+	free (node);
+}
+
+static void dir_list(int fsid, int recurse)
+{
+	struct mls_node *root = mls_node_new (fsid);
+#if HAVE_PTHREAD_H
+	pthread_t threads[MLS_THREADS];
+	int started = 0;
+	int i;
+
+	/* The workers share the partition descriptors, so reads must not seek */
+	if (recurse && fsid && tivo_partition_parallel_read ())
+	{
+		pthread_mutex_init (&walk.lock, NULL);
+		pthread_cond_init (&walk.cond, NULL);
+		walk.pending = 1;
+		for (started = 0; started < MLS_THREADS; started++)
+		{
+			if (pthread_create (&threads[started], NULL, mls_read_thread, NULL) != 0)
+				break;
 		}
+		walk.nthreads = started;
+	}
+#endif
+
+	/* The root is read here, and the workers pick up its subdirectories */
+	mls_read_node (root, recurse);
+	mls_print_node (root, recurse);
+
+#if HAVE_PTHREAD_H
+	for (i = 0; i < started; i++)
+		pthread_join (threads[i], NULL);
+#endif
+}
 
 
 int
@@ -0,0 +1,407 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#include <string.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "mfs.h"
+#include "macpart.h"
+
+#define RESTORE
+#include "backup.h"
+
+/* Direct stream copy for mfscopy.  The backup side leaves the data of */
+/* every stream out of the backup stream, as if it were an incremental */
+/* backup of the source drive.  Once a stream is allocated on the target, */
+/* its source extents are matched up with its new extents, and the data */
+/* goes straight from one drive to the other in large pieces.  Between */
+/* plain files with the same byte order it is copied in the kernel with */
+/* copy_file_range; otherwise a reader thread keeps the source drive busy */
+/* while the target is written. */
+
+/* Largest piece read or written at once, 1MiB */
+#define COPY_SECTORS 2048
+/* Pieces read ahead of the writer */
+#define COPY_BUFS 4
+
+struct restore_copy_extent
+{
+	uint64_t from;
+	uint64_t to;
+	unsigned int count;
+};
+
+struct restore_copy
+{
+	struct mfs_handle *from;
+	int native;				/* Try copying in the kernel */
+	uint64_t copied;		/* Sectors copied so far */
+
+	struct restore_copy_extent *extents;
+	unsigned int nextents;
+	unsigned int extentalloc;
+
+	unsigned char *buf[COPY_BUFS];
+#if HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int npieces;	/* Pieces in the stream being copied */
+	unsigned int filled;	/* Pieces read */
+	unsigned int drained;	/* Pieces written */
+	int readerror;
+	int stop;
+#endif
+};
+
+/*****************************************************/
+/* Get the sectors of an extent of an inode's data. */
+static void
+restore_copy_get_extent (struct mfs_handle *mfs, mfs_inode *inode, unsigned int n, uint64_t *sector, uint64_t *count)
+{
+	if (mfs_is_64bit (mfs))
+	{
+		*sector = sectorswap64 (inode->datablocks.d64[n].sector);
+		*count = intswap32 (inode->datablocks.d64[n].count);
+	}
+	else
+	{
+		*sector = intswap32 (inode->datablocks.d32[n].sector);
+		*count = intswap32 (inode->datablocks.d32[n].count);
+	}
+}
+
+/*************************************************************************/
+/* Match up the source extents of a stream with its target extents, for */
+/* the first datasize sectors.  Returns -1 if either side runs short. */
+static int
+restore_copy_plan (struct restore_copy *copy, struct mfs_handle *to, mfs_inode *frominode, mfs_inode *toinode, uint64_t datasize)
+{
+	unsigned int fromext = 0, toext = 0;
+	uint64_t fromsector = 0, fromleft = 0, tosector = 0, toleft = 0;
+
+	copy->nextents = 0;
+
+	while (datasize > 0)
+	{
+		unsigned int count;
+
+		if (!fromleft)
+		{
+			if (fromext >= intswap32 (frominode->numblocks))
+				return -1;
+			restore_copy_get_extent (copy->from, frominode, fromext++, &fromsector, &fromleft);
+			continue;
+		}
+		if (!toleft)
+		{
+			if (toext >= intswap32 (toinode->numblocks))
+				return -1;
+			restore_copy_get_extent (to, toinode, toext++, &tosector, &toleft);
+			continue;
+		}
+
+		count = COPY_SECTORS;
+		if (count > fromleft)
+			count = fromleft;
+		if (count > toleft)
+			count = toleft;
+		if (count > datasize)
+			count = datasize;
+
+		if (copy->nextents >= copy->extentalloc)
+		{
+			unsigned int newalloc = copy->extentalloc? copy->extentalloc * 2: 256;
+			struct restore_copy_extent *tmp = realloc (copy->extents, newalloc * sizeof (*tmp));
+			if (!tmp)
+				return -1;
+			copy->extents = tmp;
+			copy->extentalloc = newalloc;
+		}
+
+		copy->extents[copy->nextents].from = fromsector;
+		copy->extents[copy->nextents].to = tosector;
+		copy->extents[copy->nextents].count = count;
+		copy->nextents++;
+
+		fromsector += count;
+		fromleft -= count;
+		tosector += count;
+		toleft -= count;
+		datasize -= count;
+	}
+
+	return 0;
+}
+
+#if HAVE_PTHREAD_H
+/**********************************************************/
+/* Read the pieces of a stream ahead of the writer. */
+static void *
+restore_copy_reader (void *arg)
+{
+	struct restore_copy *copy = arg;
+	unsigned int piece;
+
+	for (piece = 0; piece < copy->npieces; piece++)
+	{
+		struct restore_copy_extent *ext = &copy->extents[piece];
+		int nread;
+
+		pthread_mutex_lock (&copy->lock);
+		while (piece - copy->drained >= COPY_BUFS && !copy->stop)
+			pthread_cond_wait (&copy->cond, &copy->lock);
+		if (copy->stop)
+		{
+			pthread_mutex_unlock (&copy->lock);
+			break;
+		}
+		pthread_mutex_unlock (&copy->lock);
+
+		nread = mfs_read_data (copy->from, copy->buf[piece % COPY_BUFS], ext->from, ext->count);
+
+		pthread_mutex_lock (&copy->lock);
+		if (nread != (int)ext->count * 512)
+			copy->readerror = 1;
+		copy->filled++;
+		pthread_cond_broadcast (&copy->cond);
+		pthread_mutex_unlock (&copy->lock);
+
+		if (nread != (int)ext->count * 512)
+			break;
+	}
+
+	return NULL;
+}
+#endif
+
+/**************************************************************************/
+/* Copy the planned pieces of a stream through memory.  With threads the */
+/* source is read ahead while the target is written. */
+static int
+restore_copy_buffered (struct backup_info *info, unsigned int fsid)
+{
+	struct restore_copy *copy = info->copy;
+	unsigned int piece;
+#if HAVE_PTHREAD_H
+	pthread_t reader;
+	int ret = 0;
+
+/* Nothing to overlap for a single piece, and nothing safe to overlap if */
+/* reads seek the source descriptors mfscopy's own reader also uses */
+	if (copy->nextents > 1 && tivo_partition_parallel_read ())
+	{
+		copy->npieces = copy->nextents;
+		copy->filled = 0;
+		copy->drained = 0;
+		copy->readerror = 0;
+		copy->stop = 0;
+
+		if (pthread_create (&reader, NULL, restore_copy_reader, copy) == 0)
+		{
+			for (piece = 0; piece < copy->npieces && ret == 0; piece++)
+			{
+				struct restore_copy_extent *ext = &copy->extents[piece];
+
+				pthread_mutex_lock (&copy->lock);
+				while (copy->filled <= piece)
+					pthread_cond_wait (&copy->cond, &copy->lock);
+				if (copy->readerror && copy->filled == piece + 1)
+				{
+					pthread_mutex_unlock (&copy->lock);
+					info->err_msg = "Error reading stream data for fsid %" PRId64 " from the source";
+					info->err_arg1 = fsid;
+					ret = -1;
+					break;
+				}
+				pthread_mutex_unlock (&copy->lock);
+
+				if (mfs_write_data (info->mfs, copy->buf[piece % COPY_BUFS], ext->to, ext->count) != (int)ext->count * 512)
+				{
+					info->err_msg = "Error writing stream data for fsid %" PRId64 "";
+					info->err_arg1 = fsid;
+					ret = -1;
+				}
+				else
+					copy->copied += ext->count;
+
+				pthread_mutex_lock (&copy->lock);
+				copy->drained++;
+				pthread_cond_broadcast (&copy->cond);
+				pthread_mutex_unlock (&copy->lock);
+			}
+
+			pthread_mutex_lock (&copy->lock);
+			copy->stop = 1;
+			pthread_cond_broadcast (&copy->cond);
+			pthread_mutex_unlock (&copy->lock);
+			pthread_join (reader, NULL);
+
+			return ret;
+		}
+	}
+#endif
+
+	for (piece = 0; piece < copy->nextents; piece++)
+	{
+		struct restore_copy_extent *ext = &copy->extents[piece];
+
+		if (mfs_read_data (copy->from, copy->buf[0], ext->from, ext->count) != (int)ext->count * 512)
+		{
+			info->err_msg = "Error reading stream data for fsid %" PRId64 " from the source";
+			info->err_arg1 = fsid;
+			return -1;
+		}
+		if (mfs_write_data (info->mfs, copy->buf[0], ext->to, ext->count) != (int)ext->count * 512)
+		{
+			info->err_msg = "Error writing stream data for fsid %" PRId64 "";
+			info->err_arg1 = fsid;
+			return -1;
+		}
+		copy->copied += ext->count;
+	}
+
+	return 0;
+}
+
+/***********************************************************************/
+/* Copy a stream left out of the backup straight from the source drive */
+/* into the freshly allocated inode.  Returns 1 once it is copied, or */
+/* -1 on error. */
+int
+restore_copy_inode_data (struct backup_info *info, mfs_inode *inode, uint64_t datasize)
+{
+	struct restore_copy *copy = info->copy;
+	unsigned int fsid = intswap32 (inode->fsid);
+	mfs_inode *frominode;
+	unsigned int piece;
+
+	frominode = mfs_read_inode_by_fsid (copy->from, fsid);
+	if (!frominode)
+	{
+		info->err_msg = "Unable to read source inode for fsid %" PRId64 "";
+		info->err_arg1 = fsid;
+		return -1;
+	}
+
+	if (restore_copy_plan (copy, info->mfs, frominode, inode, datasize) < 0)
+	{
+		free (frominode);
+		info->err_msg = "Extents for fsid %" PRId64 " do not cover its data";
+		info->err_arg1 = fsid;
+		return -1;
+	}
+	free (frominode);
+
+/* Let the kernel move the data if it can, and stop asking once it can't */
+	for (piece = 0; copy->native && piece < copy->nextents; piece++)
+	{
+		struct restore_copy_extent *ext = &copy->extents[piece];
+
+		if (mfs_copy_data (copy->from, ext->from, info->mfs, ext->to, ext->count) != (int)ext->count * 512)
+		{
+			if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP)
+			{
+				info->err_msg = "Error copying stream data for fsid %" PRId64 "";
+				info->err_arg1 = fsid;
+				return -1;
+			}
+			copy->native = 0;
+			break;
+		}
+		copy->copied += ext->count;
+	}
+
+	if (piece < copy->nextents)
+	{
+		memmove (copy->extents, copy->extents + piece, (copy->nextents - piece) * sizeof (*copy->extents));
+		copy->nextents -= piece;
+		if (restore_copy_buffered (info, fsid) < 0)
+			return -1;
+	}
+
+	return 1;
+}
+
+/*************************************************************************/
+/* Copy stream data from a source drive instead of from the backup. */
+int
+restore_set_copy_source (struct backup_info *info, struct mfs_handle *mfs)
+{
+	struct restore_copy *copy;
+	int loop;
+
+	copy = calloc (sizeof (*copy), 1);
+	if (!copy)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	for (loop = 0; loop < COPY_BUFS; loop++)
+	{
+		copy->buf[loop] = malloc (COPY_SECTORS * 512);
+		if (!copy->buf[loop])
+		{
+			while (loop-- > 0)
+				free (copy->buf[loop]);
+			free (copy);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+	}
+
+#if HAVE_PTHREAD_H
+	pthread_mutex_init (&copy->lock, NULL);
+	pthread_cond_init (&copy->cond, NULL);
+#endif
+
+	copy->from = mfs;
+	copy->native = 1;
+	info->copy = copy;
+	return 0;
+}
+
+/******************************************/
+/* Sectors of stream data copied directly */
+uint64_t
+restore_copy_sectors (struct backup_info *info)
+{
+	return info->copy? info->copy->copied: 0;
+}
+
+/*************************************/
+/* Free the direct copy information. */
+void
+restore_copy_free (struct backup_info *info)
+{
+	struct restore_copy *copy = info->copy;
+	int loop;
+
+	if (!copy)
+		return;
+
+	for (loop = 0; loop < COPY_BUFS; loop++)
+		free (copy->buf[loop]);
+	if (copy->extents)
+		free (copy->extents);
+#if HAVE_PTHREAD_H
+	pthread_mutex_destroy (&copy->lock);
+	pthread_cond_destroy (&copy->cond);
+#endif
+	free (copy);
+	info->copy = NULL;
+}
@@ -0,0 +1,266 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#if HAVE_ZSTD_H
+#include <zstd.h>
+#endif
+#if HAVE_LZ4FRAME_H
+#include <lz4frame.h>
+#endif
+
+#include "mfs.h"
+
+#define RESTORE
+#include "backup.h"
+
+/* zstd and LZ4 decoders for restore_write.  Like the encoders in backup, */
+/* these use info->comp only to track the input and output buffers, so */
+/* restore_write can call them in place of inflate. */
+
+/* Must match the long distance window used by backup */
+#define ZSTD_LONGWINDOW 27
+
+struct restore_codec
+{
+	int codec;
+#if HAVE_ZSTD_H
+	ZSTD_DCtx *zds;
+#endif
+#if HAVE_LZ4FRAME_H
+	LZ4F_dctx *lz4;
+#endif
+};
+
+/********************************************************/
+/* Start decoding a backup compressed with zstd or LZ4. */
+int
+restore_codec_init (struct backup_info *info, int codec)
+{
+	struct restore_codec *c;
+
+	c = calloc (sizeof (*c), 1);
+	if (!c)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+	c->codec = codec;
+
+	switch (codec)
+	{
+#if HAVE_ZSTD_H
+	case BC_ZSTD:
+		c->zds = ZSTD_createDCtx ();
+		if (!c->zds)
+		{
+			free (c);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+		if (ZSTD_isError (ZSTD_DCtx_setParameter (c->zds, ZSTD_d_windowLogMax, ZSTD_LONGWINDOW)))
+		{
+			ZSTD_freeDCtx (c->zds);
+			free (c);
+			info->err_msg = "Decompression error";
+			return -1;
+		}
+		break;
+#endif
+#if HAVE_LZ4FRAME_H
+	case BC_LZ4:
+		if (LZ4F_isError (LZ4F_createDecompressionContext (&c->lz4, LZ4F_VERSION)))
+		{
+			free (c);
+			info->err_msg = "Decompression error";
+			return -1;
+		}
+		break;
+#endif
+#if !HAVE_ZSTD_H
+	case BC_ZSTD:
+		free (c);
+		info->err_msg = "Backup is compressed with zstd, which this build does not support";
+		return -1;
+#endif
+#if !HAVE_LZ4FRAME_H
+	case BC_LZ4:
+		free (c);
+		info->err_msg = "Backup is compressed with LZ4, which this build does not support";
+		return -1;
+#endif
+	default:
+		free (c);
+		info->err_msg = "Backup is compressed with unknown codec %"PRId64"";
+		info->err_arg1 = codec;
+		return -1;
+	}
+
+	info->codec = c;
+	return 0;
+}
+
+/*************************************************************************/
+/* Decompress from info->comp->next_in to info->comp->next_out.  Returns */
+/* the same codes as inflate would, so restore_write can treat them alike. */
+int
+restore_codec_step (struct backup_info *info)
+{
+	struct restore_codec *c = info->codec;
+
+	switch (c->codec)
+	{
+#if HAVE_ZSTD_H
+	case BC_ZSTD:
+	{
+		z_stream *strm = info->comp;
+		ZSTD_inBuffer in;
+		ZSTD_outBuffer out;
+		size_t ret;
+
+		in.src = strm->next_in;
+		in.size = strm->avail_in;
+		in.pos = 0;
+		out.dst = strm->next_out;
+		out.size = strm->avail_out;
+		out.pos = 0;
+
+		ret = ZSTD_decompressStream (c->zds, &out, &in);
+
+		strm->next_in += in.pos;
+		strm->avail_in -= in.pos;
+		strm->next_out += out.pos;
+		strm->avail_out -= out.pos;
+
+		if (ZSTD_isError (ret))
+			return Z_DATA_ERROR;
+		if (ret == 0)
+			return Z_STREAM_END;
+		if (in.pos == 0 && out.pos == 0)
+			return Z_BUF_ERROR;
+		return Z_OK;
+	}
+#endif
+#if HAVE_LZ4FRAME_H
+	case BC_LZ4:
+	{
+		z_stream *strm = info->comp;
+		size_t insize = strm->avail_in;
+		size_t outsize = strm->avail_out;
+		size_t ret;
+
+		ret = LZ4F_decompress (c->lz4, strm->next_out, &outsize, strm->next_in, &insize, NULL);
+
+		strm->next_in += insize;
+		strm->avail_in -= insize;
+		strm->next_out += outsize;
+		strm->avail_out -= outsize;
+
+		if (LZ4F_isError (ret))
+			return Z_DATA_ERROR;
+		if (ret == 0)
+			return Z_STREAM_END;
+		if (insize == 0 && outsize == 0)
+			return Z_BUF_ERROR;
+		return Z_OK;
+	}
+#endif
+	default:
+		return Z_STREAM_ERROR;
+	}
+}
+
+/*******************************************/
+/* Release the zstd or LZ4 decoder state. */
+void
+restore_codec_end (struct backup_info *info)
+{
+	struct restore_codec *c = info->codec;
+
+	if (!c)
+		return;
+
+#if HAVE_ZSTD_H
+	if (c->zds)
+		ZSTD_freeDCtx (c->zds);
+#endif
+#if HAVE_LZ4FRAME_H
+	if (c->lz4)
+		LZ4F_freeDecompressionContext (c->lz4);
+#endif
+
+	free (c);
+	info->codec = 0;
+}
+
+/*************************************************************************/
+/* Decompress one whole chunk of a chunked backup in a single call.  The */
+/* output must come out to exactly outsize bytes. */
+int
+restore_codec_chunk (int codec, unsigned char *in, unsigned int insize, unsigned char *out, unsigned int outsize)
+{
+	switch (codec)
+	{
+	case BC_ZLIB:
+	{
+		uLongf outlen = outsize;
+
+		if (uncompress (out, &outlen, in, insize) != Z_OK || outlen != outsize)
+			return -1;
+		return 0;
+	}
+#if HAVE_ZSTD_H
+	case BC_ZSTD:
+	{
+		ZSTD_DCtx *zds = ZSTD_createDCtx ();
+		size_t ret;
+
+		if (!zds)
+			return -1;
+		ZSTD_DCtx_setParameter (zds, ZSTD_d_windowLogMax, ZSTD_LONGWINDOW);
+		ret = ZSTD_decompressDCtx (zds, out, outsize, in, insize);
+		ZSTD_freeDCtx (zds);
+		if (ZSTD_isError (ret) || ret != outsize)
+			return -1;
+		return 0;
+	}
+#endif
+#if HAVE_LZ4FRAME_H
+	case BC_LZ4:
+	{
+		LZ4F_dctx *dctx;
+		size_t inpos = 0, outpos = 0;
+		size_t ret = 1;
+
+		if (LZ4F_isError (LZ4F_createDecompressionContext (&dctx, LZ4F_VERSION)))
+			return -1;
+		while (ret != 0 && inpos < insize)
+		{
+			size_t inlen = insize - inpos;
+			size_t outlen = outsize - outpos;
+
+			ret = LZ4F_decompress (dctx, out + outpos, &outlen, in + inpos, &inlen, NULL);
+			if (LZ4F_isError (ret) || (inlen == 0 && outlen == 0))
+				break;
+			inpos += inlen;
+			outpos += outlen;
+		}
+		LZ4F_freeDecompressionContext (dctx);
+		if (ret != 0 || outpos != outsize)
+			return -1;
+		return 0;
+	}
+#endif
+	default:
+		return -1;
+	}
+}
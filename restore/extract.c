@@ -0,0 +1,356 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#include <fcntl.h>
+#include <string.h>
+#include <limits.h>
+
+#include "mfs.h"
+
+#define RESTORE
+#include "backup.h"
+
+/* Selective restore.  Single objects are pulled out of a chunked backup */
+/* by fsid through the container index, so only the chunks holding the */
+/* wanted inodes and their data are read and decompressed.  Paths are */
+/* resolved by reading the directories out of the backup the same way. */
+
+/*************************************************************************/
+/* Copy size bytes starting at a backup sector, either into memory or out */
+/* to a file. */
+static int
+restore_extract_copy (struct backup_info *info, struct restore_base *backup, uint64_t sector, uint64_t size, unsigned char *buf, int fd)
+{
+	while (size > 0)
+	{
+		unsigned int chunk = (sector - 1) / backup->head->chunksectors;
+		unsigned int offset;
+		uint64_t count;
+
+		if (restore_base_load_chunk (info, backup, chunk) < 0)
+			return -1;
+
+		offset = sector - backup->chunks[chunk].firstsector;
+		count = (uint64_t)(backup->chunks[chunk].sectors - offset) * 512;
+		if (count > size)
+			count = size;
+
+		if (buf)
+		{
+			memcpy (buf, backup->chunk + offset * 512, count);
+			buf += count;
+		}
+		else if (write (fd, backup->chunk + offset * 512, count) != (ssize_t)count)
+		{
+			info->err_msg = "Error writing extracted data";
+			return -1;
+		}
+
+		size -= count;
+		sector += (count + 511) / 512;
+	}
+
+	return 0;
+}
+
+/************************************************************************/
+/* Read the inode sector of an fsid out of the backup.  Returns the index */
+/* entry for the fsid, or NULL with the error message set. */
+static struct backup_index_fsid *
+restore_extract_inode (struct backup_info *info, struct restore_base *backup, unsigned int fsid, mfs_inode *inode)
+{
+	struct backup_index_fsid *entry;
+
+	entry = restore_base_find (backup, fsid);
+	if (!entry)
+	{
+		info->err_msg = "Fsid %" PRId64 " is not in the backup";
+		info->err_arg1 = fsid;
+		return 0;
+	}
+
+	if (restore_extract_copy (info, backup, entry->firstsector, 512, (unsigned char *)inode, -1) < 0)
+		return 0;
+
+	if (intswap32 (inode->fsid) != fsid)
+	{
+		info->err_msg = "Inode for fsid %" PRId64 " is corrupt in the backup";
+		info->err_arg1 = fsid;
+		return 0;
+	}
+
+	return entry;
+}
+
+/**********************************************************************/
+/* Work out how many bytes of data an inode has, and check the backup */
+/* holds all of it.  Returns -1 with the error message set if not. */
+static int64_t
+restore_extract_size (struct backup_info *info, struct restore_base *backup, struct backup_index_fsid *entry, mfs_inode *inode)
+{
+	uint64_t size;
+
+	if (inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2))
+	{
+		size = intswap32 (inode->size);
+		if (size > 512 - 0x3c)
+		{
+			info->err_msg = "Inode for fsid %" PRId64 " is corrupt in the backup";
+			info->err_arg1 = entry->fsid;
+			return -1;
+		}
+		return size;
+	}
+
+/* Same sizes the backup used when it wrote the data out */
+	if (inode->type == tyStream)
+	{
+		if (backup->flags & BF_STREAMTOT)
+			size = intswap32 (inode->size);
+		else
+			size = intswap32 (inode->blockused);
+		size *= intswap32 (inode->blocksize);
+	}
+	else
+		size = intswap32 (inode->size);
+
+	if ((size + 511) / 512 > entry->sectors - 1)
+	{
+		if (entry->sectors == 1 && (backup->flags & BF_INCREMENTAL))
+			info->err_msg = "Data for fsid %" PRId64 " is in the base backup";
+		else
+			info->err_msg = "Data for fsid %" PRId64 " is incomplete in the backup";
+		info->err_arg1 = entry->fsid;
+		return -1;
+	}
+
+	return size;
+}
+
+/*******************************************************************/
+/* Load the data of a directory into memory.  Directories are small. */
+static unsigned char *
+restore_extract_dir (struct backup_info *info, struct restore_base *backup, unsigned int fsid, uint64_t *size)
+{
+	unsigned char inodebuf[512];
+	mfs_inode *inode = (mfs_inode *)inodebuf;
+	struct backup_index_fsid *entry;
+	unsigned char *data;
+	int64_t datasize;
+
+	entry = restore_extract_inode (info, backup, fsid, inode);
+	if (!entry)
+		return 0;
+
+	if (inode->type != tyDir)
+	{
+		info->err_msg = "Fsid %" PRId64 " is not a directory";
+		info->err_arg1 = fsid;
+		return 0;
+	}
+
+	datasize = restore_extract_size (info, backup, entry, inode);
+	if (datasize < 0)
+		return 0;
+
+	data = malloc (datasize + 1);
+	if (!data)
+	{
+		info->err_msg = "Memory exhausted";
+		return 0;
+	}
+
+	if (inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2))
+		memcpy (data, inodebuf + 0x3c, datasize);
+	else if (restore_extract_copy (info, backup, entry->firstsector + 1, datasize, data, -1) < 0)
+	{
+		free (data);
+		return 0;
+	}
+
+	*size = datasize;
+	return data;
+}
+
+/***********************************************************************/
+/* Look a name up in a directory in the backup.  Meta-directories are */
+/* lists of other directories, and are searched through.  Returns the */
+/* fsid, 0 if the name is not there, or -1 on error. */
+static int64_t
+restore_extract_lookup (struct backup_info *info, struct restore_base *backup, unsigned int dirfsid, char *name, int depth)
+{
+	unsigned char *data;
+	uint64_t size, pos;
+	unsigned int dsize, dflags;
+	int64_t found = 0;
+
+	if (depth > 4)
+	{
+		info->err_msg = "Directory fsid %" PRId64 " nests too deep";
+		info->err_arg1 = dirfsid;
+		return -1;
+	}
+
+	data = restore_extract_dir (info, backup, dirfsid, &size);
+	if (!data)
+		return -1;
+
+	if (size < 4)
+	{
+		free (data);
+		return 0;
+	}
+
+	dsize = intswap16 (*(uint16_t *)data);
+	dflags = intswap16 (*(uint16_t *)(data + 2));
+	if (dsize > size)
+		dsize = size;
+
+	for (pos = 4; pos + 6 <= dsize && !found; )
+	{
+		unsigned char *s = data + pos + 4;
+		unsigned int fsid = intswap32 (*(uint32_t *)(data + pos));
+
+/* A zero length entry would never end */
+		if (s[0] < 8 || pos + s[0] > dsize)
+			break;
+
+		if (dflags == 0x200)
+		{
+			if (s[1] == tyDir)
+				found = restore_extract_lookup (info, backup, fsid, name, depth + 1);
+		}
+		else if (memchr (s + 2, 0, s[0] - 6) && !strcmp ((char *)s + 2, name))
+			found = fsid;
+
+		pos += s[0] & ~3;
+	}
+
+	free (data);
+	return found;
+}
+
+/************************************************************************/
+/* Turn an fsid number or an MFS path into an fsid, using the backup's */
+/* own directories. */
+static int64_t
+restore_extract_resolve (struct backup_info *info, struct restore_base *backup, char *what)
+{
+	char *path, *tok, *r = NULL;
+	int64_t fsid = 1;
+
+	if (what[0] != '/')
+	{
+		fsid = strtoul (what, &tok, 0);
+		if (*tok || fsid <= 0)
+		{
+			info->err_msg = "Not an fsid or MFS path";
+			return -1;
+		}
+		return fsid;
+	}
+
+	path = strdup (what);
+	if (!path)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	for (tok = strtok_r (path, "/", &r); tok; tok = strtok_r (NULL, "/", &r))
+	{
+		fsid = restore_extract_lookup (info, backup, fsid, tok, 0);
+		if (fsid <= 0)
+			break;
+	}
+
+	free (path);
+
+	if (fsid == 0)
+		info->err_msg = "Path not found in the backup";
+	return fsid > 0? fsid: -1;
+}
+
+/**************************************************************************/
+/* Extract an object from a chunked backup into dir, named by its fsid. */
+/* The object is given as an fsid number or as an MFS path.  Returns the */
+/* fsid extracted, or -1 on error. */
+int
+restore_extract (struct backup_info *info, struct restore_base *backup, char *what, char *dir)
+{
+	unsigned char inodebuf[512];
+	mfs_inode *inode = (mfs_inode *)inodebuf;
+	struct backup_index_fsid *entry;
+	char path[PATH_MAX];
+	int64_t fsid, size;
+	int fd, ret = 0;
+
+/* Inode fields are stored as they were on the drive */
+	mfsLSB = (backup->flags & BF_MFSLSB)? 1: 0;
+
+	fsid = restore_extract_resolve (info, backup, what);
+	if (fsid < 0)
+		return -1;
+
+	entry = restore_extract_inode (info, backup, fsid, inode);
+	if (!entry)
+		return -1;
+
+	size = restore_extract_size (info, backup, entry, inode);
+	if (size < 0)
+		return -1;
+
+	if (snprintf (path, sizeof (path), "%s/%u", dir, (unsigned int)fsid) >= (int)sizeof (path))
+	{
+		info->err_msg = "Output directory name too long";
+		return -1;
+	}
+
+#if O_LARGEFILE
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+#else
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (fd < 0)
+	{
+		info->err_msg = "Unable to create output file";
+		return -1;
+	}
+
+	if (inode->inode_flags & intswap32 (INODE_DATA) || inode->inode_flags & intswap32 (INODE_DATA2))
+	{
+		if (write (fd, inodebuf + 0x3c, size) != size)
+		{
+			info->err_msg = "Error writing extracted data";
+			ret = -1;
+		}
+	}
+	else
+		ret = restore_extract_copy (info, backup, entry->firstsector + 1, size, 0, fd);
+
+	if (close (fd) < 0 && ret == 0)
+	{
+		info->err_msg = "Error writing extracted data";
+		ret = -1;
+	}
+
+	if (ret < 0)
+	{
+		unlink (path);
+		return -1;
+	}
+
+	return fsid;
+}
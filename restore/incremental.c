@@ -0,0 +1,408 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#include <fcntl.h>
+#include <zlib.h>
+#include <string.h>
+
+#include "mfs.h"
+
+#define RESTORE
+#include "backup.h"
+
+/* Incremental restore.  An incremental backup leaves out the data of */
+/* streams that had not changed since its base, and lists their fsids in */
+/* "basefsids" extra info entries.  The base must be a chunked backup, so */
+/* that data can be pulled out of it by fsid through the container index. */
+
+static int
+restore_fsid_cmp (const void *a, const void *b)
+{
+	unsigned int fa = *(const unsigned int *)a, fb = *(const unsigned int *)b;
+
+	if (fa < fb)
+		return -1;
+	return fa > fb;
+}
+
+/* The fsid is the first field of an index entry, so the same compare works */
+static int
+restore_index_fsid_cmp (const void *a, const void *b)
+{
+	return restore_fsid_cmp (&((const struct backup_index_fsid *)a)->fsid, &((const struct backup_index_fsid *)b)->fsid);
+}
+
+/******************************************/
+/* Read exactly size bytes at an offset. */
+static int
+restore_base_pread (int fd, void *buf, unsigned int size, uint64_t offset)
+{
+	if (lseek64 (fd, (off64_t)offset, SEEK_SET) != (off64_t)offset)
+		return -1;
+
+	while (size > 0)
+	{
+		int nread = read (fd, buf, size);
+		if (nread <= 0)
+			return -1;
+		buf = (char *)buf + nread;
+		size -= nread;
+	}
+
+	return 0;
+}
+
+/*************************************************************************/
+/* Load the container index from the end of a chunked backup file, and */
+/* check it over.  Returns the index, or NULL with the error message set. */
+void *
+restore_load_index (struct backup_info *info, int fd)
+{
+	struct backup_index_tail tail;
+	struct backup_index_head *head;
+	unsigned char *index;
+	off64_t end;
+
+	end = lseek64 (fd, 0, SEEK_END);
+	if (end < (off64_t)sizeof (tail) ||
+		restore_base_pread (fd, &tail, sizeof (tail), end - sizeof (tail)) < 0 ||
+		tail.magic != TBKI_MAGIC ||
+		tail.size > end - sizeof (tail) ||
+		tail.size < sizeof (struct backup_index_head))
+	{
+		info->err_msg = "Backup index is missing";
+		return 0;
+	}
+
+	index = malloc (tail.size);
+	if (!index)
+	{
+		info->err_msg = "Memory exhausted";
+		return 0;
+	}
+
+	if (restore_base_pread (fd, index, tail.size, end - sizeof (tail) - tail.size) < 0 ||
+		crc32 (0, index, tail.size) != tail.crc)
+	{
+		free (index);
+		info->err_msg = "Backup index is corrupt";
+		return 0;
+	}
+
+	head = (struct backup_index_head *)index;
+	if (sizeof (*head) + head->nchunks * sizeof (struct backup_index_chunk) + head->nfsids * sizeof (struct backup_index_fsid) != tail.size)
+	{
+		free (index);
+		info->err_msg = "Backup index is corrupt";
+		return 0;
+	}
+
+	return index;
+}
+
+/*************************************************************************/
+/* Open a chunked backup for reading by fsid, and load its container */
+/* index.  Used for the base of an incremental restore, and to pull */
+/* single objects out of a backup. */
+struct restore_base *
+restore_base_open (struct backup_info *info, char *filename)
+{
+	struct restore_base *base;
+	struct backup_head_v3 head;
+
+	base = calloc (sizeof (*base), 1);
+	if (!base)
+	{
+		info->err_msg = "Memory exhausted";
+		return 0;
+	}
+	base->curchunk = -1;
+
+#if O_LARGEFILE
+	base->fd = open (filename, O_RDONLY | O_LARGEFILE);
+#else
+	base->fd = open (filename, O_RDONLY);
+#endif
+	if (base->fd < 0)
+	{
+		free (base);
+		info->err_msg = "Unable to open backup";
+		return 0;
+	}
+
+	if (restore_base_pread (base->fd, &head, sizeof (head), 0) < 0)
+	{
+		info->err_msg = "Unable to read backup header";
+		goto fail;
+	}
+
+	if (head.magic == TB3_ENDIAN)
+	{
+		info->err_msg = "Backup was made on a host of different endianness";
+		goto fail;
+	}
+	if (head.magic != TB3_MAGIC)
+	{
+		info->err_msg = "Backup is not a v3 backup";
+		goto fail;
+	}
+
+	base->flags = head.flags;
+	if (!(base->flags & BF_CHUNKED))
+	{
+		info->err_msg = "Backup must be a chunked backup (backup -C)";
+		goto fail;
+	}
+
+	base->index = restore_load_index (info, base->fd);
+	if (!base->index)
+		goto fail;
+
+	base->head = (struct backup_index_head *)base->index;
+	base->chunks = (struct backup_index_chunk *)(base->head + 1);
+	base->fsids = (struct backup_index_fsid *)(base->chunks + base->head->nchunks);
+
+/* The index is in backup order, which need not be fsid order */
+	qsort (base->fsids, base->head->nfsids, sizeof (*base->fsids), restore_index_fsid_cmp);
+
+	base->chunk = malloc (base->head->chunksectors * 512);
+	if (!base->chunk)
+	{
+		info->err_msg = "Memory exhausted";
+		goto fail;
+	}
+
+	return base;
+
+fail:
+	close (base->fd);
+	if (base->index)
+		free (base->index);
+	free (base);
+	return 0;
+}
+
+/*************************************/
+/* Close a backup opened by fsid. */
+void
+restore_base_close (struct restore_base *base)
+{
+	close (base->fd);
+	free (base->index);
+	if (base->carried)
+		free (base->carried);
+	if (base->comp)
+		free (base->comp);
+	if (base->chunk)
+		free (base->chunk);
+	free (base);
+}
+
+/***********************************************************************/
+/* Open the base of an incremental backup and load its container index */
+int
+restore_set_base (struct backup_info *info, char *filename)
+{
+	info->base = restore_base_open (info, filename);
+
+	return info->base? 0: -1;
+}
+
+/*******************************************************/
+/* Close the base of an incremental backup, if it is open */
+void
+restore_base_free (struct backup_info *info)
+{
+	if (info->base)
+	{
+		restore_base_close (info->base);
+		info->base = NULL;
+	}
+}
+
+/******************************************************/
+/* Find where an fsid is in a backup opened by fsid. */
+struct backup_index_fsid *
+restore_base_find (struct restore_base *base, unsigned int fsid)
+{
+	struct backup_index_fsid key;
+
+	key.fsid = fsid;
+	return bsearch (&key, base->fsids, base->head->nfsids, sizeof (key), restore_index_fsid_cmp);
+}
+
+/*****************************************************************/
+/* Gather the fsids the incremental backup left for the base. */
+static int
+restore_base_carried (struct backup_info *info)
+{
+	struct restore_base *base = info->base;
+	unsigned int total = 0;
+	int loop;
+
+	for (loop = 0; loop < info->nextrainfo; loop++)
+	{
+		struct extrainfo *extra = info->extrainfo[loop];
+		unsigned int *fsids;
+		unsigned int count, loop2;
+
+		if (extra->typelength != 9 || memcmp (extra->data, "basefsids", 9))
+			continue;
+
+		fsids = (unsigned int *)(extra->data + ((extra->typelength + 3) & ~3));
+		count = extra->datalength / sizeof (*fsids);
+
+		base->carried = realloc (base->carried, sizeof (*base->carried) * (total + count + 1));
+		if (!base->carried)
+		{
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+
+		for (loop2 = 0; loop2 < count; loop2++)
+		{
+			if (info->rest_flags & RF_ENDIAN)
+				base->carried[total + loop2] = Endian32_Swap (fsids[loop2]);
+			else
+				base->carried[total + loop2] = fsids[loop2];
+		}
+		total += count;
+	}
+
+	if (!base->carried)
+		base->carried = malloc (sizeof (*base->carried));
+
+	qsort (base->carried, total, sizeof (*base->carried), restore_fsid_cmp);
+	base->ncarried = total;
+
+	return 0;
+}
+
+/**********************************************************/
+/* Make a chunk of a backup opened by fsid the current one. */
+int
+restore_base_load_chunk (struct backup_info *info, struct restore_base *base, unsigned int chunk)
+{
+	struct backup_index_chunk *entry;
+
+	if (base->curchunk == (int)chunk)
+		return 0;
+
+	if (chunk >= base->head->nchunks)
+	{
+		info->err_msg = "Backup chunk %" PRId64 " out of range";
+		info->err_arg1 = chunk;
+		return -1;
+	}
+	entry = &base->chunks[chunk];
+
+	if (entry->size > base->compsize)
+	{
+		unsigned char *tmp = realloc (base->comp, entry->size);
+		if (!tmp)
+		{
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+		base->comp = tmp;
+		base->compsize = entry->size;
+	}
+
+	if (restore_base_pread (base->fd, base->comp, entry->size, entry->offset) < 0)
+	{
+		info->err_msg = "Error reading backup chunk %" PRId64 "";
+		info->err_arg1 = chunk;
+		return -1;
+	}
+
+	if (crc32 (0, base->comp, entry->size) != entry->crc ||
+		entry->sectors > base->head->chunksectors ||
+		restore_codec_chunk (BF_CODEC (base->flags), base->comp, entry->size, base->chunk, entry->sectors * 512) < 0)
+	{
+		base->curchunk = -1;
+		info->err_msg = "Backup chunk %" PRId64 " is corrupt";
+		info->err_arg1 = chunk;
+		return -1;
+	}
+
+	base->curchunk = chunk;
+	return 0;
+}
+
+/*************************************************************************/
+/* If the incremental backup left this stream's data to the base, copy */
+/* it from there into the freshly allocated inode.  Returns 1 if it did, */
+/* 0 if the data is in the incremental backup itself, or -1 on error. */
+int
+restore_base_inode_data (struct backup_info *info, mfs_inode *inode, uint64_t datasize)
+{
+	struct restore_base *base = info->base;
+	struct backup_index_fsid *entry;
+	unsigned int fsid = intswap32 (inode->fsid);
+	uint64_t sector, done;
+
+	if (!base)
+	{
+		info->err_msg = "Incremental backup needs its base backup (restore -I)";
+		return -1;
+	}
+
+	if (!base->carried && restore_base_carried (info) < 0)
+		return -1;
+
+	if (!bsearch (&fsid, base->carried, base->ncarried, sizeof (fsid), restore_fsid_cmp))
+		return 0;
+
+	entry = restore_base_find (base, fsid);
+	if (!entry)
+	{
+		info->err_msg = "Fsid %" PRId64 " is missing from the base backup";
+		info->err_arg1 = fsid;
+		return -1;
+	}
+
+/* The inode sector comes first, then its data */
+	if (entry->sectors - 1 != datasize)
+	{
+		info->err_msg = "Base backup data for fsid %" PRId64 " does not match";
+		info->err_arg1 = fsid;
+		return -1;
+	}
+
+	sector = entry->firstsector + 1;
+	for (done = 0; done < datasize; )
+	{
+		unsigned int chunk = (sector - 1) / base->head->chunksectors;
+		unsigned int offset, count;
+
+		if (restore_base_load_chunk (info, base, chunk) < 0)
+			return -1;
+
+		offset = sector - base->chunks[chunk].firstsector;
+		count = base->chunks[chunk].sectors - offset;
+		if (count > datasize - done)
+			count = datasize - done;
+
+		if (mfs_write_inode_data_part (info->mfs, inode, base->chunk + offset * 512, done, count) <= 0)
+			return -1;
+
+		done += count;
+		sector += count;
+	}
+
+	return 1;
+}
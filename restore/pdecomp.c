@@ -0,0 +1,809 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _LARGEFILE64_SOURCE
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#include <fcntl.h>
+#include <zlib.h>
+#include <string.h>
+#if HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "mfs.h"
+
+#define RESTORE
+#include "backup.h"
+
+/* Decompression for restore, off the thread writing to disk.  Compressed */
+/* input passed to restore_write is queued for a decoder thread, and the */
+/* decompressed data is handed back in order to restore_write, which feeds */
+/* it to the state machine.  That way inflating the next piece overlaps */
+/* writing the last one.  For a chunked backup read from a file the */
+/* container index gives the size of every chunk, so once the decoder */
+/* reaches a chunk boundary it only cuts the input into whole chunks, and */
+/* a pool of worker threads decompress them side by side. */
+
+#if HAVE_PTHREAD_H
+
+/* Output handed back from the decoder at a time, the size of comp_buf */
+#define PDECOMP_STREAMSECTORS 2048
+#define PDECOMP_STREAMSIZE (PDECOMP_STREAMSECTORS * 512)
+/* Jobs in flight when there are no chunk workers */
+#define PDECOMP_STREAMJOBS 8
+/* Compressed input queued ahead of the decoder */
+#define PDECOMP_INBLOCKS 8
+#define PDECOMP_INBLOCKSIZE (512 * 512)
+/* Most chunk workers picked when no count is given */
+#define PDECOMP_MAXAUTO 4
+
+enum pdecomp_job_state
+{
+	pdFree = 0,
+	pdFilling,
+	pdReady,
+	pdBusy,
+	pdDone
+};
+
+struct pdecomp_job
+{
+	enum pdecomp_job_state state;
+	uint64_t seq;
+	int error;
+
+	unsigned int chunk;			/* Chunk, for jobs decoded by a worker */
+	unsigned char *in;
+	unsigned int insize;
+
+	unsigned char *out;
+	unsigned int outsize;
+};
+
+struct pdecomp_inblock
+{
+	unsigned char *data;
+	unsigned int size;
+};
+
+struct restore_pdecomp
+{
+	pthread_mutex_t lock;
+	pthread_cond_t input;		/* Input was queued or a job was freed, for the decoder */
+	pthread_cond_t ready;		/* A chunk was queued, for the workers */
+	pthread_cond_t done;		/* A job finished or input was used, for restore_write */
+	int shutdown;
+
+	pthread_t decoder;
+	int hasdecoder;
+	int nthreads;
+	pthread_t *threads;
+
+	struct pdecomp_inblock in[PDECOMP_INBLOCKS];
+	unsigned int inhead;		/* Next block for the decoder */
+	unsigned int incount;		/* Blocks queued */
+	int inputdone;				/* restore_finish was called */
+
+	int njobs;
+	struct pdecomp_job *jobs;
+	uint64_t nextseq;			/* Sequence of the next job the decoder takes */
+	uint64_t nextapply;			/* Sequence of the next job to restore */
+	int finished;				/* The decoder has stopped */
+	char *err_msg;				/* The decoder hit an error */
+	int64_t err_arg1;
+
+/* Decoder thread only */
+	struct pdecomp_job *cur;	/* Job being filled */
+	uint64_t outtotal;			/* Bytes of backup decompressed so far */
+	int splitting;				/* Cutting the input into chunks */
+	unsigned int chunk;			/* Next chunk to cut */
+	int streamend;				/* Everything has been decompressed */
+	int pending;				/* The decoder may have more output */
+};
+
+/****************************************************************/
+/* Pick how many chunk workers to use when no count was given. */
+static int
+restore_pdecomp_auto_threads (void)
+{
+	int ncpus = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+	ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	if (ncpus < 1)
+		ncpus = 1;
+	if (ncpus > PDECOMP_MAXAUTO)
+		ncpus = PDECOMP_MAXAUTO;
+
+	return ncpus;
+}
+
+/*********************************************************************/
+/* Hand off the job being filled, and wait for the next one to free */
+/* up.  Returns the new job, or NULL if shutting down. */
+static struct pdecomp_job *
+restore_pdecomp_next_job (struct restore_pdecomp *pd, enum pdecomp_job_state state)
+{
+	struct pdecomp_job *job;
+
+	pthread_mutex_lock (&pd->lock);
+	if (pd->cur)
+	{
+		pd->cur->state = state;
+		if (state == pdReady)
+			pthread_cond_signal (&pd->ready);
+		else
+			pthread_cond_signal (&pd->done);
+		pd->cur = NULL;
+	}
+
+	job = &pd->jobs[pd->nextseq % pd->njobs];
+	while (!pd->shutdown && job->state != pdFree)
+		pthread_cond_wait (&pd->input, &pd->lock);
+	if (pd->shutdown)
+	{
+		pthread_mutex_unlock (&pd->lock);
+		return NULL;
+	}
+
+	job->state = pdFilling;
+	job->seq = pd->nextseq++;
+	job->error = 0;
+	job->insize = 0;
+	job->outsize = 0;
+	pd->cur = job;
+	pthread_mutex_unlock (&pd->lock);
+
+	return job;
+}
+
+/***************************************************/
+/* Hand off the last job, there will be no more. */
+static void
+restore_pdecomp_last_job (struct restore_pdecomp *pd, enum pdecomp_job_state state)
+{
+	pthread_mutex_lock (&pd->lock);
+	if (pd->cur)
+	{
+		pd->cur->state = state;
+		if (state == pdReady)
+			pthread_cond_signal (&pd->ready);
+		else
+			pthread_cond_signal (&pd->done);
+		pd->cur = NULL;
+	}
+	pthread_mutex_unlock (&pd->lock);
+}
+
+/*************************************************************************/
+/* Find the chunk starting where the decoder is, so it can start cutting */
+/* chunks.  Returns the chunk, or -1 if there is no chunk boundary here. */
+static int
+restore_pdecomp_find_chunk (struct backup_info *info, uint64_t offset)
+{
+	struct backup_index_chunk *chunks = (struct backup_index_chunk *)(info->index + 1);
+	unsigned int low = 0, high = info->index->nchunks;
+
+	if (offset % 512)
+		return -1;
+	offset /= 512;
+
+	while (low < high)
+	{
+		unsigned int mid = (low + high) / 2;
+
+		if (chunks[mid].firstsector == offset)
+			return mid;
+		if (chunks[mid].firstsector < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return -1;
+}
+
+/*************************************************************************/
+/* Decompress or cut up a block of input.  Returns 0, or -1 on error or */
+/* shut down. */
+static int
+restore_pdecomp_feed (struct backup_info *info, unsigned char *data, unsigned int size)
+{
+	struct restore_pdecomp *pd = info->pdecomp;
+	z_stream *strm = info->comp;
+
+	while (size > 0 || pd->pending)
+	{
+		struct pdecomp_job *job = pd->cur;
+		unsigned int used;
+		int zres;
+
+		if (pd->streamend)
+		{
+/* Whatever follows the last chunk is the container index, which */
+/* restore has no use for */
+			if (size > 0 && !(info->back_flags & BF_CHUNKED))
+			{
+				pd->err_msg = "Extra data at end of backup";
+				return -1;
+			}
+			return 0;
+		}
+
+		if (pd->splitting)
+		{
+			struct backup_index_chunk *chunk = (struct backup_index_chunk *)(info->index + 1) + pd->chunk;
+			unsigned int count = chunk->size - job->insize;
+
+			if (count > size)
+				count = size;
+			memcpy (job->in + job->insize, data, count);
+			job->insize += count;
+			data += count;
+			size -= count;
+
+			if (job->insize == chunk->size)
+			{
+				job->chunk = pd->chunk++;
+				if (pd->chunk == info->index->nchunks)
+				{
+					restore_pdecomp_last_job (pd, pdReady);
+					pd->streamend = 1;
+				}
+				else if (!restore_pdecomp_next_job (pd, pdReady))
+					return -1;
+			}
+			continue;
+		}
+
+		strm->next_in = data;
+		strm->avail_in = size;
+		strm->next_out = job->out + job->outsize;
+		strm->avail_out = PDECOMP_STREAMSIZE - job->outsize;
+
+		zres = info->codec? restore_codec_step (info): inflate (strm, 0);
+
+		used = size - strm->avail_in;
+		data += used;
+		size -= used;
+		pd->outtotal += (strm->next_out - job->out) - job->outsize;
+		job->outsize = strm->next_out - job->out;
+/* With the output full there may be more to come even without input */
+		pd->pending = strm->avail_out == 0;
+
+		switch (zres)
+		{
+		case Z_STREAM_END:
+			pd->pending = 0;
+			if ((info->back_flags & BF_CHUNKED) && pd->outtotal < info->nsectors * 512)
+			{
+				int chunk = info->index? restore_pdecomp_find_chunk (info, pd->outtotal): -1;
+
+/* The rest of the backup can be cut into chunks for the workers */
+				if (chunk >= 0)
+				{
+					if (!restore_pdecomp_next_job (pd, pdDone))
+						return -1;
+					pd->splitting = 1;
+					pd->chunk = chunk;
+					continue;
+				}
+
+				if (!info->codec && inflateReset (strm) != Z_OK)
+				{
+					pd->err_msg = "Internal error: zlib structures corrupt";
+					return -1;
+				}
+				break;
+			}
+			restore_pdecomp_last_job (pd, pdDone);
+			pd->streamend = 1;
+			continue;
+		case Z_OK:
+			break;
+		case Z_BUF_ERROR:
+			if (size == 0)
+			{
+				pd->pending = 0;
+				break;
+			}
+			pd->err_msg = "Error in compressed data stream";
+			return -1;
+		case Z_NEED_DICT:
+			pd->err_msg = "No dict to feed hungry inflate";
+			return -1;
+		case Z_ERRNO:
+			pd->err_msg = "Inflate is doing things it shouldn't be";
+			return -1;
+		case Z_STREAM_ERROR:
+			pd->err_msg = "Internal error: zlib structures corrupt";
+			return -1;
+		case Z_DATA_ERROR:
+			pd->err_msg = "Error in compressed data stream";
+			return -1;
+		case Z_MEM_ERROR:
+			pd->err_msg = "Decompression out of memory";
+			return -1;
+		default:
+			pd->err_msg = "Unknown zlib_error %"PRId64"";
+			pd->err_arg1 = zres;
+			return -1;
+		}
+
+		if (job->outsize == PDECOMP_STREAMSIZE && !restore_pdecomp_next_job (pd, pdDone))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*************************************************************/
+/* Decoder thread - decompress or cut up the queued input */
+static void *
+restore_pdecomp_decoder (void *arg)
+{
+	struct backup_info *info = arg;
+	struct restore_pdecomp *pd = info->pdecomp;
+
+	while (1)
+	{
+		struct pdecomp_inblock *block;
+
+		pthread_mutex_lock (&pd->lock);
+		while (!pd->shutdown && pd->incount == 0 && !pd->inputdone)
+			pthread_cond_wait (&pd->input, &pd->lock);
+		if (pd->shutdown)
+			break;
+
+		if (pd->incount == 0)
+		{
+/* Out of input.  Whatever is left over is passed along, and if that */
+/* is not the whole backup restore_finish will say so. */
+			if (pd->cur)
+			{
+				if (pd->splitting)
+					pd->cur->insize = 0;
+				pd->cur->state = pdDone;
+				pd->cur = NULL;
+			}
+			break;
+		}
+
+		block = &pd->in[pd->inhead];
+		pthread_mutex_unlock (&pd->lock);
+
+		if (restore_pdecomp_feed (info, block->data, block->size) < 0)
+		{
+			pthread_mutex_lock (&pd->lock);
+			break;
+		}
+
+		pthread_mutex_lock (&pd->lock);
+		pd->inhead = (pd->inhead + 1) % PDECOMP_INBLOCKS;
+		pd->incount--;
+		pthread_cond_signal (&pd->done);
+		pthread_mutex_unlock (&pd->lock);
+	}
+
+	pd->finished = 1;
+	pthread_cond_signal (&pd->done);
+	pthread_mutex_unlock (&pd->lock);
+
+	return 0;
+}
+
+/******************************************************/
+/* Worker thread - decompress queued chunks, oldest first */
+static void *
+restore_pdecomp_worker (void *arg)
+{
+	struct backup_info *info = arg;
+	struct restore_pdecomp *pd = info->pdecomp;
+	struct backup_index_chunk *chunks = (struct backup_index_chunk *)(info->index + 1);
+	int codec = BF_CODEC (info->back_flags);
+
+	pthread_mutex_lock (&pd->lock);
+	while (1)
+	{
+		struct pdecomp_job *job = NULL;
+		int loop;
+
+		for (loop = 0; loop < pd->njobs; loop++)
+		{
+			if (pd->jobs[loop].state == pdReady && (!job || pd->jobs[loop].seq < job->seq))
+				job = &pd->jobs[loop];
+		}
+
+		if (!job)
+		{
+			if (pd->shutdown)
+				break;
+			pthread_cond_wait (&pd->ready, &pd->lock);
+			continue;
+		}
+
+		job->state = pdBusy;
+		pthread_mutex_unlock (&pd->lock);
+
+		if (crc32 (0, job->in, job->insize) != chunks[job->chunk].crc ||
+			restore_codec_chunk (codec, job->in, job->insize, job->out, chunks[job->chunk].sectors * 512) < 0)
+			job->error = 1;
+		else
+			job->outsize = chunks[job->chunk].sectors * 512;
+
+		pthread_mutex_lock (&pd->lock);
+		job->state = pdDone;
+		pthread_cond_signal (&pd->done);
+	}
+	pthread_mutex_unlock (&pd->lock);
+
+	return 0;
+}
+
+/**********************************/
+/* Stop the threads and free it all. */
+void
+restore_pdecomp_free (struct backup_info *info)
+{
+	struct restore_pdecomp *pd = info->pdecomp;
+	int loop;
+
+	if (!pd)
+		return;
+
+	pthread_mutex_lock (&pd->lock);
+	pd->shutdown = 1;
+	pthread_cond_broadcast (&pd->input);
+	pthread_cond_broadcast (&pd->ready);
+	pthread_mutex_unlock (&pd->lock);
+
+	if (pd->hasdecoder)
+		pthread_join (pd->decoder, NULL);
+	for (loop = 0; loop < pd->nthreads; loop++)
+		pthread_join (pd->threads[loop], NULL);
+
+	for (loop = 0; loop < pd->njobs; loop++)
+	{
+		free (pd->jobs[loop].in);
+		free (pd->jobs[loop].out);
+	}
+	for (loop = 0; loop < PDECOMP_INBLOCKS; loop++)
+		free (pd->in[loop].data);
+
+	pthread_cond_destroy (&pd->done);
+	pthread_cond_destroy (&pd->ready);
+	pthread_cond_destroy (&pd->input);
+	pthread_mutex_destroy (&pd->lock);
+	free (pd->jobs);
+	free (pd->threads);
+	free (pd);
+	info->pdecomp = NULL;
+}
+
+/*************************************************************************/
+/* Start decompressing on other threads, picking up where restore_write */
+/* left off.  Returns 1 if it is running, 0 if restore_write should keep */
+/* decompressing itself, -1 on error. */
+int
+restore_pdecomp_init (struct backup_info *info)
+{
+	struct restore_pdecomp *pd;
+	struct backup_index_chunk *chunks = NULL;
+	unsigned int outalloc = PDECOMP_STREAMSIZE, inalloc = 0;
+	unsigned int leftover;
+	int nthreads = 0;
+	int loop;
+
+	if (info->nthreads == 1)
+		return 0;
+
+/* Chunks can only be handed to workers if the index agrees with them */
+	if (info->index)
+	{
+		chunks = (struct backup_index_chunk *)(info->index + 1);
+		nthreads = info->nthreads > 1? info->nthreads: restore_pdecomp_auto_threads ();
+		if (info->index->chunksectors > outalloc / 512)
+			outalloc = info->index->chunksectors * 512;
+		for (loop = 0; loop < info->index->nchunks; loop++)
+		{
+			if (chunks[loop].sectors > outalloc / 512 || chunks[loop].size > outalloc * 2)
+			{
+				nthreads = 0;
+				outalloc = PDECOMP_STREAMSIZE;
+				break;
+			}
+			if (chunks[loop].size > inalloc)
+				inalloc = chunks[loop].size;
+		}
+	}
+
+	pd = calloc (sizeof (*pd), 1);
+	if (!pd)
+	{
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	pd->njobs = nthreads > 0? nthreads + 2: PDECOMP_STREAMJOBS;
+	pd->jobs = calloc (sizeof (*pd->jobs), pd->njobs);
+	if (nthreads > 0)
+		pd->threads = calloc (sizeof (*pd->threads), nthreads);
+	if (!pd->jobs || (nthreads > 0 && !pd->threads))
+	{
+		free (pd->jobs);
+		free (pd->threads);
+		free (pd);
+		info->err_msg = "Memory exhausted";
+		return -1;
+	}
+
+	pthread_mutex_init (&pd->lock, NULL);
+	pthread_cond_init (&pd->input, NULL);
+	pthread_cond_init (&pd->ready, NULL);
+	pthread_cond_init (&pd->done, NULL);
+	info->pdecomp = pd;
+
+	for (loop = 0; loop < pd->njobs; loop++)
+	{
+		pd->jobs[loop].out = malloc (outalloc);
+		if (nthreads > 0)
+			pd->jobs[loop].in = malloc (inalloc > 0? inalloc: 1);
+		if (!pd->jobs[loop].out || (nthreads > 0 && !pd->jobs[loop].in))
+		{
+			restore_pdecomp_free (info);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+	}
+	for (loop = 0; loop < PDECOMP_INBLOCKS; loop++)
+	{
+		pd->in[loop].data = malloc (PDECOMP_INBLOCKSIZE);
+		if (!pd->in[loop].data)
+		{
+			restore_pdecomp_free (info);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+	}
+
+/* The first job starts with whatever restore_write had decompressed */
+/* but not yet restored */
+	leftover = (size_t)info->comp->next_out - (size_t)info->comp_buf;
+	pd->cur = &pd->jobs[0];
+	pd->cur->state = pdFilling;
+	pd->cur->seq = 0;
+	pd->nextseq = 1;
+	memcpy (pd->cur->out, info->comp_buf, leftover);
+	pd->cur->outsize = leftover;
+	pd->outtotal = info->cursector * 512 + leftover;
+	info->comp->next_out = info->comp_buf;
+	info->comp->avail_out = 512 * 2048;
+
+	for (loop = 0; loop < nthreads; loop++)
+	{
+		if (pthread_create (&pd->threads[loop], NULL, restore_pdecomp_worker, info) != 0)
+		{
+			restore_pdecomp_free (info);
+			info->err_msg = "Unable to start decompression threads";
+			return -1;
+		}
+		pd->nthreads++;
+	}
+
+	if (pthread_create (&pd->decoder, NULL, restore_pdecomp_decoder, info) != 0)
+	{
+		restore_pdecomp_free (info);
+		info->err_msg = "Unable to start decompression threads";
+		return -1;
+	}
+	pd->hasdecoder = 1;
+
+	return 1;
+}
+
+/*****************************************************************/
+/* Pass a decompressed job to the state machine.  Returns 0, or -1 */
+/* on error. */
+static int
+restore_pdecomp_apply (struct backup_info *info, struct pdecomp_job *job)
+{
+	unsigned int done = 0;
+
+	if (job->error)
+	{
+		info->err_msg = "Chunk %" PRId64 " of the backup is corrupt";
+		info->err_arg1 = job->chunk;
+		return -1;
+	}
+
+	while (job->outsize - done >= 512)
+	{
+		int nread = restore_next_records (info, job->out + done, (job->outsize - done) / 512);
+		if (nread < 0)
+			return -1;
+		if (nread == 0)
+			break;
+		done += nread * 512;
+	}
+
+	return 0;
+}
+
+/*************************************************************************/
+/* Restore decompressed jobs in order, and queue the input if given. */
+/* With wait set, keep going until the decoder is done with everything. */
+/* Returns 0, or -1 on error. */
+static int
+restore_pdecomp_run (struct backup_info *info, unsigned char *buf, unsigned int size, int wait)
+{
+	struct restore_pdecomp *pd = info->pdecomp;
+
+	pthread_mutex_lock (&pd->lock);
+	while (1)
+	{
+		struct pdecomp_job *job = &pd->jobs[pd->nextapply % pd->njobs];
+
+		if (pd->finished && pd->err_msg)
+		{
+			info->err_msg = pd->err_msg;
+			info->err_arg1 = pd->err_arg1;
+			pthread_mutex_unlock (&pd->lock);
+			return -1;
+		}
+
+		if (job->state == pdDone && job->seq == pd->nextapply)
+		{
+			int ret;
+
+			pthread_mutex_unlock (&pd->lock);
+			ret = restore_pdecomp_apply (info, job);
+			pthread_mutex_lock (&pd->lock);
+			if (ret < 0)
+			{
+				pthread_mutex_unlock (&pd->lock);
+				return -1;
+			}
+			job->state = pdFree;
+			pd->nextapply++;
+			pthread_cond_signal (&pd->input);
+			continue;
+		}
+
+		if (size > 0 && pd->incount < PDECOMP_INBLOCKS)
+		{
+/* The block is not the decoder's until it is counted */
+			struct pdecomp_inblock *block = &pd->in[(pd->inhead + pd->incount) % PDECOMP_INBLOCKS];
+			unsigned int count = size < PDECOMP_INBLOCKSIZE? size: PDECOMP_INBLOCKSIZE;
+
+			pthread_mutex_unlock (&pd->lock);
+			memcpy (block->data, buf, count);
+			block->size = count;
+			buf += count;
+			size -= count;
+			pthread_mutex_lock (&pd->lock);
+			pd->incount++;
+			pthread_cond_signal (&pd->input);
+			continue;
+		}
+
+		if (size == 0 && (!wait || (pd->finished && pd->nextapply == pd->nextseq)))
+			break;
+
+		pthread_cond_wait (&pd->done, &pd->lock);
+	}
+	pthread_mutex_unlock (&pd->lock);
+
+	return 0;
+}
+
+/*************************************************************************/
+/* Queue compressed data from restore_write.  Returns size, or -1 on error. */
+int
+restore_pdecomp_write (struct backup_info *info, unsigned char *buf, unsigned int size)
+{
+	if (restore_pdecomp_run (info, buf, size, 0) < 0)
+		return -1;
+
+	return size;
+}
+
+/*************************************************************************/
+/* No more input is coming.  Restore everything the decoder has left and */
+/* stop the threads.  Returns 0, or -1 on error. */
+int
+restore_pdecomp_finish (struct backup_info *info)
+{
+	struct restore_pdecomp *pd = info->pdecomp;
+	int ret;
+
+	pthread_mutex_lock (&pd->lock);
+	pd->inputdone = 1;
+	pthread_cond_signal (&pd->input);
+	pthread_mutex_unlock (&pd->lock);
+
+	ret = restore_pdecomp_run (info, NULL, 0, 1);
+	restore_pdecomp_free (info);
+
+	return ret;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+int
+restore_pdecomp_init (struct backup_info *info)
+{
+	return 0;
+}
+
+int
+restore_pdecomp_write (struct backup_info *info, unsigned char *buf, unsigned int size)
+{
+	info->err_msg = "Internal error: Parallel decompression not available";
+	return -1;
+}
+
+int
+restore_pdecomp_finish (struct backup_info *info)
+{
+	return 0;
+}
+
+void
+restore_pdecomp_free (struct backup_info *info)
+{
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+void
+restore_set_threads (struct backup_info *info, int nthreads)
+{
+	info->nthreads = nthreads;
+}
+
+/*************************************************************************/
+/* Load the container index of a chunked backup being restored from a */
+/* file, so the chunks can be decompressed in parallel.  Anything else is */
+/* left alone, and so is a missing or damaged index, since the chunks can */
+/* still be restored one after the other.  Returns 0, or -1 on error. */
+int
+restore_set_index (struct backup_info *info, int fd)
+{
+	struct backup_head_v3 head;
+	struct stat st;
+	void *index = NULL;
+
+	if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))
+		return 0;
+
+	if (read (fd, &head, sizeof (head)) == sizeof (head) &&
+		head.magic == TB3_MAGIC &&
+		(head.flags & (BF_COMPRESSED | BF_CHUNKED)) == (BF_COMPRESSED | BF_CHUNKED))
+	{
+		index = restore_load_index (info, fd);
+		if (!index)
+			restore_clearerror (info);
+	}
+
+	if (lseek64 (fd, 0, SEEK_SET) != 0)
+	{
+		if (index)
+			free (index);
+		info->err_msg = "Unable to seek in backup";
+		return -1;
+	}
+
+	info->index = index;
+	return 0;
+}
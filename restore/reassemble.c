@@ -0,0 +1,253 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#if HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_ASM_TYPES_H
+#include <asm/types.h>
+#endif
+#include <fcntl.h>
+#include <zlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "mfs.h"
+
+#define RESTORE
+#include "backup.h"
+
+/* Restore from a deduplicating backup store.  The recipe lists the chunks */
+/* of the backup stream in order; each is read from the store, checked */
+/* against its hash, and handed out as if it were read from a backup file. */
+
+/*********************************************/
+/* Build the path of a chunk in the store. */
+static void
+restore_store_path (char *path, char *dir, unsigned char *hash)
+{
+	char *cur;
+	int loop;
+
+	cur = path + sprintf (path, "%s/%02x/", dir, hash[0]);
+	for (loop = 0; loop < 32; loop++)
+		cur += sprintf (cur, "%02x", hash[loop]);
+}
+
+/*****************************************/
+/* Read exactly size bytes from a file. */
+static int
+restore_store_readall (int fd, void *buf, unsigned int size)
+{
+	while (size > 0)
+	{
+		int nread = read (fd, buf, size);
+		if (nread <= 0)
+			return -1;
+		buf = (char *)buf + nread;
+		size -= nread;
+	}
+
+	return 0;
+}
+
+/*******************************************/
+/* Open a recipe in a store for restoring */
+struct backup_store *
+restore_store_open (struct backup_info *info, char *dir, char *recipe)
+{
+	struct backup_store *store;
+
+	if (strlen (dir) + 68 >= PATH_MAX)
+	{
+		info->err_msg = "Store directory name too long";
+		return 0;
+	}
+
+	store = calloc (sizeof (*store), 1);
+	if (!store)
+	{
+		info->err_msg = "Memory exhausted";
+		return 0;
+	}
+	store->dir = dir;
+
+#if O_LARGEFILE
+	store->recipefd = open (recipe, O_RDONLY | O_LARGEFILE);
+#else
+	store->recipefd = open (recipe, O_RDONLY);
+#endif
+	if (store->recipefd < 0)
+	{
+		free (store);
+		info->err_msg = "Unable to open recipe";
+		return 0;
+	}
+
+	if (restore_store_readall (store->recipefd, &store->head, sizeof (store->head)) < 0 ||
+		store->head.magic != TBKR_MAGIC)
+	{
+		info->err_msg = "Not a backup store recipe";
+		restore_store_close (store);
+		return 0;
+	}
+
+	store->buf = malloc (BACKUP_STORE_MAXCHUNK);
+	if (!store->buf)
+	{
+		info->err_msg = "Memory exhausted";
+		restore_store_close (store);
+		return 0;
+	}
+
+	return store;
+}
+
+/*********************************************************/
+/* Load the next chunk in the recipe from the store. */
+static int
+restore_store_next (struct backup_info *info, struct backup_store *store)
+{
+	struct backup_recipe_entry entry;
+	unsigned char hash[32];
+	char path[PATH_MAX];
+	struct stat st;
+	uLongf size;
+	int fd;
+
+	if (restore_store_readall (store->recipefd, &entry, sizeof (entry)) < 0)
+	{
+		info->err_msg = "Recipe is truncated at chunk %" PRId64 "";
+		info->err_arg1 = store->newchunks;
+		return -1;
+	}
+
+	if (entry.size == 0 || entry.size > BACKUP_STORE_MAXCHUNK)
+	{
+		info->err_msg = "Recipe chunk %" PRId64 " is corrupt";
+		info->err_arg1 = store->newchunks;
+		return -1;
+	}
+
+	restore_store_path (path, store->dir, entry.hash);
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+	{
+		info->err_msg = "Chunk %" PRId64 " is missing from the store";
+		info->err_arg1 = store->newchunks;
+		return -1;
+	}
+
+	if (fstat (fd, &st) < 0 || st.st_size <= 0 || st.st_size > compressBound (BACKUP_STORE_MAXCHUNK))
+	{
+		close (fd);
+		info->err_msg = "Chunk %" PRId64 " in the store is corrupt";
+		info->err_arg1 = store->newchunks;
+		return -1;
+	}
+
+	if (st.st_size > store->compsize)
+	{
+		unsigned char *tmp = realloc (store->comp, st.st_size);
+		if (!tmp)
+		{
+			close (fd);
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+		store->comp = tmp;
+		store->compsize = st.st_size;
+	}
+
+	if (restore_store_readall (fd, store->comp, st.st_size) < 0)
+	{
+		close (fd);
+		info->err_msg = "Error reading chunk %" PRId64 " from the store";
+		info->err_arg1 = store->newchunks;
+		return -1;
+	}
+	close (fd);
+
+	size = BACKUP_STORE_MAXCHUNK;
+	if (uncompress (store->buf, &size, store->comp, st.st_size) != Z_OK || size != entry.size)
+	{
+		info->err_msg = "Chunk %" PRId64 " in the store is corrupt";
+		info->err_arg1 = store->newchunks;
+		return -1;
+	}
+
+	compute_sha256 (store->buf, size, hash);
+	if (memcmp (hash, entry.hash, sizeof (hash)))
+	{
+		info->err_msg = "Chunk %" PRId64 " in the store is corrupt";
+		info->err_arg1 = store->newchunks;
+		return -1;
+	}
+
+	store->bufused = size;
+	store->bufpos = 0;
+/* Count chunks read, for error messages */
+	store->newchunks++;
+	store->newbytes += size;
+
+	return 0;
+}
+
+/***********************************************************************/
+/* Read the reassembled backup stream.  Returns the number of bytes */
+/* read, 0 at the end of the backup, or -1 on error. */
+int
+restore_store_read (struct backup_info *info, struct backup_store *store, unsigned char *buf, unsigned int size)
+{
+	unsigned int total = 0;
+
+	while (size > 0)
+	{
+		unsigned int count;
+
+		if (store->bufpos == store->bufused)
+		{
+			if (store->newchunks == store->head.nchunks)
+				break;
+			if (restore_store_next (info, store) < 0)
+				return -1;
+		}
+
+		count = store->bufused - store->bufpos;
+		if (count > size)
+			count = size;
+		memcpy (buf, store->buf + store->bufpos, count);
+		store->bufpos += count;
+		buf += count;
+		size -= count;
+		total += count;
+	}
+
+	if (total == 0 && store->newbytes != store->head.size)
+	{
+		info->err_msg = "Recipe size does not match its chunks";
+		return -1;
+	}
+
+	return total;
+}
+
+/*************************/
+/* Close a store handle. */
+void
+restore_store_close (struct backup_store *store)
+{
+	close (store->recipefd);
+	if (store->buf)
+		free (store->buf);
+	if (store->comp)
+		free (store->comp);
+	free (store);
+}
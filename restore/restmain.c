@@ -32,9 +32,15 @@ restore_usage (char *progname)
 {
 	fprintf (stderr, "%s %s\n", PACKAGE, VERSION);
 	fprintf (stderr, "Usage: %s [options] Adrive [Bdrive]\n", progname);
+	fprintf (stderr, "       %s -i file -X item [-X item...] [-o dir]\n", progname);
 	fprintf (stderr, "Options:\n");
 	fprintf (stderr, " -h        Display this help message\n");
 	fprintf (stderr, " -i file   Input from file, - for stdin\n");
+	fprintf (stderr, " -I file   Base backup for an incremental backup (must be chunked)\n");
+	fprintf (stderr, " -R dir    Restore from backup store dir, with -i naming the recipe\n");
+	fprintf (stderr, " -X item   Extract an fsid or MFS path from a chunked backup, instead of restoring\n");
+	fprintf (stderr, " -o dir    Directory to extract into (default .)\n");
+	fprintf (stderr, " -j count  Decompress chunked backups using count threads (1 for no threads)\n");
 #if DEPRECATED
 	// Optimized layout is now the default.  Probably no reason to allow a non-optimized layout...
 	//fprintf (stderr, " -p        Optimize partition layout\n");
@@ -54,6 +60,8 @@ restore_usage (char *progname)
 	// Arguments could be made to keep this, but I suspect few will actually miss it.
 	fprintf (stderr, " -z        Zero out partitions not backed up\n");
 #endif
+	fprintf (stderr, " -Z        Target is already zeroed, skip writing holes in the backup\n");
+	fprintf (stderr, " -W size   Buffer up to size MiB of writes and flush them in order (default 64, 0 for none)\n");
 	fprintf (stderr, " -w 32/64  Write MFS structures as 32 or 64 bit\n");
 	fprintf (stderr, " -c size   Carve (leave free) in blocks on drive A\n");
 	fprintf (stderr, " -C size   Carve (leave free) in blocks on Drive B\n");
@@ -81,6 +89,58 @@ get_percent (uint64_t current, uint64_t max)
 	return prcnt;
 }
 
+/*******************************************************/
+/* Read backup data from a file or from a backup store */
+static int
+restore_input (struct backup_info *info, struct backup_store *store, int fd, unsigned char *buf, unsigned int size)
+{
+	if (store)
+		return restore_store_read (info, store, buf, size);
+	return read (fd, buf, size);
+}
+
+/**********************************************************************/
+/* Pull single objects out of a chunked backup, without a target drive */
+static int
+restore_extract_main (char *filename, char **extract, int nextract, char *dir, int quiet)
+{
+	struct backup_info *info;
+	struct restore_base *backup;
+	int loop;
+
+	info = init_restore (0);
+	if (!info)
+	{
+		fprintf (stderr, "Restore: Memory exhausted\n");
+		return 1;
+	}
+
+	backup = restore_base_open (info, filename);
+	if (!backup)
+	{
+		restore_perror (info, filename);
+		return 1;
+	}
+
+	for (loop = 0; loop < nextract; loop++)
+	{
+		int fsid = restore_extract (info, backup, extract[loop], dir);
+
+		if (fsid < 0)
+		{
+			restore_perror (info, extract[loop]);
+			restore_base_close (backup);
+			return 1;
+		}
+
+		if (quiet < 2)
+			fprintf (stderr, "Extracted %s to %s/%d\n", extract[loop], dir, fsid);
+	}
+
+	restore_base_close (backup);
+	return 0;
+}
+
 int
 restore_main (int argc, char **argv)
 {
@@ -89,6 +149,12 @@ restore_main (int argc, char **argv)
 	int opt;
 	unsigned int varsize = 0, dbsize = 0, swapsize = 0, rflags = RF_BALANCE;;
 	char *filename = 0;
+	char *basefile = 0;
+	char *storedir = 0;
+	struct backup_store *store = 0;
+	char **extract = 0;
+	int nextract = 0;
+	char *extractdir = ".";
 	int quiet = 0;
 	int bswap = 0;
 	int restorebits = 0;
@@ -97,13 +163,17 @@ restore_main (int argc, char **argv)
 	int64_t maxdisk = 0;
 	int64_t maxmedia = 0;
 	unsigned int minalloc = 0;
+	int nthreads = 0;
+	unsigned int writebehind = 64;
 	unsigned starttime = time (NULL);
 
 	tivo_partition_direct ();
+/* Holes in a backup are discarded on the target rather than written out */
+	tivo_partition_zeromode = tzDiscard;
 #if DEPRECATED
-	while ((opt = getopt (argc, argv, "hi:v:S:zqbBPkxlr:w:c:C:d:m:M:")) > 0)
+	while ((opt = getopt (argc, argv, "hi:I:R:X:o:j:v:S:zZW:qbBPkxlr:w:c:C:d:m:M:")) > 0)
 #else
-	while ((opt = getopt (argc, argv, "hi:v:S:qbBkxlr:w:c:C:d:m:M:")) > 0)
+	while ((opt = getopt (argc, argv, "hi:I:R:X:o:j:v:S:ZW:qbBkxlr:w:c:C:d:m:M:")) > 0)
 #endif
 	{
 		switch (opt)
@@ -114,6 +184,25 @@ restore_main (int argc, char **argv)
 		case 'i':
 			filename = optarg;
 			break;
+		case 'I':
+			basefile = optarg;
+			break;
+		case 'X':
+			if (!extract)
+				extract = calloc (sizeof (*extract), argc);
+			if (!extract)
+			{
+				fprintf (stderr, "%s: Memory exhausted\n", argv[0]);
+				return 1;
+			}
+			extract[nextract++] = optarg;
+			break;
+		case 'o':
+			extractdir = optarg;
+			break;
+		case 'R':
+			storedir = optarg;
+			break;
 		case 'v':
 			varsize = strtoul (optarg, &tmp, 10);
 			varsize *= 1024 * 2;
@@ -143,6 +232,9 @@ restore_main (int argc, char **argv)
 		case 'z':
 			rflags |= RF_ZEROPART;
 			break;
+		case 'Z':
+			tivo_partition_zeromode = tzSkip;
+			break;
 		case 'b':
 			if (bswap != 0)
 			{
@@ -211,6 +303,22 @@ restore_main (int argc, char **argv)
 				return 1;
 			}
 			break;
+		case 'W':
+			writebehind = strtoul (optarg, &tmp, 10);
+			if (tmp && *tmp)
+			{
+				fprintf (stderr, "%s: Integer argument expected for -W.\n", argv[0]);
+				return 1;
+			}
+			break;
+		case 'j':
+			nthreads = strtoul (optarg, &tmp, 10);
+			if (*tmp || nthreads < 1)
+			{
+				fprintf (stderr, "%s: Positive integer argument expected for -j\n", argv[0]);
+				return 1;
+			}
+			break;
 		case 'k':
 			rflags |= RF_BALANCE;
 			rflags |= RF_KOPT;
@@ -245,6 +353,18 @@ restore_main (int argc, char **argv)
 		return 1;
 	}
 
+	if (nextract)
+	{
+		int ret = 1;
+
+		if (optind < argc || storedir || basefile)
+			restore_usage (argv[0]);
+		else
+			ret = restore_extract_main (filename, extract, nextract, extractdir, quiet);
+		free (extract);
+		return ret;
+	}
+
 	drive = 0;
 	drive2 = 0;
 
@@ -273,9 +393,9 @@ restore_main (int argc, char **argv)
 
 	if (info)
 	{
-		int fd, nread, nwrit;
+		int fd, nread, nwrit, curcount;
 		unsigned char buf[BUFSIZE];
-		unsigned int cursec = 0, curcount;
+		unsigned int cursec = 0;
 
 		if (varsize)
 			restore_set_varsize (info, varsize);
@@ -293,8 +413,25 @@ restore_main (int argc, char **argv)
 			restore_set_maxdisk (info, maxdisk);
 		if (maxmedia)
 			restore_set_maxmedia (info, maxmedia);
+		if (nthreads)
+			restore_set_threads (info, nthreads);
+		if (basefile && restore_set_base (info, basefile) < 0)
+		{
+			restore_perror (info, basefile);
+			return 1;
+		}
 
-		if (filename[0] == '-' && filename[1] == '\0')
+		if (storedir)
+		{
+			store = restore_store_open (info, storedir, filename);
+			if (!store)
+			{
+				restore_perror (info, storedir);
+				return 1;
+			}
+			fd = -1;
+		}
+		else if (filename[0] == '-' && filename[1] == '\0')
 			fd = 0;
 		else
 		{
@@ -305,16 +442,26 @@ restore_main (int argc, char **argv)
 #endif
 		}
 
-		if (fd < 0)
+		if (fd < 0 && !store)
 		{
 			perror (filename);
 			return 1;
 		}
 
-		nread = read (fd, buf, BUFSIZE);
+/* A chunked backup in a file can be decompressed a chunk per thread */
+		if (fd > 0 && nthreads != 1 && restore_set_index (info, fd) < 0)
+		{
+			restore_perror (info, filename);
+			return 1;
+		}
+
+		nread = restore_input (info, store, fd, buf, BUFSIZE);
 		if (nread <= 0)
 		{
-			fprintf (stderr, "Restore failed: %s: %s\n", filename, strerror(errno));
+			if (store && restore_has_error (info))
+				restore_perror (info, storedir);
+			else
+				fprintf (stderr, "Restore failed: %s: %s\n", filename, strerror(errno));
 			return 1;
 		}
 
@@ -383,10 +530,16 @@ restore_main (int argc, char **argv)
 			return 1;
 		}
 
+		if (writebehind && tivo_partition_writebehind ((size_t)writebehind * 1024 * 1024) < 0)
+		{
+			perror ("Restore: write behind");
+			return 1;
+		}
+
 		starttime = time (NULL);
 
 		fprintf (stderr, "Starting restore\nUncompressed backup size: %" PRId64 " MiB\n", info->nsectors / 2048);
-		while ((curcount = read (fd, buf, BUFSIZE)) > 0)
+		while ((curcount = restore_input (info, store, fd, buf, BUFSIZE)) > 0)
 		{
 			unsigned int prcnt, compr;
 			if (restore_write (info, buf, curcount) != curcount)
@@ -427,6 +580,9 @@ restore_main (int argc, char **argv)
 			restore_perror (info, "Restore");
 			return 1;
 		}
+
+		if (store)
+			restore_store_close (store);
 	}
 	else
 	{
@@ -446,6 +602,12 @@ restore_main (int argc, char **argv)
 		return 1;
 	}
 
+	if (tivo_partition_flush () < 0)
+	{
+		perror ("Restore: writing buffered data");
+		return 1;
+	}
+
 	if (quiet < 2)
 		{
 		unsigned tot = time(NULL) - starttime;
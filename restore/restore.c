@@ -443,6 +443,100 @@ restore_next_sectors (struct backup_info *info, unsigned char *buf, int sectors)
 	return restore_blocks;
 }
 
+/*****************************************************************/
+/* Check if a backup sector is a hole record for this position. */
+static int
+restore_is_hole (struct backup_info *info, unsigned char *buf, uint64_t sector, unsigned int *count)
+{
+	struct backup_hole *hole = (struct backup_hole *)buf;
+	unsigned int magic = hole->magic, check = hole->check;
+
+	*count = hole->count;
+	if (info->rest_flags & RF_ENDIAN)
+	{
+		magic = Endian32_Swap (magic);
+		check = Endian32_Swap (check);
+		*count = Endian32_Swap (*count);
+	}
+
+	return magic == TBKH_MAGIC && check == BACKUP_HOLE_CHECK (*count, sector);
+}
+
+/***********************************************************************/
+/* Return the next records in a backup made with holes.  Each hole */
+/* record stands for a run of zero sectors, which are passed along from */
+/* a zeroed buffer the partition layer knows it need not write.  Returns */
+/* the number of backup sectors used, which may be less than the number */
+/* of sectors restored. */
+int
+restore_next_records (struct backup_info *info, unsigned char *buf, int sectors)
+{
+	int done = 0;
+
+	if (!(info->back_flags & BF_HOLES))
+		return restore_next_sectors (info, buf, sectors);
+
+	if (!info->holebuf)
+	{
+		info->holebuf = calloc (2048, 512);
+		if (!info->holebuf)
+		{
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+		tivo_partition_zeros = info->holebuf;
+		tivo_partition_nzeros = 2048;
+	}
+
+	while (1)
+	{
+		unsigned int count;
+		int run, nwrit;
+
+		while (info->holeleft > 0)
+		{
+			count = info->holeleft < 2048? info->holeleft: 2048;
+			nwrit = restore_next_sectors (info, info->holebuf, count);
+			if (nwrit < 0)
+				return -1;
+/* Some states byte swap in place, which leaves zeros alone, but be sure */
+			memset (info->holebuf, 0, nwrit * 512);
+			if (nwrit == 0)
+				return done;
+			info->holeleft -= nwrit;
+		}
+
+		if (done >= sectors)
+			break;
+
+		if (!info->holeliteral && restore_is_hole (info, buf + done * 512, info->cursector, &count))
+		{
+/* A count of 0 means the next sector is data that looks like a record */
+			if (count == 0)
+				info->holeliteral = 1;
+			else
+				info->holeleft = count;
+			done++;
+			continue;
+		}
+
+		for (run = 1; done + run < sectors; run++)
+			if (restore_is_hole (info, buf + (done + run) * 512, info->cursector + run, &count))
+				break;
+
+		nwrit = restore_next_sectors (info, buf + done * 512, run);
+		if (nwrit < 0)
+			return -1;
+		if (nwrit > 0)
+			info->holeliteral = 0;
+		done += nwrit;
+		if (nwrit < run)
+			break;
+	}
+
+	return done;
+}
+
 /*************************************************************************/
 /* Pass the data to the front-end program.  This handles compression and */
 /* all that fun stuff. */
@@ -460,15 +554,28 @@ restore_write (struct backup_info *info, unsigned char *buf, unsigned int size)
 			return retval;
 		}
 
+/* Once the state machine is past the header, decompression moves to its */
+/* own threads so it can overlap writing to disk */
+		if (!info->pdecomp && (info->rest_flags & RF_INITIALIZED) && !(info->rest_flags & RF_NOMORECOMP))
+		{
+			if (restore_pdecomp_init (info) < 0)
+				return -1;
+		}
+		if (info->pdecomp)
+			return restore_pdecomp_write (info, buf, size);
+
 		info->comp->avail_in = size;
 		info->comp->next_in = (unsigned char *) buf;
+/* Once the input is used up, keep draining down to the last whole */
+/* sector.  A tail of exactly one sector is common with holes, where it */
+/* is often a lone hole record, and must not be left behind. */
 		while ((info->comp && info->comp->avail_in > 0) ||
 			(((info->rest_flags & RF_NOMORECOMP) || !(info->rest_flags & RF_INITIALIZED)) &&
-			(size_t)info->comp->next_out - (size_t)info->comp_buf > 512))
+			(size_t)info->comp->next_out - (size_t)info->comp_buf >= 512))
 		{
-			if ((size_t)info->comp->next_out - (size_t)info->comp_buf > 512)
+			if ((size_t)info->comp->next_out - (size_t)info->comp_buf >= 512)
 			{
-				int nread = restore_next_sectors (info, info->comp_buf, ((size_t)info->comp->next_out - (size_t)info->comp_buf) / 512);
+				int nread = restore_next_records (info, info->comp_buf, ((size_t)info->comp->next_out - (size_t)info->comp_buf) / 512);
 				if (nread < 0)
 				{
 					return -1;
@@ -490,10 +597,22 @@ restore_write (struct backup_info *info, unsigned char *buf, unsigned int size)
 			}
 			else if (!(info->rest_flags & RF_NOMORECOMP))
 			{
-				int zres = inflate (info->comp, 0);
+				int zres = info->codec? restore_codec_step (info): inflate (info->comp, 0);
 
 				switch (zres) {
 				case Z_STREAM_END:
+/* A chunked backup has another stream after each chunk until everything */
+/* in the header has been accounted for */
+					if ((info->back_flags & BF_CHUNKED) &&
+						info->cursector * 512 + ((size_t)info->comp->next_out - (size_t)info->comp_buf) < info->nsectors * 512)
+					{
+						if (!info->codec && inflateReset (info->comp) != Z_OK)
+						{
+							info->err_msg = "Internal error: zlib structures corrupt";
+							return -1;
+						}
+						continue;
+					}
 					info->rest_flags |= RF_NOMORECOMP;
 					continue;
 				case Z_OK:
@@ -526,6 +645,13 @@ restore_write (struct backup_info *info, unsigned char *buf, unsigned int size)
 			}
 			else
 			{
+/* Whatever follows the last chunk is the container index, which */
+/* restore has no use for */
+				if (info->back_flags & BF_CHUNKED)
+				{
+					info->comp->next_in += info->comp->avail_in;
+					info->comp->avail_in = 0;
+				}
 				break;
 			}
 		}
@@ -564,6 +690,7 @@ restore_write (struct backup_info *info, unsigned char *buf, unsigned int size)
 				if (!info->comp)
 				{
 					free (info->comp_buf);
+					info->comp_buf = 0;
 					info->err_msg = "Memory exhausted";
 					return -1;
 				}
@@ -576,10 +703,23 @@ restore_write (struct backup_info *info, unsigned char *buf, unsigned int size)
 				info->comp->next_out = info->comp_buf;
 				info->comp->avail_out = 512 * 2048;
 
-				if (inflateInit (info->comp) != Z_OK)
+				if (BF_CODEC (info->back_flags) != BC_ZLIB)
+				{
+					if (restore_codec_init (info, BF_CODEC (info->back_flags)) < 0)
+					{
+						free (info->comp_buf);
+						free (info->comp);
+						info->comp_buf = 0;
+						info->comp = 0;
+						return -1;
+					}
+				}
+				else if (inflateInit (info->comp) != Z_OK)
 				{
 					free (info->comp_buf);
 					free (info->comp);
+					info->comp_buf = 0;
+					info->comp = 0;
 					info->err_msg = "Deompression error";
 					return -1;
 				}
@@ -599,7 +739,7 @@ restore_write (struct backup_info *info, unsigned char *buf, unsigned int size)
 				}
 			}
 		}
-		return retval + restore_next_sectors (info, buf, size / 512) * 512;
+		return retval + restore_next_records (info, buf, size / 512) * 512;
 	}
 
 	return retval;
@@ -1797,9 +1937,41 @@ restore_fixup_volume_header(struct backup_info *info)
 	return 0;
 }
 
+/*************************************/
+/* Release the decompression state. */
+static void
+restore_comp_free (struct backup_info *info)
+{
+	if (info->comp)
+	{
+		if (info->codec)
+			restore_codec_end (info);
+		else
+			inflateEnd (info->comp);
+		free (info->comp);
+		info->comp = 0;
+	}
+
+	if (info->comp_buf)
+	{
+		free (info->comp_buf);
+		info->comp_buf = 0;
+	}
+}
+
 int
 restore_finish(struct backup_info *info)
 {
+	if (info->pdecomp && restore_pdecomp_finish (info) < 0)
+	{
+		restore_comp_free (info);
+		restore_base_free (info);
+		return -1;
+	}
+	restore_copy_free (info);
+	restore_comp_free (info);
+	restore_base_free (info);
+
 	if (info->cursector != info->nsectors)
 	{
 		info->err_msg = "Premature end of backup data";
@@ -24,6 +24,7 @@
 #endif
 #include <sys/param.h>
 #include <string.h>
+#include <inttypes.h>
 #include <sys/ioctl.h>
 
 #include "mfs.h"
@@ -972,6 +973,192 @@ restore_state_mfs_reinit_v3 (struct backup_info *info, void *data, unsigned size
 	return bsNextState;
 }
 
+/* A stream allocated ahead of its data */
+struct restore_prealloc
+{
+	unsigned int fsid;
+	int taken;
+	unsigned char inode[512];
+};
+
+static int
+restore_prealloc_cmp (const void *a, const void *b)
+{
+	unsigned int fa = ((const struct restore_prealloc *)a)->fsid, fb = ((const struct restore_prealloc *)b)->fsid;
+
+	if (fa < fb)
+		return -1;
+	return fa > fb;
+}
+
+/*******************************************************************/
+/* Mark the blocks of a preallocated stream allocated or free in the */
+/* zone bitmaps directly, without going through the transaction log. */
+static int
+restore_physorder_mark (struct backup_info *info, mfs_inode *inode, int state)
+{
+	unsigned int logstamp = info->mfs->lastlogcommit + 1;
+	int loop;
+
+	for (loop = 0; loop < intswap32 (inode->numblocks); loop++)
+	{
+		int ret;
+
+		if (info->mfs->is_64)
+			ret = mfs_zone_map_update (info->mfs, sectorswap64 (inode->datablocks.d64[loop].sector), intswap32 (inode->datablocks.d64[loop].count), state, logstamp);
+		else
+			ret = mfs_zone_map_update (info->mfs, intswap32 (inode->datablocks.d32[loop].sector), intswap32 (inode->datablocks.d32[loop].count), state, logstamp);
+
+		if (ret < 1)
+		{
+			info->err_msg = "Unable to reserve space for video content";
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************************/
+/* A BF_PHYSORDER backup has its streams in disk order, but restore fills */
+/* the region below basetop with the lowest fsids first.  Allocate all the */
+/* streams up front, by fsid, from the list in the "fsidorder" entries. */
+/* The allocations only live in the zone change records until a commit, */
+/* and each commit throws those away, so the space is marked in the */
+/* bitmaps themselves.  Replaying the real allocations from the log later */
+/* finds the blocks already allocated and leaves them be. */
+static int
+restore_physorder_alloc (struct backup_info *info, uint64_t basetop)
+{
+	unsigned int total = 0;
+	int loop;
+
+	for (loop = 0; loop < info->nextrainfo; loop++)
+	{
+		struct extrainfo *extra = info->extrainfo[loop];
+		struct backup_fsidorder_entry *entries;
+		unsigned int count, loop2;
+
+		if (extra->typelength != 9 || memcmp (extra->data, "fsidorder", 9))
+			continue;
+
+		entries = (struct backup_fsidorder_entry *)(extra->data + ((extra->typelength + 3) & ~3));
+		count = extra->datalength / sizeof (*entries);
+
+		info->prealloc = realloc (info->prealloc, sizeof (*info->prealloc) * (total + count + 1));
+		if (!info->prealloc)
+		{
+			info->err_msg = "Memory exhausted";
+			return -1;
+		}
+
+		for (loop2 = 0; loop2 < count; loop2++)
+		{
+			struct restore_prealloc *pre = &info->prealloc[total + loop2];
+			mfs_inode *inode = (mfs_inode *)pre->inode;
+			unsigned int size = entries[loop2].size, blocksize = entries[loop2].blocksize;
+
+			pre->fsid = entries[loop2].fsid;
+			pre->taken = 0;
+			if (info->rest_flags & RF_ENDIAN)
+			{
+				pre->fsid = Endian32_Swap (pre->fsid);
+				size = Endian32_Swap (size);
+				blocksize = Endian32_Swap (blocksize);
+			}
+
+			memset (inode, 0, sizeof (pre->inode));
+			inode->fsid = intswap32 (pre->fsid);
+			inode->type = tyStream;
+			inode->size = intswap32 (size);
+			inode->blocksize = intswap32 (blocksize);
+		}
+		total += count;
+	}
+
+	if (!info->prealloc)
+		info->prealloc = malloc (sizeof (*info->prealloc));
+	info->nprealloc = total;
+
+/* The entries are written in fsid order, but make sure */
+	qsort (info->prealloc, total, sizeof (*info->prealloc), restore_prealloc_cmp);
+
+/* Start from a clean set of changes so only the streams get folded in */
+	if (mfs_log_commit (info->mfs) <= 0)
+		return -1;
+
+	for (loop = 0; loop < total; loop++)
+	{
+		mfs_inode *inode = (mfs_inode *)info->prealloc[loop].inode;
+
+		if (!mfs_alloc_greedy (info->mfs, inode, basetop) && !mfs_alloc_greedy (info->mfs, inode, 0))
+		{
+			info->err_msg = "Out of space for video content";
+			return -1;
+		}
+	}
+
+	for (loop = 0; loop < total; loop++)
+	{
+		if (restore_physorder_mark (info, (mfs_inode *)info->prealloc[loop].inode, 0) < 0)
+			return -1;
+	}
+
+/* The bitmaps hold the reservation now, so drop the change records */
+	mfs_zone_map_commit (info->mfs, info->mfs->lastlogcommit);
+
+	return 0;
+}
+
+/***********************************************************/
+/* Give back the space of any streams that never showed up */
+static int
+restore_physorder_release (struct backup_info *info)
+{
+	int loop;
+
+	for (loop = 0; loop < info->nprealloc; loop++)
+	{
+		if (!info->prealloc[loop].taken &&
+			restore_physorder_mark (info, (mfs_inode *)info->prealloc[loop].inode, 1) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/****************************************************************/
+/* Give a stream inode the space allocated for it in advance. */
+static int
+restore_physorder_take (struct backup_info *info, mfs_inode *inode)
+{
+	struct restore_prealloc key, *pre;
+	mfs_inode *preinode;
+
+	key.fsid = intswap32 (inode->fsid);
+	pre = bsearch (&key, info->prealloc, info->nprealloc, sizeof (key), restore_prealloc_cmp);
+	if (!pre || pre->taken)
+	{
+		info->err_msg = "Stream %" PRId64 " is missing from the fsid order list";
+		info->err_arg1 = key.fsid;
+		return -1;
+	}
+
+	preinode = (mfs_inode *)pre->inode;
+	if (preinode->size != inode->size || preinode->blocksize != inode->blocksize)
+	{
+		info->err_msg = "Stream %" PRId64 " does not match the fsid order list";
+		info->err_arg1 = key.fsid;
+		return -1;
+	}
+
+	inode->numblocks = preinode->numblocks;
+	memcpy (&inode->datablocks, &preinode->datablocks, 512 - offsetof (mfs_inode, datablocks));
+	pre->taken = 1;
+
+	return 0;
+}
+
 /******************************/
 /* Restore application inodes */
 /* Write inode sector, followed by date for non tyStream inodes. */
@@ -1160,7 +1347,16 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 				}
 			}
 
-			if (!mfs_alloc_greedy (info->mfs, inode, basetop))
+			if (info->back_flags & BF_PHYSORDER)
+			{
+				if ((!info->prealloc && restore_physorder_alloc (info, basetop) < 0) ||
+					restore_physorder_take (info, inode) < 0)
+				{
+					free (inode);
+					return bsError;
+				}
+			}
+			else if (!mfs_alloc_greedy (info->mfs, inode, basetop))
 			{
 				/* Should be safe from this, but just in case */
 				if (!mfs_alloc_greedy (info->mfs, inode, 0))
@@ -1185,6 +1381,30 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 		{
 			return bsError;
 		}
+
+/* Streams left out of an incremental backup come from its base, or */
+/* from the source drive when copying */
+		if (inode->type == tyStream && (info->back_flags & BF_INCREMENTAL))
+		{
+			int ret;
+
+			if (info->copy)
+				ret = restore_copy_inode_data (info, inode, datasize);
+			else
+				ret = restore_base_inode_data (info, inode, datasize);
+
+			if (ret != 0)
+			{
+				free (inode);
+				info->state_ptr1 = NULL;
+				if (ret < 0)
+					return bsError;
+				info->state_val1++;
+				numsincecommit++;
+				continue;
+			}
+		}
+
 		info->state_ptr1 = inode;
 		info->shared_val1 = datasize;
 		info->state_val2 = 0;
@@ -1201,6 +1421,16 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 	if (info->state_val1 < info->ninodes)
 		return bsMoreData;
 
+	if (info->prealloc)
+	{
+		int ret = restore_physorder_release (info);
+
+		free (info->prealloc);
+		info->prealloc = NULL;
+		if (ret < 0)
+			return bsError;
+	}
+
 	return bsNextState;
 }
 